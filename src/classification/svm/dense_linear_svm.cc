@@ -0,0 +1,340 @@
+#include "dense_linear_svm.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <stdint.h>
+
+namespace {
+
+  // dot product of a float feature with (the first dim elements of) a
+  // double-precision weight vector
+  inline double dotRow_(const float* x, const double* w, const size_t dim) {
+    double sum0 = 0.0, sum1 = 0.0, sum2 = 0.0, sum3 = 0.0;
+    size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+      sum0 += x[i]*w[i];
+      sum1 += x[i+1]*w[i+1];
+      sum2 += x[i+2]*w[i+2];
+      sum3 += x[i+3]*w[i+3];
+    }
+    for (; i < dim; ++i) {
+      sum0 += x[i]*w[i];
+    }
+    return (sum0 + sum1) + (sum2 + sum3);
+  }
+
+  // w += a*x
+  inline void axpyRow_(const double a, const float* x, double* w, const size_t dim) {
+    for (size_t i = 0; i < dim; ++i) {
+      w[i] += a*x[i];
+    }
+  }
+
+  // squared norm of a feature (with a bias term appended)
+  inline double sqNorm_(const float* x, const size_t dim, const double bias) {
+    double xx = bias*bias;
+    for (size_t i = 0; i < dim; ++i) {
+      xx += static_cast<double>(x[i])*x[i];
+    }
+    return xx;
+  }
+
+  // small deterministic generator for shuffling the solve order (so that
+  // repeated training on the same data gives the same model)
+  inline uint32_t nextRand_(uint64_t* state) {
+    (*state) = (*state)*6364136223846793005ULL + 1442695040888963407ULL;
+    return static_cast<uint32_t>((*state) >> 33);
+  }
+
+}
+
+featpipe::DenseSvmSampleSet::DenseSvmSampleSet(const float* input, const size_t n,
+                                               const size_t feat_dim,
+                                               const signed char label,
+                                               const double bias)
+  : feat_dim_(feat_dim)
+  , label_(label)
+  , bias_(bias)
+  , rows_(n)
+  , sq_norms_(n) {
+  for (size_t fi = 0; fi < n; ++fi) {
+    rows_[fi] = input + fi*feat_dim;
+    sq_norms_[fi] = sqNorm_(rows_[fi], feat_dim, bias);
+  }
+}
+
+void featpipe::DenseLinearSvm::train(const float* input, const size_t feat_dim,
+                                     const size_t n,
+                                     std::vector<std::vector<size_t> > labels) {
+  feat_dim_ = feat_dim;
+  allocW_(labels.size());
+
+  std::vector<const float*> rows(n);
+  std::vector<double> QD(n);
+  for (size_t fi = 0; fi < n; ++fi) {
+    rows[fi] = input + fi*feat_dim;
+    QD[fi] = sqNorm_(rows[fi], feat_dim, BIAS_MUL_);
+  }
+
+  // Train a single SVM for each class
+  // -------
+  std::vector<signed char> y(n);
+  for (size_t ci = 0; ci < labels.size(); ++ci) {
+    std::fill(y.begin(), y.end(), -1);
+    for (size_t li = 0; li < labels[ci].size(); ++li) {
+      if (labels[ci][li] >= n) {
+        throw std::runtime_error("DenseLinearSvm: label index out of range");
+      }
+      y[labels[ci][li]] = 1; // labels are 0-indexed
+    }
+    std::vector<double> alpha(n, 0.0);
+    std::vector<double> w(feat_dim+1, 0.0);
+    solve_(rows, y, QD, &alpha, &w);
+    storeW_(w, w_ + ci*(feat_dim+1));
+  }
+}
+
+void featpipe::DenseLinearSvm::train(const float* pos_input, const size_t pos_n,
+                                     const float* neg_input, const size_t neg_n,
+                                     const size_t feat_dim) {
+  feat_dim_ = feat_dim;
+  allocW_(1);
+
+  // positive rows first (as for a concatenated training set)
+  std::vector<const float*> rows(pos_n + neg_n);
+  std::vector<signed char> y(pos_n + neg_n);
+  std::vector<double> QD(pos_n + neg_n);
+  for (size_t fi = 0; fi < pos_n; ++fi) {
+    rows[fi] = pos_input + fi*feat_dim;
+    y[fi] = 1;
+    QD[fi] = sqNorm_(rows[fi], feat_dim, BIAS_MUL_);
+  }
+  for (size_t fi = 0; fi < neg_n; ++fi) {
+    rows[pos_n + fi] = neg_input + fi*feat_dim;
+    y[pos_n + fi] = -1;
+    QD[pos_n + fi] = sqNorm_(rows[pos_n + fi], feat_dim, BIAS_MUL_);
+  }
+
+  std::vector<double> alpha(pos_n + neg_n, 0.0);
+  std::vector<double> w(feat_dim+1, 0.0);
+  solve_(rows, y, QD, &alpha, &w);
+  storeW_(w, w_);
+}
+
+void featpipe::DenseLinearSvm::train(const float* pos_input, const size_t pos_n,
+                                     const DenseSvmSampleSet& neg_set,
+                                     const DenseSvmWarmStart* warm_start) {
+  if (neg_set.bias() != BIAS_MUL_) {
+    throw std::runtime_error("DenseLinearSvm: sample set has a different bias term");
+  }
+  const size_t feat_dim = neg_set.feat_dim();
+  const size_t neg_n = neg_set.size();
+  feat_dim_ = feat_dim;
+  allocW_(1);
+
+  // only the positives are prepared here - negative rows and norms are
+  // copied from the sample set
+  std::vector<const float*> rows(pos_n + neg_n);
+  std::vector<signed char> y(pos_n + neg_n);
+  std::vector<double> QD(pos_n + neg_n);
+  for (size_t fi = 0; fi < pos_n; ++fi) {
+    rows[fi] = pos_input + fi*feat_dim;
+    y[fi] = 1;
+    QD[fi] = sqNorm_(rows[fi], feat_dim, BIAS_MUL_);
+  }
+  std::copy(neg_set.rows().begin(), neg_set.rows().end(), rows.begin() + pos_n);
+  std::fill(y.begin() + pos_n, y.end(), neg_set.label());
+  std::copy(neg_set.sq_norms().begin(), neg_set.sq_norms().end(), QD.begin() + pos_n);
+
+  std::vector<double> alpha(pos_n + neg_n, 0.0);
+  std::vector<double> w(feat_dim+1, 0.0);
+
+  if (warm_start && !warm_start->empty()) {
+    if ((warm_start->alpha.size() != neg_n) || (warm_start->w.size() != feat_dim+1)) {
+      throw std::runtime_error("DenseLinearSvm: warm start does not match sample set");
+    }
+    // start from the stored dual variables of the negatives (with the
+    // positives at zero), which remain feasible if clipped to [0, c_]
+    std::copy(warm_start->alpha.begin(), warm_start->alpha.end(), alpha.begin() + pos_n);
+    if (warm_start->c <= c_) {
+      w = warm_start->w;
+    } else {
+      const double label = neg_set.label();
+      for (size_t fi = pos_n; fi < pos_n + neg_n; ++fi) {
+        alpha[fi] = std::min(alpha[fi], c_);
+        if (alpha[fi] > 0.0) {
+          axpyRow_(alpha[fi]*label, rows[fi], &w[0], feat_dim);
+          w[feat_dim] += alpha[fi]*label*BIAS_MUL_;
+        }
+      }
+    }
+  }
+
+  solve_(rows, y, QD, &alpha, &w);
+  storeW_(w, w_);
+}
+
+void featpipe::DenseLinearSvm::solveWarmStart(const DenseSvmSampleSet& neg_set,
+                                              DenseSvmWarmStart* warm_start) {
+  if (neg_set.bias() != BIAS_MUL_) {
+    throw std::runtime_error("DenseLinearSvm: sample set has a different bias term");
+  }
+  feat_dim_ = neg_set.feat_dim();
+
+  std::vector<signed char> y(neg_set.size(), neg_set.label());
+  warm_start->c = c_;
+  warm_start->alpha.assign(neg_set.size(), 0.0);
+  warm_start->w.assign(feat_dim_+1, 0.0);
+  solve_(neg_set.rows(), y, neg_set.sq_norms(), &warm_start->alpha, &warm_start->w);
+}
+
+void featpipe::DenseLinearSvm::test(const float* input, const size_t n,
+                                    size_t** est_label, float** scoremat) const {
+  if (!w_) {
+    throw std::runtime_error("no model trained");
+  }
+
+  for (size_t ci = 0; ci < num_classes_; ++ci) {
+    const float* w = w_ + ci*(feat_dim_+1);
+    for (size_t fi = 0; fi < n; ++fi) {
+      const float* x = input + fi*feat_dim_;
+      float score = w[feat_dim_]; // bias term
+      for (size_t ei = 0; ei < feat_dim_; ++ei) {
+        score += w[ei]*x[ei];
+      }
+      (*scoremat)[ci*n+fi] = score;
+    }
+  }
+  /* now calculate estimated label */
+  for (size_t fi = 0; fi < n; ++fi) {
+    int maxidx = -1;
+    float maxval = -std::numeric_limits<float>::max();
+    for (size_t ci = 0; ci < num_classes_; ++ci) {
+      if ((*scoremat)[ci*n+fi] > maxval) {
+        maxval = (*scoremat)[ci*n+fi];
+        maxidx = ci;
+      }
+    }
+    (*est_label)[fi] = maxidx;
+  }
+}
+
+// Protected functions ------
+
+void featpipe::DenseLinearSvm::solve_(const std::vector<const float*>& rows,
+                                      const std::vector<signed char>& y,
+                                      const std::vector<double>& QD,
+                                      std::vector<double>* alpha_ptr,
+                                      std::vector<double>* w_ptr) const {
+  // dual coordinate descent for L2-regularized L1-loss SVC, as
+  // solve_l2r_l1l2_svc in Liblinear (with the same stopping criterion)
+  const size_t l = rows.size();
+  const size_t dim = feat_dim_;
+  const double C = c_;
+  const double bias = BIAS_MUL_;
+
+  std::vector<double>& alpha = *alpha_ptr;
+  std::vector<double>& w = *w_ptr; // (last element is the bias weight)
+  if ((y.size() != l) || (QD.size() != l) || (alpha.size() != l) || (w.size() != dim+1)) {
+    throw std::runtime_error("DenseLinearSvm: inconsistent solver inputs");
+  }
+
+  std::vector<size_t> index(l);
+  for (size_t i = 0; i < l; ++i) {
+    index[i] = i;
+  }
+
+  size_t active_size = l;
+  double PGmax_old = std::numeric_limits<double>::infinity();
+  double PGmin_old = -std::numeric_limits<double>::infinity();
+  uint64_t rand_state = 0;
+
+  size_t iter = 0;
+  while (iter < max_iter_) {
+    double PGmax_new = -std::numeric_limits<double>::infinity();
+    double PGmin_new = std::numeric_limits<double>::infinity();
+
+    for (size_t i = 0; i < active_size; ++i) {
+      const size_t j = i + nextRand_(&rand_state) % (active_size - i);
+      std::swap(index[i], index[j]);
+    }
+
+    for (size_t s = 0; s < active_size; ++s) {
+      const size_t i = index[s];
+      const double yi = y[i];
+      const float* x = rows[i];
+
+      const double G = yi*(dotRow_(x, &w[0], dim) + w[dim]*bias) - 1.0;
+
+      double PG = 0.0;
+      if (alpha[i] == 0.0) {
+        if (G > PGmax_old) {
+          // shrink - unlikely to change in later iterations
+          --active_size;
+          std::swap(index[s], index[active_size]);
+          --s;
+          continue;
+        } else if (G < 0.0) {
+          PG = G;
+        }
+      } else if (alpha[i] == C) {
+        if (G < PGmin_old) {
+          --active_size;
+          std::swap(index[s], index[active_size]);
+          --s;
+          continue;
+        } else if (G > 0.0) {
+          PG = G;
+        }
+      } else {
+        PG = G;
+      }
+
+      PGmax_new = std::max(PGmax_new, PG);
+      PGmin_new = std::min(PGmin_new, PG);
+
+      if (std::fabs(PG) > 1.0e-12) {
+        const double alpha_old = alpha[i];
+        alpha[i] = std::min(std::max(alpha[i] - G/QD[i], 0.0), C);
+        const double d = (alpha[i] - alpha_old)*yi;
+        axpyRow_(d, x, &w[0], dim);
+        w[dim] += d*bias;
+      }
+    }
+
+    ++iter;
+
+    if (PGmax_new - PGmin_new <= eps_) {
+      if (active_size == l) {
+        break;
+      } else {
+        // check convergence over all variables before stopping
+        active_size = l;
+        PGmax_old = std::numeric_limits<double>::infinity();
+        PGmin_old = -std::numeric_limits<double>::infinity();
+        continue;
+      }
+    }
+    PGmax_old = PGmax_new;
+    PGmin_old = PGmin_new;
+    if (PGmax_old <= 0) PGmax_old = std::numeric_limits<double>::infinity();
+    if (PGmin_old >= 0) PGmin_old = -std::numeric_limits<double>::infinity();
+  }
+}
+
+void featpipe::DenseLinearSvm::storeW_(const std::vector<double>& w, float* w_out) const {
+  for (size_t j = 0; j < w.size(); ++j) {
+    w_out[j] = static_cast<float>(w[j]);
+  }
+}
+
+void featpipe::DenseLinearSvm::allocW_(const size_t num_classes) {
+  if (w_) {
+    delete[] w_;
+    w_ = 0;
+  }
+  num_classes_ = num_classes;
+  w_ = new float[num_classes*(feat_dim_+1)];
+}
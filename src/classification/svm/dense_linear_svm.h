@@ -0,0 +1,179 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        dense_linear_svm.h
+//    Author:      Ken Chatfield
+//    Description: Linear SVM trained directly on dense float features
+//
+//    Solves the same problem as Liblinear with its default solver
+//    (L2-regularized L1-loss SVC, by dual coordinate descent with
+//    shrinking, and a bias term appended to each feature) but reads
+//    training features in place, through row pointers, rather than first
+//    converting them to sparse double-precision feature nodes - CNN
+//    features are almost entirely dense, so the conversion is pure
+//    overhead
+//
+//    Samples which are reused across many training calls (such as a fixed
+//    set of negatives) can be prepared once as a DenseSvmSampleSet, and
+//    their dual variables warm-started from a fixed solution for the
+//    samples alone (so every call starting from it gives a model which
+//    does not depend on any other call)
+//
+//    DenseLinearSvm is NOT thread-safe (though a DenseSvmSampleSet can be
+//    shared between threads)
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef FEATPIPE_DENSE_LINEAR_SVM_H_
+#define FEATPIPE_DENSE_LINEAR_SVM_H_
+
+#include <stdexcept>
+#include <vector>
+
+#include "generic_svm.h"
+
+namespace featpipe {
+
+  // training samples with a single label (stored as row pointers into the
+  // row-major input array, which must outlive the set), along with the
+  // per-sample data the solver would otherwise recompute for each call
+  class DenseSvmSampleSet {
+  public:
+    DenseSvmSampleSet(const float* input, const size_t n, const size_t feat_dim,
+                      const signed char label = -1, const double bias = 1.0);
+    inline size_t size() const { return rows_.size(); }
+    inline size_t feat_dim() const { return feat_dim_; }
+    inline signed char label() const { return label_; }
+    inline double bias() const { return bias_; }
+    inline const std::vector<const float*>& rows() const { return rows_; }
+    // squared norm of each sample (including the bias term)
+    inline const std::vector<double>& sq_norms() const { return sq_norms_; }
+  protected:
+    size_t feat_dim_;
+    signed char label_;
+    double bias_;
+    std::vector<const float*> rows_;
+    std::vector<double> sq_norms_;
+  };
+
+  // dual variables of the samples in a DenseSvmSampleSet from a solution
+  // (with parameter c), used to warm-start training
+  struct DenseSvmWarmStart {
+    DenseSvmWarmStart() : c(0.0) { }
+    inline bool empty() const { return alpha.empty(); }
+    double c;
+    std::vector<double> alpha;
+    std::vector<double> w; // [feat_dim+1] weights contributed by the samples
+  };
+
+  class DenseLinearSvm : public GenericSvm {
+  public:
+    DenseLinearSvm();
+    virtual ~DenseLinearSvm();
+    virtual void train(const float* input, const size_t feat_dim, const size_t n,
+                       std::vector<std::vector<size_t> > labels);
+    // trains a single binary SVM from separate row-major arrays of positive
+    // and negative features (without concatenating them)
+    void train(const float* pos_input, const size_t pos_n,
+               const float* neg_input, const size_t neg_n,
+               const size_t feat_dim);
+    // trains a single binary SVM from positive features and a prepared set
+    // of negatives - if warm_start is specified (and not empty), the dual
+    // variables of the negatives start from it
+    void train(const float* pos_input, const size_t pos_n,
+               const DenseSvmSampleSet& neg_set,
+               const DenseSvmWarmStart* warm_start = 0);
+    // solves for the samples of neg_set alone, storing the solution in
+    // warm_start (to be used as a fixed starting point by later calls to
+    // train with the same set)
+    void solveWarmStart(const DenseSvmSampleSet& neg_set,
+                        DenseSvmWarmStart* warm_start);
+    virtual void test(const float* input, const size_t n,
+                      size_t** est_label, float** scoremat) const;
+    // setter/getter funcs for SVM parameters
+    double get_eps() const;
+    double get_c() const;
+    size_t get_max_iter() const;
+    void set_eps(const double eps);
+    void set_c(const double c);
+    void set_max_iter(const size_t max_iter);
+    // getter funcs for model output
+    size_t get_feat_dim() const;
+    size_t get_num_classes() const;
+    float* get_w() const;
+  protected:
+    // trains a binary SVM on the given rows (with labels y = +1/-1 and
+    // squared norms QD), starting from dual variables alpha and the
+    // corresponding [feat_dim+1] weights w (the last of which is the bias
+    // weight), which are updated in place
+    void solve_(const std::vector<const float*>& rows,
+                const std::vector<signed char>& y,
+                const std::vector<double>& QD,
+                std::vector<double>* alpha,
+                std::vector<double>* w) const;
+    void storeW_(const std::vector<double>& w, float* w_out) const;
+    void allocW_(const size_t num_classes);
+    // SVM parameters
+    double eps_;
+    double c_;
+    size_t max_iter_;
+    const double BIAS_MUL_;
+    // variables relating to currently trained model
+    size_t feat_dim_; /* dimensionality of features */
+    size_t num_classes_; /* number of classes */
+    float* w_; /* [num_classes x (feat_dim+1)] matrix of w vectors */
+  };
+
+}
+
+// Constructor/destructor ------
+inline featpipe::DenseLinearSvm::DenseLinearSvm(): BIAS_MUL_(1.0) {
+  eps_ = 0.1;
+  c_ = 10.0;
+  max_iter_ = 1000;
+  feat_dim_ = 0;
+  num_classes_ = 0;
+  w_ = 0;
+}
+
+inline featpipe::DenseLinearSvm::~DenseLinearSvm() {
+  if (w_) {
+    delete[] w_;
+  }
+}
+
+// Inline functions ------
+inline double featpipe::DenseLinearSvm::get_eps() const {
+  return eps_;
+}
+
+inline double featpipe::DenseLinearSvm::get_c() const {
+  return c_;
+}
+
+inline size_t featpipe::DenseLinearSvm::get_max_iter() const {
+  return max_iter_;
+}
+
+inline void featpipe::DenseLinearSvm::set_eps(const double eps) {
+  eps_ = eps;
+}
+
+inline void featpipe::DenseLinearSvm::set_c(const double c) {
+  c_ = c;
+}
+
+inline void featpipe::DenseLinearSvm::set_max_iter(const size_t max_iter) {
+  max_iter_ = max_iter;
+}
+
+inline size_t featpipe::DenseLinearSvm::get_feat_dim() const {
+  return feat_dim_;
+}
+
+inline size_t featpipe::DenseLinearSvm::get_num_classes() const {
+  return num_classes_;
+}
+
+inline float* featpipe::DenseLinearSvm::get_w() const {
+  return w_;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#include <iostream>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "server/util/io.h"
+#include "cpuvisor_config.pb.h"
+
+#include "server/zmq_client.h"
+
+DEFINE_string(config_path, "../config.prototxt", "Server config file");
+
+int main(int argc, char* argv[]) {
+
+  //google::InitGoogleLogging(argv[0]);
+  google::InstallFailureSignalHandler();
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  cpuvisor::Config config;
+  cpuvisor::readProtoFromTextFile(FLAGS_config_path, &config);
+
+  cpuvisor::ZmqClient zmq_client(config);
+
+  // score the dataset with all classifiers in the server's store
+  LOG(INFO) << "Applying stored classifiers...";
+  if (!zmq_client.applyStoredClassifiers()) {
+    return 1;
+  }
+
+  return 0;
+
+}
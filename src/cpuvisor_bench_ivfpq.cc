@@ -0,0 +1,146 @@
+#include <iostream>
+#include <vector>
+#include <set>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <opencv2/opencv.hpp>
+
+#include "server/util/io.h"
+#include "server/util/feats_index.h"
+#include "server/util/feat_util.h"
+#include "server/util/ivfpq_index.h"
+#include "server/util/tictoc.h"
+
+#include "cpuvisor_config.pb.h"
+
+DEFINE_string(config_path, "../config.prototxt", "Server config file");
+DEFINE_string(index_file, "", "IVF-PQ index file (defaults to dataset_ivfpq_file in config)");
+DEFINE_int64(queries, 20, "Number of query models to evaluate");
+DEFINE_int64(pos_count, 10, "Number of random dataset images used as positives for each query");
+DEFINE_int64(top_k, 100, "Number of top ranked items over which recall is measured");
+DEFINE_int64(rescore_sz, 1000, "Number of candidates rescored exactly (0 = no rescoring)");
+DEFINE_string(nprobe, "1,4,16,64", "Comma-separated list of numbers of inverted lists to scan");
+
+int main(int argc, char* argv[]) {
+
+  google::InstallFailureSignalHandler();
+  gflags::SetUsageMessage("Recall/latency benchmark of IVF-PQ index against exact ranking");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  CHECK_GT(FLAGS_queries, 0);
+  CHECK_GT(FLAGS_pos_count, 0);
+  CHECK_GT(FLAGS_top_k, 0);
+
+  cpuvisor::Config config;
+  cpuvisor::readProtoFromTextFile(FLAGS_config_path, &config);
+
+  const cpuvisor::PreprocConfig& preproc_config = config.preproc_config();
+
+  std::string index_file = FLAGS_index_file;
+  if (index_file.empty()) index_file = preproc_config.dataset_ivfpq_file();
+  CHECK_NE(index_file, "") << "No index file specified in either config or --index_file";
+
+  std::vector<size_t> nprobes;
+  {
+    std::vector<std::string> elems;
+    boost::split(elems, FLAGS_nprobe, boost::is_any_of(","));
+    for (size_t i = 0; i < elems.size(); ++i) {
+      nprobes.push_back(boost::lexical_cast<size_t>(elems[i]));
+    }
+  }
+
+  // load data
+  // ---------
+
+  cv::Mat dset_feats;
+  std::vector<std::string> dset_paths;
+  boost::shared_ptr<cpuvisor::FeatsIndexMapping> dset_feats_mapping;
+  CHECK(cpuvisor::readFeatsFromFile(preproc_config.dataset_feats_file(),
+                                    &dset_feats, &dset_paths,
+                                    &dset_feats_mapping));
+
+  cv::Mat neg_feats;
+  std::vector<std::string> neg_paths;
+  CHECK(cpuvisor::readFeatsFromFile(preproc_config.neg_feats_file(),
+                                    &neg_feats, &neg_paths));
+
+  cpuvisor::IvfPqIndex index;
+  CHECK(index.open(index_file));
+  CHECK_EQ(index.num(), dset_feats.rows) << "IVF-PQ index inconsistent with dataset features";
+  CHECK_EQ(index.dim(), dset_feats.cols) << "IVF-PQ index inconsistent with dataset features";
+
+  std::cout << "Dataset: " << index.num() << "x" << index.dim()
+            << ", IVF-PQ index: " << index.nlist() << " lists, "
+            << index.m() << " sub-quantizers" << std::endl;
+
+  // train query models using random dataset images as positives
+  // ------------------------------------------------------------
+
+  std::cout << "Training " << FLAGS_queries << " query models..." << std::endl;
+
+  cv::RNG rng(100);
+  std::vector<cv::Mat> models(FLAGS_queries);
+  for (int64_t q = 0; q < FLAGS_queries; ++q) {
+    cv::Mat pos_feats;
+    for (int64_t i = 0; i < FLAGS_pos_count; ++i) {
+      pos_feats.push_back(dset_feats.row(rng.uniform(0, dset_feats.rows)));
+    }
+    models[q] = cpuvisor::trainLinearSvm(pos_feats, neg_feats, 10.0);
+  }
+
+  // 1. exact ranking
+  // ----------------
+
+  std::vector<cpuvisor::Ranking> ref_rankings(FLAGS_queries);
+  TicTocObj timer = tic();
+  for (int64_t q = 0; q < FLAGS_queries; ++q) {
+    cpuvisor::rankUsingModel(models[q], dset_feats, &ref_rankings[q], FLAGS_top_k);
+  }
+  float exact_time = toc(timer);
+
+  std::cout << "Exact ranking: mean " << exact_time/FLAGS_queries << " seconds per query" << std::endl;
+
+  // 2. approximate ranking
+  // ----------------------
+
+  cv::Mat exact_feats = (FLAGS_rescore_sz > 0) ? dset_feats : cv::Mat();
+
+  for (size_t pi = 0; pi < nprobes.size(); ++pi) {
+    float recall_sum = 0.0;
+
+    timer = tic();
+    std::vector<cpuvisor::Ranking> rankings(FLAGS_queries);
+    for (int64_t q = 0; q < FLAGS_queries; ++q) {
+      index.rank(models[q], exact_feats, &rankings[q], FLAGS_top_k,
+                 nprobes[pi], FLAGS_rescore_sz);
+    }
+    float approx_time = toc(timer);
+
+    for (int64_t q = 0; q < FLAGS_queries; ++q) {
+      const size_t top_k = std::min(static_cast<size_t>(FLAGS_top_k),
+                                    ref_rankings[q].sorted_count);
+      const int* ref_idxs = (const int*)ref_rankings[q].sort_idxs.data;
+      std::set<int> ref_top(ref_idxs, ref_idxs + top_k);
+
+      const size_t approx_k = std::min(top_k, rankings[q].size());
+      const int* idxs = (const int*)rankings[q].sort_idxs.data;
+      size_t hits = 0;
+      for (size_t i = 0; i < approx_k; ++i) {
+        if (ref_top.count(idxs[i])) ++hits;
+      }
+      recall_sum += static_cast<float>(hits) / static_cast<float>(top_k);
+    }
+
+    std::cout << "nprobe = " << nprobes[pi]
+              << ": recall@" << FLAGS_top_k << " " << recall_sum/FLAGS_queries
+              << ", mean " << approx_time/FLAGS_queries << " seconds per query"
+              << " (speedup " << exact_time/approx_time << "x)" << std::endl;
+  }
+
+  return 0;
+
+}
@@ -0,0 +1,58 @@
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "server/util/io.h"
+#include "server/util/feats_index.h"
+#include "server/util/ivfpq_index.h"
+
+#include "cpuvisor_config.pb.h"
+
+DEFINE_string(config_path, "../config.prototxt", "Server config file");
+DEFINE_string(index_file, "", "Output IVF-PQ index file (defaults to dataset_ivfpq_file in config)");
+DEFINE_int64(nlist, 1024, "Number of coarse centroids (inverted lists)");
+DEFINE_int64(m, 64, "Number of product quantizer sub-vectors (must divide feature dimensionality)");
+DEFINE_int64(train_sz, 100000, "Maximum number of features used to train the quantizers");
+DEFINE_int64(iters, 20, "Number of k-means iterations");
+
+int main(int argc, char* argv[]) {
+
+  google::InstallFailureSignalHandler();
+  gflags::SetUsageMessage("Build approximate IVF-PQ index over dataset features for CPU Visor server");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  cpuvisor::Config config;
+  cpuvisor::readProtoFromTextFile(FLAGS_config_path, &config);
+
+  const cpuvisor::PreprocConfig& preproc_config = config.preproc_config();
+
+  std::string index_file = FLAGS_index_file;
+  if (index_file.empty()) index_file = preproc_config.dataset_ivfpq_file();
+  CHECK_NE(index_file, "") << "No output file specified in either config or --index_file";
+
+  CHECK_GT(FLAGS_nlist, 0);
+  CHECK_GT(FLAGS_m, 0);
+  CHECK_GT(FLAGS_train_sz, 0);
+  CHECK_GT(FLAGS_iters, 0);
+
+  cv::Mat dset_feats;
+  std::vector<std::string> dset_paths;
+  boost::shared_ptr<cpuvisor::FeatsIndexMapping> dset_feats_mapping;
+
+  LOG(INFO) << "Loading dataset features...";
+  CHECK(cpuvisor::readFeatsFromFile(preproc_config.dataset_feats_file(),
+                                    &dset_feats, &dset_paths,
+                                    &dset_feats_mapping));
+
+  cpuvisor::IvfPqBuildParams params;
+  params.nlist = FLAGS_nlist;
+  params.m = FLAGS_m;
+  params.train_sz = FLAGS_train_sz;
+  params.kmeans_iters = FLAGS_iters;
+
+  cpuvisor::buildIvfPqIndex(dset_feats, index_file, params);
+
+  LOG(INFO) << "Done!";
+
+  return 0;
+
+}
@@ -54,20 +54,22 @@ int main(int argc, char* argv[]) {
   LOG(INFO) << "Scanning chunks...";
   size_t feat_num = 0, feat_dim = 0;
 
+  std::vector<size_t> chunk_nums(chunk_files.size());
+
   for (size_t i = 0; i < chunk_files.size(); ++i) {
     LOG(INFO) << "Processing chunk: " << chunk_files[i];
-    cv::Mat feats_chunk;
-    std::vector<std::string> paths_chunk;
+    size_t chunk_num, chunk_dim;
 
-    CHECK(cpuvisor::readFeatsFromProto(chunk_files[i], &feats_chunk, &paths_chunk));
+    // only the header of each chunk needs to be read
+    CHECK(cpuvisor::readFeatsHeaderFromProto(chunk_files[i], &chunk_num, &chunk_dim));
+    chunk_nums[i] = chunk_num;
 
     if (i == 0) {
-      feat_num = feats_chunk.rows;
-      feat_dim = feats_chunk.cols;
-      CHECK_EQ(feat_num, paths_chunk.size());
+      feat_num = chunk_num;
+      feat_dim = chunk_dim;
     } else {
-      feat_num += feats_chunk.rows;
-      CHECK_EQ(feat_dim, feats_chunk.cols);
+      feat_num += chunk_num;
+      CHECK_EQ(feat_dim, chunk_dim);
     }
 
   }
@@ -78,7 +80,8 @@ int main(int argc, char* argv[]) {
 
   LOG(INFO) << "Saving chunk index file...";
   // save filenames only (with no path - as assumed in same directory as index file)
-  cpuvisor::writeChunkIndexToProto(chunk_fnames, feat_num, feat_dim, feats_file);
+  // together with the size of each chunk, so chunks can be loaded in parallel
+  cpuvisor::writeChunkIndexToProto(chunk_fnames, feat_num, feat_dim, feats_file, chunk_nums);
 
   // LOG(INFO) << "Combining chunks...";
   // cv::Mat feats;
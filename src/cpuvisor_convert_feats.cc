@@ -0,0 +1,35 @@
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "server/util/feats_index.h"
+
+DEFINE_string(feats_file, "", "Input binaryproto features file (or chunk index / feature index)");
+DEFINE_string(index_file, "", "Output feature index file");
+DEFINE_string(dtype, "float32", "Output data type (float32, float16 or int8)");
+
+int main(int argc, char* argv[]) {
+
+  google::InstallFailureSignalHandler();
+  gflags::SetUsageMessage("Convert binaryproto feature file to memory-mappable feature index");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  CHECK_NE(FLAGS_feats_file, "");
+  CHECK_NE(FLAGS_index_file, "");
+
+  cpuvisor::FeatsIndexDType dtype;
+  if (FLAGS_dtype == "float32") {
+    dtype = cpuvisor::FIDX_FLOAT32;
+  } else if (FLAGS_dtype == "float16") {
+    dtype = cpuvisor::FIDX_FLOAT16;
+  } else if (FLAGS_dtype == "int8") {
+    dtype = cpuvisor::FIDX_INT8;
+  } else {
+    LOG(FATAL) << "Unrecognised data type: " << FLAGS_dtype;
+    return 1;
+  }
+
+  cpuvisor::convertFeatsToIndex(FLAGS_feats_file, FLAGS_index_file, dtype);
+
+  return 0;
+
+}
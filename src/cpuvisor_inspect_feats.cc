@@ -2,13 +2,14 @@
 #include <gflags/gflags.h>
 
 #include "server/util/io.h"
+#include "server/util/feats_index.h"
 
 DEFINE_string(feats_file, "", "Features file");
 
 int main(int argc, char* argv[]) {
 
   google::InstallFailureSignalHandler();
-  gflags::SetUsageMessage("Inspect binaryproto feature file");
+  gflags::SetUsageMessage("Inspect binaryproto or feature index file");
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
   CHECK_NE(FLAGS_feats_file, "");
@@ -16,9 +17,9 @@ int main(int argc, char* argv[]) {
   cv::Mat feats;
   std::vector<std::string> paths;
 
-  CHECK(cpuvisor::readFeatsFromProto(FLAGS_feats_file,
-                                     &feats,
-                                     &paths));
+  CHECK(cpuvisor::readFeatsFromFile(FLAGS_feats_file,
+                                    &feats,
+                                    &paths));
 
   for (size_t i = 0; i < 5; ++i) {
     LOG(INFO) << i << ": " << paths[i];
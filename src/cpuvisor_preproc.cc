@@ -1,13 +1,17 @@
 #include <glog/logging.h>
 #include <gflags/gflags.h>
 
+#include <algorithm>
+
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
 #include <boost/lexical_cast.hpp>
 
 #include "directencode/caffe_encoder.h"
 #include "server/util/preproc.h"
+#include "server/util/preproc_pipeline.h"
 #include "server/util/io.h"
+#include "server/util/feats_index.h"
 
 #include "cpuvisor_config.pb.h"
 
@@ -18,6 +22,11 @@ DEFINE_bool(negfeats, true, "Compute negative training image features");
 DEFINE_int64(startidx, -1, "Starting index for dataset feature computation (inclusive index)");
 DEFINE_int64(endidx, -1, "Ending index for dataset feature computation (exclusive index)");
 
+DEFINE_bool(pipeline, true, "Compute features using a multi-threaded pipeline (ignored if startidx or endidx is set)");
+DEFINE_int32(threads, 0, "Number of image decoding threads in the pipeline (0 = one per core)");
+DEFINE_int64(chunk_sz, 1000, "Number of dataset images in each chunk written by the pipeline");
+DEFINE_bool(resume, true, "Resume from the feature logs of an interrupted run (if false, existing logs are discarded)");
+
 int main(int argc, char* argv[]) {
 
   google::InstallFailureSignalHandler();
@@ -39,14 +48,20 @@ int main(int argc, char* argv[]) {
 
   featpipe::CaffeEncoder encoder(caffe_config_upd);
 
+  cpuvisor::PreprocPipelineParams pipeline_params;
+  pipeline_params.decode_threads = FLAGS_threads;
+  pipeline_params.encode_threads = std::max<size_t>(caffe_config_upd.netpool_sz(), 1);
+  pipeline_params.batch_sz = std::max<size_t>(caffe_config_upd.max_batch_sz(), 1);
+  pipeline_params.resume = FLAGS_resume;
+
   if (FLAGS_dsetfeats) {
     std::string feats_file = preproc_config.dataset_feats_file();
+    bool using_idxs = false;
 
     {
       fs::path feats_file_fs(feats_file);
       std::string feats_file_stem = (feats_file_fs.parent_path() / feats_file_fs.stem()).string();
       std::string feats_file_ext = feats_file_fs.extension().string();
-      bool using_idxs = false;
 
       if (FLAGS_startidx > -1) {
         feats_file_stem = feats_file_stem + "_" +
@@ -66,12 +81,36 @@ int main(int argc, char* argv[]) {
 
     if (fs::exists(feats_file)) {
       LOG(INFO) << "Skipping existing feature file!";
+    } else if (FLAGS_pipeline && !using_idxs) {
+      // writes chunks and a chunk index, as cpuvisor_combine_chunks
+      std::vector<std::string> paths;
+      cpuvisor::readPathsFromTextFile(preproc_config.dataset_im_paths(), &paths);
+      pipeline_params.chunk_sz = FLAGS_chunk_sz;
+      cpuvisor::PreprocPipeline pipeline(encoder, pipeline_params);
+      pipeline.run(paths, preproc_config.dataset_im_base_path(), feats_file);
     } else {
       cpuvisor::procTextFile(preproc_config.dataset_im_paths(),
                              feats_file,
                              encoder,
                              preproc_config.dataset_im_base_path(),
-                             -1, FLAGS_startidx, FLAGS_endidx);
+                             -1, FLAGS_startidx, FLAGS_endidx, FLAGS_resume);
+    }
+
+    if (!preproc_config.dataset_compressed_feats_file().empty()) {
+      const std::string& cfeats_file = preproc_config.dataset_compressed_feats_file();
+      cpuvisor::FeatsIndexDType dtype =
+        (preproc_config.dataset_compression_type() == cpuvisor::FCT_FLOAT16) ?
+        cpuvisor::FIDX_FLOAT16 : cpuvisor::FIDX_INT8;
+
+      if (using_idxs) {
+        LOG(INFO) << "Not writing compressed features for partial feature file "
+                  << "- run cpuvisor_convert_feats once all chunks have been combined";
+      } else if (fs::exists(cfeats_file)) {
+        LOG(INFO) << "Skipping existing compressed feature file!";
+      } else {
+        LOG(INFO) << "Writing compressed features to: " << cfeats_file;
+        cpuvisor::convertFeatsToIndex(feats_file, cfeats_file, dtype);
+      }
     }
   }
 
@@ -80,11 +119,18 @@ int main(int argc, char* argv[]) {
 
     if (fs::exists(preproc_config.neg_feats_file())) {
       LOG(INFO) << "Skipping existing feature file!";
+    } else if (FLAGS_pipeline) {
+      std::vector<std::string> paths;
+      cpuvisor::readPathsFromTextFile(preproc_config.neg_im_paths(), &paths);
+      pipeline_params.chunk_sz = 0; // write a single feature file
+      cpuvisor::PreprocPipeline pipeline(encoder, pipeline_params);
+      pipeline.run(paths, preproc_config.neg_im_base_path(), preproc_config.neg_feats_file());
     } else {
       cpuvisor::procTextFile(preproc_config.neg_im_paths(),
                              preproc_config.neg_feats_file(),
                              encoder,
-                             preproc_config.neg_im_base_path());
+                             preproc_config.neg_im_base_path(),
+                             -1, -1, -1, FLAGS_resume);
     }
   }
 
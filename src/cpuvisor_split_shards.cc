@@ -0,0 +1,102 @@
+#include <vector>
+#include <string>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+#include <boost/lexical_cast.hpp>
+
+#include "server/util/io.h"
+#include "server/util/feats_index.h"
+
+#include "cpuvisor_config.pb.h"
+
+DEFINE_string(config_path, "../config.prototxt", "Server config file");
+DEFINE_int64(num_shards, 2, "Number of dataset shards");
+DEFINE_string(output_dir, "shards", "Output directory for shard feature indexes and configs");
+DEFINE_string(host, "127.0.0.1", "Host on which shard servers will be run");
+DEFINE_int64(base_port, 5600, "First port used by shard servers (each uses two consecutive ports)");
+
+int main(int argc, char* argv[]) {
+
+  google::InstallFailureSignalHandler();
+  gflags::SetUsageMessage("Split dataset features into shards to be served by separate CPU Visor services");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  CHECK_GT(FLAGS_num_shards, 0);
+
+  cpuvisor::Config config;
+  cpuvisor::readProtoFromTextFile(FLAGS_config_path, &config);
+
+  cv::Mat dset_feats;
+  std::vector<std::string> dset_paths;
+  boost::shared_ptr<cpuvisor::FeatsIndexMapping> dset_feats_mapping;
+
+  LOG(INFO) << "Loading dataset features...";
+  CHECK(cpuvisor::readFeatsFromFile(config.preproc_config().dataset_feats_file(),
+                                    &dset_feats, &dset_paths,
+                                    &dset_feats_mapping));
+  CHECK_GE(dset_feats.rows, FLAGS_num_shards) << "Fewer dataset features than shards";
+
+  const fs::path output_dir_fs(FLAGS_output_dir);
+  if (!fs::exists(output_dir_fs)) {
+    fs::create_directories(output_dir_fs);
+  }
+
+  cpuvisor::Config coord_config = config;
+  cpuvisor::ServerConfig* coord_server_config = coord_config.mutable_server_config();
+  coord_server_config->clear_shard_endpoints();
+
+  const size_t num = dset_feats.rows;
+  for (int64_t i = 0; i < FLAGS_num_shards; ++i) {
+    const std::string shard_str = boost::lexical_cast<std::string>(i + 1);
+
+    // write shard features
+    const size_t start_idx = (i*num)/FLAGS_num_shards;
+    const size_t end_idx = ((i + 1)*num)/FLAGS_num_shards;
+    const std::string feats_file =
+      (output_dir_fs / ("dsetfeats_shard" + shard_str + ".fidx")).string();
+
+    LOG(INFO) << "Writing shard " << shard_str << " (features " << start_idx
+              << "-" << end_idx << ") to: " << feats_file;
+    std::vector<std::string> shard_paths(dset_paths.begin() + start_idx,
+                                         dset_paths.begin() + end_idx);
+    cpuvisor::writeFeatsToIndex(dset_feats.rowRange(start_idx, end_idx),
+                                shard_paths, feats_file);
+
+    // write shard config
+    const std::string endpoint_base = "tcp://" + FLAGS_host + ":";
+    const std::string server_endpoint =
+      endpoint_base + boost::lexical_cast<std::string>(FLAGS_base_port + 2*i);
+    const std::string notify_endpoint =
+      endpoint_base + boost::lexical_cast<std::string>(FLAGS_base_port + 2*i + 1);
+
+    cpuvisor::Config shard_config = config;
+    cpuvisor::PreprocConfig* shard_preproc_config = shard_config.mutable_preproc_config();
+    shard_preproc_config->set_dataset_feats_file(fs::absolute(feats_file).string());
+    // compressed features and IVF-PQ indexes must be regenerated per shard
+    shard_preproc_config->clear_dataset_compressed_feats_file();
+    shard_preproc_config->clear_dataset_ivfpq_file();
+    cpuvisor::ServerConfig* shard_server_config = shard_config.mutable_server_config();
+    shard_server_config->set_server_endpoint(server_endpoint);
+    shard_server_config->set_notify_endpoint(notify_endpoint);
+    shard_server_config->clear_shard_endpoints();
+
+    const std::string config_file =
+      (output_dir_fs / ("config_shard" + shard_str + ".prototxt")).string();
+    cpuvisor::writeProtoToTextFile(config_file, shard_config);
+
+    coord_server_config->add_shard_endpoints(server_endpoint);
+  }
+
+  const std::string coord_config_file =
+    (output_dir_fs / "config_coordinator.prototxt").string();
+  cpuvisor::writeProtoToTextFile(coord_config_file, coord_config);
+
+  LOG(INFO) << "Launch one cpuvisor_service per shard config, and a coordinator using: "
+            << coord_config_file;
+
+  return 0;
+
+}
@@ -87,5 +87,11 @@ int main (int argc, char* argv[]) {
   std::cout << "Trials completed in " << comp_time << " seconds" << std::endl;
   std::cout << "   mean " << comp_time/TRIAL_COUNT << " per image" << std::endl;
 
+  featpipe::CaffeNetPoolStats netpool_stats = encoder->netpool_stats();
+  std::cout << "Nets checked out " << netpool_stats.checkouts << " times, waiting "
+            << netpool_stats.waits << " times (mean wait "
+            << (netpool_stats.waits > 0 ? netpool_stats.total_wait_us/netpool_stats.waits : 0)
+            << "us, max " << netpool_stats.max_wait_us << "us)" << std::endl;
+
   return 0;
 }
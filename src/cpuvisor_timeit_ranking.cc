@@ -0,0 +1,86 @@
+#include <iostream>
+#include <vector>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "server/util/scoring_engine.h"
+#include "server/util/tictoc.h"
+
+DEFINE_int64(num, 1000000, "Number of dataset features");
+DEFINE_int64(dim, 4096, "Feature dimensionality");
+DEFINE_int64(top_k, 100, "Number of top ranked items to select");
+DEFINE_int64(threads, 0, "Number of scoring threads (0 = one per core)");
+DEFINE_int64(trials, 10, "Number of trials");
+
+int main (int argc, char* argv[]) {
+
+  google::InstallFailureSignalHandler();
+  gflags::SetUsageMessage("Ranking benchmarking utility for CPU Visor server");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  CHECK_GT(FLAGS_num, 0);
+  CHECK_GT(FLAGS_dim, 0);
+  CHECK_GT(FLAGS_trials, 0);
+
+  cv::theRNG().state = 100;
+
+  std::cout << "Generating " << FLAGS_num << "x" << FLAGS_dim << " features..." << std::endl;
+  cv::Mat dset_feats(FLAGS_num, FLAGS_dim, CV_32F);
+  cv::randu(dset_feats, cv::Scalar::all(-1), cv::Scalar::all(1));
+  cv::Mat model(FLAGS_dim, 1, CV_32F);
+  cv::randu(model, cv::Scalar::all(-1), cv::Scalar::all(1));
+
+  const float gb = static_cast<float>(dset_feats.total()*sizeof(float)) / 1073741824.0;
+
+  // 1. baseline - single-threaded matrix product and full sort
+  // ----------------------------------------------------------
+
+  std::cout << "Running " << FLAGS_trials << " baseline trials..." << std::endl;
+
+  cv::Mat ref_scores, ref_sort_idxs;
+  TicTocObj timer = tic();
+  for (int64_t t = 0; t < FLAGS_trials; ++t) {
+    ref_scores = dset_feats*model;
+    cv::sortIdx(ref_scores, ref_sort_idxs, CV_SORT_EVERY_COLUMN + CV_SORT_DESCENDING);
+  }
+  float base_time = toc(timer);
+
+  std::cout << "Baseline completed in " << base_time << " seconds" << std::endl;
+  std::cout << "   mean " << base_time/FLAGS_trials << " per query" << std::endl;
+
+  // 2. scoring engine with fused top-K
+  // ----------------------------------
+
+  cpuvisor::ScoringEngine engine(FLAGS_threads);
+
+  std::cout << "Running " << FLAGS_trials << " trials using scoring engine ("
+            << engine.num_threads() << " threads)..." << std::endl;
+
+  cv::Mat scores;
+  std::vector<int> top_idxs;
+  timer = tic();
+  for (int64_t t = 0; t < FLAGS_trials; ++t) {
+    engine.score(dset_feats, model, &scores, &top_idxs, FLAGS_top_k);
+  }
+  float engine_time = toc(timer);
+
+  std::cout << "Scoring engine completed in " << engine_time << " seconds" << std::endl;
+  std::cout << "   mean " << engine_time/FLAGS_trials << " per query ("
+            << (gb*FLAGS_trials)/engine_time << " GB/s)" << std::endl;
+  std::cout << "   speedup " << base_time/engine_time << "x" << std::endl;
+
+  // check consistency of top ranked scores
+  const float* ref_scores_ptr = (const float*)ref_scores.data;
+  const int* ref_sort_idxs_ptr = (const int*)ref_sort_idxs.data;
+  const float* scores_ptr = (const float*)scores.data;
+  float max_diff = 0.0;
+  for (size_t i = 0; i < top_idxs.size(); ++i) {
+    float diff = std::abs(scores_ptr[top_idxs[i]] - ref_scores_ptr[ref_sort_idxs_ptr[i]]);
+    max_diff = std::max(max_diff, diff);
+  }
+  std::cout << "Max difference in top " << top_idxs.size() << " scores: " << max_diff << std::endl;
+
+  return 0;
+}
@@ -1,4 +1,7 @@
 #include "augmentation_helper.h"
+
+#include <algorithm>
+
 #include <glog/logging.h>
 
 //#define DEBUG_CAFFE_IMS
@@ -7,8 +10,130 @@
 #include <fstream>
 #endif
 
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#endif
+
 using namespace featpipe;
 
+namespace {
+
+  // dst = src*mul - mean for a single row of one channel -------------
+
+  inline void convertRow_(const uchar* src, const float* mean, const float mul,
+                          const int n, float* dst) {
+    int x = 0;
+    #if defined(__AVX2__)
+    const __m256 mul_v = _mm256_set1_ps(mul);
+    for (; x + 8 <= n; x += 8) {
+      const __m256i src_i = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + x)));
+      const __m256 src_v = _mm256_cvtepi32_ps(src_i);
+      _mm256_storeu_ps(dst + x, _mm256_sub_ps(_mm256_mul_ps(src_v, mul_v),
+                                              _mm256_loadu_ps(mean + x)));
+    }
+    #endif
+    for (; x < n; ++x) {
+      dst[x] = static_cast<float>(src[x])*mul - mean[x];
+    }
+  }
+
+  inline void convertRow_(const float* src, const float* mean, const float mul,
+                          const int n, float* dst) {
+    for (int x = 0; x < n; ++x) {
+      dst[x] = src[x]*mul - mean[x];
+    }
+  }
+
+  template <typename T>
+  void convertCrop_(const cv::Mat& plane, const cv::Mat& mean, const int x,
+                    const int y, const float mul, float* dst) {
+    for (int i = 0; i < mean.rows; ++i) {
+      convertRow_(plane.ptr<T>(y + i) + x, mean.ptr<float>(i), mul,
+                  mean.cols, dst + i*mean.cols);
+    }
+  }
+
+}
+
+size_t AugmentationHelper::augmentedImageCount() const {
+  switch (aug_type) {
+  case DAT_NONE:
+    return 1;
+  case DAT_ASPECT_CORNERS:
+    return 10;
+  default:
+    LOG(FATAL) << "Unsupported aug_type!";
+  }
+  return 0;
+}
+
+void AugmentationHelper::prepareImagesInto(const cv::Mat& image, float* dst,
+                                           const bool swap_rb) {
+  const int IMAGE_DIM = image_dim;
+  const int CROPPED_DIM = cropped_dim;
+
+  if (image.channels() != 3) {
+    throw InvalidImageError("Image did not pass validation check");
+  }
+  CHECK((image.depth() == CV_8U) || (image.depth() == CV_32F));
+  CHECK_EQ(mean_planes_[0].rows, CROPPED_DIM);
+  CHECK_EQ(mean_planes_[0].cols, CROPPED_DIM);
+
+  const size_t crop_sz = 3*CROPPED_DIM*CROPPED_DIM;
+
+  // resize to DIM x N where DIM is the smaller dimension, and split into
+  // channels so each crop row can be converted contiguously
+  const int base_dim = (aug_type == DAT_NONE) ? CROPPED_DIM : IMAGE_DIM;
+  const float sf = static_cast<float>(base_dim) /
+    static_cast<float>(std::min(image.rows, image.cols));
+  cv::resize(image, base_im_, cv::Size(), sf, sf);
+  cv::split(base_im_, base_planes_);
+
+  const int centre_x = (base_im_.cols - CROPPED_DIM)/2;
+  const int centre_y = (base_im_.rows - CROPPED_DIM)/2;
+  CHECK_GE(centre_x, 0);
+  CHECK_GE(centre_y, 0);
+
+  if (aug_type == DAT_NONE) {
+    writeCrop_(base_planes_, centre_x, centre_y, swap_rb, dst);
+    return;
+  }
+  CHECK_EQ(aug_type, DAT_ASPECT_CORNERS);
+
+  // centre then corner crops of the image, and then of its mirror image
+  const int max_x = base_im_.cols - CROPPED_DIM;
+  const int max_y = base_im_.rows - CROPPED_DIM;
+  const int crop_xs[5] = {centre_x, 0, 0, max_x, max_x};
+  const int crop_ys[5] = {centre_y, 0, max_y, 0, max_y};
+
+  flipped_planes_.resize(3);
+  for (size_t ci = 0; ci < 3; ++ci) {
+    cv::flip(base_planes_[ci], flipped_planes_[ci], 1);
+  }
+
+  for (size_t flip_idx = 0; flip_idx < 2; ++flip_idx) {
+    const std::vector<cv::Mat>& planes = (flip_idx == 0) ? base_planes_ : flipped_planes_;
+    for (size_t i = 0; i < 5; ++i) {
+      writeCrop_(planes, crop_xs[i], crop_ys[i], swap_rb, dst);
+      dst += crop_sz;
+    }
+  }
+}
+
+void AugmentationHelper::writeCrop_(const std::vector<cv::Mat>& planes, const int x, const int y,
+                                    const bool swap_rb, float* dst) const {
+  const size_t plane_sz = cropped_dim*cropped_dim;
+
+  for (size_t ci = 0; ci < 3; ++ci) {
+    const cv::Mat& plane = planes[swap_rb ? 2 - ci : ci];
+    if (plane.depth() == CV_8U) {
+      convertCrop_<uchar>(plane, mean_planes_[ci], x, y, image_mul, dst + ci*plane_sz);
+    } else {
+      convertCrop_<float>(plane, mean_planes_[ci], x, y, image_mul, dst + ci*plane_sz);
+    }
+  }
+}
+
 std::vector<cv::Mat>
 AugmentationHelper::prepareImages(const cv::Mat& image) {
   //const int IMAGE_DIM = image_dim;
@@ -61,14 +61,41 @@ namespace featpipe {
         CHECK_EQ(mean_image_.depth(), CV_32F);
 
         CHECK_GT(IMAGE_DIM, CROPPED_DIM);
+
+        cv::split(mean_image_, mean_planes_);
+      } else {
+        mean_planes_.assign(3, cv::Mat::zeros(cropped_dim, cropped_dim, CV_32F));
       }
     }
 
     virtual std::vector<cv::Mat> prepareImages(const cv::Mat& image);
 
+    // number of augmented images prepared from each input image
+    size_t augmentedImageCount() const;
+    // smallest dimension input images are resized to (images may be
+    // decoded at any resolution at least this large)
+    inline int minInputDim() const {
+      return (aug_type == DAT_NONE) ? cropped_dim : image_dim;
+    }
+    // as prepareImages, but writes augmented images directly to dst in
+    // Caffe (channel-contiguous) layout in a single pass over each crop,
+    // without intermediate float images - image may be 8-bit or float,
+    // and dst must have space for augmentedImageCount() crops
+    virtual void prepareImagesInto(const cv::Mat& image, float* dst,
+                                   const bool swap_rb = false);
+
   protected:
     bool use_mean_image_;
     cv::Mat mean_image_;
+    std::vector<cv::Mat> mean_planes_; // mean image split into channels
+
+    // buffers reused between calls to prepareImagesInto
+    cv::Mat base_im_;
+    std::vector<cv::Mat> base_planes_;
+    std::vector<cv::Mat> flipped_planes_;
+
+    void writeCrop_(const std::vector<cv::Mat>& planes, const int x, const int y,
+                    const bool swap_rb, float* dst) const;
 
     virtual std::vector<cv::Mat> augmentWholeImage(const cv::Mat& imobj) const;
     virtual std::vector<cv::Mat> augmentAspectCorners(const cv::Mat& imobj) const;
@@ -29,6 +29,8 @@ namespace featpipe {
     CaffeMode mode;
     bool use_rgb_images;
     uint32_t netpool_sz;
+    uint32_t max_batch_sz;      // max images per forward pass across callers
+    uint32_t batch_deadline_ms; // max wait for a batch to fill
     inline virtual void configureFromPtree(const boost::property_tree::ptree& properties) {
       param_file = properties.get<std::string>("param_file");
       model_file = properties.get<std::string>("model_file");
@@ -52,6 +54,8 @@ namespace featpipe {
       }
       use_rgb_images = properties.get<bool>("use_rgb_images", false);
       netpool_sz = properties.get<uint32_t>("netpool_sz", 1);
+      max_batch_sz = properties.get<uint32_t>("max_batch_sz", 1);
+      batch_deadline_ms = properties.get<uint32_t>("batch_deadline_ms", 5);
     }
     inline virtual void configureFromProtobuf(const cpuvisor::CaffeConfig& proto_config) {
       param_file = proto_config.param_file();
@@ -78,6 +82,8 @@ namespace featpipe {
       }
       use_rgb_images = proto_config.use_rgb_images();
       netpool_sz = proto_config.netpool_sz();
+      max_batch_sz = proto_config.max_batch_sz();
+      batch_deadline_ms = proto_config.batch_deadline_ms();
     }
   };
 
@@ -11,7 +11,12 @@
 cv::Mat featpipe::CaffeEncoder::compute(const std::vector<cv::Mat>& images,
                                         std::vector<std::vector<cv::Mat> >* _debug_input_images) {
 
-  boost::shared_ptr<CaffeNetInst> net = nets_->getReadyNet();
+  // batch together with images from concurrent callers if enabled
+  if (batcher_ && !_debug_input_images) {
+    return batcher_->compute(images);
+  }
+
+  CaffeNetPool::NetHandle net(*nets_);
   cv::Mat feats = net->compute(images, _debug_input_images);
 
   return feats;
@@ -34,6 +39,11 @@ void featpipe::CaffeEncoder::initNetFromConfig_() {
     LOG(FATAL) << "Unsupported mode!";
   }
 
+  batcher_.reset();
   nets_ = boost::shared_ptr<CaffeNetPool>(new CaffeNetPool(config_));
 
+  if (config_.max_batch_sz > 1) {
+    batcher_ = boost::shared_ptr<CaffeBatcher>(new CaffeBatcher(config_, nets_));
+  }
+
 }
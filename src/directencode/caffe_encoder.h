@@ -10,6 +10,7 @@
 #include "generic_direct_encoder.h"
 #include "caffe_config.h"
 #include "netpool/caffe_netpool.h"
+#include "netpool/caffe_batcher.h"
 
 #include <string>
 #include <iostream>
@@ -54,6 +55,12 @@ namespace featpipe {
     inline virtual size_t get_code_size() const {
       return nets_->get_code_size();
     }
+    inline size_t get_min_image_dim() const {
+      return nets_->get_min_image_dim();
+    }
+    inline CaffeNetPoolStats netpool_stats() const {
+      return nets_->stats();
+    }
     // configuration
     inline virtual void configureFromPtree(const boost::property_tree::ptree& properties) {
       CaffeConfig config;
@@ -65,6 +72,7 @@ namespace featpipe {
     void initNetFromConfig_();
     CaffeConfig config_;
     boost::shared_ptr<CaffeNetPool> nets_;
+    boost::shared_ptr<CaffeBatcher> batcher_;
   };
 }
 
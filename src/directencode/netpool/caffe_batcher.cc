@@ -0,0 +1,154 @@
+#include "caffe_batcher.h"
+
+#include <glog/logging.h>
+
+namespace featpipe {
+
+  CaffeBatcher::CaffeBatcher(const CaffeConfig& config,
+                             const boost::shared_ptr<CaffeNetPool>& nets)
+    : config_(config)
+    , nets_(nets)
+    , queued_images_(0)
+    , stop_(false) {
+
+    CHECK_GE(config_.max_batch_sz, 1);
+    LOG(INFO) << "Batching up to " << config_.max_batch_sz << " images per forward pass"
+              << " (deadline " << config_.batch_deadline_ms << "ms)";
+
+    for (size_t i = 0; i < nets_->size(); ++i) {
+      dispatch_threads_.create_thread(boost::bind(&CaffeBatcher::dispatch_, this));
+    }
+  }
+
+  CaffeBatcher::~CaffeBatcher() {
+    {
+      boost::lock_guard<boost::mutex> queue_lock(queue_mutex_);
+      stop_ = true;
+    }
+    queue_cond_var_.notify_all();
+    dispatch_threads_.join_all();
+  }
+
+  cv::Mat CaffeBatcher::compute(const std::vector<cv::Mat>& images) {
+
+    if (images.empty()) return cv::Mat();
+
+    Request request(images);
+
+    boost::mutex::scoped_lock queue_lock(queue_mutex_);
+    CHECK(!stop_);
+
+    queue_.push_back(&request);
+    queued_images_ += images.size();
+    queue_cond_var_.notify_all();
+
+    while (!request.done) {
+      done_cond_var_.wait(queue_lock);
+    }
+    queue_lock.unlock();
+
+    if (request.error) {
+      boost::rethrow_exception(request.error);
+    }
+
+    return request.feats;
+  }
+
+  void CaffeBatcher::dispatch_() {
+
+    // Caffe mode is stored per-thread
+    switch (config_.mode) {
+    case CM_CPU:
+      caffe::Caffe::set_mode(caffe::Caffe::CPU);
+      break;
+    case CM_GPU:
+      caffe::Caffe::set_mode(caffe::Caffe::GPU);
+      break;
+    }
+
+    std::vector<Request*> batch;
+
+    while (getBatch_(&batch)) {
+
+      std::vector<cv::Mat> images;
+      for (size_t i = 0; i < batch.size(); ++i) {
+        images.insert(images.end(), batch[i]->images.begin(), batch[i]->images.end());
+      }
+      VLOG(1) << "Computing batch of " << images.size() << " images from "
+              << batch.size() << " requests";
+
+      cv::Mat feats;
+      boost::exception_ptr error;
+      try {
+        CaffeNetPool::NetHandle net(*nets_);
+        feats = net->compute(images);
+      } catch (...) {
+        error = boost::current_exception();
+      }
+
+      // hand each request back its own rows of the batch features
+      {
+        boost::lock_guard<boost::mutex> queue_lock(queue_mutex_);
+        size_t start_row = 0;
+        for (size_t i = 0; i < batch.size(); ++i) {
+          size_t end_row = start_row + batch[i]->images.size();
+          if (error) {
+            batch[i]->error = error;
+          } else {
+            batch[i]->feats = feats.rowRange(start_row, end_row).clone();
+          }
+          batch[i]->done = true;
+          start_row = end_row;
+        }
+      }
+      done_cond_var_.notify_all();
+    }
+
+  }
+
+  bool CaffeBatcher::getBatch_(std::vector<Request*>* batch) {
+
+    batch->clear();
+
+    boost::mutex::scoped_lock queue_lock(queue_mutex_);
+
+    // wait until either a full batch is available, or the oldest queued
+    // request has waited for longer than the deadline
+    while (true) {
+      if (stop_) return false;
+
+      if (queued_images_ >= config_.max_batch_sz) break;
+
+      if (!queue_.empty()) {
+        boost::system_time deadline = queue_.front()->enqueued +
+          boost::posix_time::milliseconds(config_.batch_deadline_ms);
+        if (!queue_cond_var_.timed_wait(queue_lock, deadline)) {
+          if (!queue_.empty()) break;
+        }
+      } else {
+        queue_cond_var_.wait(queue_lock);
+      }
+    }
+
+    // always take at least one request, even if it exceeds max_batch_sz
+    size_t batch_images = 0;
+    while (!queue_.empty()) {
+      size_t request_images = queue_.front()->images.size();
+      if (!batch->empty() && (batch_images + request_images > config_.max_batch_sz)) {
+        break;
+      }
+      batch->push_back(queue_.front());
+      batch_images += request_images;
+      queued_images_ -= request_images;
+      queue_.pop_front();
+    }
+
+    // wake another dispatcher if a further batch is ready
+    if (queued_images_ >= config_.max_batch_sz) {
+      queue_cond_var_.notify_one();
+    }
+
+    return true;
+  }
+
+}
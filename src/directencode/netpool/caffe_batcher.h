@@ -0,0 +1,69 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        caffe_batcher.h
+//    Author:      Ken Chatfield
+//    Description: Batches images from concurrent callers into a single
+//                 forward pass of a net from a CaffeNetPool
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef FEATPIPE_CAFFE_BATCHER_H_
+#define FEATPIPE_CAFFE_BATCHER_H_
+
+#include <deque>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "caffe_netpool.h"
+
+namespace featpipe {
+
+  class CaffeBatcher : boost::noncopyable {
+  public:
+    // one dispatcher thread is started per net in the pool, so that up
+    // to nets->size() batches can be computed at once
+    CaffeBatcher(const CaffeConfig& config,
+                 const boost::shared_ptr<CaffeNetPool>& nets);
+    virtual ~CaffeBatcher();
+
+    // blocks until the features for images have been computed (possibly
+    // alongside the images of other callers) and returns one row per image
+    cv::Mat compute(const std::vector<cv::Mat>& images);
+
+  protected:
+    struct Request {
+      Request(const std::vector<cv::Mat>& images)
+        : images(images)
+        , enqueued(boost::get_system_time())
+        , done(false) { }
+      const std::vector<cv::Mat>& images;
+      boost::system_time enqueued;
+      cv::Mat feats;
+      boost::exception_ptr error;
+      bool done;
+    };
+
+    void dispatch_();
+    // blocks until a batch is available, returning false on shutdown
+    bool getBatch_(std::vector<Request*>* batch);
+
+    CaffeConfig config_;
+    boost::shared_ptr<CaffeNetPool> nets_;
+
+    std::deque<Request*> queue_;
+    size_t queued_images_;
+    bool stop_;
+    boost::mutex queue_mutex_;
+    boost::condition_variable queue_cond_var_;
+    boost::condition_variable done_cond_var_;
+
+    boost::thread_group dispatch_threads_;
+  };
+
+}
+
+#endif
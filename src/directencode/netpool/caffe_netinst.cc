@@ -7,23 +7,11 @@ namespace featpipe {
   cv::Mat CaffeNetInst::compute(const std::vector<cv::Mat>& images,
                                 std::vector<std::vector<cv::Mat> >* _debug_input_images) {
 
-    ready_ = false;
+    cv::Mat feats;
 
-    try {
-      cv::Mat feats;
+    compute_(images, &feats, _debug_input_images);
 
-      compute_(images, &feats, _debug_input_images);
-
-      ready_ = true;
-      if (ready_cond_var_) {
-        ready_cond_var_->notify_all();
-      }
-
-      return feats;
-    } catch(...) {
-      ready_ = true;
-      throw;
-    }
+    return feats;
   }
 
   size_t CaffeNetInst::get_code_size() const {
@@ -63,32 +51,48 @@ namespace featpipe {
                               cv::Mat* feats,
                               std::vector<std::vector<cv::Mat> >* _debug_input_images) {
 
+    size_t subbatch_sz = 0;
+    cv::Mat scores;
+
     if (_debug_input_images) {
       (*_debug_input_images) = std::vector<std::vector<cv::Mat> >();
-    }
 
-    size_t subbatch_sz = 0;
+      std::vector<cv::Mat> flat_images;
 
-    std::vector<cv::Mat> flat_images;
+      for (size_t im_idx = 0; im_idx < images.size(); ++im_idx) {
+        std::vector<cv::Mat> subbatch = prepareImage_(images[im_idx]);
 
-    for (size_t im_idx = 0; im_idx < images.size(); ++im_idx) {
-      std::vector<cv::Mat> subbatch = prepareImage_(images[im_idx]);
+        if (im_idx == 0) {
+          subbatch_sz = subbatch.size();
+        } else {
+          CHECK_EQ(subbatch_sz, subbatch.size());
+        }
+
+        flat_images.insert(flat_images.end(), subbatch.begin(), subbatch.end());
+        _debug_input_images->push_back(flat_images);
 
-      if (im_idx == 0) {
-        subbatch_sz = subbatch.size();
-      } else {
-        CHECK_EQ(subbatch_sz, subbatch.size());
       }
 
-      flat_images.insert(flat_images.end(), subbatch.begin(), subbatch.end());
-      if (_debug_input_images) {
-        _debug_input_images->push_back(flat_images);
+      scores = forwardPropImages_(flat_images);
+    } else {
+      // prepare augmented images directly in the network input blob
+      subbatch_sz = augmentation_helper_.augmentedImageCount();
+      caffe::Blob<float>* input_blob = reshapeInput_(images.size()*subbatch_sz);
+      CHECK_EQ(input_blob->channels(), 3);
+      CHECK_EQ(input_blob->height(), augmentation_helper_.cropped_dim);
+      CHECK_EQ(input_blob->width(), augmentation_helper_.cropped_dim);
+
+      const size_t im_pix_sz = input_blob->count() / input_blob->num();
+      float* input_data = input_blob->mutable_cpu_data();
+      for (size_t im_idx = 0; im_idx < images.size(); ++im_idx) {
+        augmentation_helper_.prepareImagesInto(images[im_idx],
+                                               input_data + im_pix_sz*subbatch_sz*im_idx,
+                                               config_.use_rgb_images);
       }
 
+      scores = forward_();
     }
 
-    cv::Mat scores = forwardPropImages_(flat_images);
-
     // decompose scores to feats again
 
     cv::Mat feats_mat(images.size(), scores.cols, CV_32FC1);
@@ -119,6 +123,9 @@ namespace featpipe {
     } else {
       in_image = image;
     }
+    if (in_image.depth() != CV_32F) {
+      in_image.convertTo(in_image, CV_32F);
+    }
 
     //CHECK(!in_image.empty());
 
@@ -142,13 +149,34 @@ namespace featpipe {
   }
 
   cv::Mat CaffeNetInst::forwardPropImages_(std::vector<cv::Mat> images) {
-    cv::Mat scores;
-
-    boost::lock_guard<boost::mutex> compute_lock(compute_mutex_);
+    reshapeInput_(images.size());
 
     VLOG(1) << "Copying images to network for feature computation...";
     caffeutils::setNetTestImages(images, (*net_));
 
+    return forward_();
+
+  }
+
+  caffe::Blob<float>* CaffeNetInst::reshapeInput_(const size_t num) {
+
+    // resize input blob to the number of images in the batch if required
+    // (e.g. when images from multiple requests have been batched together)
+    caffe::Blob<float>* input_blob = net_->input_blobs()[0];
+    if (input_blob->num() != static_cast<int>(num)) {
+      VLOG(1) << "Reshaping network input to " << num << " images...";
+      input_blob->Reshape(num, input_blob->channels(),
+                          input_blob->height(), input_blob->width());
+      net_->Reshape();
+    }
+
+    return input_blob;
+
+  }
+
+  cv::Mat CaffeNetInst::forward_() {
+    cv::Mat scores;
+
     VLOG(1) << "Forwarding test images through network...";
     const:: std::vector<caffe::Blob<float>*>& last_blobs = net_->ForwardPrefilled();
     VLOG(1) << "Done forwarding!";
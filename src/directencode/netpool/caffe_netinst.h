@@ -27,12 +27,10 @@ namespace featpipe {
   class CaffeNetInst : boost::noncopyable {
   public:
     // constructors
-    CaffeNetInst(const CaffeConfig& config,
-                 const boost::shared_ptr<boost::condition_variable> ready_cond_var =
-                 boost::shared_ptr<boost::condition_variable>())
-      : config_(config)
-      , ready_(true)
-      , ready_cond_var_(ready_cond_var) {
+    // N.B. a net instance is not thread safe - use a CaffeNetPool to
+    // ensure each net is used by only one thread at a time
+    CaffeNetInst(const CaffeConfig& config)
+      : config_(config) {
       initNetFromConfig_();
     }
     virtual ~CaffeNetInst() { }
@@ -41,19 +39,15 @@ namespace featpipe {
                             std::vector<std::vector<cv::Mat> >* _debug_input_images = 0);
 
     size_t get_code_size() const;
-
-    bool ready() const { return ready_; }
-    void set_ready(const bool ready) { ready_ = ready; }
+    inline size_t get_min_image_dim() const {
+      return augmentation_helper_.minInputDim();
+    }
 
   protected:
     virtual void initNetFromConfig_();
     CaffeConfig config_;
     AugmentationHelper augmentation_helper_;
     boost::shared_ptr<caffe::Net<float> > net_;
-    boost::mutex compute_mutex_;
-
-    bool ready_;
-    const boost::shared_ptr<boost::condition_variable> ready_cond_var_;
 
     virtual void compute_(const std::vector<cv::Mat>& images,
                           cv::Mat* feats,
@@ -61,6 +55,10 @@ namespace featpipe {
 
     virtual std::vector<cv::Mat> prepareImage_(const cv::Mat image);
     virtual cv::Mat forwardPropImages_(std::vector<cv::Mat> images);
+    // returns the input blob, reshaped to hold num images
+    virtual caffe::Blob<float>* reshapeInput_(const size_t num);
+    // forward the images already in the input blob through the network
+    virtual cv::Mat forward_();
   };
 
 }
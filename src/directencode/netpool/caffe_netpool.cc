@@ -1,26 +1,87 @@
 #include "caffe_netpool.h"
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+
 namespace featpipe {
 
-  boost::shared_ptr<CaffeNetInst> CaffeNetPool::getReadyNet() {
+  CaffeNetPool::CaffeNetPool(const CaffeConfig& config, const size_t pool_sz_override)
+    : config_(config)
+    , idle_nets_(0)
+    , waiters_(0)
+    , checkouts_(0)
+    , waits_(0)
+    , total_wait_us_(0)
+    , max_wait_us_(0) {
+    uint32_t pool_sz = config_.netpool_sz;
 
-    boost::mutex::scoped_lock ready_net_lock_(ready_net_mutex_);
+    if (pool_sz_override > 0) {
+      pool_sz = pool_sz_override;
+    }
+    LOG(INFO) << "Initializing netpool of size: " << pool_sz;
 
-    while (true) {
+    CHECK_GE(pool_sz, 1);
+    // preallocate queue nodes for every net, so that returning a net to
+    // the pool never allocates
+    idle_nets_.reserve(pool_sz);
+    for (size_t i = 0; i < pool_sz; ++i) {
+      LOG(INFO) << "Net " << i+1 << " of " << pool_sz;
+      nets_.push_back(boost::shared_ptr<CaffeNetInst>(new CaffeNetInst(config_)));
+      CHECK(idle_nets_.bounded_push(i));
+    }
+  }
 
-      // scan nets_ vector for a network which is currently ready
-      for (size_t i = 0; i < nets_.size(); ++i) {
-        if (nets_[i]->ready()) {
-          nets_[i]->set_ready(false);
-          return nets_[i];
-        }
-      }
+  CaffeNetPoolStats CaffeNetPool::stats() const {
+    CaffeNetPoolStats stats;
+    stats.checkouts = checkouts_.load();
+    stats.waits = waits_.load();
+    stats.total_wait_us = total_wait_us_.load();
+    stats.max_wait_us = max_wait_us_.load();
+    return stats;
+  }
+
+  // -----------------------------------------------------------------------------
+
+  size_t CaffeNetPool::checkout_() {
+
+    ++checkouts_;
 
-      // if not found, wait on condition variable (which should be
-      // posted to by any networks transitioning to ready state)
-      ready_net_cond_var_->wait(ready_net_lock_);
+    // fast path - take an idle net without locking
+    uint32_t idx;
+    if (idle_nets_.pop(idx)) return idx;
+
+    // otherwise register as a waiter before checking again, so that any
+    // net returned after the check is guaranteed to notify us
+    boost::posix_time::ptime wait_start = boost::posix_time::microsec_clock::universal_time();
+    {
+      boost::mutex::scoped_lock ready_net_lock(ready_net_mutex_);
+      ++waiters_;
+      while (!idle_nets_.pop(idx)) {
+        ready_net_cond_var_.wait(ready_net_lock);
+      }
+      --waiters_;
     }
 
+    const uint64_t wait_us =
+      (boost::posix_time::microsec_clock::universal_time() - wait_start).total_microseconds();
+    ++waits_;
+    total_wait_us_ += wait_us;
+    uint64_t max_wait_us = max_wait_us_.load();
+    while ((wait_us > max_wait_us) &&
+           !max_wait_us_.compare_exchange_weak(max_wait_us, wait_us)) { }
+    VLOG(1) << "Waited " << wait_us << "us for a net from the pool";
+
+    return idx;
+  }
+
+  void CaffeNetPool::checkin_(const size_t idx) {
+
+    CHECK(idle_nets_.bounded_push(idx));
+
+    // only take the lock (and wake a single caller) if any are waiting
+    if (waiters_.load() > 0) {
+      boost::mutex::scoped_lock ready_net_lock(ready_net_mutex_);
+      ready_net_cond_var_.notify_one();
+    }
   }
 
 }
@@ -2,52 +2,82 @@
 //    File:        caffe_netpool.h
 //    Author:      Ken Chatfield
 //    Description: Netpool for VGG Caffe
+//
+//    Idle nets are kept in a lock-free queue, so a net can be checked out
+//    in O(1) without taking a lock. Only when all nets are busy does a
+//    caller block, and each net returned to the pool then wakes a single
+//    waiting caller.
 ////////////////////////////////////////////////////////////////////////////
 
 #ifndef FEATPIPE_CAFFE_NETPOOL_H_
 #define FEATPIPE_CAFFE_NETPOOL_H_
 
 #include <vector>
+#include <stdint.h>
 #include <glog/logging.h>
 
+#include <boost/atomic.hpp>
+#include <boost/lockfree/queue.hpp>
+
 #include "caffe_netinst.h"
 
 #include "cpuvisor_config.pb.h"
 
 namespace featpipe {
 
+  struct CaffeNetPoolStats {
+    uint64_t checkouts;
+    uint64_t waits;         // checkouts which had to wait for a free net
+    uint64_t total_wait_us;
+    uint64_t max_wait_us;
+  };
+
   class CaffeNetPool : boost::noncopyable {
   public:
-    CaffeNetPool(const CaffeConfig& config, const size_t pool_sz_override = 0)
-      : config_(config)
-      , ready_net_cond_var_(boost::shared_ptr<boost::condition_variable>(new boost::condition_variable)) {
-      uint32_t pool_sz = config_.netpool_sz;
-
-      if (pool_sz_override > 0) {
-        pool_sz = pool_sz_override;
-      }
-      LOG(INFO) << "Initializing netpool of size: " << pool_sz;
-
-      CHECK_GE(pool_sz, 1);
-      for (size_t i = 0; i < pool_sz; ++i) {
-        LOG(INFO) << "Net " << i+1 << " of " << pool_sz;
-        nets_.push_back(boost::shared_ptr<CaffeNetInst>(new CaffeNetInst(config_, ready_net_cond_var_)));
-      }
-    }
+    CaffeNetPool(const CaffeConfig& config, const size_t pool_sz_override = 0);
+
+    // checks out a net from the pool for as long as it is in scope,
+    // blocking until one is available - the net is returned to the pool
+    // on destruction (including during stack unwinding)
+    class NetHandle : boost::noncopyable {
+    public:
+      explicit NetHandle(CaffeNetPool& pool)
+        : pool_(pool)
+        , idx_(pool.checkout_()) { }
+      ~NetHandle() { pool_.checkin_(idx_); }
+      inline CaffeNetInst* operator->() const { return pool_.nets_[idx_].get(); }
+      inline CaffeNetInst& operator*() const { return *pool_.nets_[idx_]; }
+    private:
+      CaffeNetPool& pool_;
+      const size_t idx_;
+    };
 
-    // main functions
-    virtual boost::shared_ptr<CaffeNetInst> getReadyNet();
     // virtual setter / getter
+    inline size_t size() const { return nets_.size(); }
     inline size_t get_code_size() const {
       boost::shared_ptr<CaffeNetInst> net = nets_[0];
       return net->get_code_size();
     }
+    inline size_t get_min_image_dim() const {
+      return nets_[0]->get_min_image_dim();
+    }
+    CaffeNetPoolStats stats() const;
   protected:
+    size_t checkout_();
+    void checkin_(const size_t idx);
+
     CaffeConfig config_;
     std::vector<boost::shared_ptr<CaffeNetInst> > nets_;
 
-    boost::shared_ptr<boost::condition_variable> ready_net_cond_var_;
+    boost::lockfree::queue<uint32_t> idle_nets_;
+    boost::atomic<size_t> waiters_;
     boost::mutex ready_net_mutex_;
+    boost::condition_variable ready_net_cond_var_;
+
+    boost::atomic<uint64_t> checkouts_;
+    boost::atomic<uint64_t> waits_;
+    boost::atomic<uint64_t> total_wait_us_;
+    boost::atomic<uint64_t> max_wait_us_;
   };
 
 }
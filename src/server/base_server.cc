@@ -1,6 +1,7 @@
 #include "base_server.h"
 
 #include <fstream>
+#include <algorithm>
 
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_generators.hpp>
@@ -11,6 +12,7 @@
 namespace fs = boost::filesystem;
 
 #include <boost/thread.hpp>
+#include <boost/bind.hpp>
 
 #include "server/util/io.h"
 #include "server/util/feat_util.h"
@@ -25,6 +27,42 @@ namespace cpuvisor {
 
   void BaseServerPostProcessor::process(const std::string imfile,
                                         boost::shared_ptr<ExtraDataWrapper> extra_data) {
+    processImage_(imfile, cv::Mat(), extra_data);
+  }
+
+  void BaseServerPostProcessor::process(const ImfileIfo& imfile_ifo, const cv::Mat& image) {
+    std::string data_hash;
+    if (feat_cache_ && imfile_ifo.data) {
+      data_hash = FeatCache::hashData(*imfile_ifo.data);
+    }
+    processImage_(imfile_ifo.fname, image, imfile_ifo.extra_data,
+                  imfile_ifo.url, data_hash);
+  }
+
+  bool BaseServerPostProcessor::processCached(const ImfileIfo& imfile_ifo) {
+
+    // lookup feature for an image previously downloaded from the same url,
+    // in which case the image need not be downloaded again
+    if (!feat_cache_) return false;
+
+    cv::Mat feat;
+    std::string imfile;
+    if (!feat_cache_->getByUrl(imfile_ifo.url, &feat, &imfile)) return false;
+
+    DLOG(INFO) << "Using cached feature for url: " << imfile_ifo.url;
+    BaseServerExtraData* extra_data_s =
+      dynamic_cast<BaseServerExtraData*>(imfile_ifo.extra_data.get());
+    if (extra_data_s) {
+      addFeat_(imfile, feat, extra_data_s->query_ifo, extra_data_s->notifier);
+    }
+
+    return true;
+  }
+
+  void BaseServerPostProcessor::processImage_(const std::string& imfile, const cv::Mat& image,
+                                              boost::shared_ptr<ExtraDataWrapper> extra_data,
+                                              const std::string& url,
+                                              const std::string& data_hash) {
 
     // callback function which computes a caffe encoding for a
     // downloaded image
@@ -35,27 +73,45 @@ namespace cpuvisor {
       dynamic_cast<BaseServerExtraData*>(extra_data.get());
     if (!extra_data_s) return; // return if query_ifo cannot be retrieved
     boost::shared_ptr<QueryIfo>& query_ifo = extra_data_s->query_ifo;
-    boost::shared_ptr<StatusNotifier>& notifier = extra_data_s->notifier;
     if (query_ifo->state != QS_DATACOLL) {
       LOG(INFO) << "Skipping computing feature(s) for query " << query_ifo->id << " as it has advanced past data collection stage";
       return;
     }
 
-    cv::Mat& feats = query_ifo->data.pos_feats;
-    std::vector<std::string>& feat_paths = query_ifo->data.pos_paths;
-    boost::mutex& feat_mutex = query_ifo->data.pos_mutex;
-
     cv::Mat feat;
 
-    try {
-      feat = computeFeat_(imfile);
-    } catch (featpipe::InvalidImageError& e) {
-      // delete image here
-      DLOG(INFO) << "Removing invalid image: " << imfile;
-      fs::remove(imfile);
-      return;
+    // the same image may already have been downloaded from another url
+    const bool use_cache = feat_cache_ && !data_hash.empty();
+    if (use_cache && feat_cache_->getByHash(data_hash, &feat)) {
+      DLOG(INFO) << "Using cached feature for image data: " << data_hash;
+    } else {
+      try {
+        feat = computeFeat_(imfile, image);
+      } catch (featpipe::InvalidImageError& e) {
+        // delete image here
+        DLOG(INFO) << "Removing invalid image: " << imfile;
+        if (image.empty()) {
+          fs::remove(imfile);
+        }
+        return;
+      }
+    }
+
+    if (use_cache) {
+      feat_cache_->insert(url, data_hash, imfile, feat);
     }
 
+    addFeat_(imfile, feat, query_ifo, extra_data_s->notifier);
+  }
+
+  void BaseServerPostProcessor::addFeat_(const std::string& imfile, const cv::Mat& feat,
+                                         boost::shared_ptr<QueryIfo> query_ifo,
+                                         boost::shared_ptr<StatusNotifier> notifier) {
+
+    cv::Mat& feats = query_ifo->data.pos_feats;
+    std::vector<std::string>& feat_paths = query_ifo->data.pos_paths;
+    boost::mutex& feat_mutex = query_ifo->data.pos_mutex;
+
     if (!feats.empty()) {
       CHECK_EQ(feats.cols, feat.cols);
     }
@@ -79,7 +135,11 @@ namespace cpuvisor {
     notifier->post_image_processed_(query_ifo->id, imfile);
   }
 
-  cv::Mat BaseServerPostProcessor::computeFeat_(const std::string& imfile) {
+  cv::Mat BaseServerPostProcessor::computeFeat_(const std::string& imfile, const cv::Mat& image) {
+
+    if (!image.empty()) {
+      return computeFeat(image, encoder_);
+    }
 
     return computeFeat(imfile, encoder_);
 
@@ -94,7 +154,7 @@ namespace cpuvisor {
 
   }
 
-  cv::Mat BaseServerPostProcessorWithDsetFeats::computeFeat_(const std::string& imfile) {
+  cv::Mat BaseServerPostProcessorWithDsetFeats::computeFeat_(const std::string& imfile, const cv::Mat& image) {
 
     // look for precomputed feature from dataset first
     {
@@ -104,25 +164,28 @@ namespace cpuvisor {
 
       if (proc_rel_path) {
         DLOG(INFO) << "rel_path to find is: " << rel_path;
-        std::map<std::string, size_t>::const_iterator it =
-          dset_paths_index_.find(rel_path);
-        if (it != dset_paths_index_.end()) {
-          CHECK_EQ(dset_paths_[it->second], rel_path);
-
+        size_t idx;
+        if (dset_paths_index_->find(rel_path, &idx)) {
           LOG(INFO) << "Looking up feature from dataset: " << rel_path;
-          cv::Mat feat = dset_feats_.row(it->second);
-          return feat;
+          boost::shared_lock<boost::shared_mutex> lock(dset_update_mutex_);
+          if (idx < static_cast<size_t>(dset_feats_.rows)) {
+            return dset_feats_.row(idx).clone();
+          }
+          // (the paths of an update are indexed just before its rows are
+          // added, so the row may not be available yet)
+          if (dset_deltas_ && (idx - dset_feats_.rows < dset_deltas_->num())) {
+            return dset_deltas_->row(idx - dset_feats_.rows).clone();
+          }
         } else {
           LOG(WARNING) << "Path looked like dataset image, but could not be found in dataset index: " << rel_path;
         }
       }
 
-
     }
 
     // if it isn't a dataset image, compute directly as normal
     DLOG(INFO) << "Computing feature from scratch...";
-    return BaseServerPostProcessor::computeFeat_(imfile);
+    return BaseServerPostProcessor::computeFeat_(imfile, image);
 
   }
 
@@ -138,7 +201,42 @@ namespace cpuvisor {
 
   // -----------------------------------------------------------------------------
 
-  BaseServer::BaseServer(const cpuvisor::Config& config) {
+  namespace {
+
+    // identifies the model used to compute features (so features persisted
+    // by the feature cache are not reused after the model is changed)
+    std::string featModelId_(const cpuvisor::CaffeConfig& caffe_config) {
+      // (only fields which affect the computed features are included)
+      cpuvisor::CaffeConfig model_config = caffe_config;
+      model_config.clear_mode();
+      model_config.clear_netpool_sz();
+      model_config.clear_max_batch_sz();
+      model_config.clear_batch_deadline_ms();
+      std::string model_str = model_config.SerializeAsString();
+      // (the model file may be replaced without changing the config)
+      boost::system::error_code ec;
+      const uintmax_t model_size = fs::file_size(caffe_config.model_file(), ec);
+      if (!ec) {
+        const std::time_t model_mtime = fs::last_write_time(caffe_config.model_file(), ec);
+        model_str += boost::lexical_cast<std::string>(model_size) + ":"
+          + boost::lexical_cast<std::string>(model_mtime);
+      }
+      return FeatCache::hashData(model_str);
+    }
+
+    // values of C used to train the SVM (warm starts are computed for each)
+    const double kSvmCs[] = {1.0, 10.0};
+    const size_t kSvmCCount = sizeof(kSvmCs)/sizeof(kSvmCs[0]);
+
+    // C is increased when there are only a few positive training samples
+    double chooseSvmC_(const size_t pos_count) {
+      return (pos_count < 10) ? kSvmCs[1] : kSvmCs[0];
+    }
+
+  }
+
+  BaseServer::BaseServer(const cpuvisor::Config& config)
+    : dset_version_(0) {
     LOG(INFO) << "Initialize encoder...";
     const cpuvisor::ServiceConfig& service_config = config.service_config();
     const cpuvisor::CaffeConfig caffe_config = config.caffe_config();
@@ -151,49 +249,133 @@ namespace cpuvisor {
     }
     encoder_.reset(new featpipe::CaffeEncoder(caffe_config_upd));
 
-    LOG(INFO) << "Load in features...";
-
     const cpuvisor::PreprocConfig preproc_config = config.preproc_config();
+    const cpuvisor::ServerConfig server_config = config.server_config();
 
-    CHECK(cpuvisor::readFeatsFromProto(preproc_config.dataset_feats_file(),
-                                       &dset_feats_, &dset_paths_));
     dset_base_path_ = preproc_config.dataset_im_base_path();
     dset_feats_file_ = preproc_config.dataset_feats_file();
 
-    CHECK(cpuvisor::readFeatsFromProto(preproc_config.neg_feats_file(),
-                                       &neg_feats_, &neg_paths_));
+    if (server_config.shard_endpoints_size() > 0) {
+      LOG(INFO) << "Using " << server_config.shard_endpoints_size()
+                << " dataset shards (dataset features will not be loaded)...";
+      std::vector<std::string> shard_endpoints(server_config.shard_endpoints().begin(),
+                                               server_config.shard_endpoints().end());
+      shard_coordinator_.reset(new ShardCoordinator(shard_endpoints,
+                                                    server_config.shard_top_k(),
+                                                    server_config.shard_timeout_ms()));
+      dset_paths_index_.reset(new PathIndex());
+    } else {
+      loadDsetFeats_(preproc_config);
+
+      // features added by previous incremental updates
+      dset_deltas_.reset(new DeltaSegments(dset_feats_file_, dset_paths_index_->size(), dset_feats_.cols,
+                                           dset_update_mutex_, dset_paths_index_.get(),
+                                           server_config.max_delta_segments()));
+      CHECK(dset_deltas_->load());
+      if (dset_deltas_->num() > 0) {
+        CHECK(dset_cfeats_.empty() && !ivfpq_index_)
+          << "Dataset features added by incremental updates (" << dset_deltas_->manifest_path()
+          << ") cannot be used with compressed dataset features or an IVF-PQ index";
+      }
+    }
+
+    LOG(INFO) << "Load in negative features...";
+    CHECK(cpuvisor::readFeatsFromFile(preproc_config.neg_feats_file(),
+                                      &neg_feats_, &neg_paths_));
     neg_base_path_ = preproc_config.neg_im_base_path();
+    // (the solver reads negatives in place, so they must be contiguous)
+    if (!neg_feats_.isContinuous()) neg_feats_ = neg_feats_.clone();
+    neg_sample_set_.reset(new featpipe::DenseSvmSampleSet((const float*)neg_feats_.data,
+                                                          neg_feats_.rows, neg_feats_.cols));
+    svm_warm_start_ = server_config.svm_warm_start();
+    if (svm_warm_start_) {
+      LOG(INFO) << "Solve for negatives to warm-start training...";
+      for (size_t i = 0; i < kSvmCCount; ++i) {
+        featpipe::DenseLinearSvm svm;
+        svm.set_c(kSvmCs[i]);
+        svm.solveWarmStart(*neg_sample_set_, &neg_warm_starts_[kSvmCs[i]]);
+      }
+    }
 
-    post_processor_ =
-      boost::shared_ptr<BaseServerPostProcessorWithDsetFeats>(new BaseServerPostProcessorWithDsetFeats(*encoder_, dset_feats_, dset_paths_, dset_base_path_));
+    if (server_config.feat_cache_size() > 0) {
+      LOG(INFO) << "Initialize feature cache for downloaded images...";
+      feat_cache_.reset(new FeatCache(server_config.feat_cache_size(), neg_feats_.cols,
+                                      server_config.feat_cache_file(),
+                                      featModelId_(caffe_config_upd)));
+    }
 
-    const cpuvisor::ServerConfig server_config = config.server_config();
+    post_processor_ =
+      boost::shared_ptr<BaseServerPostProcessorWithDsetFeats>(new BaseServerPostProcessorWithDsetFeats(*encoder_, dset_feats_, dset_deltas_, dset_update_mutex_, dset_paths_index_, dset_base_path_, feat_cache_));
 
     image_cache_path_ = server_config.image_cache_path();
+    // initially sort only the first page of rankings
+    rank_top_k_ = server_config.page_size();
+    if (!shard_coordinator_) {
+      scoring_engine_.reset(new ScoringEngine(server_config.scoring_threads()));
+    }
+    rescore_sz_ = server_config.rescore_size();
+    ivfpq_nprobe_ = server_config.ivfpq_nprobe();
+    ImageDownloaderParams downloader_params;
+    downloader_params.download_threads = server_config.download_threads();
+    downloader_params.max_host_downloads = server_config.max_host_downloads();
+    downloader_params.timeout_s = server_config.download_timeout();
+    // post-process downloaded images from as many threads as there are
+    // images which can be encoded at once
+    feat_threads_ =
+      std::max<size_t>(caffe_config_upd.netpool_sz(), 1) *
+      std::max<size_t>(caffe_config_upd.max_batch_sz(), 1);
+    downloader_params.postprocess_threads = feat_threads_;
+    // downloaded images are decoded at the lowest resolution the encoder can use
+    downloader_params.decode_min_dim = encoder_->get_min_image_dim();
+    downloader_params.cache_images = server_config.cache_downloaded_images();
     image_downloader_ =
       boost::shared_ptr<ImageDownloader>(new ImageDownloader(image_cache_path_,
-                                                             post_processor_));
+                                                             post_processor_,
+                                                             downloader_params));
 
     notifier_ = boost::shared_ptr<StatusNotifier>(new StatusNotifier());
 
+    classifier_cache_.reset(new ClassifierCache(std::max<size_t>(server_config.classifier_cache_size(), 1)));
+
+    if (!server_config.classifier_store_path().empty()) {
+      if (shard_coordinator_) {
+        LOG(WARNING) << "Classifier store is not supported when ranking dataset shards - ignoring";
+      } else {
+        LOG(INFO) << "Load in classifier store...";
+        classifier_store_.reset(new ClassifierStore(server_config.classifier_store_path(),
+                                                    dset_feats_.cols,
+                                                    std::max<size_t>(server_config.classifier_store_top_k(), 1),
+                                                    server_config.scoring_threads()));
+        CHECK(classifier_store_->load());
+      }
+    }
+
+    if (server_config.ranking_cache_size_mb() > 0) {
+      ranking_cache_.reset(new RankingCache(static_cast<size_t>(server_config.ranking_cache_size_mb())*1024*1024));
+    }
+
   }
 
   std::string BaseServer::startQuery(const std::string& tag) {
     static boost::uuids::random_generator uuid_gen = boost::uuids::random_generator();
 
     std::string id;
-    do {
-      LOG(INFO) << "Geneating UUID for Query ID";
-      id = boost::lexical_cast<std::string>(uuid_gen());
-    } while (queries_.find(id) != queries_.end());
-
-    if (!tag.empty()) {
-      DLOG(INFO) << "Starting query with tag: " << tag << " (" << id << ")";
-    } else {
-      DLOG(INFO) << "Starting query (" << id << ")";
+    boost::shared_ptr<QueryIfo> query_ifo;
+    {
+      boost::mutex::scoped_lock lock(queries_mutex_);
+      do {
+        LOG(INFO) << "Geneating UUID for Query ID";
+        id = boost::lexical_cast<std::string>(uuid_gen());
+      } while (queries_.find(id) != queries_.end());
+
+      if (!tag.empty()) {
+        DLOG(INFO) << "Starting query with tag: " << tag << " (" << id << ")";
+      } else {
+        DLOG(INFO) << "Starting query (" << id << ")";
+      }
+      query_ifo.reset(new QueryIfo(id, tag));
+      queries_[id] = query_ifo;
     }
-    boost::shared_ptr<QueryIfo> query_ifo(new QueryIfo(id, tag));
-    queries_[id] = query_ifo;
 
     notifier_->post_state_change_(id, query_ifo->state);
 
@@ -271,14 +453,17 @@ namespace cpuvisor {
     }
   }
 
-  Ranking BaseServer::getRanking(const std::string& id) {
+  Ranking BaseServer::getRanking(const std::string& id, const size_t min_sorted) {
     boost::shared_ptr<QueryIfo> query_ifo = getQueryIfo_(id);
 
     if (query_ifo->state != QS_RANKED) {
       throw WrongQueryStatusError("Cannot test unles state = QS_TRAINED");
     }
 
-    CHECK(!query_ifo->data.ranking.scores.empty());
+    boost::mutex::scoped_lock lock(query_ifo->data.ranking_mutex);
+
+    CHECK(!query_ifo->data.ranking.scores.empty() || query_ifo->data.ranking.truncated);
+    ensureRankingSorted(&query_ifo->data.ranking, min_sorted);
 
     return query_ifo->data.ranking;
   }
@@ -286,7 +471,11 @@ namespace cpuvisor {
   void BaseServer::freeQuery(const std::string& id) {
     boost::shared_ptr<QueryIfo> query_ifo = getQueryIfo_(id);
 
-    size_t num_erased = queries_.erase(id);
+    size_t num_erased;
+    {
+      boost::mutex::scoped_lock lock(queries_mutex_);
+      num_erased = queries_.erase(id);
+    }
 
     if (num_erased == 0) throw InvalidRequestError("Tried to free query which does not exist");
   }
@@ -458,12 +647,14 @@ namespace cpuvisor {
     if (dset_paths.size() < 1) {
       throw InvalidDsetIncrementalUpdateError("Issued incremental dataset update with no paths");
     }
-
-    // get a temporary filename for the newly processed features
-    fs::path tmp_feats_path;
-    for (int i = 0; i < 100; i++) {
-      tmp_feats_path = fs::path(dset_feats_file_ + "." + boost::lexical_cast<std::string>(i));
-      if (!fs::exists(tmp_feats_path)) break;
+    if (!dset_cfeats_.empty()) {
+      throw InvalidDsetIncrementalUpdateError("Incremental dataset updates are not supported when using compressed dataset features");
+    }
+    if (ivfpq_index_) {
+      throw InvalidDsetIncrementalUpdateError("Incremental dataset updates are not supported when using an IVF-PQ index");
+    }
+    if (shard_coordinator_) {
+      throw InvalidDsetIncrementalUpdateError("Incremental dataset updates must be issued directly to a dataset shard");
     }
 
     // check if paths are relative or absolute
@@ -501,35 +692,23 @@ namespace cpuvisor {
     try {
 
       // process!!
-      // (append new features to in-memory index and save to temporary file)
-      {
-        boost::unique_lock<boost::shared_mutex> lock(dset_update_mutex_);
-        procPathListAppend(paths, tmp_feats_path.string(), *encoder_.get(),
-                           &dset_feats_, &dset_paths_, dset_base_path_);
-      }
-
-      // replace old on-disk file with new on-disk feature file
-      fs::path dset_feats_file_fs(dset_feats_file_);
-      fs::path dset_feats_file_bak_fs(dset_feats_file_ + ".bak");
+      // (only the new features are written to disk, as a delta segment,
+      // so the cost of an update does not depend on the dataset size)
+      cv::Mat new_feats = procPaths_(paths, *encoder_.get(), dset_base_path_);
 
-      std::string err_msg;
       try {
-
-        err_msg = "Could not create backup of original index";
-        fs::rename(dset_feats_file_fs, dset_feats_file_bak_fs);
-
-        err_msg = "Could not replace original index with updated index. Original index was removed, and can be found as .bak file in origin directory";
-        fs::rename(tmp_feats_path, dset_feats_file_fs);
-
+        // (also adds paths to dset_paths_index_)
+        dset_deltas_->append(new_feats, paths);
       } catch (fs::filesystem_error& e) {
-        throw InvalidDsetIncrementalUpdateError(err_msg);
+        throw InvalidDsetIncrementalUpdateError("Could not write dataset update to delta segment");
       }
 
-      try {
-        fs::remove(dset_feats_file_bak_fs);
-      } catch (fs::filesystem_error& e) {
-        LOG(WARNING) << "Could not remove temporary dataset features backup file";
+      {
+        boost::unique_lock<boost::shared_mutex> lock(dset_update_mutex_);
+        ++dset_version_;
       }
+      // rankings of the previous version of the index can no longer be used
+      if (ranking_cache_) ranking_cache_->clear();
 
     } catch (InvalidDsetIncrementalUpdateError& e) {
 
@@ -546,50 +725,209 @@ namespace cpuvisor {
 
   }
 
+  void BaseServer::rankUsingModel(const cv::Mat& model, const size_t top_k,
+                                  Ranking* ranking) {
+
+    if (shard_coordinator_) {
+      shard_coordinator_->rank(model, top_k, ranking);
+      return;
+    }
+
+    if (model.rows != dset_feats_.cols) {
+      throw InvalidRequestError("Model dimensionality does not match dataset features");
+    }
+
+    boost::shared_lock<boost::shared_mutex> lock(dset_update_mutex_);
+    if (ivfpq_index_) {
+      // approximate ranking - only the top candidates are retrieved
+      // (and rescored exactly), so the ranking is truncated
+      ivfpq_index_->rank(model,
+                         dset_feats_,
+                         ranking,
+                         top_k,
+                         ivfpq_nprobe_,
+                         rescore_sz_);
+    } else if (dset_cfeats_.empty()) {
+      if (dset_deltas_ && (dset_deltas_->num() > 0)) {
+        // rank delta segments together with the base features
+        std::vector<cv::Mat> segments(1, dset_feats_);
+        segments.insert(segments.end(),
+                        dset_deltas_->segments().begin(), dset_deltas_->segments().end());
+        scoring_engine_->rankSegments(segments,
+                                      model,
+                                      ranking,
+                                      top_k);
+      } else {
+        scoring_engine_->rank(dset_feats_,
+                              model,
+                              ranking,
+                              top_k);
+      }
+    } else {
+      scoring_engine_->rankCompressed(dset_cfeats_,
+                                      dset_cfeats_scales_,
+                                      dset_feats_,
+                                      model,
+                                      ranking,
+                                      top_k,
+                                      rescore_sz_);
+    }
+  }
+
   void BaseServer::returnClassifiersScoresForImages(const std::vector<std::string>& paths,
                                                     const std::vector<std::string>& classifier_paths,
                                                     std::vector<Ranking>* rankings) {
-    LOG(INFO) << "Applying pretrained classifiers over image...";
+    LOG(INFO) << "Applying " << classifier_paths.size() << " pretrained classifiers over "
+              << paths.size() << " images...";
+    CHECK(rankings);
+
+    // read (or fetch from cache) all classifiers first, so an invalid
+    // classifier is reported before any features are computed
+    cv::Mat models;
+    std::string err_path;
+    if (!classifier_cache_->getStacked(classifier_paths, &models, &err_path)) {
+      throw InvalidRequestError(std::string("Could not read classifier: ") + err_path);
+    }
 
-    (*rankings) = std::vector<Ranking>(classifier_paths.size());
+    std::vector<std::string> full_paths(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+      // check if path is relative (assume it is a dataset path if so)
+      fs::path path_fs(paths[i]);
+      if (!path_fs.has_root_path()) {
+        path_fs = fs::path(dset_base_path_) / path_fs;
+      }
+      full_paths[i] = path_fs.string();
+    }
 
     cv::Mat feats;
+    computeFeats_(full_paths, &feats);
 
-    for (size_t i = 0; i< paths.size(); ++i) {
-      std::string path = paths[i];
-      LOG(INFO) << "Precomputing feature for path: " << path << "...";
-      // check if path is relative (assume it is a dataset path if so)
-      {
-        fs::path path_fs(path);
-        if (!path_fs.has_root_path()) {
-          path_fs = fs::path(dset_base_path_) / path_fs;
-          path = path_fs.string();
-        }
-      }
+    if (models.empty() || feats.empty()) {
+      (*rankings) = std::vector<Ranking>(classifier_paths.size());
+      return;
+    }
+    if (feats.cols != models.rows) {
+      throw InvalidRequestError("Classifier dimensionality does not match image features");
+    }
+
+    // score all images with all classifiers at once
+    cpuvisor::rankUsingModels(models, feats, rankings);
+  }
+
+  void BaseServer::addClassifierToStore(const std::string& id, const std::string& name) {
+    if (!classifier_store_) throw InvalidRequestError("No classifier store has been configured");
+    if (!ClassifierStore::isValidName(name)) {
+      throw InvalidRequestError(std::string("Invalid classifier name: ") + name);
+    }
+
+    boost::shared_ptr<QueryIfo> query_ifo = getQueryIfo_(id);
+
+    if (query_ifo->state < QS_TRAINED) {
+      throw WrongQueryStatusError("Cannot save classifier unles state = QS_TRAINED or later");
+    }
+    LOG(INFO) << "Adding classifier to store as: " << name << "...";
+
+    classifier_store_->add(name, query_ifo->data.model);
+  }
 
-      // N.B. not using postprocessor (so no support for lookup of dataset images)
-      cv::Mat feat = computeFeat(path, *encoder_);
+  void BaseServer::applyStoredClassifiers() {
+    if (!classifier_store_) throw InvalidRequestError("No classifier store has been configured");
 
-      feats.push_back(feat);
+    // take a snapshot of the dataset (the data of existing segments is
+    // never modified, so the lock need not be held whilst scoring)
+    std::vector<cv::Mat> segments;
+    {
+      boost::shared_lock<boost::shared_mutex> lock(dset_update_mutex_);
+      segments.push_back(dset_feats_);
+      if (dset_deltas_) {
+        segments.insert(segments.end(), dset_deltas_->segments().begin(),
+                        dset_deltas_->segments().end());
+      }
     }
 
-    for (size_t i = 0; i < classifier_paths.size(); ++i) {
-      LOG(INFO) << "Ranking using classifier from: " << classifier_paths[i] << "...";
-      cv::Mat model;
-      cpuvisor::readModelFromProto(classifier_paths[i], &model);
+    classifier_store_->applyAll(segments);
+  }
+
+  Ranking BaseServer::getStoredClassifierRanking(const std::string& name) {
+    if (!classifier_store_) throw InvalidRequestError("No classifier store has been configured");
 
-      cpuvisor::rankUsingModel(model,
-                               feats,
-                               &(*rankings)[i].scores,
-                               &(*rankings)[i].sort_idxs);
+    Ranking ranking;
+    if (!classifier_store_->getResults(name, &ranking)) {
+      throw InvalidRequestError(std::string("No results for stored classifier (stored classifiers must be applied first): ") + name);
     }
+    return ranking;
   }
 
   // Protected methods -----------------------------------------------------------
 
+  namespace {
+
+    // state shared by the threads of BaseServer::computeFeats_
+    struct ComputeFeatsJob_ {
+      ComputeFeatsJob_(const std::vector<std::string>& paths,
+                       BaseServerPostProcessor& post_processor)
+        : paths(paths)
+        , post_processor(post_processor)
+        , feats(paths.size())
+        , next_idx(0) { }
+      const std::vector<std::string>& paths;
+      BaseServerPostProcessor& post_processor;
+      std::vector<cv::Mat> feats;
+      boost::mutex mutex; // guards next_idx and err_msg
+      size_t next_idx;
+      std::string err_msg;
+    };
+
+    void computeFeatsWorker_(ComputeFeatsJob_* job) {
+      while (true) {
+        size_t idx;
+        {
+          boost::mutex::scoped_lock lock(job->mutex);
+          if ((job->next_idx >= job->paths.size()) || !job->err_msg.empty()) return;
+          idx = job->next_idx++;
+        }
+
+        try {
+          job->feats[idx] = job->post_processor.getFeat(job->paths[idx]);
+        } catch (const std::exception& e) {
+          boost::mutex::scoped_lock lock(job->mutex);
+          if (job->err_msg.empty()) {
+            job->err_msg = std::string("Could not compute feature for image: ")
+              + job->paths[idx] + " (" + e.what() + ")";
+          }
+        }
+      }
+    }
+
+  }
+
+  void BaseServer::computeFeats_(const std::vector<std::string>& paths, cv::Mat* feats) {
+
+    ComputeFeatsJob_ job(paths, *post_processor_);
+
+    // (features of dataset images are looked up rather than computed)
+    const size_t thread_count = std::min(feat_threads_, paths.size());
+    boost::thread_group threads;
+    for (size_t i = 0; i < thread_count; ++i) {
+      threads.create_thread(boost::bind(computeFeatsWorker_, &job));
+    }
+    threads.join_all();
+
+    if (!job.err_msg.empty()) {
+      throw InvalidRequestError(job.err_msg);
+    }
+
+    (*feats) = cv::Mat();
+    if (!job.feats.empty()) {
+      cv::vconcat(job.feats, *feats);
+    }
+  }
+
   boost::shared_ptr<QueryIfo> BaseServer::getQueryIfo_(const std::string& id) {
     if (id.empty()) throw InvalidRequestError("No query id specified");
 
+    boost::mutex::scoped_lock lock(queries_mutex_);
+
     std::map<std::string, boost::shared_ptr<QueryIfo> >::iterator query_iter =
       queries_.find(id);
 
@@ -598,6 +936,58 @@ namespace cpuvisor {
     return query_iter->second;
   }
 
+  void BaseServer::loadDsetFeats_(const cpuvisor::PreprocConfig& preproc_config) {
+    LOG(INFO) << "Load in features...";
+
+    // feature index files are memory mapped (dset_feats_ then wraps the
+    // mapping without copying, and paths are looked up directly from its
+    // path table), binaryproto files are read into memory
+    if (cpuvisor::isFeatsIndexFile(preproc_config.dataset_feats_file())) {
+      CHECK(cpuvisor::readFeatsFromIndex(preproc_config.dataset_feats_file(),
+                                         &dset_feats_, 0, &dset_feats_mapping_));
+      dset_paths_index_.reset(new PathIndex(dset_feats_mapping_));
+    } else {
+      // paths are streamed straight into the arena of the index
+      CHECK(cpuvisor::readFeatsFromProto(preproc_config.dataset_feats_file(),
+                                         &dset_feats_, 0));
+      std::vector<char> path_data;
+      std::vector<uint64_t> path_offsets;
+      CHECK(cpuvisor::readPathsFromProto(preproc_config.dataset_feats_file(),
+                                         &path_data, &path_offsets));
+      dset_paths_index_.reset(new PathIndex(&path_data, &path_offsets));
+      CHECK_EQ(dset_paths_index_->size(), dset_feats_.rows)
+        << "Dataset paths inconsistent with dataset features";
+    }
+
+    if (!preproc_config.dataset_compressed_feats_file().empty()) {
+      LOG(INFO) << "Load in compressed features...";
+      if (!dset_feats_mapping_) {
+        LOG(WARNING) << "Dataset features are not in feature index format, so are held in memory "
+                     << "- convert using cpuvisor_convert_feats to load them on demand";
+      }
+
+      dset_cfeats_mapping_.reset(new FeatsIndexMapping());
+      CHECK(dset_cfeats_mapping_->open(preproc_config.dataset_compressed_feats_file()));
+      CHECK_EQ(dset_cfeats_mapping_->num(), dset_paths_index_->size())
+        << "Compressed dataset features inconsistent with dataset features";
+      CHECK_EQ(dset_cfeats_mapping_->dim(), dset_feats_.cols)
+        << "Compressed dataset features inconsistent with dataset features";
+
+      dset_cfeats_ = dset_cfeats_mapping_->feats();
+      dset_cfeats_scales_ = dset_cfeats_mapping_->scales();
+    }
+
+    if (!preproc_config.dataset_ivfpq_file().empty()) {
+      LOG(INFO) << "Load in IVF-PQ index...";
+      ivfpq_index_.reset(new IvfPqIndex());
+      CHECK(ivfpq_index_->open(preproc_config.dataset_ivfpq_file()));
+      CHECK_EQ(ivfpq_index_->num(), dset_paths_index_->size())
+        << "IVF-PQ index inconsistent with dataset features";
+      CHECK_EQ(ivfpq_index_->dim(), dset_feats_.cols)
+        << "IVF-PQ index inconsistent with dataset features";
+    }
+  }
+
   void BaseServer::train_(const std::string& id, const bool post_errors) {
     boost::shared_ptr<QueryIfo> query_ifo = getQueryIfo_(id);
 
@@ -618,14 +1008,22 @@ namespace cpuvisor {
       }
 #endif
 
-      double svm_c = 1.0;
-      if (query_ifo->data.pos_paths.size() < 10) {
-        svm_c = 10.0;
+      const double svm_c = chooseSvmC_(query_ifo->data.pos_paths.size());
+
+      if (svm_warm_start_) {
+        // (the warm starts are read-only, so queries can be trained
+        // concurrently, and do not depend on each other)
+        std::map<double, featpipe::DenseSvmWarmStart>::const_iterator warm_start_it =
+          neg_warm_starts_.find(svm_c);
+        CHECK(warm_start_it != neg_warm_starts_.end());
+        query_ifo->data.model =
+          cpuvisor::trainLinearSvm(query_ifo->data.pos_feats, *neg_sample_set_, svm_c,
+                                   &warm_start_it->second);
+      } else {
+        query_ifo->data.model =
+          cpuvisor::trainLinearSvm(query_ifo->data.pos_feats, *neg_sample_set_, svm_c);
       }
 
-      query_ifo->data.model =
-        cpuvisor::trainLinearSvm(query_ifo->data.pos_feats, neg_feats_, svm_c);
-
 #ifdef MATEXP_DEBUG // DEBUG
       MatFile mat_file("prebasetrain.mat", true);
       mat_file.writeFloatMat("w_vect", (float*)query_ifo->data.model.data,
@@ -672,11 +1070,29 @@ namespace cpuvisor {
       notifier_->post_state_change_(id, query_ifo->state);
 
       {
-        boost::shared_lock<boost::shared_mutex> lock(dset_update_mutex_);
-        cpuvisor::rankUsingModel(query_ifo->data.model,
-                                 dset_feats_,
-                                 &query_ifo->data.ranking.scores,
-                                 &query_ifo->data.ranking.sort_idxs);
+        Ranking ranking;
+
+        // identical models (e.g. the same classifier loaded again) give
+        // identical rankings of the same version of the dataset (not used
+        // with shards, which may be updated independently)
+        const bool use_cache = ranking_cache_ && !shard_coordinator_;
+        std::string model_hash;
+        size_t dset_version = 0;
+        if (use_cache) {
+          model_hash = RankingCache::hashMat(query_ifo->data.model);
+          boost::shared_lock<boost::shared_mutex> lock(dset_update_mutex_);
+          dset_version = dset_version_;
+        }
+
+        if (use_cache && ranking_cache_->getRanking(model_hash, dset_version, &ranking)) {
+          LOG(INFO) << "Using cached ranking for model: " << model_hash;
+        } else {
+          rankUsingModel(query_ifo->data.model, rank_top_k_, &ranking);
+          if (use_cache) ranking_cache_->insertRanking(model_hash, dset_version, ranking);
+        }
+
+        boost::mutex::scoped_lock lock(query_ifo->data.ranking_mutex);
+        query_ifo->data.ranking = ranking;
       }
 
       query_ifo->state = QS_RANKED;
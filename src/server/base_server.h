@@ -15,10 +15,21 @@
 #include <opencv2/opencv.hpp>
 
 #include "directencode/caffe_encoder.h"
+#include "classification/svm/dense_linear_svm.h"
 
 #include "server/query_data.h" // defines all datatypes used in this class
 #include "server/util/image_downloader.h"
+#include "server/util/feat_cache.h"
+#include "server/util/classifier_cache.h"
+#include "server/util/classifier_store.h"
+#include "server/util/ranking_cache.h"
+#include "server/util/path_index.h"
 #include "server/util/status_notifier.h"
+#include "server/util/feats_index.h"
+#include "server/util/scoring_engine.h"
+#include "server/util/delta_segments.h"
+#include "server/util/ivfpq_index.h"
+#include "server/shard_coordinator.h"
 #include "cpuvisor_config.pb.h"
 
 namespace cpuvisor {
@@ -65,39 +76,62 @@ namespace cpuvisor {
 
   class BaseServerPostProcessor : public PostProcessor {
   public:
-    inline BaseServerPostProcessor(featpipe::CaffeEncoder& encoder)
-      : encoder_(encoder) { }
+    inline BaseServerPostProcessor(featpipe::CaffeEncoder& encoder,
+                                   boost::shared_ptr<FeatCache> feat_cache = boost::shared_ptr<FeatCache>())
+      : encoder_(encoder)
+      , feat_cache_(feat_cache) { }
     virtual void process(const std::string imfile,
                          boost::shared_ptr<ExtraDataWrapper> extra_data
                          = boost::shared_ptr<ExtraDataWrapper>());
+    virtual void process(const ImfileIfo& imfile_ifo, const cv::Mat& image);
+    virtual bool processCached(const ImfileIfo& imfile_ifo);
+    // returns the feature for an image file (without adding it to any
+    // query) - can be called from multiple threads at once
+    inline cv::Mat getFeat(const std::string& imfile) {
+      return computeFeat_(imfile, cv::Mat());
+    }
   protected:
-    virtual cv::Mat computeFeat_(const std::string& imfile);
+    // image is empty if it should be read from imfile, and data_hash is
+    // empty if the computed feature should not be cached
+    virtual void processImage_(const std::string& imfile, const cv::Mat& image,
+                               boost::shared_ptr<ExtraDataWrapper> extra_data,
+                               const std::string& url = std::string(),
+                               const std::string& data_hash = std::string());
+    virtual void addFeat_(const std::string& imfile, const cv::Mat& feat,
+                          boost::shared_ptr<QueryIfo> query_ifo,
+                          boost::shared_ptr<StatusNotifier> notifier);
+    virtual cv::Mat computeFeat_(const std::string& imfile, const cv::Mat& image);
 
     featpipe::CaffeEncoder& encoder_;
+    boost::shared_ptr<FeatCache> feat_cache_;
   };
 
   class BaseServerPostProcessorWithDsetFeats : public BaseServerPostProcessor {
   public:
+    // dset_feats (and dset_deltas) are read under a shared lock on
+    // dset_update_mutex, as they may be extended by incremental dataset
+    // updates
     inline BaseServerPostProcessorWithDsetFeats(featpipe::CaffeEncoder& encoder,
-                                                const cv::Mat dset_feats,
-                                                const std::vector<std::string>& dset_paths,
-                                                const std::string dset_base_path)
-      : BaseServerPostProcessor(encoder)
+                                                const cv::Mat& dset_feats,
+                                                boost::shared_ptr<DeltaSegments> dset_deltas,
+                                                boost::shared_mutex& dset_update_mutex,
+                                                boost::shared_ptr<PathIndex> dset_paths_index,
+                                                const std::string dset_base_path,
+                                                boost::shared_ptr<FeatCache> feat_cache = boost::shared_ptr<FeatCache>())
+      : BaseServerPostProcessor(encoder, feat_cache)
       , dset_feats_(dset_feats)
-      , dset_paths_(dset_paths)
-      , dset_base_path_(dset_base_path) {
-
-      for (size_t i = 0; i < dset_paths_.size(); ++i) {
-        dset_paths_index_.insert(std::pair<std::string, size_t>(dset_paths_[i], i));
-      }
-    }
+      , dset_deltas_(dset_deltas)
+      , dset_update_mutex_(dset_update_mutex)
+      , dset_paths_index_(dset_paths_index)
+      , dset_base_path_(dset_base_path) { }
   protected:
-    virtual cv::Mat computeFeat_(const std::string& imfile);
+    virtual cv::Mat computeFeat_(const std::string& imfile, const cv::Mat& image);
 
-    const cv::Mat dset_feats_;
-    const std::vector<std::string>& dset_paths_;
+    const cv::Mat& dset_feats_;
+    boost::shared_ptr<DeltaSegments> dset_deltas_;
+    boost::shared_mutex& dset_update_mutex_;
+    boost::shared_ptr<PathIndex> dset_paths_index_;
     const std::string dset_base_path_;
-    std::map<std::string, size_t> dset_paths_index_;
   };
 
   class BaseServerCallback : public DownloadCompleteCallback {
@@ -126,15 +160,17 @@ namespace cpuvisor {
                               Ranking* ranking = 0);
     virtual void train(const std::string& id, const bool block = false);
     virtual void rank(const std::string& id, const bool block = false);
-    virtual Ranking getRanking(const std::string& id);
+    // ensures at least min_sorted items of the returned ranking are sorted
+    virtual Ranking getRanking(const std::string& id, const size_t min_sorted = 0);
     virtual void freeQuery(const std::string& id);
 
     inline boost::shared_ptr<StatusNotifier> notifier() {
       return notifier_;
     }
     inline std::string dset_path(const size_t idx) const {
-      CHECK_LT(idx, dset_paths_.size());
-      return dset_paths_[idx];
+      // (the index is internally locked, as it may be appended to by
+      // incremental dataset updates)
+      return dset_paths_index_->path(idx);
     }
 
     // legacy methods
@@ -149,33 +185,92 @@ namespace cpuvisor {
 
     virtual void addDsetImagesToIndex(const std::vector<std::string>& dset_paths);
 
+    // ranks the dataset (or all dataset shards) using model, ensuring at
+    // least the top_k items of the returned ranking are sorted
+    virtual void rankUsingModel(const cv::Mat& model, const size_t top_k,
+                                Ranking* ranking);
+
     virtual void returnClassifiersScoresForImages(const std::vector<std::string>& paths,
                                                   const std::vector<std::string>& classifier_paths,
                                                   std::vector<Ranking>* rankings = 0);
 
+    // the classifier store (available if server_config->classifier_store_path
+    // is specified) - the classifier of a trained query can be added to the
+    // store, and all stored classifiers applied to the dataset in a single
+    // batch, after which the top results of each can be retrieved
+    virtual void addClassifierToStore(const std::string& id, const std::string& name);
+    virtual void applyStoredClassifiers();
+    virtual Ranking getStoredClassifierRanking(const std::string& name);
+
   protected:
     virtual boost::shared_ptr<QueryIfo> getQueryIfo_(const std::string& id);
+    virtual void loadDsetFeats_(const cpuvisor::PreprocConfig& preproc_config);
 
     virtual void train_(const std::string& id, bool post_errors = false);
     virtual void rank_(const std::string& id, bool post_errors = false);
 
     virtual void addTrsFromFile_(const std::string& id, const std::vector<std::string>& paths);
 
+    // computes features for images (looking up dataset images in the
+    // index) from feat_threads_ threads, as rows of feats in path order
+    virtual void computeFeats_(const std::vector<std::string>& paths, cv::Mat* feats);
+
     std::map<std::string, boost::shared_ptr<QueryIfo> > queries_;
+    boost::mutex queries_mutex_; // requests may be handled from multiple threads
 
     cv::Mat dset_feats_;
-    std::vector<std::string> dset_paths_;
+    // paths of all dataset rows (dset_feats_ followed by dset_deltas_)
+    boost::shared_ptr<PathIndex> dset_paths_index_;
     std::string dset_base_path_;
 
     std::string dset_feats_file_;
     boost::shared_mutex dset_update_mutex_;
+    // incremented each time the dataset index is changed (guarded by
+    // dset_update_mutex_)
+    size_t dset_version_;
+    // kept alive for the lifetime of the server, as dset_feats_ (and
+    // copies of it) may wrap the mapped data
+    boost::shared_ptr<FeatsIndexMapping> dset_feats_mapping_;
+    // features added by incremental updates (ranked after dset_feats_)
+    boost::shared_ptr<DeltaSegments> dset_deltas_;
+
+    // compressed dataset features (used for scoring if specified)
+    cv::Mat dset_cfeats_;
+    cv::Mat dset_cfeats_scales_;
+    boost::shared_ptr<FeatsIndexMapping> dset_cfeats_mapping_;
+    size_t rescore_sz_;
+
+    // approximate dataset index (used for ranking if specified)
+    boost::shared_ptr<IvfPqIndex> ivfpq_index_;
+    size_t ivfpq_nprobe_;
+
+    // if specified, the dataset is held by shard servers instead
+    boost::shared_ptr<ShardCoordinator> shard_coordinator_;
 
     cv::Mat neg_feats_;
     std::vector<std::string> neg_paths_;
+    // negatives prepared for training once on startup (references
+    // neg_feats_)
+    boost::shared_ptr<featpipe::DenseSvmSampleSet> neg_sample_set_;
+    bool svm_warm_start_;
+    // solutions for the negatives alone for each value of C used in
+    // training (computed once on startup, and never updated)
+    std::map<double, featpipe::DenseSvmWarmStart> neg_warm_starts_;
     std::string neg_base_path_;
     std::string image_cache_path_;
+    size_t rank_top_k_;
+    size_t feat_threads_;
+
+    // pretrained classifiers for returnClassifiersScoresForImages
+    boost::shared_ptr<ClassifierCache> classifier_cache_;
+    // saved classifiers (if specified)
+    boost::shared_ptr<ClassifierStore> classifier_store_;
+    // results of previous queries (if enabled)
+    boost::shared_ptr<RankingCache> ranking_cache_;
 
     boost::shared_ptr<featpipe::CaffeEncoder> encoder_;
+    boost::shared_ptr<ScoringEngine> scoring_engine_;
+    boost::shared_ptr<FeatCache> feat_cache_;
     boost::shared_ptr<BaseServerPostProcessorWithDsetFeats> post_processor_;
     boost::shared_ptr<ImageDownloader> image_downloader_;
 
@@ -16,8 +16,33 @@
 namespace cpuvisor {
 
   struct Ranking {
+    Ranking() : sorted_count(0), truncated(false) { }
     cv::Mat scores;
     cv::Mat sort_idxs;
+    // only the first sorted_count entries of sort_idxs are in their final
+    // order - the remainder are partitioned (all with lower scores) but
+    // unsorted, and are sorted lazily as deeper pages are requested
+    // (sort_idxs may also hold only the sorted prefix)
+    size_t sorted_count;
+    // set for rankings which hold only their top sorted_count items
+    // (e.g. from an approximate index) - scores then holds the score of
+    // each ranked item in ranked order, rather than being indexed by
+    // dataset index, and the ranking cannot be extended
+    bool truncated;
+    // path of each ranked item in ranked order, for truncated rankings
+    // of items not held in the local dataset (e.g. merged from shards)
+    std::vector<std::string> paths;
+
+    // number of items which can be retrieved from the ranking
+    inline size_t size() const {
+      return truncated ? sorted_count : static_cast<size_t>(scores.rows);
+    }
+    // score of the item at position rank in the (sorted) ranking
+    inline float rankedScore(const size_t rank) const {
+      const float* scores_ptr = (const float*)scores.data;
+      return truncated ? scores_ptr[rank]
+        : scores_ptr[((const int*)sort_idxs.data)[rank]];
+    }
   };
 
   enum QueryState {QS_DATACOLL, QS_DATACOLL_COMPLETE,
@@ -30,6 +55,7 @@ namespace cpuvisor {
     boost::mutex pos_mutex; // to ensure features are added in thread-safe manner
     cv::Mat model;
     Ranking ranking;
+    boost::mutex ranking_mutex; // to ensure ranking is extended in thread-safe manner
   };
 
   struct QueryIfo {
@@ -0,0 +1,112 @@
+#include "shard_coordinator.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <boost/thread.hpp>
+#include <boost/scoped_array.hpp>
+
+#include <glog/logging.h>
+
+#include "server/zmq_client.h"
+#include "server/util/scoring_engine.h" // for ScoredIdx
+
+namespace cpuvisor {
+
+  ShardCoordinator::ShardCoordinator(const std::vector<std::string>& shard_endpoints,
+                                     const size_t shard_top_k, const int timeout_ms)
+    : shard_endpoints_(shard_endpoints)
+    , shard_top_k_(shard_top_k)
+    , timeout_ms_(timeout_ms)
+    , context_(new zmq::context_t(1)) {
+
+    CHECK_GT(shard_endpoints_.size(), 0);
+
+  }
+
+  void ShardCoordinator::rank(const cv::Mat& model, const size_t top_k, Ranking* ranking) {
+
+    const size_t shard_count = shard_endpoints_.size();
+    const size_t merged_k = std::max(top_k, shard_top_k_);
+
+    // scatter
+    std::vector<RankedList> shard_rankings(shard_count);
+    boost::scoped_array<bool> shard_success(new bool[shard_count]);
+
+    boost::thread_group shard_threads;
+    for (size_t i = 0; i < shard_count; ++i) {
+      shard_success[i] = false;
+      shard_threads.add_thread(new boost::thread(&ShardCoordinator::rankShard_, this, i,
+                                                 model, merged_k,
+                                                 &shard_rankings[i], &shard_success[i]));
+    }
+    shard_threads.join_all();
+
+    // gather
+    std::vector<ScoredIdx> items;
+    std::vector<const std::string*> item_paths;
+    size_t failed_count = 0;
+
+    for (size_t i = 0; i < shard_count; ++i) {
+      if (!shard_success[i]) {
+        ++failed_count;
+        continue;
+      }
+      const RankedList& shard_ranking = shard_rankings[i];
+      for (int j = 0; j < shard_ranking.rlist_size(); ++j) {
+        ScoredIdx item;
+        item.score = shard_ranking.rlist(j).score();
+        item.idx = item_paths.size();
+        items.push_back(item);
+        item_paths.push_back(&shard_ranking.rlist(j).path());
+      }
+    }
+
+    if (failed_count == shard_count) {
+      throw std::runtime_error("Could not retrieve ranking from any dataset shard");
+    }
+    if (failed_count > 0) {
+      LOG(ERROR) << "Ranking is missing results from " << failed_count << " of "
+                 << shard_count << " dataset shards";
+    }
+
+    // merge (ties are broken by shard order, then rank within shard)
+    const size_t result_count = std::min(merged_k, items.size());
+    std::partial_sort(items.begin(), items.begin() + result_count, items.end(),
+                      isBetterScoredIdx);
+
+    ranking->scores = cv::Mat(result_count, 1, CV_32F);
+    ranking->sort_idxs = cv::Mat(result_count, 1, CV_32S);
+    ranking->paths.resize(result_count);
+    float* scores_ptr = (float*)ranking->scores.data;
+    int* sort_idxs_ptr = (int*)ranking->sort_idxs.data;
+    for (size_t i = 0; i < result_count; ++i) {
+      scores_ptr[i] = items[i].score;
+      sort_idxs_ptr[i] = i;
+      ranking->paths[i] = *item_paths[items[i].idx];
+    }
+    ranking->sorted_count = result_count;
+    ranking->truncated = true;
+
+  }
+
+  void ShardCoordinator::rankShard_(const size_t shard_idx, const cv::Mat& model,
+                                    const size_t top_k, RankedList* ranking, bool* success) {
+
+    DLOG(INFO) << "Ranking dataset shard at: " << shard_endpoints_[shard_idx];
+
+    try {
+      ZmqClient client(shard_endpoints_[shard_idx], timeout_ms_, context_);
+      *success = client.rankUsingModel(model, top_k, ranking);
+    } catch (const zmq::error_t& e) {
+      LOG(ERROR) << "ZMQ error when ranking dataset shard at: "
+                 << shard_endpoints_[shard_idx] << " (" << e.what() << ")";
+      *success = false;
+    }
+
+    if (!(*success)) {
+      LOG(ERROR) << "Failed to rank dataset shard at: " << shard_endpoints_[shard_idx];
+    }
+
+  }
+
+}
@@ -0,0 +1,51 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        shard_coordinator.h
+//    Author:      Ken Chatfield
+//    Description: Scatter-gather ranking over dataset shards, each served
+//                 by a separate cpuvisor_service instance
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_SHARD_COORDINATOR_H_
+#define CPUVISOR_SHARD_COORDINATOR_H_
+
+#include <vector>
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+
+#include <zmq.hpp>
+
+#include <opencv2/opencv.hpp>
+
+#include "server/query_data.h"
+#include "cpuvisor_srv.pb.h"
+
+namespace cpuvisor {
+
+  class ShardCoordinator : boost::noncopyable {
+  public:
+    ShardCoordinator(const std::vector<std::string>& shard_endpoints,
+                     const size_t shard_top_k, const int timeout_ms = -1);
+
+    // sends model to all shards in parallel, and merges their top
+    // max(top_k, shard_top_k) items into a truncated ranking - shards
+    // which fail to respond are skipped (with an error logged), and a
+    // std::runtime_error is thrown only if all shards fail
+    void rank(const cv::Mat& model, const size_t top_k, Ranking* ranking);
+
+    inline size_t shard_count() const { return shard_endpoints_.size(); }
+
+  protected:
+    void rankShard_(const size_t shard_idx, const cv::Mat& model,
+                    const size_t top_k, RankedList* ranking, bool* success);
+
+    std::vector<std::string> shard_endpoints_;
+    size_t shard_top_k_;
+    int timeout_ms_;
+
+    boost::shared_ptr<zmq::context_t> context_;
+  };
+
+}
+
+#endif
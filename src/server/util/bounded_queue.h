@@ -0,0 +1,83 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        bounded_queue.h
+//    Author:      Ken Chatfield
+//    Description: Thread-safe concurrent queue with a maximum size, for
+//                 connecting the stages of a pipeline
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef FEATPIPE_BOUNDED_QUEUE_H_
+#define FEATPIPE_BOUNDED_QUEUE_H_
+
+#include <queue>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+namespace featpipe {
+
+  template<typename Data>
+  class BoundedQueue : boost::noncopyable {
+  protected:
+    std::queue<Data> queue_;
+    size_t capacity_;
+    size_t producers_;
+    mutable boost::mutex mutex_;
+    boost::condition_variable not_empty_cond_var_;
+    boost::condition_variable not_full_cond_var_;
+  public:
+    // the queue is closed once each of the producers has called close()
+    BoundedQueue(const size_t capacity, const size_t producers = 1)
+      : capacity_(capacity)
+      , producers_(producers) { }
+
+    // blocks while the queue is full
+    void push(Data const& data) {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (queue_.size() >= capacity_) {
+        not_full_cond_var_.wait(lock);
+      }
+      queue_.push(data);
+      lock.unlock();
+      not_empty_cond_var_.notify_one();
+    }
+
+    void close() {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (producers_ > 0) --producers_;
+      lock.unlock();
+      not_empty_cond_var_.notify_all();
+    }
+
+    bool tryPop(Data& popped_value) {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (queue_.empty()) {
+        return false;
+      }
+
+      popped_value = queue_.front();
+      queue_.pop();
+      lock.unlock();
+      not_full_cond_var_.notify_one();
+      return true;
+    }
+
+    // blocks while the queue is empty, returning false once it has been
+    // closed by all producers and drained
+    bool waitAndPop(Data& popped_value) {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (queue_.empty()) {
+        if (producers_ == 0) return false;
+        not_empty_cond_var_.wait(lock);
+      }
+
+      popped_value = queue_.front();
+      queue_.pop();
+      lock.unlock();
+      not_full_cond_var_.notify_one();
+      return true;
+    }
+
+  };
+
+}
+
+#endif
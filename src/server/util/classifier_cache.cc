@@ -0,0 +1,100 @@
+#include "classifier_cache.h"
+
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+
+#include <glog/logging.h>
+
+#include "server/util/io.h"
+
+namespace cpuvisor {
+
+  ClassifierCache::ClassifierCache(const size_t max_entries)
+    : max_entries_(max_entries) {
+
+    CHECK_GT(max_entries_, 0);
+  }
+
+  bool ClassifierCache::get(const std::string& path, cv::Mat* model) {
+
+    std::time_t mtime;
+    try {
+      mtime = fs::last_write_time(path);
+    } catch (fs::filesystem_error& e) {
+      LOG(ERROR) << "Could not find classifier: " << path;
+      return false;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      EntryIndex::iterator it = path_index_.find(path);
+      if (it != path_index_.end()) {
+        if (it->second->mtime == mtime) {
+          entries_.splice(entries_.begin(), entries_, it->second);
+          (*model) = it->second->model;
+          return true;
+        }
+        // stale - file has been modified since it was cached
+        entries_.erase(it->second);
+        path_index_.erase(it);
+      }
+    }
+
+    // read without holding the lock (the same file may occasionally be
+    // read by two threads at once, in which case the later insert wins)
+    Entry entry;
+    entry.path = path;
+    entry.mtime = mtime;
+    if (!readModelFromProto(path, &entry.model) || entry.model.empty()) {
+      LOG(ERROR) << "Could not read classifier: " << path;
+      return false;
+    }
+    CHECK_EQ(entry.model.type(), CV_32F);
+    CHECK_EQ(entry.model.cols, 1);
+    DLOG(INFO) << "Read classifier: " << path;
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    EntryIndex::iterator it = path_index_.find(path);
+    if (it != path_index_.end()) {
+      entries_.erase(it->second);
+      path_index_.erase(it);
+    }
+    entries_.push_front(entry);
+    path_index_[path] = entries_.begin();
+
+    while (entries_.size() > max_entries_) {
+      path_index_.erase(entries_.back().path);
+      entries_.pop_back();
+    }
+
+    (*model) = entry.model;
+    return true;
+  }
+
+  bool ClassifierCache::getStacked(const std::vector<std::string>& paths, cv::Mat* models,
+                                   std::string* err_path) {
+
+    std::vector<cv::Mat> cols(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if (!get(paths[i], &cols[i]) || ((i > 0) && (cols[i].rows != cols[0].rows))) {
+        if (err_path) (*err_path) = paths[i];
+        return false;
+      }
+    }
+
+    if (cols.empty()) {
+      (*models) = cv::Mat();
+    } else {
+      cv::hconcat(cols, *models);
+    }
+    return true;
+  }
+
+  size_t ClassifierCache::size() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return entries_.size();
+  }
+
+}
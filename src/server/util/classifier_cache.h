@@ -0,0 +1,60 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        classifier_cache.h
+//    Author:      Ken Chatfield
+//    Description: LRU cache of pretrained classifiers read from model
+//                 files, keyed by path
+//
+//    A cached classifier is read again if its file has been modified
+//    since it was cached.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_CLASSIFIER_CACHE_H_
+#define CPUVISOR_UTILS_CLASSIFIER_CACHE_H_
+
+#include <list>
+#include <map>
+#include <vector>
+#include <string>
+#include <ctime>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <opencv2/opencv.hpp>
+
+namespace cpuvisor {
+
+  class ClassifierCache : boost::noncopyable {
+  public:
+    ClassifierCache(const size_t max_entries);
+
+    // returns the [dim x 1] model stored in the model file at path (false
+    // if it could not be read)
+    bool get(const std::string& path, cv::Mat* model);
+    // returns the models for all paths stacked as the columns of a single
+    // [dim x paths.size()] matrix (false if any could not be read, or
+    // they are of different dimensionality, in which case err_path is set
+    // to the path of the offending model file)
+    bool getStacked(const std::vector<std::string>& paths, cv::Mat* models,
+                    std::string* err_path = 0);
+
+    size_t size();
+
+  protected:
+    struct Entry {
+      std::string path;
+      std::time_t mtime;
+      cv::Mat model;
+    };
+    typedef std::list<Entry> EntryList;
+    typedef std::map<std::string, EntryList::iterator> EntryIndex;
+
+    size_t max_entries_;
+    EntryList entries_; // most recently used first
+    EntryIndex path_index_;
+    boost::mutex mutex_;
+  };
+
+}
+
+#endif
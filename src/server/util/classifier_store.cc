@@ -0,0 +1,273 @@
+#include "classifier_store.h"
+
+#include <algorithm>
+#include <cctype>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+
+#include "server/util/io.h"
+
+namespace cpuvisor {
+
+  ClassifierStore::ClassifierStore(const std::string& store_path, const size_t dim,
+                                   const size_t top_k, const size_t num_threads)
+    : store_path_(store_path)
+    , dim_(dim)
+    , top_k_(top_k)
+    , next_version_(0) {
+
+    CHECK_GT(dim_, 0);
+    CHECK_GT(top_k_, 0);
+    thread_count_ = (num_threads > 0) ? num_threads : boost::thread::hardware_concurrency();
+    if (thread_count_ < 1) thread_count_ = 1;
+  }
+
+  bool ClassifierStore::load() {
+    if (!fs::exists(store_path_)) {
+      LOG(INFO) << "Creating classifier store: " << store_path_;
+      fs::create_directories(store_path_);
+      return true;
+    }
+
+    std::vector<std::string> names;
+    for (fs::directory_iterator it(store_path_); it != fs::directory_iterator(); ++it) {
+      const fs::path& path_fs = it->path();
+      if (!fs::is_regular_file(path_fs) || (path_fs.extension().string() != ".binaryproto")) continue;
+      const std::string name = path_fs.stem().string();
+      if (isValidName(name)) names.push_back(name);
+    }
+    std::sort(names.begin(), names.end());
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (size_t i = 0; i < names.size(); ++i) {
+      cv::Mat model;
+      if (!readModelFromProto(modelPath_(names[i]), &model)) {
+        LOG(ERROR) << "Could not read stored classifier: " << modelPath_(names[i]);
+        return false;
+      }
+      if (static_cast<size_t>(model.rows) != dim_) {
+        LOG(ERROR) << "Stored classifier inconsistent with dataset features - wrong dimensionality ("
+                   << model.rows << " vs. " << dim_ << "): " << modelPath_(names[i]);
+        return false;
+      }
+      addLocked_(names[i], model);
+    }
+
+    LOG(INFO) << "Loaded " << entries_.size() << " classifiers from store: " << store_path_;
+
+    return true;
+  }
+
+  void ClassifierStore::add(const std::string& name, const cv::Mat& model) {
+    CHECK(isValidName(name)) << "Invalid classifier name: " << name;
+    CHECK_EQ(model.type(), CV_32F);
+    CHECK_EQ(model.total(), dim_);
+
+    // write to a temporary file first, so a stored classifier file is
+    // never partially written
+    const std::string model_path = modelPath_(name);
+    const std::string tmp_model_path = model_path + ".tmp";
+    writeModelToProto(model, tmp_model_path);
+    fs::rename(tmp_model_path, model_path);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    addLocked_(name, model);
+  }
+
+  void ClassifierStore::applyAll(const std::vector<cv::Mat>& segments) {
+    boost::mutex::scoped_lock apply_lock(apply_mutex_);
+
+    size_t dset_sz = 0;
+    for (size_t s = 0; s < segments.size(); ++s) {
+      CHECK_EQ(segments[s].type(), CV_32FC1);
+      CHECK_EQ(segments[s].cols, static_cast<int>(dim_));
+      dset_sz += segments[s].rows;
+    }
+
+    // snapshot the current classifiers (models_ is replaced rather than
+    // modified if a classifier is replaced whilst applying)
+    cv::Mat models;
+    std::vector<std::string> names;
+    std::vector<size_t> versions;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      models = models_;
+      for (size_t i = 0; i < entries_.size(); ++i) {
+        names.push_back(entries_[i].name);
+        versions.push_back(entries_[i].version);
+      }
+    }
+    const size_t model_count = names.size();
+    if (model_count == 0) return;
+    CHECK_EQ(models.rows, static_cast<int>(model_count));
+
+    LOG(INFO) << "Applying " << model_count << " stored classifiers to "
+              << dset_sz << " dataset features...";
+
+    // split classifiers between threads
+    const size_t thread_count = std::min(thread_count_, model_count);
+    std::vector<std::vector<std::vector<ScoredIdx> > > thread_heaps(thread_count);
+    {
+      boost::thread_group threads;
+      for (size_t t = 0; t < thread_count; ++t) {
+        const size_t start_idx = model_count*t/thread_count;
+        const size_t end_idx = model_count*(t+1)/thread_count;
+        threads.create_thread(boost::bind(&ClassifierStore::scoreWorker_, this, &segments,
+                                          models.rowRange(start_idx, end_idx),
+                                          &thread_heaps[t]));
+      }
+      threads.join_all();
+    }
+
+    // convert the top results of each classifier to a truncated ranking
+    std::vector<Ranking> results(model_count);
+    size_t model_idx = 0;
+    for (size_t t = 0; t < thread_count; ++t) {
+      for (size_t i = 0; i < thread_heaps[t].size(); ++i, ++model_idx) {
+        std::vector<ScoredIdx>& heap = thread_heaps[t][i];
+        std::sort(heap.begin(), heap.end(), isBetterScoredIdx);
+
+        Ranking& ranking = results[model_idx];
+        ranking.truncated = true;
+        ranking.sorted_count = heap.size();
+        ranking.scores = cv::Mat(heap.size(), 1, CV_32F);
+        ranking.sort_idxs = cv::Mat(heap.size(), 1, CV_32S);
+        float* scores_ptr = (float*)ranking.scores.data;
+        int* sort_idxs_ptr = (int*)ranking.sort_idxs.data;
+        for (size_t j = 0; j < heap.size(); ++j) {
+          scores_ptr[j] = heap[j].score;
+          sort_idxs_ptr[j] = heap[j].idx;
+        }
+      }
+    }
+    CHECK_EQ(model_idx, model_count);
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      for (size_t i = 0; i < model_count; ++i) {
+        std::map<std::string, size_t>::iterator it = name_index_.find(names[i]);
+        // (results of classifiers replaced whilst applying are discarded)
+        if ((it == name_index_.end()) || (entries_[it->second].version != versions[i])) continue;
+        entries_[it->second].results = results[i];
+        entries_[it->second].applied = true;
+      }
+    }
+
+    LOG(INFO) << "Applied " << model_count << " stored classifiers";
+  }
+
+  bool ClassifierStore::getResults(const std::string& name, Ranking* ranking) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::map<std::string, size_t>::iterator it = name_index_.find(name);
+    if ((it == name_index_.end()) || !entries_[it->second].applied) return false;
+
+    (*ranking) = entries_[it->second].results;
+    return true;
+  }
+
+  bool ClassifierStore::getModel(const std::string& name, cv::Mat* model) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::map<std::string, size_t>::iterator it = name_index_.find(name);
+    if (it == name_index_.end()) return false;
+
+    (*model) = models_.row(it->second).t();
+    return true;
+  }
+
+  std::vector<std::string> ClassifierStore::names() {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::vector<std::string> names;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      names.push_back(entries_[i].name);
+    }
+    return names;
+  }
+
+  size_t ClassifierStore::size() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return entries_.size();
+  }
+
+  bool ClassifierStore::isValidName(const std::string& name) {
+    if (name.empty() || (name[0] == '.')) return false;
+    for (size_t i = 0; i < name.size(); ++i) {
+      const char c = name[i];
+      if (!std::isalnum(static_cast<unsigned char>(c)) && (c != '-') && (c != '_') && (c != '.')) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // -----------------------------------------------------------------------------
+
+  std::string ClassifierStore::modelPath_(const std::string& name) const {
+    return (fs::path(store_path_) / fs::path(name + ".binaryproto")).string();
+  }
+
+  void ClassifierStore::addLocked_(const std::string& name, const cv::Mat& model) {
+    cv::Mat model_row = model.clone().reshape(1, 1); // [1 x dim]
+
+    std::map<std::string, size_t>::iterator it = name_index_.find(name);
+    if (it != name_index_.end()) {
+      // (the current matrix may be in use by applyAll)
+      models_ = models_.clone();
+      model_row.copyTo(models_.row(it->second));
+
+      Entry& entry = entries_[it->second];
+      entry.version = next_version_++;
+      entry.applied = false;
+      entry.results = Ranking();
+    } else {
+      // (appended rows are not part of any snapshot taken by applyAll)
+      models_.push_back(model_row);
+
+      Entry entry;
+      entry.name = name;
+      entry.version = next_version_++;
+      entry.applied = false;
+      entries_.push_back(entry);
+      name_index_[name] = entries_.size() - 1;
+    }
+  }
+
+  void ClassifierStore::scoreWorker_(const std::vector<cv::Mat>* segments, const cv::Mat models,
+                                     std::vector<std::vector<ScoredIdx> >* heaps) const {
+    const size_t model_count = models.rows;
+    heaps->assign(model_count, std::vector<ScoredIdx>());
+
+    // each block of dataset rows fits comfortably in cache, and is scored
+    // against all classifiers before moving on to the next
+    const size_t block_rows = std::max<size_t>(SCORING_BLOCK_BYTES/(dim_*sizeof(float)), 16);
+    cv::Mat block_scores;
+
+    size_t offset = 0;
+    for (size_t s = 0; s < segments->size(); ++s) {
+      const cv::Mat& segment = (*segments)[s];
+      const size_t segment_rows = segment.rows;
+
+      for (size_t start_row = 0; start_row < segment_rows; start_row += block_rows) {
+        const size_t end_row = std::min(start_row + block_rows, segment_rows);
+        // [block rows x model_count] scores
+        cv::gemm(segment.rowRange(start_row, end_row), models, 1.0, cv::Mat(), 0.0,
+                 block_scores, cv::GEMM_2_T);
+
+        for (size_t r = 0; r < end_row - start_row; ++r) {
+          const float* row_scores = block_scores.ptr<float>(r);
+          const int idx = offset + start_row + r;
+          for (size_t m = 0; m < model_count; ++m) {
+            pushTopK(&(*heaps)[m], top_k_, row_scores[m], idx);
+          }
+        }
+      }
+      offset += segment_rows;
+    }
+  }
+
+}
@@ -0,0 +1,98 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        classifier_store.h
+//    Author:      Ken Chatfield
+//    Description: Library of saved classifiers, which can all be applied
+//                 to the dataset in a single batch
+//
+//    Classifiers are stored in a directory as <name>.binaryproto model
+//    files, and held in memory as the rows of a single matrix. applyAll()
+//    scores the dataset with every stored classifier in one pass: the
+//    classifiers are split between threads, and each thread streams
+//    through the dataset in blocks of rows, scoring each block against all
+//    of its classifiers with a single matrix product. Only the top_k
+//    results of each classifier are kept, and can be served again without
+//    recomputation until the classifier is replaced.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_CLASSIFIER_STORE_H_
+#define CPUVISOR_UTILS_CLASSIFIER_STORE_H_
+
+#include <vector>
+#include <string>
+#include <map>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <glog/logging.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "server/query_data.h"
+#include "server/util/scoring_engine.h"
+
+namespace cpuvisor {
+
+  class ClassifierStore : boost::noncopyable {
+  public:
+    // num_threads = 0 uses one thread per core
+    ClassifierStore(const std::string& store_path, const size_t dim,
+                    const size_t top_k = 1000, const size_t num_threads = 0);
+
+    // reads all classifiers in the store directory (creating it if it
+    // does not exist)
+    bool load();
+
+    // writes model to the store as name, replacing (and discarding the
+    // results of) any existing classifier of the same name
+    void add(const std::string& name, const cv::Mat& model);
+
+    // scores the dataset (split across segments, with rows numbered
+    // consecutively from the first segment) with all stored classifiers,
+    // keeping the top_k results of each - classifiers added whilst
+    // applying are left without results
+    void applyAll(const std::vector<cv::Mat>& segments);
+
+    // returns the results of a classifier from the last call to
+    // applyAll() as a truncated ranking (false if it has none)
+    bool getResults(const std::string& name, Ranking* ranking);
+    bool getModel(const std::string& name, cv::Mat* model);
+    std::vector<std::string> names();
+    size_t size();
+
+    // names may contain only alphanumeric characters, '-', '_' and '.'
+    // (and may not start with '.')
+    static bool isValidName(const std::string& name);
+
+  protected:
+    struct Entry {
+      std::string name;
+      size_t version; // changes each time the classifier is replaced
+      bool applied; // set once results have been computed
+      Ranking results;
+    };
+
+    std::string modelPath_(const std::string& name) const;
+    void addLocked_(const std::string& name, const cv::Mat& model);
+    void scoreWorker_(const std::vector<cv::Mat>* segments, const cv::Mat models,
+                      std::vector<std::vector<ScoredIdx> >* heaps) const;
+
+    std::string store_path_;
+    size_t dim_;
+    size_t top_k_;
+    size_t thread_count_;
+
+    boost::mutex mutex_; // guards the following
+    std::vector<Entry> entries_;
+    std::map<std::string, size_t> name_index_;
+    // [num classifiers x dim] - replaced rather than modified in place
+    // once shared with applyAll()
+    cv::Mat models_;
+    size_t next_version_;
+
+    boost::mutex apply_mutex_; // serializes calls to applyAll()
+  };
+
+}
+
+#endif
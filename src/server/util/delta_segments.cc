@@ -0,0 +1,282 @@
+#include "delta_segments.h"
+
+#include <algorithm>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+
+#include "server/util/io.h"
+
+namespace cpuvisor {
+
+  DeltaSegments::DeltaSegments(const std::string& base_feats_file,
+                               const size_t base_num, const size_t dim,
+                               boost::shared_mutex& update_mutex,
+                               PathIndex* path_index,
+                               const size_t max_segments)
+    : base_num_(base_num)
+    , dim_(dim)
+    , max_segments_(std::max<size_t>(max_segments, 1))
+    , update_mutex_(update_mutex)
+    , path_index_(path_index)
+    , num_(0)
+    , compact_pending_(false)
+    , stopping_(false) {
+
+    CHECK(path_index_);
+
+    fs::path base_feats_file_fs(base_feats_file);
+    seg_stem_ = (base_feats_file_fs.parent_path() / base_feats_file_fs.stem()).string() + "_delta";
+    // (delta segments are always written in binaryproto format, as they
+    // are small enough to be read into memory)
+    seg_ext_ = ".binaryproto";
+    manifest_path_ = seg_stem_ + seg_ext_;
+
+    compact_thread_ = boost::thread(&DeltaSegments::compactWorker_, this);
+  }
+
+  DeltaSegments::~DeltaSegments() {
+    {
+      boost::mutex::scoped_lock lock(compact_mutex_);
+      stopping_ = true;
+    }
+    compact_cond_var_.notify_all();
+    compact_thread_.join();
+  }
+
+  bool DeltaSegments::load() {
+    boost::mutex::scoped_lock write_lock(write_mutex_);
+
+    if (!fs::exists(manifest_path_)) return true;
+
+    FeatsProto manifest;
+    if (!readProtoFromBinaryFile(manifest_path_, &manifest)) {
+      LOG(ERROR) << "Could not read delta segment manifest: " << manifest_path_;
+      return false;
+    }
+    if ((manifest.num() > 0) && (manifest.dim() != dim_)) {
+      LOG(ERROR) << "Delta segments inconsistent with dataset features - wrong dimensionality ("
+                 << manifest.dim() << " vs. " << dim_ << ")";
+      return false;
+    }
+
+    const fs::path manifest_dir_fs = fs::path(manifest_path_).parent_path();
+
+    boost::unique_lock<boost::shared_mutex> lock(update_mutex_);
+    CHECK_EQ(num_, 0);
+    CHECK_EQ(path_index_->size(), base_num_);
+
+    for (int i = 0; i < manifest.chunks_size(); ++i) {
+      const std::string seg_path = (manifest_dir_fs / fs::path(manifest.chunks(i))).string();
+
+      cv::Mat feats;
+      std::vector<std::string> paths;
+      if (!readFeatsFromProto(seg_path, &feats, &paths)) {
+        LOG(ERROR) << "Could not read delta segment: " << seg_path;
+        return false;
+      }
+      CHECK_EQ(feats.cols, static_cast<int>(dim_));
+
+      path_index_->append(paths);
+      seg_offsets_.push_back(num_);
+      segments_.push_back(feats);
+      num_ += feats.rows;
+
+      seg_fnames_.push_back(manifest.chunks(i));
+    }
+    CHECK_EQ(num_, manifest.num()) << "Delta segments inconsistent with manifest";
+
+    LOG(INFO) << "Loaded " << num_ << " features from " << segments_.size()
+              << " delta segments: " << manifest_path_;
+
+    return true;
+  }
+
+  void DeltaSegments::append(const cv::Mat& feats, const std::vector<std::string>& paths) {
+    CHECK_EQ(feats.type(), CV_32F);
+    CHECK_EQ(feats.cols, static_cast<int>(dim_));
+    CHECK_EQ(feats.rows, paths.size());
+    CHECK_GT(paths.size(), 0);
+
+    size_t seg_count;
+    {
+      boost::mutex::scoped_lock write_lock(write_mutex_);
+
+      // num_ is only modified with write_mutex_ held, so can be read here
+      const size_t start_idx = base_num_ + num_;
+      const std::string seg_fname = segmentFname_(start_idx, start_idx + paths.size());
+      const std::string seg_path = (fs::path(manifest_path_).parent_path() / fs::path(seg_fname)).string();
+
+      LOG(INFO) << "Writing " << paths.size() << " features to delta segment: " << seg_path;
+      writeFeatsToProto(feats, paths, seg_path);
+
+      // (segments_ is only modified with write_mutex_ held)
+      std::vector<std::string> seg_fnames = seg_fnames_;
+      std::vector<size_t> seg_nums;
+      for (size_t i = 0; i < segments_.size(); ++i) {
+        seg_nums.push_back(segments_[i].rows);
+      }
+      seg_fnames.push_back(seg_fname);
+      seg_nums.push_back(paths.size());
+      writeManifest_(seg_fnames, seg_nums);
+
+      seg_fnames_.swap(seg_fnames);
+
+      // publish paths before the rows become visible to ranking (lookups
+      // of paths whose rows are not yet visible fall back to computing
+      // the feature)
+      path_index_->append(paths);
+
+      {
+        boost::unique_lock<boost::shared_mutex> lock(update_mutex_);
+        seg_offsets_.push_back(num_);
+        segments_.push_back(feats);
+        num_ += feats.rows;
+      }
+
+      seg_count = seg_fnames_.size();
+    }
+
+    if (seg_count > max_segments_) {
+      {
+        boost::mutex::scoped_lock lock(compact_mutex_);
+        compact_pending_ = true;
+      }
+      compact_cond_var_.notify_one();
+    }
+  }
+
+  void DeltaSegments::compact() {
+    boost::mutex::scoped_lock merge_lock(merge_mutex_);
+
+    // take a snapshot of the current segments - segments appended whilst
+    // they are merged are kept as they are
+    std::vector<cv::Mat> segments;
+    std::vector<std::string> old_fnames;
+    size_t start_idx, merged_num;
+    {
+      boost::mutex::scoped_lock write_lock(write_mutex_);
+      if (seg_fnames_.size() < 2) return;
+
+      old_fnames = seg_fnames_;
+      segments = segments_; // (only modified with write_mutex_ held)
+      start_idx = base_num_ + seg_offsets_[0];
+      merged_num = num_;
+    }
+    CHECK_EQ(segments.size(), old_fnames.size());
+
+    LOG(INFO) << "Merging " << segments.size() << " delta segments ("
+              << merged_num << " features)...";
+
+    // merge and write without holding any locks - the paths of the merged
+    // rows are read back from the path index (which is internally locked)
+    cv::Mat merged_feats;
+    cv::vconcat(segments, merged_feats);
+    CHECK_EQ(merged_feats.rows, merged_num);
+
+    std::vector<std::string> merged_paths(merged_num);
+    for (size_t i = 0; i < merged_num; ++i) {
+      merged_paths[i] = path_index_->path(start_idx + i);
+    }
+
+    const std::string merged_fname = segmentFname_(start_idx, start_idx + merged_num);
+    const fs::path manifest_dir_fs = fs::path(manifest_path_).parent_path();
+    writeFeatsToProto(merged_feats, merged_paths, (manifest_dir_fs / fs::path(merged_fname)).string());
+
+    {
+      boost::mutex::scoped_lock write_lock(write_mutex_);
+      const size_t merged_count = old_fnames.size();
+      CHECK_GE(seg_fnames_.size(), merged_count);
+
+      std::vector<std::string> seg_fnames(1, merged_fname);
+      std::vector<size_t> seg_nums(1, merged_num);
+      for (size_t i = merged_count; i < seg_fnames_.size(); ++i) {
+        seg_fnames.push_back(seg_fnames_[i]);
+        seg_nums.push_back(segments_[i].rows);
+      }
+      writeManifest_(seg_fnames, seg_nums);
+
+      seg_fnames_.swap(seg_fnames);
+
+      {
+        // swap in the merged segment (rows are unchanged, so existing
+        // rankings remain valid)
+        boost::unique_lock<boost::shared_mutex> lock(update_mutex_);
+        segments_.erase(segments_.begin(), segments_.begin() + merged_count);
+        segments_.insert(segments_.begin(), merged_feats);
+        seg_offsets_.clear();
+        size_t offset = 0;
+        for (size_t i = 0; i < segments_.size(); ++i) {
+          seg_offsets_.push_back(offset);
+          offset += segments_[i].rows;
+        }
+        CHECK_EQ(offset, num_);
+      }
+    }
+
+    // old segments are no longer referenced by the manifest
+    for (size_t i = 0; i < old_fnames.size(); ++i) {
+      if (old_fnames[i] == merged_fname) continue;
+      try {
+        fs::remove(manifest_dir_fs / fs::path(old_fnames[i]));
+      } catch (fs::filesystem_error& e) {
+        LOG(WARNING) << "Could not remove merged delta segment: " << old_fnames[i];
+      }
+    }
+
+    LOG(INFO) << "Merged delta segments into: " << merged_fname;
+  }
+
+  cv::Mat DeltaSegments::row(const size_t idx) const {
+    CHECK_LT(idx, num_);
+    // segments are few, so a linear scan (from the most recent) suffices
+    size_t seg_idx = segments_.size() - 1;
+    while (seg_offsets_[seg_idx] > idx) --seg_idx;
+    return segments_[seg_idx].row(idx - seg_offsets_[seg_idx]);
+  }
+
+  // -----------------------------------------------------------------------------
+
+  std::string DeltaSegments::segmentFname_(const size_t start_idx, const size_t end_idx) const {
+    // (named as chunks, by inclusive one-based range of dataset rows)
+    return (fs::path(seg_stem_).filename().string()
+            + "_" + boost::lexical_cast<std::string>(start_idx + 1)
+            + "-" + boost::lexical_cast<std::string>(end_idx)
+            + seg_ext_);
+  }
+
+  void DeltaSegments::writeManifest_(const std::vector<std::string>& seg_fnames,
+                                     const std::vector<size_t>& seg_nums) {
+    size_t num = 0;
+    for (size_t i = 0; i < seg_nums.size(); ++i) {
+      num += seg_nums[i];
+    }
+
+    // replace the manifest atomically, so it always lists a complete set
+    // of segments
+    const std::string tmp_manifest_path = manifest_path_ + ".tmp";
+    writeChunkIndexToProto(seg_fnames, num, dim_, tmp_manifest_path, seg_nums);
+    fs::rename(tmp_manifest_path, manifest_path_);
+  }
+
+  void DeltaSegments::compactWorker_() {
+    while (true) {
+      {
+        boost::mutex::scoped_lock lock(compact_mutex_);
+        while (!compact_pending_ && !stopping_) {
+          compact_cond_var_.wait(lock);
+        }
+        if (stopping_) return;
+        compact_pending_ = false;
+      }
+
+      try {
+        compact();
+      } catch (fs::filesystem_error& e) {
+        LOG(ERROR) << "Could not merge delta segments: " << e.what();
+      }
+    }
+  }
+
+}
@@ -0,0 +1,110 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        delta_segments.h
+//    Author:      Ken Chatfield
+//    Description: Dataset features added incrementally, stored as small
+//                 delta segments alongside the base dataset feature file
+//
+//    Each call to append() writes only the new features, to a segment
+//    file of their own (<base>_delta_<start>-<end><ext>, numbered as
+//    dataset rows), and then replaces a small manifest (<base>_delta<ext>,
+//    in chunk index format) listing all segments in order - so the cost of
+//    an update is proportional to the number of images added, rather than
+//    the size of the dataset. Once there are more than max_segments
+//    segments they are merged into one by a background thread.
+//
+//    Segments are ranked together with the base features, with rows
+//    numbered consecutively after the base rows.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_DELTA_SEGMENTS_H_
+#define CPUVISOR_UTILS_DELTA_SEGMENTS_H_
+
+#include <vector>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <glog/logging.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "server/util/path_index.h"
+
+namespace cpuvisor {
+
+  class DeltaSegments : boost::noncopyable {
+  public:
+    // the in-memory segments are guarded by update_mutex, which is held
+    // exclusively only to add or swap segments which have already been
+    // written to disk
+    //
+    // path_index holds the paths of all dataset rows (base_num of which
+    // are base rows) - paths of appended rows are added to it (it is
+    // internally locked) before the rows themselves are added, so any row
+    // which can be ranked always has its path in the index
+    DeltaSegments(const std::string& base_feats_file,
+                  const size_t base_num, const size_t dim,
+                  boost::shared_mutex& update_mutex,
+                  PathIndex* path_index,
+                  const size_t max_segments = 8);
+    virtual ~DeltaSegments();
+
+    // loads the segments listed in an existing manifest (if any), adding
+    // their paths to path_index
+    bool load();
+
+    // writes feats as a new segment and adds it to the manifest, then to
+    // the in-memory segments
+    void append(const cv::Mat& feats, const std::vector<std::string>& paths);
+
+    // merges all current segments into a single segment (called from the
+    // background thread, but can also be called directly)
+    void compact();
+
+    // the following should only be called with update_mutex held
+
+    inline size_t num() const { return num_; }
+    inline const std::vector<cv::Mat>& segments() const { return segments_; }
+    // idx counts from the first delta row (i.e. excludes base rows)
+    cv::Mat row(const size_t idx) const;
+
+    inline const std::string& manifest_path() const { return manifest_path_; }
+
+  protected:
+    std::string segmentFname_(const size_t start_idx, const size_t end_idx) const;
+    void writeManifest_(const std::vector<std::string>& seg_fnames,
+                        const std::vector<size_t>& seg_nums);
+    void compactWorker_();
+
+    std::string manifest_path_;
+    std::string seg_stem_;
+    std::string seg_ext_;
+    size_t base_num_;
+    size_t dim_;
+    size_t max_segments_;
+
+    // guarded by update_mutex_
+    boost::shared_mutex& update_mutex_;
+    PathIndex* path_index_;
+    std::vector<cv::Mat> segments_;
+    std::vector<size_t> seg_offsets_;
+    size_t num_;
+
+    // guarded by write_mutex_ (which serializes all changes to segment
+    // files and the manifest) - in the same order as segments_
+    boost::mutex write_mutex_;
+    std::vector<std::string> seg_fnames_;
+
+    // background compaction
+    boost::mutex merge_mutex_; // serializes calls to compact()
+    boost::thread compact_thread_;
+    boost::mutex compact_mutex_;
+    boost::condition_variable compact_cond_var_;
+    bool compact_pending_;
+    bool stopping_;
+  };
+
+}
+
+#endif
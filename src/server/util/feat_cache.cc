@@ -0,0 +1,277 @@
+#include "feat_cache.h"
+
+#include <cstdio>
+#include <stdint.h>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION >= 106600
+  #include <boost/uuid/detail/sha1.hpp>
+#else
+  #include <boost/uuid/sha1.hpp>
+#endif
+
+#include <glog/logging.h>
+
+namespace cpuvisor {
+
+  namespace {
+
+    const uint32_t kPersistMagic = 0x43564643; // "CFVC"
+    const uint32_t kPersistVersion = 1;
+
+    void writeString_(std::ostream& stream, const std::string& str) {
+      uint32_t len = str.size();
+      stream.write(reinterpret_cast<const char*>(&len), sizeof(len));
+      stream.write(str.data(), len);
+    }
+
+    bool readString_(std::istream& stream, std::string* str) {
+      uint32_t len;
+      if (!stream.read(reinterpret_cast<char*>(&len), sizeof(len))) return false;
+      str->resize(len);
+      if (len == 0) return true;
+      return static_cast<bool>(stream.read(&(*str)[0], len));
+    }
+
+  }
+
+  FeatCache::FeatCache(const size_t max_entries, const size_t feat_dim,
+                       const std::string& persist_file,
+                       const std::string& model_id)
+    : max_entries_(max_entries)
+    , feat_dim_(feat_dim)
+    , model_id_(model_id)
+    , persist_file_(persist_file)
+    , persist_records_(0) {
+
+    CHECK_GT(max_entries_, 0);
+    CHECK_GT(feat_dim_, 0);
+
+    if (!persist_file_.empty()) {
+      if (load_()) {
+        LOG(INFO) << "Loaded " << entries_.size() << " cached features from: " << persist_file_;
+      }
+      // rewrite file to drop any truncated or stale records
+      compact_();
+    }
+  }
+
+  bool FeatCache::getByUrl(const std::string& url, cv::Mat* feat,
+                           std::string* imfile) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    EntryIndex::iterator it = url_index_.find(url);
+    if (it == url_index_.end()) return false;
+
+    if (!checkEntry_(it->second)) return false;
+
+    entries_.splice(entries_.begin(), entries_, it->second);
+    (*feat) = it->second->feat;
+    if (imfile) (*imfile) = it->second->imfile;
+
+    return true;
+  }
+
+  bool FeatCache::getByHash(const std::string& data_hash, cv::Mat* feat) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    EntryIndex::iterator it = hash_index_.find(data_hash);
+    if (it == hash_index_.end()) return false;
+
+    if (!checkEntry_(it->second)) return false;
+
+    entries_.splice(entries_.begin(), entries_, it->second);
+    (*feat) = it->second->feat;
+
+    return true;
+  }
+
+  void FeatCache::insert(const std::string& url, const std::string& data_hash,
+                         const std::string& imfile, const cv::Mat& feat) {
+    CHECK_EQ(feat.total(), feat_dim_);
+
+    Entry entry;
+    entry.url = url;
+    entry.data_hash = data_hash;
+    entry.imfile = imfile;
+    entry.feat = feat.clone();
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    insert_(entry);
+
+    if (persist_stream_.is_open()) {
+      append_(persist_stream_, entry);
+      persist_stream_.flush();
+      ++persist_records_;
+      if (persist_records_ > 2*max_entries_) {
+        compact_();
+      }
+    }
+  }
+
+  size_t FeatCache::size() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return entries_.size();
+  }
+
+  std::string FeatCache::hashData(const std::string& data) {
+    boost::uuids::detail::sha1 sha1;
+    sha1.process_bytes(data.data(), data.size());
+
+    char hex[41];
+    #if BOOST_VERSION >= 108600
+    unsigned char digest[20];
+    sha1.get_digest(digest);
+    for (size_t i = 0; i < 20; ++i) {
+      std::sprintf(hex + 2*i, "%02x", digest[i]);
+    }
+    #else
+    unsigned int digest[5];
+    sha1.get_digest(digest);
+    for (size_t i = 0; i < 5; ++i) {
+      std::sprintf(hex + 8*i, "%08x", digest[i]);
+    }
+    #endif
+
+    return std::string(hex, 40);
+  }
+
+  // -----------------------------------------------------------------------------
+
+  void FeatCache::insert_(const Entry& entry) {
+
+    // replace any existing entry for the same url
+    EntryIndex::iterator url_it = url_index_.find(entry.url);
+    if (url_it != url_index_.end()) {
+      erase_(url_it->second);
+    }
+
+    entries_.push_front(entry);
+    url_index_[entry.url] = entries_.begin();
+    hash_index_[entry.data_hash] = entries_.begin();
+
+    while (entries_.size() > max_entries_) {
+      erase_(--entries_.end());
+    }
+  }
+
+  void FeatCache::erase_(EntryList::iterator it) {
+
+    // only remove index entries which still refer to this entry (the same
+    // image data may since have been downloaded from a different url)
+    EntryIndex::iterator url_it = url_index_.find(it->url);
+    if ((url_it != url_index_.end()) && (url_it->second == it)) {
+      url_index_.erase(url_it);
+    }
+    EntryIndex::iterator hash_it = hash_index_.find(it->data_hash);
+    if ((hash_it != hash_index_.end()) && (hash_it->second == it)) {
+      hash_index_.erase(hash_it);
+    }
+
+    entries_.erase(it);
+  }
+
+  bool FeatCache::checkEntry_(EntryList::iterator it) {
+    if (it->feat.total() == feat_dim_) return true;
+
+    LOG(WARNING) << "Discarding cached feature of wrong size (" << it->feat.total()
+                 << " vs. " << feat_dim_ << ") for: " << it->url;
+    erase_(it);
+    return false;
+  }
+
+  bool FeatCache::load_() {
+
+    std::ifstream stream(persist_file_.c_str(), std::ios::in | std::ios::binary);
+    if (!stream.is_open()) return false;
+
+    uint32_t magic, version, dim;
+    std::string model_id;
+    if (!stream.read(reinterpret_cast<char*>(&magic), sizeof(magic)) ||
+        !stream.read(reinterpret_cast<char*>(&version), sizeof(version)) ||
+        !stream.read(reinterpret_cast<char*>(&dim), sizeof(dim)) ||
+        !readString_(stream, &model_id) ||
+        (magic != kPersistMagic) || (version != kPersistVersion)) {
+      LOG(WARNING) << "Discarding feature cache file with missing or invalid header: " << persist_file_;
+      return false;
+    }
+    if ((dim != feat_dim_) || (model_id != model_id_)) {
+      LOG(WARNING) << "Discarding feature cache file computed using a different model: " << persist_file_
+                   << " (dim " << dim << " vs. " << feat_dim_ << ")";
+      return false;
+    }
+
+    while (true) {
+      Entry entry;
+      uint32_t dim;
+      if (!readString_(stream, &entry.url)) break;
+      if (!readString_(stream, &entry.data_hash)) break;
+      if (!readString_(stream, &entry.imfile)) break;
+      if (!stream.read(reinterpret_cast<char*>(&dim), sizeof(dim))) break;
+      if (dim != feat_dim_) {
+        LOG(WARNING) << "Stopped reading feature cache file at record of wrong size: " << persist_file_;
+        break;
+      }
+
+      entry.feat = cv::Mat(1, dim, CV_32F);
+      if (!stream.read(reinterpret_cast<char*>(entry.feat.data), sizeof(float)*dim)) break;
+
+      insert_(entry);
+    }
+
+    return true;
+  }
+
+  void FeatCache::writeHeader_(std::ostream& stream) {
+    stream.write(reinterpret_cast<const char*>(&kPersistMagic), sizeof(kPersistMagic));
+    stream.write(reinterpret_cast<const char*>(&kPersistVersion), sizeof(kPersistVersion));
+    uint32_t dim = feat_dim_;
+    stream.write(reinterpret_cast<const char*>(&dim), sizeof(dim));
+    writeString_(stream, model_id_);
+  }
+
+  void FeatCache::append_(std::ostream& stream, const Entry& entry) {
+
+    CHECK_EQ(entry.feat.type(), CV_32F);
+    CHECK(entry.feat.isContinuous());
+
+    writeString_(stream, entry.url);
+    writeString_(stream, entry.data_hash);
+    writeString_(stream, entry.imfile);
+    uint32_t dim = entry.feat.total();
+    stream.write(reinterpret_cast<const char*>(&dim), sizeof(dim));
+    stream.write(reinterpret_cast<const char*>(entry.feat.data), sizeof(float)*dim);
+  }
+
+  void FeatCache::compact_() {
+
+    if (persist_stream_.is_open()) {
+      persist_stream_.close();
+    }
+
+    // write entries least recently used first, so recency is preserved
+    // when the file is replayed
+    const std::string tmp_file = persist_file_ + ".tmp";
+    {
+      std::ofstream tmp_stream(tmp_file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+      if (!tmp_stream.is_open()) {
+        LOG(ERROR) << "Could not write feature cache file: " << tmp_file;
+        return;
+      }
+      writeHeader_(tmp_stream);
+      for (EntryList::reverse_iterator it = entries_.rbegin(); it != entries_.rend(); ++it) {
+        append_(tmp_stream, *it);
+      }
+    }
+
+    if (std::rename(tmp_file.c_str(), persist_file_.c_str()) != 0) {
+      LOG(ERROR) << "Could not replace feature cache file: " << persist_file_;
+      return;
+    }
+    persist_records_ = entries_.size();
+
+    persist_stream_.open(persist_file_.c_str(), std::ios::out | std::ios::binary | std::ios::app);
+  }
+
+}
@@ -0,0 +1,99 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        feat_cache.h
+//    Author:      Ken Chatfield
+//    Description: LRU cache of features computed for downloaded images,
+//                 keyed by both URL and a hash of the image data
+//
+//    If a persist file is specified, all insertions are appended to it
+//    and replayed when the cache is next constructed. The file starts
+//    with a header:
+//
+//      uint32 magic, uint32 version
+//      uint32 feature dim
+//      uint32 len, char[len] model id
+//
+//    and is discarded if any of these do not match the cache. Each
+//    record that follows is:
+//
+//      uint32 len, char[len] url
+//      uint32 len, char[len] data hash
+//      uint32 len, char[len] image file
+//      uint32 dim, float32[dim] feature
+//
+//    The file is rewritten with only the entries currently in the cache
+//    once it holds more than twice as many records.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_FEAT_CACHE_H_
+#define CPUVISOR_UTILS_FEAT_CACHE_H_
+
+#include <list>
+#include <map>
+#include <string>
+#include <fstream>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <opencv2/opencv.hpp>
+
+namespace cpuvisor {
+
+  class FeatCache : boost::noncopyable {
+  public:
+    // all cached features are of size feat_dim, and were computed using
+    // the model identified by model_id (used to check the persist file)
+    FeatCache(const size_t max_entries, const size_t feat_dim,
+              const std::string& persist_file = std::string(),
+              const std::string& model_id = std::string());
+
+    // returns the feature (and the file the image was originally
+    // downloaded to) for an image previously downloaded from url
+    bool getByUrl(const std::string& url, cv::Mat* feat,
+                  std::string* imfile = 0);
+    bool getByHash(const std::string& data_hash, cv::Mat* feat);
+
+    void insert(const std::string& url, const std::string& data_hash,
+                const std::string& imfile, const cv::Mat& feat);
+
+    size_t size();
+
+    // hex SHA-1 digest of (encoded) image data
+    static std::string hashData(const std::string& data);
+
+  protected:
+    struct Entry {
+      std::string url;
+      std::string data_hash;
+      std::string imfile;
+      cv::Mat feat;
+    };
+    typedef std::list<Entry> EntryList;
+    typedef std::map<std::string, EntryList::iterator> EntryIndex;
+
+    void insert_(const Entry& entry);
+    void erase_(EntryList::iterator it);
+    // returns false (and removes the entry) if its feature is the wrong size
+    bool checkEntry_(EntryList::iterator it);
+
+    bool load_();
+    void writeHeader_(std::ostream& stream);
+    void append_(std::ostream& stream, const Entry& entry);
+    void compact_();
+
+    size_t max_entries_;
+    size_t feat_dim_;
+    std::string model_id_;
+    EntryList entries_; // most recently used first
+    EntryIndex url_index_;
+    EntryIndex hash_index_;
+    boost::mutex mutex_;
+
+    std::string persist_file_;
+    std::ofstream persist_stream_;
+    size_t persist_records_;
+  };
+
+}
+
+#endif
@@ -1,17 +1,34 @@
 #include "feat_util.h"
 
-#include "classification/svm/liblinear.h"
+#include <algorithm>
+
+#include "classification/svm/dense_linear_svm.h"
+#include "server/util/image_util.h"
 #ifdef MATEXP_DEBUG
   #include "server/util/debug/matfileutils_cpp.h"
 #endif
 
 namespace cpuvisor {
 
+  namespace {
+
+    // orders dataset indexes by descending score (ties by ascending index)
+    struct ScoreIdxGreater_ {
+      ScoreIdxGreater_(const float* scores) : scores(scores) { }
+      inline bool operator()(const int a, const int b) const {
+        return (scores[a] > scores[b]) || ((scores[a] == scores[b]) && (a < b));
+      }
+      const float* scores;
+    };
+
+  }
+
   cv::Mat computeFeat(const std::string& full_path,
                       featpipe::CaffeEncoder& encoder) {
 
-    cv::Mat im = cv::imread(full_path, CV_LOAD_IMAGE_COLOR);
-    im.convertTo(im, CV_32FC3);
+    // (decoded at the lowest resolution the encoder can use, and
+    // converted to float by the encoder only after resizing)
+    cv::Mat im = readImage(full_path, encoder.get_min_image_dim());
 
     std::vector<cv::Mat> ims;
     ims.push_back(im);
@@ -40,6 +57,16 @@ namespace cpuvisor {
 
   }
 
+  cv::Mat computeFeat(const cv::Mat& image,
+                      featpipe::CaffeEncoder& encoder) {
+
+    std::vector<cv::Mat> ims;
+    ims.push_back(image);
+
+    return encoder.compute(ims);
+
+  }
+
   cv::Mat trainLinearSvm(const cv::Mat pos_feats, const cv::Mat neg_feats,
                          const std::vector<std::string> _debug_pos_paths,
                          const std::vector<std::string> _debug_neg_paths,
@@ -47,31 +74,30 @@ namespace cpuvisor {
 
     CHECK_EQ(pos_feats.type(), CV_32F);
     CHECK_EQ(neg_feats.type(), CV_32F);
-    cv::Mat feats;
-    cv::vconcat(pos_feats, neg_feats, feats);
-    CHECK_EQ(feats.type(), CV_32F);
+    if (!pos_feats.empty()) CHECK_EQ(pos_feats.cols, neg_feats.cols);
+    // (features are read in place, so must be stored contiguously)
+    CHECK(pos_feats.empty() || pos_feats.isContinuous());
+    CHECK(neg_feats.isContinuous());
 
     DLOG(INFO) << "pos_feats size: " << pos_feats.rows << "x" << pos_feats.cols;
     DLOG(INFO) << "neg_feats size: " << neg_feats.rows << "x" << neg_feats.cols;
-    DLOG(INFO) << "comb feats size: " << feats.rows << "x" << feats.cols;
     DLOG(INFO) << "pos count: " << pos_feats.rows;
     DLOG(INFO) << "SVM C parameter: " << svm_c;
 
-    // train using Liblinear
-
-    std::vector<std::vector<size_t> > labels(1);
-    labels[0].resize(pos_feats.rows);
-    for (size_t i = 0; i < labels[0].size(); ++i) {
-      labels[0][i] = i;
-    }
+    // train directly on the (dense) positive and negative features,
+    // without concatenating them or converting to Liblinear's sparse format
 
-    featpipe::Liblinear svm;
+    featpipe::DenseLinearSvm svm;
     svm.set_c(svm_c);
     //svm.set_eps(0.001);
-    svm.train((float*)feats.data, feats.cols, feats.rows, labels);
+    svm.train((const float*)pos_feats.data, pos_feats.rows,
+              (const float*)neg_feats.data, neg_feats.rows,
+              neg_feats.cols);
     float* w_ptr = svm.get_w();
 
     #ifdef MATEXP_DEBUG // DEBUG
+    cv::Mat feats;
+    cv::vconcat(pos_feats, neg_feats, feats);
     MatFile mat_file("pretrain.mat", true);
     mat_file.writeFloatMat("feats", (float*)feats.data, feats.rows, feats.cols);
     mat_file.writeFloatMat("pos_feats", (float*)pos_feats.data, pos_feats.rows, pos_feats.cols);
@@ -82,7 +108,7 @@ namespace cpuvisor {
     if (!_debug_neg_paths.empty()) {
       mat_file.writeVectOfStrs("neg_paths", _debug_neg_paths);
     }
-    mat_file.writeFloatMat("w_vect", w_ptr, 1, feats.cols);
+    mat_file.writeFloatMat("w_vect", w_ptr, 1, neg_feats.cols);
     #endif
 
     // CRAZILY the following lines don't seem to work consistently
@@ -90,9 +116,9 @@ namespace cpuvisor {
     //return cv::Mat(feats.cols, 1, CV_32F, w_ptr);
     //cv::Mat w_mat(feats.cols, 1, CV_32F, w_ptr);
     //return w_mat;
-    cv::Mat w_mat(feats.cols, 1, CV_32F);
+    cv::Mat w_mat(neg_feats.cols, 1, CV_32F);
     float* w_mat_data = (float*)w_mat.data;
-    for (size_t i = 0; i < static_cast<size_t>(feats.cols); ++i) {
+    for (size_t i = 0; i < static_cast<size_t>(neg_feats.cols); ++i) {
       w_mat_data[i] = w_ptr[i];
     }
     return w_mat;
@@ -107,10 +133,47 @@ namespace cpuvisor {
                           svm_c);
   }
 
+  cv::Mat trainLinearSvm(const cv::Mat pos_feats,
+                         const featpipe::DenseSvmSampleSet& neg_set,
+                         const double svm_c,
+                         const featpipe::DenseSvmWarmStart* warm_start) {
+
+    CHECK_EQ(pos_feats.type(), CV_32F);
+    if (!pos_feats.empty()) CHECK_EQ(pos_feats.cols, neg_set.feat_dim());
+    CHECK(pos_feats.empty() || pos_feats.isContinuous());
+
+    DLOG(INFO) << "pos count: " << pos_feats.rows;
+    DLOG(INFO) << "neg count: " << neg_set.size();
+    DLOG(INFO) << "SVM C parameter: " << svm_c;
+    DLOG(INFO) << "Warm start: " << ((warm_start && !warm_start->empty()) ? "yes" : "no");
+
+    featpipe::DenseLinearSvm svm;
+    svm.set_c(svm_c);
+    svm.train((const float*)pos_feats.data, pos_feats.rows, neg_set, warm_start);
+    const float* w_ptr = svm.get_w();
+
+    cv::Mat w_mat(neg_set.feat_dim(), 1, CV_32F);
+    float* w_mat_data = (float*)w_mat.data;
+    for (size_t i = 0; i < neg_set.feat_dim(); ++i) {
+      w_mat_data[i] = w_ptr[i];
+    }
+    return w_mat;
+
+  }
+
   void rankUsingModel(const cv::Mat model, const cv::Mat dset_feats,
                       cv::Mat* scores, cv::Mat* sortIdxs) {
+    Ranking ranking;
+    rankUsingModel(model, dset_feats, &ranking, 0);
+
+    (*scores) = ranking.scores;
+    (*sortIdxs) = ranking.sort_idxs;
+  }
+
+  void rankUsingModel(const cv::Mat model, const cv::Mat dset_feats,
+                      Ranking* ranking, const size_t top_k) {
     DLOG(INFO) << "Applying model";
-    (*scores) = dset_feats*model;
+    ranking->scores = dset_feats*model;
     // #ifdef MATEXP_DEBUG
     // const float* model_ptr = (float*)model.data;
     // float model_abssum = 0.0;
@@ -121,12 +184,13 @@ namespace cpuvisor {
     // #endif
 
     DLOG(INFO) << "Getting sort indexes...";
-    size_t dset_sz = scores->rows;
-    CHECK_EQ(scores->cols, 1);
+    size_t dset_sz = ranking->scores.rows;
+    CHECK_EQ(ranking->scores.cols, 1);
     CHECK_EQ(dset_sz, dset_feats.rows);
 
-    cv::sortIdx((*scores), (*sortIdxs),
-                CV_SORT_EVERY_COLUMN + CV_SORT_DESCENDING);
+    ranking->sort_idxs = cv::Mat();
+    ranking->sorted_count = 0;
+    ensureRankingSorted(ranking, (top_k > 0) ? top_k : dset_sz);
 
     #ifdef MATEXP_DEBUG // DEBUG
     MatFile mat_file("posttrain.mat", true);
@@ -137,4 +201,83 @@ namespace cpuvisor {
 
   }
 
+  void rankUsingModels(const cv::Mat models, const cv::Mat feats,
+                       std::vector<Ranking>* rankings) {
+    CHECK_EQ(models.type(), CV_32F);
+    CHECK_EQ(feats.type(), CV_32F);
+    CHECK_EQ(feats.cols, models.rows);
+
+    DLOG(INFO) << "Applying " << models.cols << " models to " << feats.rows << " features";
+    // [N x num_models] scores
+    cv::Mat scores;
+    cv::gemm(feats, models, 1.0, cv::Mat(), 0.0, scores);
+
+    (*rankings) = std::vector<Ranking>(models.cols);
+    for (size_t i = 0; i < static_cast<size_t>(models.cols); ++i) {
+      Ranking& ranking = (*rankings)[i];
+      ranking.scores = scores.col(i).clone();
+      ensureRankingSorted(&ranking, feats.rows);
+    }
+  }
+
+  void ensureRankingSorted(Ranking* ranking, const size_t min_sorted) {
+    CHECK_EQ(ranking->scores.type(), CV_32F);
+    // truncated rankings hold no items beyond their sorted prefix
+    if (ranking->truncated) return;
+    const size_t dset_sz = ranking->scores.rows;
+    const size_t target_sorted = std::min(min_sorted, dset_sz);
+
+    if (ranking->sort_idxs.empty()) {
+      ranking->sort_idxs = cv::Mat(dset_sz, 1, CV_32S);
+      int* sort_idxs_ptr = (int*)ranking->sort_idxs.data;
+      for (size_t i = 0; i < dset_sz; ++i) {
+        sort_idxs_ptr[i] = i;
+      }
+      ranking->sorted_count = 0;
+    }
+    if (ranking->sorted_count >= target_sorted) return;
+
+    if (static_cast<size_t>(ranking->sort_idxs.rows) < dset_sz) {
+      // only the sorted prefix is stored (e.g. from ScoringEngine) -
+      // expand into a full permutation, appending all other items
+      CHECK_EQ(ranking->sort_idxs.rows, ranking->sorted_count);
+      cv::Mat sort_idxs(dset_sz, 1, CV_32S);
+      const int* prefix_ptr = (const int*)ranking->sort_idxs.data;
+      int* sort_idxs_ptr = (int*)sort_idxs.data;
+
+      std::vector<bool> in_prefix(dset_sz, false);
+      for (size_t i = 0; i < ranking->sorted_count; ++i) {
+        sort_idxs_ptr[i] = prefix_ptr[i];
+        in_prefix[prefix_ptr[i]] = true;
+      }
+      size_t ptr = ranking->sorted_count;
+      for (size_t i = 0; i < dset_sz; ++i) {
+        if (!in_prefix[i]) sort_idxs_ptr[ptr++] = i;
+      }
+      CHECK_EQ(ptr, dset_sz);
+
+      ranking->sort_idxs = sort_idxs;
+    }
+
+    DLOG(INFO) << "Extending sorted ranking from " << ranking->sorted_count
+               << " to " << target_sorted << " items";
+
+    // select the next (target_sorted - sorted_count) items from the
+    // unsorted remainder, then sort only those - entries before
+    // sorted_count are never modified, so copies of the ranking which
+    // share sort_idxs remain valid
+    const ScoreIdxGreater_ cmp((const float*)ranking->scores.data);
+    int* sort_idxs_ptr = (int*)ranking->sort_idxs.data;
+    int* unsorted_begin = sort_idxs_ptr + ranking->sorted_count;
+    int* sorted_end = sort_idxs_ptr + target_sorted;
+    int* end = sort_idxs_ptr + dset_sz;
+
+    if (sorted_end < end) {
+      std::nth_element(unsorted_begin, sorted_end, end, cmp);
+    }
+    std::sort(unsorted_begin, sorted_end, cmp);
+
+    ranking->sorted_count = target_sorted;
+  }
+
 }
@@ -15,11 +15,16 @@
 #include <opencv2/opencv.hpp>
 
 #include "directencode/caffe_encoder.h"
+#include "classification/svm/dense_linear_svm.h"
+#include "server/query_data.h"
 
 namespace cpuvisor {
 
   cv::Mat computeFeat(const std::string& full_path,
                       featpipe::CaffeEncoder& encoder);
+  // as above, for an 8-bit BGR image which has already been decoded
+  cv::Mat computeFeat(const cv::Mat& image,
+                      featpipe::CaffeEncoder& encoder);
 
   cv::Mat trainLinearSvm(const cv::Mat pos_feats, const cv::Mat neg_feats,
                          const std::vector<std::string> _debug_pos_paths = std::vector<std::string>(),
@@ -27,9 +32,25 @@ namespace cpuvisor {
                          const double svm_c = 1.0);
   cv::Mat trainLinearSvm(const cv::Mat pos_feats, const cv::Mat neg_feats,
                          const double svm_c = 1.0);
+  // as above, with negatives prepared in advance - if warm_start is
+  // specified, the dual variables of the negatives start from it
+  cv::Mat trainLinearSvm(const cv::Mat pos_feats,
+                         const featpipe::DenseSvmSampleSet& neg_set,
+                         const double svm_c,
+                         const featpipe::DenseSvmWarmStart* warm_start = 0);
 
   void rankUsingModel(const cv::Mat model, const cv::Mat dset_feats,
                       cv::Mat* scores, cv::Mat* sortIdxs);
+  // sorts only the top_k highest scoring items (or all items if top_k = 0)
+  void rankUsingModel(const cv::Mat model, const cv::Mat dset_feats,
+                      Ranking* ranking, const size_t top_k);
+  // as above, for a number of models stacked as the columns of a single
+  // [dim x N] matrix - all are applied with a single matrix product, and a
+  // fully sorted ranking returned for each
+  void rankUsingModels(const cv::Mat models, const cv::Mat feats,
+                       std::vector<Ranking>* rankings);
+  // extends the sorted part of ranking to cover at least min_sorted items
+  void ensureRankingSorted(Ranking* ranking, const size_t min_sorted);
 
 }
 
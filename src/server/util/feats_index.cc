@@ -0,0 +1,515 @@
+#include "feats_index.h"
+
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+
+#include "server/util/io.h"
+
+namespace cpuvisor {
+
+  namespace {
+
+    inline uint64_t alignOffset_(const uint64_t offset, const uint64_t alignment) {
+      return ((offset + alignment - 1) / alignment) * alignment;
+    }
+
+    inline void writePadding_(std::ofstream& out, const uint64_t alignment) {
+      uint64_t pos = static_cast<uint64_t>(out.tellp());
+      uint64_t padded_pos = alignOffset_(pos, alignment);
+      for (uint64_t i = pos; i < padded_pos; ++i) {
+        out.put(0);
+      }
+    }
+
+  }
+
+  size_t getFeatsIndexDTypeSize(const FeatsIndexDType dtype) {
+    switch (dtype) {
+    case FIDX_FLOAT32:
+      return sizeof(float);
+    case FIDX_FLOAT16:
+      return sizeof(uint16_t);
+    case FIDX_INT8:
+      return sizeof(int8_t);
+    default:
+      return 0;
+    }
+  }
+
+  uint16_t floatToHalf(const float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const uint32_t float_exp = (bits >> 23) & 0xff;
+    uint32_t mant = bits & 0x7fffff;
+
+    if (float_exp == 0xff) {
+      // inf / nan
+      return sign | 0x7c00 | (mant ? 0x200 : 0);
+    }
+    const int32_t exp = static_cast<int32_t>(float_exp) - 127 + 15;
+    if (exp >= 0x1f) {
+      // overflow to inf
+      return sign | 0x7c00;
+    }
+    if (exp <= 0) {
+      // subnormal (or underflow to zero)
+      if (exp < -10) return sign;
+      mant |= 0x800000;
+      const uint32_t shift = 14 - exp;
+      uint32_t half_mant = mant >> shift;
+      const uint32_t rem = mant & ((1u << shift) - 1);
+      const uint32_t halfway = 1u << (shift - 1);
+      if ((rem > halfway) || ((rem == halfway) && (half_mant & 1))) ++half_mant;
+      return sign | half_mant;
+    }
+
+    uint32_t half = sign | (exp << 10) | (mant >> 13);
+    const uint32_t rem = mant & 0x1fff;
+    // (a carry into the exponent correctly rounds up to the next power of 2)
+    if ((rem > 0x1000) || ((rem == 0x1000) && (half & 1))) ++half;
+    return half;
+  }
+
+  float halfToFloat(const uint16_t value) {
+    const uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+    uint32_t exp = (value >> 10) & 0x1f;
+    uint32_t mant = value & 0x3ff;
+    uint32_t bits;
+
+    if (exp == 0) {
+      if (mant == 0) {
+        bits = sign;
+      } else {
+        // subnormal - renormalize
+        exp = 127 - 15 + 1;
+        while (!(mant & 0x400)) {
+          mant <<= 1;
+          --exp;
+        }
+        mant &= 0x3ff;
+        bits = sign | (exp << 23) | (mant << 13);
+      }
+    } else if (exp == 0x1f) {
+      bits = sign | 0x7f800000 | (mant << 13);
+    } else {
+      bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+  }
+
+  // FeatsIndexMapping -------------------------------------------------------
+
+  FeatsIndexMapping::FeatsIndexMapping()
+    : fd_(-1)
+    , data_(0)
+    , size_(0) { }
+
+  FeatsIndexMapping::~FeatsIndexMapping() {
+    close();
+  }
+
+  bool FeatsIndexMapping::open(const std::string& index_path) {
+    close();
+    index_path_ = index_path;
+
+    fd_ = ::open(index_path.c_str(), O_RDONLY);
+    if (fd_ == -1) {
+      LOG(ERROR) << "File not found: " << index_path;
+      return false;
+    }
+
+    struct stat st;
+    if ((fstat(fd_, &st) != 0) || (static_cast<size_t>(st.st_size) < sizeof(FeatsIndexHeader))) {
+      LOG(ERROR) << "Feature index file is truncated: " << index_path;
+      close();
+      return false;
+    }
+    size_ = st.st_size;
+
+    // map the whole file read-only and shared, so that the page cache
+    // is shared between all processes serving the same index
+    void* data = mmap(0, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+      LOG(ERROR) << "Could not memory map feature index file: " << index_path;
+      close();
+      return false;
+    }
+    data_ = static_cast<char*>(data);
+
+    const FeatsIndexHeader& hdr = header();
+    const size_t dtype_size = getFeatsIndexDTypeSize(static_cast<FeatsIndexDType>(hdr.dtype));
+    const uint64_t feats_bytes = hdr.num*hdr.dim*dtype_size;
+    const uint64_t feats_end = (hdr.dtype == FIDX_INT8) ?
+      (hdr.scales_offset + hdr.num*sizeof(float)) : (hdr.feats_offset + feats_bytes);
+
+    if (std::strncmp(hdr.magic, FEATS_INDEX_MAGIC, sizeof(hdr.magic)) != 0) {
+      LOG(ERROR) << "Not a feature index file: " << index_path;
+    } else if (hdr.version != FEATS_INDEX_VERSION) {
+      LOG(ERROR) << "Unsupported feature index version (" << hdr.version << "): " << index_path;
+    } else if (dtype_size == 0) {
+      LOG(ERROR) << "Unsupported feature index data type (" << hdr.dtype << "): " << index_path;
+    } else if ((hdr.feats_offset % FEATS_INDEX_ALIGNMENT != 0) ||
+               ((hdr.dtype == FIDX_INT8) &&
+                ((hdr.scales_offset % FEATS_INDEX_ALIGNMENT != 0) ||
+                 (hdr.feats_offset + feats_bytes > hdr.scales_offset))) ||
+               (feats_end > hdr.paths_offset) ||
+               (hdr.paths_offset + hdr.paths_bytes > size_) ||
+               (hdr.paths_bytes < (hdr.num + 1)*sizeof(uint64_t))) {
+      LOG(ERROR) << "Feature index file is corrupt or truncated: " << index_path;
+    } else {
+      return true;
+    }
+
+    close();
+    return false;
+  }
+
+  void FeatsIndexMapping::close() {
+    if (data_) {
+      munmap(data_, size_);
+      data_ = 0;
+    }
+    if (fd_ != -1) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+    size_ = 0;
+  }
+
+  cv::Mat FeatsIndexMapping::feats() const {
+    const FeatsIndexHeader& hdr = header();
+    int type;
+    switch (hdr.dtype) {
+    case FIDX_FLOAT16:
+      type = CV_16UC1;
+      break;
+    case FIDX_INT8:
+      type = CV_8SC1;
+      break;
+    default:
+      type = CV_32FC1;
+    }
+    return cv::Mat(hdr.num, hdr.dim, type,
+                   static_cast<void*>(data_ + hdr.feats_offset));
+  }
+
+  cv::Mat FeatsIndexMapping::scales() const {
+    const FeatsIndexHeader& hdr = header();
+    if (hdr.dtype != FIDX_INT8) return cv::Mat();
+
+    return cv::Mat(hdr.num, 1, CV_32FC1,
+                   static_cast<void*>(data_ + hdr.scales_offset));
+  }
+
+  const uint64_t* FeatsIndexMapping::pathOffsets() const {
+    const FeatsIndexHeader& hdr = header();
+    return reinterpret_cast<const uint64_t*>(data_ + hdr.paths_offset);
+  }
+
+  const char* FeatsIndexMapping::pathData() const {
+    const FeatsIndexHeader& hdr = header();
+    return data_ + hdr.paths_offset + (hdr.num + 1)*sizeof(uint64_t);
+  }
+
+  std::string FeatsIndexMapping::path(const size_t idx) const {
+    CHECK_LT(idx, num());
+
+    const uint64_t* offsets = pathOffsets();
+    return std::string(pathData() + offsets[idx], offsets[idx + 1] - offsets[idx]);
+  }
+
+  void FeatsIndexMapping::readPaths(std::vector<std::string>* paths) const {
+    const size_t num_paths = num();
+    const uint64_t* offsets = pathOffsets();
+    const char* strs = pathData();
+
+    std::vector<std::string>& paths_ref = (*paths);
+    paths_ref = std::vector<std::string>(num_paths);
+    for (size_t i = 0; i < num_paths; ++i) {
+      paths_ref[i].assign(strs + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+  }
+
+  // FeatsIndexWriter --------------------------------------------------------
+
+  FeatsIndexWriter::FeatsIndexWriter(const std::string& index_path, const size_t dim,
+                                     const FeatsIndexDType dtype)
+    : index_path_(index_path)
+    , tmp_path_(index_path + ".tmp")
+    , dim_(dim)
+    , dtype_(dtype)
+    , num_(0)
+    , row_buf_(dim*getFeatsIndexDTypeSize(dtype))
+    , closed_(false) {
+
+    CHECK_GT(getFeatsIndexDTypeSize(dtype), 0) << "Unsupported feature index data type";
+
+    // ensure output dir exists
+    fs::path index_dir_fs = fs::path(index_path).parent_path();
+    if (!index_dir_fs.empty() && !fs::exists(index_dir_fs)) {
+      fs::create_directories(index_dir_fs);
+    }
+
+    out_.open(tmp_path_.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+    CHECK(out_.is_open()) << "Could not open file for writing: " << tmp_path_;
+
+    // reserve space for header (filled in on close)
+    FeatsIndexHeader hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    out_.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    writePadding_(out_, FEATS_INDEX_ALIGNMENT);
+
+    path_offsets_.push_back(0);
+  }
+
+  FeatsIndexWriter::~FeatsIndexWriter() {
+    if (!closed_) {
+      LOG(WARNING) << "Feature index writer destroyed before close() - discarding: " << tmp_path_;
+      out_.close();
+      std::remove(tmp_path_.c_str());
+    }
+  }
+
+  void FeatsIndexWriter::append(const cv::Mat& feats, const std::vector<std::string>& paths) {
+    CHECK(!closed_);
+    CHECK_EQ(paths.size(), feats.rows);
+    if (feats.rows == 0) return;
+
+    CHECK_EQ(feats.type(), CV_32FC1);
+    CHECK_EQ(feats.cols, dim_);
+
+    if ((dtype_ == FIDX_FLOAT32) && feats.isContinuous()) {
+      out_.write(reinterpret_cast<const char*>(feats.data),
+                 feats.rows*dim_*sizeof(float));
+    } else {
+      for (int i = 0; i < feats.rows; ++i) {
+        const float* row = feats.ptr<float>(i);
+
+        switch (dtype_) {
+        case FIDX_FLOAT32:
+          out_.write(reinterpret_cast<const char*>(row), dim_*sizeof(float));
+          break;
+
+        case FIDX_FLOAT16: {
+          uint16_t* row_buf = reinterpret_cast<uint16_t*>(&row_buf_[0]);
+          for (size_t j = 0; j < dim_; ++j) {
+            row_buf[j] = floatToHalf(row[j]);
+          }
+          out_.write(&row_buf_[0], row_buf_.size());
+          break;
+        }
+
+        case FIDX_INT8: {
+          // symmetric quantization with per-row scale
+          float max_abs = 0.0;
+          for (size_t j = 0; j < dim_; ++j) {
+            max_abs = std::max(max_abs, std::abs(row[j]));
+          }
+          const float scale = max_abs / 127.0f;
+          const float inv_scale = (scale > 0.0f) ? (1.0f / scale) : 0.0f;
+
+          int8_t* row_buf = reinterpret_cast<int8_t*>(&row_buf_[0]);
+          for (size_t j = 0; j < dim_; ++j) {
+            float q = row[j]*inv_scale;
+            q = std::min(127.0f, std::max(-127.0f, q));
+            row_buf[j] = static_cast<int8_t>((q >= 0.0f) ? (q + 0.5f) : (q - 0.5f));
+          }
+          out_.write(&row_buf_[0], row_buf_.size());
+          scales_.push_back(scale);
+          break;
+        }
+        }
+      }
+    }
+    CHECK(out_.good()) << "Error writing to: " << tmp_path_;
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+      path_data_ += paths[i];
+      path_offsets_.push_back(path_data_.size());
+    }
+    num_ += feats.rows;
+  }
+
+  void FeatsIndexWriter::close() {
+    CHECK(!closed_);
+
+    FeatsIndexHeader hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    std::strncpy(hdr.magic, FEATS_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = FEATS_INDEX_VERSION;
+    hdr.dtype = dtype_;
+    hdr.num = num_;
+    hdr.dim = dim_;
+    hdr.feats_offset = alignOffset_(sizeof(FeatsIndexHeader), FEATS_INDEX_ALIGNMENT);
+
+    // write per-row scales
+    if (dtype_ == FIDX_INT8) {
+      writePadding_(out_, FEATS_INDEX_ALIGNMENT);
+      hdr.scales_offset = static_cast<uint64_t>(out_.tellp());
+      if (!scales_.empty()) {
+        out_.write(reinterpret_cast<const char*>(&scales_[0]),
+                   scales_.size()*sizeof(float));
+      }
+    }
+
+    // write path table
+    writePadding_(out_, sizeof(uint64_t));
+    hdr.paths_offset = static_cast<uint64_t>(out_.tellp());
+    out_.write(reinterpret_cast<const char*>(&path_offsets_[0]),
+               path_offsets_.size()*sizeof(uint64_t));
+    out_.write(path_data_.data(), path_data_.size());
+    hdr.paths_bytes = static_cast<uint64_t>(out_.tellp()) - hdr.paths_offset;
+
+    // fill in header
+    out_.seekp(0);
+    out_.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    out_.close();
+    CHECK(!out_.fail()) << "Error writing to: " << tmp_path_;
+
+    fs::rename(fs::path(tmp_path_), fs::path(index_path_));
+    closed_ = true;
+
+    std::vector<uint64_t>().swap(path_offsets_);
+    std::string().swap(path_data_);
+    std::vector<float>().swap(scales_);
+  }
+
+  // Helper functions --------------------------------------------------------
+
+  bool isFeatsIndexFile(const std::string& path) {
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    char magic[8];
+    if (!in.read(magic, sizeof(magic))) return false;
+
+    return (std::strncmp(magic, FEATS_INDEX_MAGIC, sizeof(magic)) == 0);
+  }
+
+  void writeFeatsToIndex(const cv::Mat& feats, const std::vector<std::string>& paths,
+                         const std::string& index_path,
+                         const FeatsIndexDType dtype) {
+    FeatsIndexWriter writer(index_path, feats.cols, dtype);
+    writer.append(feats, paths);
+    writer.close();
+  }
+
+  bool readFeatsFromIndex(const std::string& index_path,
+                          cv::Mat* feats, std::vector<std::string>* paths,
+                          boost::shared_ptr<FeatsIndexMapping>* mapping) {
+
+    boost::shared_ptr<FeatsIndexMapping> index_mapping(new FeatsIndexMapping());
+    if (!index_mapping->open(index_path)) return false;
+    if (index_mapping->dtype() != FIDX_FLOAT32) {
+      LOG(ERROR) << "Feature index is compressed (data type " << index_mapping->dtype()
+                 << ") - cannot read as float features: " << index_path;
+      return false;
+    }
+
+    if (paths) index_mapping->readPaths(paths);
+
+    if (mapping) {
+      // wrap mapped data without copying - caller keeps mapping alive
+      (*feats) = index_mapping->feats();
+      (*mapping) = index_mapping;
+    } else {
+      (*feats) = index_mapping->feats().clone();
+    }
+
+    return true;
+  }
+
+  void convertFeatsToIndex(const std::string& feats_path, const std::string& index_path,
+                           const FeatsIndexDType dtype) {
+    boost::shared_ptr<FeatsIndexWriter> writer;
+    size_t expected_num = 0;
+
+    if (isFeatsIndexFile(feats_path)) {
+      // convert mapped features in blocks of rows
+      cv::Mat feats;
+      std::vector<std::string> paths;
+      boost::shared_ptr<FeatsIndexMapping> mapping;
+      CHECK(readFeatsFromIndex(feats_path, &feats, &paths, &mapping));
+      expected_num = feats.rows;
+
+      writer.reset(new FeatsIndexWriter(index_path, feats.cols, dtype));
+      const size_t block_sz = 10000;
+      for (size_t i = 0; i < static_cast<size_t>(feats.rows); i += block_sz) {
+        const size_t end = std::min(i + block_sz, static_cast<size_t>(feats.rows));
+        writer->append(feats.rowRange(i, end),
+                       std::vector<std::string>(paths.begin() + i, paths.begin() + end));
+      }
+
+    } else {
+      // list chunks to convert - for chunk indexes, chunks are converted
+      // one by one so the full feature matrix is never held in memory
+      cpuvisor::FeatsProto feats_proto;
+      CHECK(readProtoFromBinaryFile(feats_path, &feats_proto));
+      expected_num = feats_proto.num();
+
+      std::vector<std::string> chunk_files;
+      if (feats_proto.chunks_size() > 0) {
+        fs::path proto_dir_fs = fs::path(feats_path).parent_path();
+        for (size_t ci = 0; ci < static_cast<size_t>(feats_proto.chunks_size()); ++ci) {
+          fs::path chunk_file_fs(feats_proto.chunks(ci));
+          if (!chunk_file_fs.is_absolute()) {
+            chunk_file_fs = proto_dir_fs / chunk_file_fs;
+          }
+          chunk_files.push_back(chunk_file_fs.string());
+        }
+      } else {
+        chunk_files.push_back(feats_path);
+      }
+      feats_proto.Clear();
+
+      LOG(INFO) << "Converting " << chunk_files.size() << " chunk(s) to: " << index_path;
+
+      for (size_t i = 0; i < chunk_files.size(); ++i) {
+        LOG(INFO) << "Processing chunk: " << chunk_files[i];
+        cv::Mat feats_chunk;
+        std::vector<std::string> paths_chunk;
+
+        CHECK(readFeatsFromProto(chunk_files[i], &feats_chunk, &paths_chunk));
+
+        if (!writer) {
+          writer.reset(new FeatsIndexWriter(index_path, feats_chunk.cols, dtype));
+        }
+        writer->append(feats_chunk, paths_chunk);
+      }
+    }
+
+    CHECK(writer);
+    CHECK_GT(writer->num(), 0);
+    CHECK_EQ(writer->num(), expected_num);
+    writer->close();
+
+    LOG(INFO) << "Wrote " << writer->num() << " features to: " << index_path;
+  }
+
+  bool readFeatsFromFile(const std::string& feats_path,
+                         cv::Mat* feats, std::vector<std::string>* paths,
+                         boost::shared_ptr<FeatsIndexMapping>* mapping) {
+
+    if (isFeatsIndexFile(feats_path)) {
+      DLOG(INFO) << "Reading features from index file: " << feats_path;
+      return readFeatsFromIndex(feats_path, feats, paths, mapping);
+    } else {
+      DLOG(INFO) << "Reading features from proto file: " << feats_path;
+      if (mapping) mapping->reset();
+      return readFeatsFromProto(feats_path, feats, paths);
+    }
+  }
+
+}
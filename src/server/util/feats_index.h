@@ -0,0 +1,161 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        feats_index.h
+//    Author:      Ken Chatfield
+//    Description: Native memory-mappable binary feature index format
+//
+//    Layout of a feature index file (all fields in native byte order):
+//
+//      [0, 64)             FeatsIndexHeader
+//      [feats_offset, ..)  num x dim row-major feature block (64-byte
+//                          aligned) of float32, float16 or int8 values
+//      [scales_offset, ..) num float32 per-row scales (int8 only, 64-byte
+//                          aligned) - row i is feats[i]*scales[i]
+//      [paths_offset, ..)  path table: (num + 1) uint64 offsets into the
+//                          string data which immediately follows them
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_FEATS_INDEX_H_
+#define CPUVISOR_UTILS_FEATS_INDEX_H_
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+
+#include <glog/logging.h>
+
+#include <opencv2/opencv.hpp>
+
+#define FEATS_INDEX_MAGIC "CPVFIDX"
+#define FEATS_INDEX_VERSION 1
+#define FEATS_INDEX_ALIGNMENT 64
+
+namespace cpuvisor {
+
+  enum FeatsIndexDType {FIDX_FLOAT32 = 0, FIDX_FLOAT16 = 1, FIDX_INT8 = 2};
+
+  struct FeatsIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint64_t num;
+    uint64_t dim;
+    uint64_t feats_offset;
+    uint64_t paths_offset;
+    uint64_t paths_bytes;
+    uint64_t scales_offset;
+  };
+
+  size_t getFeatsIndexDTypeSize(const FeatsIndexDType dtype);
+
+  // IEEE 754 half precision conversion (round to nearest even)
+  uint16_t floatToHalf(const float value);
+  float halfToFloat(const uint16_t value);
+
+  // read-only memory mapping of a feature index file ------------
+
+  class FeatsIndexMapping : boost::noncopyable {
+  public:
+    FeatsIndexMapping();
+    virtual ~FeatsIndexMapping();
+
+    bool open(const std::string& index_path);
+    void close();
+
+    inline const FeatsIndexHeader& header() const {
+      CHECK(data_);
+      return *reinterpret_cast<const FeatsIndexHeader*>(data_);
+    }
+    inline size_t num() const { return header().num; }
+    inline size_t dim() const { return header().dim; }
+    inline FeatsIndexDType dtype() const {
+      return static_cast<FeatsIndexDType>(header().dtype);
+    }
+
+    // returns a cv::Mat header wrapping the mapped feature block -
+    // the matrix does NOT own its data, so is only valid for as long
+    // as this mapping is kept alive (and must be treated as read-only)
+    //
+    // the matrix type is CV_32F, CV_16U (raw float16 values) or CV_8S
+    // depending on dtype()
+    cv::Mat feats() const;
+    // per-row scales of int8 features (empty for other types)
+    cv::Mat scales() const;
+    // mapped path table - path i is the string data in the range
+    // [pathOffsets()[i], pathOffsets()[i + 1]) of pathData() (again only
+    // valid for as long as this mapping is kept alive)
+    const uint64_t* pathOffsets() const;
+    const char* pathData() const;
+    std::string path(const size_t idx) const;
+    void readPaths(std::vector<std::string>* paths) const;
+
+  protected:
+    std::string index_path_;
+    int fd_;
+    char* data_;
+    size_t size_;
+  };
+
+  // streaming writer for feature index files --------------------
+
+  class FeatsIndexWriter : boost::noncopyable {
+  public:
+    // output is written to a temporary file, which is only moved to
+    // index_path once close() is called - float32 features passed to
+    // append() are converted to dtype on the fly
+    FeatsIndexWriter(const std::string& index_path, const size_t dim,
+                     const FeatsIndexDType dtype = FIDX_FLOAT32);
+    virtual ~FeatsIndexWriter();
+
+    void append(const cv::Mat& feats, const std::vector<std::string>& paths);
+    void close();
+
+    inline size_t num() const { return num_; }
+
+  protected:
+    std::string index_path_;
+    std::string tmp_path_;
+    std::ofstream out_;
+    size_t dim_;
+    FeatsIndexDType dtype_;
+    size_t num_;
+    std::vector<float> scales_;
+    std::vector<char> row_buf_;
+    std::vector<uint64_t> path_offsets_;
+    std::string path_data_;
+    bool closed_;
+  };
+
+  // helper functions --------------------------------------------
+
+  bool isFeatsIndexFile(const std::string& path);
+
+  void writeFeatsToIndex(const cv::Mat& feats, const std::vector<std::string>& paths,
+                         const std::string& index_path,
+                         const FeatsIndexDType dtype = FIDX_FLOAT32);
+  // only float32 feature indexes can be read using the functions below
+  // (compressed indexes should be accessed using FeatsIndexMapping) -
+  // paths may be NULL, in which case they are not copied out of the index
+  bool readFeatsFromIndex(const std::string& index_path,
+                          cv::Mat* feats, std::vector<std::string>* paths,
+                          boost::shared_ptr<FeatsIndexMapping>* mapping = 0);
+
+  // convert a binaryproto feature file (or chunk index, converted chunk
+  // by chunk) or float32 feature index to a feature index of type dtype
+  void convertFeatsToIndex(const std::string& feats_path, const std::string& index_path,
+                           const FeatsIndexDType dtype = FIDX_FLOAT32);
+
+  // read features from either a feature index file or a binaryproto
+  // (optionally chunked) feature file - if a mapping is provided,
+  // index files are memory mapped rather than copied into memory (paths
+  // may be NULL, in which case they are not read)
+  bool readFeatsFromFile(const std::string& feats_path,
+                         cv::Mat* feats, std::vector<std::string>* paths,
+                         boost::shared_ptr<FeatsIndexMapping>* mapping = 0);
+
+}
+
+#endif
@@ -0,0 +1,181 @@
+#include "feats_log.h"
+
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <boost/crc.hpp>
+
+#include <glog/logging.h>
+
+namespace cpuvisor {
+
+  namespace {
+
+    bool writeAll_(const int fd, const char* data, size_t len) {
+      while (len > 0) {
+        const ssize_t written = ::write(fd, data, len);
+        if (written < 0) return false;
+        data += written;
+        len -= written;
+      }
+      return true;
+    }
+
+    uint32_t recordCrc_(const char* record, const size_t record_sz) {
+      FeatsLogRecordHeader hdr;
+      std::memcpy(&hdr, record, sizeof(hdr));
+      hdr.crc = 0;
+
+      boost::crc_32_type crc;
+      crc.process_bytes(&hdr, sizeof(hdr));
+      crc.process_bytes(record + sizeof(hdr), record_sz - sizeof(hdr));
+      return crc.checksum();
+    }
+
+  }
+
+  FeatsLog::FeatsLog(const size_t sync_interval)
+    : fd_(-1)
+    , dim_(0)
+    , sync_interval_(sync_interval)
+    , unsynced_count_(0) { }
+
+  FeatsLog::~FeatsLog() {
+    close();
+  }
+
+  size_t FeatsLog::open(const std::string& log_path, const size_t dim,
+                        cv::Mat* feats, std::vector<bool>* done,
+                        std::vector<size_t>* skipped_idxs) {
+    close();
+    log_path_ = log_path;
+    dim_ = dim;
+
+    const size_t record_sz = sizeof(FeatsLogRecordHeader) + dim_*sizeof(float);
+    record_buf_.resize(record_sz);
+
+    fd_ = ::open(log_path.c_str(), O_RDWR | O_CREAT, 0644);
+    CHECK_NE(fd_, -1) << "Could not open feature log: " << log_path;
+
+    struct stat st;
+    CHECK_EQ(fstat(fd_, &st), 0);
+
+    FeatsLogHeader hdr;
+    size_t replayed = 0;
+    off_t valid_end = sizeof(hdr);
+
+    if ((static_cast<size_t>(st.st_size) < sizeof(hdr)) ||
+        (::pread(fd_, &hdr, sizeof(hdr), 0) != static_cast<ssize_t>(sizeof(hdr))) ||
+        (std::strncmp(hdr.magic, FEATS_LOG_MAGIC, sizeof(hdr.magic)) != 0) ||
+        (hdr.version != FEATS_LOG_VERSION) || (hdr.dim != dim_)) {
+      if (st.st_size > 0) {
+        LOG(WARNING) << "Discarding invalid feature log: " << log_path;
+      }
+      std::memset(&hdr, 0, sizeof(hdr));
+      std::strncpy(hdr.magic, FEATS_LOG_MAGIC, sizeof(hdr.magic));
+      hdr.version = FEATS_LOG_VERSION;
+      hdr.dim = dim_;
+      CHECK_EQ(::ftruncate(fd_, 0), 0);
+      CHECK(writeAll_(fd_, reinterpret_cast<const char*>(&hdr), sizeof(hdr)));
+    } else {
+      // replay records until the first which is truncated or corrupt
+      char* record = &record_buf_[0];
+      while (::pread(fd_, record, record_sz, valid_end) == static_cast<ssize_t>(record_sz)) {
+        FeatsLogRecordHeader rec_hdr;
+        std::memcpy(&rec_hdr, record, sizeof(rec_hdr));
+        if (rec_hdr.crc != recordCrc_(record, record_sz)) break;
+        valid_end += record_sz;
+
+        if (!feats || (rec_hdr.idx >= static_cast<uint64_t>(feats->rows))) continue;
+        CHECK_EQ(feats->cols, static_cast<int>(dim_));
+        // (rows are only ever logged once, but guard against duplicates)
+        if (done) {
+          CHECK_EQ(done->size(), static_cast<size_t>(feats->rows));
+          if ((*done)[rec_hdr.idx]) continue;
+          (*done)[rec_hdr.idx] = true;
+        }
+        ++replayed;
+
+        if (rec_hdr.flags & FLOG_SKIPPED) {
+          if (skipped_idxs) skipped_idxs->push_back(rec_hdr.idx);
+        } else {
+          std::memcpy(feats->ptr<float>(rec_hdr.idx), record + sizeof(rec_hdr),
+                      dim_*sizeof(float));
+        }
+      }
+
+      if (valid_end < st.st_size) {
+        LOG(WARNING) << "Discarding " << (st.st_size - valid_end)
+                     << " bytes of incomplete records from feature log: " << log_path;
+        CHECK_EQ(::ftruncate(fd_, valid_end), 0);
+      }
+    }
+
+    CHECK_NE(::lseek(fd_, 0, SEEK_END), -1);
+    sync();
+
+    return replayed;
+  }
+
+  void FeatsLog::close() {
+    if (fd_ != -1) {
+      sync();
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  void FeatsLog::remove() {
+    close();
+    if (!log_path_.empty()) {
+      std::remove(log_path_.c_str());
+    }
+  }
+
+  void FeatsLog::append(const size_t idx, const cv::Mat& feat) {
+    CHECK_EQ(feat.type(), CV_32F);
+    CHECK_EQ(feat.total(), dim_);
+    CHECK(feat.isContinuous());
+    append_(idx, 0, feat.ptr<float>(0));
+  }
+
+  void FeatsLog::appendSkipped(const size_t idx) {
+    append_(idx, FLOG_SKIPPED, 0);
+  }
+
+  void FeatsLog::sync() {
+    CHECK(is_open());
+    CHECK_EQ(::fsync(fd_), 0) << "Could not sync feature log: " << log_path_;
+    unsynced_count_ = 0;
+  }
+
+  // -----------------------------------------------------------------------------
+
+  void FeatsLog::append_(const size_t idx, const uint32_t flags, const float* feat) {
+    CHECK(is_open());
+
+    char* record = &record_buf_[0];
+    FeatsLogRecordHeader rec_hdr;
+    rec_hdr.idx = idx;
+    rec_hdr.flags = flags;
+    rec_hdr.crc = 0;
+    std::memcpy(record, &rec_hdr, sizeof(rec_hdr));
+    if (feat) {
+      std::memcpy(record + sizeof(rec_hdr), feat, dim_*sizeof(float));
+    } else {
+      std::memset(record + sizeof(rec_hdr), 0, dim_*sizeof(float));
+    }
+    rec_hdr.crc = recordCrc_(record, record_buf_.size());
+    std::memcpy(record, &rec_hdr, sizeof(rec_hdr));
+
+    CHECK(writeAll_(fd_, record, record_buf_.size()))
+      << "Could not write to feature log: " << log_path_;
+
+    if (++unsynced_count_ >= sync_interval_) sync();
+  }
+
+}
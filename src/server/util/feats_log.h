@@ -0,0 +1,88 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        feats_log.h
+//    Author:      Ken Chatfield
+//    Description: Append-only on-disk log of computed feature rows, used
+//                 to checkpoint feature extraction so that it can be
+//                 resumed after a crash
+//
+//    Layout of a feature log file (all fields in native byte order):
+//
+//      FeatsLogHeader
+//      FeatsLogRecordHeader, float32[dim] feature   (repeated)
+//
+//    Records may be appended in any row order. Only records up to the
+//    last sync() are guaranteed to be durable - a partially written or
+//    corrupt trailing record is discarded (and truncated) on replay.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_FEATS_LOG_H_
+#define CPUVISOR_UTILS_FEATS_LOG_H_
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include <boost/utility.hpp>
+
+#include <opencv2/opencv.hpp>
+
+#define FEATS_LOG_MAGIC "CPVFLOG"
+#define FEATS_LOG_VERSION 1
+
+namespace cpuvisor {
+
+  struct FeatsLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+  };
+
+  enum FeatsLogRecordFlags {FLOG_SKIPPED = 1};
+
+  struct FeatsLogRecordHeader {
+    uint64_t idx;
+    uint32_t flags;
+    uint32_t crc; // CRC-32 of the record header (with crc = 0) and feature
+  };
+
+  class FeatsLog : boost::noncopyable {
+  public:
+    // appended records are synced to disk every sync_interval records
+    FeatsLog(const size_t sync_interval = 100);
+    virtual ~FeatsLog();
+
+    // opens a log for features of dimension dim, creating it if it does
+    // not exist. If it does, each durable record with an idx < num is
+    // replayed into feats (a num x dim CV_32F matrix), marked in done and
+    // (if skipped) appended to skipped_idxs, and the number of distinct
+    // rows replayed is returned
+    size_t open(const std::string& log_path, const size_t dim,
+                cv::Mat* feats = 0, std::vector<bool>* done = 0,
+                std::vector<size_t>* skipped_idxs = 0);
+    void close();
+    // closes and deletes the log (once its rows have been written elsewhere)
+    void remove();
+
+    void append(const size_t idx, const cv::Mat& feat);
+    // records that no feature could be computed for row idx
+    void appendSkipped(const size_t idx);
+
+    // flushes all appended records to disk
+    void sync();
+
+    inline bool is_open() const { return fd_ != -1; }
+
+  protected:
+    void append_(const size_t idx, const uint32_t flags, const float* feat);
+
+    std::string log_path_;
+    int fd_;
+    size_t dim_;
+    size_t sync_interval_;
+    size_t unsynced_count_;
+    std::vector<char> record_buf_;
+  };
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        host_limiter.h
+//    Author:      Ken Chatfield
+//    Description: Limits the number of downloads in flight to each host
+//
+//    Downloads to a host which is at its limit are held (in order) in a
+//    pending queue for that host, and handed over one at a time as
+//    downloads to the same host complete. A host is forgotten once its
+//    last download slot is released.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_HOST_LIMITER_H_
+#define CPUVISOR_UTILS_HOST_LIMITER_H_
+
+#include <deque>
+#include <map>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <glog/logging.h>
+
+namespace cpuvisor {
+
+  template<typename Item>
+  class HostLimiter : boost::noncopyable {
+  public:
+    HostLimiter(const size_t max_per_host = 0) // 0 = unlimited
+      : max_per_host_(max_per_host) { }
+
+    // returns true if a download slot for host was acquired, otherwise
+    // item is added to the pending queue of host
+    bool acquireOrDefer(const std::string& host, const Item& item) {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      HostState_& state = hosts_[host];
+      if ((max_per_host_ > 0) && (state.in_flight >= max_per_host_)) {
+        state.pending.push_back(item);
+        return false;
+      }
+
+      ++state.in_flight;
+      return true;
+    }
+
+    // releases a download slot for host - if any downloads are pending
+    // for host, the slot is instead passed to the next of them, which is
+    // returned in next_item (and true returned)
+    bool release(const std::string& host, Item* next_item) {
+      CHECK(next_item);
+      boost::mutex::scoped_lock lock(mutex_);
+
+      typename std::map<std::string, HostState_>::iterator it = hosts_.find(host);
+      CHECK(it != hosts_.end());
+      CHECK_GT(it->second.in_flight, 0);
+
+      if (!it->second.pending.empty()) {
+        // hand the slot straight over to the next pending download
+        *next_item = it->second.pending.front();
+        it->second.pending.pop_front();
+        return true;
+      }
+
+      if (--(it->second.in_flight) == 0) {
+        hosts_.erase(it);
+      }
+      return false;
+    }
+
+    // number of hosts with downloads in flight
+    size_t hostCount() const {
+      boost::mutex::scoped_lock lock(mutex_);
+      return hosts_.size();
+    }
+
+  private:
+    struct HostState_ {
+      HostState_() : in_flight(0) { }
+      size_t in_flight;
+      std::deque<Item> pending;
+    };
+    size_t max_per_host_;
+    std::map<std::string, HostState_> hosts_;
+    mutable boost::mutex mutex_;
+  };
+
+}
+
+#endif
@@ -2,27 +2,49 @@
 
 namespace cpuvisor {
 
+  void PostProcessor::process(const ImfileIfo& imfile_ifo, const cv::Mat& image) {
+    process(imfile_ifo.fname, imfile_ifo.extra_data);
+  }
+
   ImageDownloader::ImageDownloader(const std::string& download_base_dir,
-                                   boost::shared_ptr<PostProcessor> post_processor)
+                                   boost::shared_ptr<PostProcessor> post_processor,
+                                   const ImageDownloaderParams& params)
     : download_base_dir_(download_base_dir)
+    , params_(params)
     , launch_queue_(new ImfileQueue())
+    , host_limiter_(params.max_host_downloads)
     , post_processor_(post_processor)
-    , postprocess_queue_(new ImfileQueue()) {
+    , postprocess_queue_(new ImfileQueue())
+    , cache_queue_(new ImfileQueue()) {
 
-    // launch bunch of threads for initiating downloads
-    for (size_t i = 0; i < 30; ++i) {
+    // launch bunch of threads for initiating downloads (each thread has
+    // at most one download in flight at a time)
+    CHECK_GE(params_.download_threads, 1);
+    for (size_t i = 0; i < params_.download_threads; ++i) {
       launch_threads_.add_thread(new boost::thread(&ImageDownloader::run_launch_, this));
     }
 
-    // launch post-processing thread
-    postprocess_thread_.reset(new boost::thread(&ImageDownloader::run_postprocess_, this));
+    // launch post-processing threads (so features for multiple images can
+    // be computed at once when the encoder supports it)
+    CHECK_GE(params_.postprocess_threads, 1);
+    for (size_t i = 0; i < params_.postprocess_threads; ++i) {
+      postprocess_threads_.add_thread(new boost::thread(&ImageDownloader::run_postprocess_, this));
+    }
+
+    // launch thread for writing images to cache in the background
+    if (params_.cache_images) {
+      cache_thread_.reset(new boost::thread(&ImageDownloader::run_cache_, this));
+    }
   }
 
   ImageDownloader::~ImageDownloader() {
-    // interrupt post-processing thread to ensure termination before auto-detaching
-    postprocess_thread_->interrupt();
-    // and those in thread group
+    // interrupt post-processing threads to ensure termination before auto-detaching
+    postprocess_threads_.interrupt_all();
+    // and launch threads
     launch_threads_.interrupt_all();
+    if (cache_thread_) {
+      cache_thread_->interrupt();
+    }
   }
 
   void ImageDownloader::downloadUrls(const std::vector<std::string>& urls,
@@ -31,23 +53,33 @@ namespace cpuvisor {
                                      boost::shared_ptr<DownloadCompleteCallback> callback) {
 
     DLOG(INFO) << "In image donwloader...";
-    const std::string callback_hash = callback->hash();
-    image_count_[callback_hash] = 0;
 
+    std::vector<ImfileIfo> imfile_ifos;
     for (size_t i = 0; i < urls.size(); ++i) {
-
       if (shouldDownloadUrl_(urls[i])) {
-        ImfileIfo imfile_ifo = prepareForDownload_(urls[i], tag, extra_data, callback);
-
-        image_count_[callback_hash] += 1;
-        DLOG(INFO) << "Image count was incremented to: " << image_count_[callback_hash];
+        imfile_ifos.push_back(prepareForDownload_(urls[i], tag, extra_data, callback));
+      }
+    }
 
-        // issue request asynchronously
-        // (to be handled by download_stream_handler callback)
-        // by adding to launch_queue_
-        launch_queue_->push(imfile_ifo);
+    if (callback) {
+      // no images to download - complete immediately
+      if (imfile_ifos.empty()) {
+        (*callback)();
+        return;
       }
 
+      // set the final image count before any downloads are launched, so
+      // that it cannot reach zero before all images have been processed
+      boost::mutex::scoped_lock lock(image_count_mutex_);
+      image_count_[callback->hash()] = imfile_ifos.size();
+      DLOG(INFO) << "Image count was set to: " << imfile_ifos.size();
+    }
+
+    for (size_t i = 0; i < imfile_ifos.size(); ++i) {
+      // issue request asynchronously
+      // (to be handled by download_stream_handler callback)
+      // by adding to launch_queue_
+      launch_queue_->push(imfile_ifos[i]);
     }
   }
 
@@ -74,7 +106,12 @@ namespace cpuvisor {
 
     // generate id for filename
     static boost::uuids::random_generator uuid_gen = boost::uuids::random_generator();
-    std::string id = boost::lexical_cast<std::string>(uuid_gen());
+    static boost::mutex uuid_gen_mutex;
+    std::string id;
+    {
+      boost::mutex::scoped_lock lock(uuid_gen_mutex);
+      id = boost::lexical_cast<std::string>(uuid_gen());
+    }
 
     // compose output dir
     fs::path out_dir_fs;
@@ -85,7 +122,7 @@ namespace cpuvisor {
     }
 
     // ensure output dir exists
-    if (!fs::exists(out_dir_fs)) {
+    if (params_.cache_images && !fs::exists(out_dir_fs)) {
       fs::create_directories(out_dir_fs);
     }
 
@@ -108,6 +145,8 @@ namespace cpuvisor {
 
     http::client::options options;
     options.follow_redirects(true);
+    options.cache_resolved(true); // avoid repeated lookups of the same hosts
+    options.timeout(params_.timeout_s);
 
     http::client client(options);
 
@@ -116,13 +155,58 @@ namespace cpuvisor {
       ImfileIfo imfile_ifo;
       launch_queue_->waitAndPop(imfile_ifo);
 
+      if (post_processor_ && post_processor_->processCached(imfile_ifo)) {
+        // push directly to post-processing queue only so that the
+        // associated callback is still updated
+        imfile_ifo.completed = true;
+        imfile_ifo.cached = true;
+        postprocess_queue_->push(imfile_ifo);
+        continue;
+      }
+
       http::client::request request(imfile_ifo.url);
+      const std::string host = request.host();
+
+      if (!host_limiter_.acquireOrDefer(host, imfile_ifo)) {
+        // too many downloads in flight to this host - the url will be
+        // downloaded once one of them completes
+        continue;
+      }
+
+      download_(client, request, imfile_ifo);
+
+      // download any urls deferred while this host was at its limit
+      while (host_limiter_.release(host, &imfile_ifo)) {
+        http::client::request next_request(imfile_ifo.url);
+        download_(client, next_request, imfile_ifo);
+      }
+
+    }
+
+  }
+
+  void ImageDownloader::download_(http::client& client, http::client::request& request,
+                                  const ImfileIfo& imfile_ifo) {
+
+    boost::shared_ptr<DownloadResultSink> result_sink(new DownloadResultSink(postprocess_queue_));
+
+    try {
       request << net::header("Connection", "close");
       http::client::response response;
-      response = client.get(request, body_handler(postprocess_queue_,
+      response = client.get(request, body_handler(result_sink,
                                                   imfile_ifo));
       DLOG(INFO) << "Issued GET request for URL: " << imfile_ifo.url;
 
+      // wait for download to complete (or fail)
+      status(response);
+      body(response);
+    } catch (std::exception& e) {
+      LOG(ERROR) << "Error downloading URL: " << imfile_ifo.url << " (" << e.what() << ")";
+      // push error to queue if not already done by the stream handler
+      ImfileIfo failed_imfile_ifo = imfile_ifo;
+      failed_imfile_ifo.completed = false;
+      failed_imfile_ifo.err_msg = e.what();
+      result_sink->push(failed_imfile_ifo);
     }
 
   }
@@ -134,23 +218,42 @@ namespace cpuvisor {
       ImfileIfo imfile_ifo;
       postprocess_queue_->waitAndPop(imfile_ifo);
 
-      const std::string callback_hash = imfile_ifo.callback->hash();
+      // process an image, decoding directly from the downloaded data
+      if (imfile_ifo.completed && !imfile_ifo.cached) {
+        cv::Mat image;
+        if (imfile_ifo.data) {
+          image = decodeImage(*imfile_ifo.data, params_.decode_min_dim);
+        }
 
-      // process an image
-      if (imfile_ifo.completed) {
-        if (post_processor_) {
-          post_processor_->process(imfile_ifo.fname,
-                                   imfile_ifo.extra_data);
+        if (image.empty()) {
+          LOG(WARNING) << "Could not decode image downloaded from: " << imfile_ifo.url;
+        } else {
+          if (params_.cache_images) {
+            cache_queue_->push(imfile_ifo);
+          }
+          if (post_processor_) {
+            post_processor_->process(imfile_ifo, image);
+          }
         }
-        image_count_[callback_hash] -= 1;
-      } else {
-        image_count_[callback_hash] -= 1;
       }
-      DLOG(INFO) << "Image count was decremented to: " << image_count_[callback_hash];
 
-      // check to see if associated callback (if any) should be called
-      int32_t images_remaining = image_count_[callback_hash];
-      CHECK_GE(images_remaining, 0);
+      if (!imfile_ifo.callback) continue;
+
+      // check to see if associated callback should be called - only the
+      // thread which decrements the count to zero does so
+      const std::string callback_hash = imfile_ifo.callback->hash();
+      int32_t images_remaining;
+      {
+        boost::mutex::scoped_lock lock(image_count_mutex_);
+        std::map<std::string, int32_t>::iterator it = image_count_.find(callback_hash);
+        CHECK(it != image_count_.end());
+        images_remaining = --(it->second);
+        CHECK_GE(images_remaining, 0);
+        if (images_remaining == 0) {
+          image_count_.erase(it);
+        }
+      }
+      DLOG(INFO) << "Image count was decremented to: " << images_remaining;
 
       if (images_remaining == 0) {
         (*imfile_ifo.callback)();
@@ -159,4 +262,20 @@ namespace cpuvisor {
     }
 
   }
+
+  void ImageDownloader::run_cache_() {
+
+    while (true) {
+
+      ImfileIfo imfile_ifo;
+      cache_queue_->waitAndPop(imfile_ifo);
+
+      std::ofstream out_file;
+      out_file.open(imfile_ifo.fname.c_str(), std::ios::out | std::ios::binary);
+      out_file << *imfile_ifo.data;
+      DLOG(INFO) << "Wrote image to file: " << imfile_ifo.fname;
+
+    }
+
+  }
 }
@@ -8,6 +8,7 @@
 #define CPUVISOR_IMAGE_DOWNLOADER_H_
 
 #include <vector>
+#include <map>
 #include <string>
 #include <sstream>
 #include <fstream>
@@ -33,7 +34,11 @@ namespace http = boost::network::http;
 
 #include <glog/logging.h>
 
+#include <opencv2/opencv.hpp>
+
 #include "server/util/concurrent_queue.h"
+#include "server/util/host_limiter.h"
+#include "server/util/image_util.h"
 
 namespace cpuvisor {
 
@@ -45,16 +50,29 @@ namespace cpuvisor {
                                     // allow downcasts
   };
 
+  class ImfileIfo;
+
   class PostProcessor {
   public:
     virtual void process(const std::string imfile,
                          boost::shared_ptr<ExtraDataWrapper> extra_data = boost::shared_ptr<ExtraDataWrapper>()) = 0;
+    // as above, for a downloaded image which has already been decoded in
+    // memory - imfile_ifo.fname may not yet (or ever) have been written
+    // to disk. By default falls back to processing imfile_ifo.fname, so
+    // should be overridden if images are not cached
+    virtual void process(const ImfileIfo& imfile_ifo, const cv::Mat& image);
+    // called before an image is downloaded - returns true if it has
+    // already been processed (e.g. from a cache), in which case the
+    // download is skipped
+    virtual bool processCached(const ImfileIfo& imfile_ifo) { return false; }
   };
 
   class DownloadCompleteCallback {
   public:
     inline DownloadCompleteCallback() {
       static boost::uuids::random_generator uuid_gen = boost::uuids::random_generator();
+      static boost::mutex uuid_gen_mutex;
+      boost::mutex::scoped_lock lock(uuid_gen_mutex);
       hash_val_ = boost::lexical_cast<std::string>(uuid_gen());
     }
     inline std::string hash() { return hash_val_; }
@@ -67,25 +85,64 @@ namespace cpuvisor {
 
   class ImfileIfo {
   public:
-    ImfileIfo(): completed(false) { }
+    ImfileIfo(): completed(false), cached(false) { }
 
     std::string url;
     std::string fname;
     boost::shared_ptr<ExtraDataWrapper> extra_data; // optional extra data
     boost::shared_ptr<DownloadCompleteCallback> callback; // optional associated completion callback
+    boost::shared_ptr<std::string> data; // downloaded (encoded) image data
 
     bool completed;
+    bool cached; // processed without being downloaded
     std::string err_msg;
   };
 
   typedef featpipe::ConcurrentQueue<ImfileIfo> ImfileQueue;
 
+  // ensures exactly one result is pushed for each download, whether from
+  // the stream handler or (on failure to connect) the launching thread
+  class DownloadResultSink : boost::noncopyable {
+  public:
+    DownloadResultSink(boost::shared_ptr<ImfileQueue> queue)
+      : queue_(queue)
+      , pushed_(false) { }
+    inline void push(const ImfileIfo& imfile_ifo) {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (pushed_) return;
+      pushed_ = true;
+      queue_->push(imfile_ifo);
+    }
+  private:
+    boost::shared_ptr<ImfileQueue> queue_;
+    bool pushed_;
+    boost::mutex mutex_;
+  };
+
+  struct ImageDownloaderParams {
+    ImageDownloaderParams()
+      : download_threads(30)
+      , max_host_downloads(8)
+      , timeout_s(30)
+      , postprocess_threads(1)
+      , decode_min_dim(0)
+      , cache_images(true) { }
+    size_t download_threads;    // max downloads in flight at once
+    size_t max_host_downloads;  // max downloads in flight per host (0 = unlimited)
+    size_t timeout_s;           // timeout for each download (0 = none)
+    size_t postprocess_threads;
+    size_t decode_min_dim;      // min size of smaller dimension of decoded
+                                // images (0 = decode at full resolution)
+    bool cache_images;          // write downloaded images to download_base_dir
+  };
+
   // class definition --------------------
 
   class ImageDownloader : boost::noncopyable {
   public:
     ImageDownloader(const std::string& download_base_dir_,
-                    boost::shared_ptr<PostProcessor> post_processor = boost::shared_ptr<PostProcessor>());
+                    boost::shared_ptr<PostProcessor> post_processor = boost::shared_ptr<PostProcessor>(),
+                    const ImageDownloaderParams& params = ImageDownloaderParams());
     virtual ~ImageDownloader();
 
     virtual void downloadUrls(const std::vector<std::string>& urls,
@@ -99,28 +156,40 @@ namespace cpuvisor {
                                           boost::shared_ptr<ExtraDataWrapper> extra_data,
                                           boost::shared_ptr<DownloadCompleteCallback> callback = boost::shared_ptr<DownloadCompleteCallback>());
     std::string download_base_dir_;
+    ImageDownloaderParams params_;
     // launching image download
     virtual void run_launch_();
+    // downloads a single image (blocking until complete or failed)
+    virtual void download_(http::client& client, http::client::request& request,
+                           const ImfileIfo& imfile_ifo);
     boost::shared_ptr<ImfileQueue> launch_queue_;
     boost::thread_group launch_threads_;
+    HostLimiter<ImfileIfo> host_limiter_;
     // post-processing related vars
     virtual void run_postprocess_();
     boost::shared_ptr<PostProcessor> post_processor_;
     boost::shared_ptr<ImfileQueue> postprocess_queue_;
-    boost::shared_ptr<boost::thread> postprocess_thread_;
+    boost::thread_group postprocess_threads_;
+    // writing downloaded images to the image cache (if enabled)
+    virtual void run_cache_();
+    boost::shared_ptr<ImfileQueue> cache_queue_;
+    boost::shared_ptr<boost::thread> cache_thread_;
 
+    // number of images remaining to be post-processed for each callback
     std::map<std::string, int32_t> image_count_;
+    boost::mutex image_count_mutex_; // downloads may be issued and post-processed
+                                     // from multiple threads
   };
 
   // STREAM HANDLER FOR CPP-NETLIB LIBRARY --
   // ---------------------------------------------------------------
-  // pushes downloaded files to postprocess_queue to be processed by
-  // postprocess_thread in an ImageDownloader class instance (which in
-  // turn will call the process function of an associated
-  // PostProcessor class instance if attached)
+  // pushes downloaded image data to postprocess_queue to be processed
+  // by postprocess_threads in an ImageDownloader class instance (which
+  // in turn will decode the image and call the process function of an
+  // associated PostProcessor class instance if attached)
 
   struct body_handler {
-    explicit body_handler(boost::shared_ptr<ImfileQueue> postprocess_queue,
+    explicit body_handler(boost::shared_ptr<DownloadResultSink> postprocess_queue,
                           ImfileIfo imfile_ifo)
       : postprocess_queue_(postprocess_queue)
       , imfile_ifo_(imfile_ifo)
@@ -138,13 +207,12 @@ namespace cpuvisor {
         //DLOG(INFO) << "Extending stored body of size " << body.size() << " bytes to " << body.size();
       } else {
         if (error == boost::asio::error::eof) {
-          // write image to file
-          std::ofstream out_file;
-          out_file.open(imfile_ifo_.fname.c_str(), std::ios::out | std::ios::binary);
-          out_file << body;
-          DLOG(INFO) << "Wrote image to file: " << imfile_ifo_.fname;
+          DLOG(INFO) << "Downloaded image: " << imfile_ifo_.url;
 
-          // push filename to queue for post-processing
+          // push image data to queue for post-processing (which will
+          // also write it to file if required)
+          imfile_ifo_.data.reset(new std::string());
+          imfile_ifo_.data->swap(body);
           imfile_ifo_.completed = true;
           postprocess_queue_->push(imfile_ifo_);
         } else {
@@ -159,7 +227,7 @@ namespace cpuvisor {
         }
       }
     }
-    boost::shared_ptr<ImfileQueue> postprocess_queue_;
+    boost::shared_ptr<DownloadResultSink> postprocess_queue_;
     ImfileIfo imfile_ifo_;
 
     std::string body;
@@ -0,0 +1,97 @@
+#include "image_util.h"
+
+#include <fstream>
+
+#include <glog/logging.h>
+
+// reduced resolution decoding was added in OpenCV 3.2
+#if (CV_MAJOR_VERSION > 3) || ((CV_MAJOR_VERSION == 3) && (CV_MINOR_VERSION >= 2))
+  #define CPUVISOR_REDUCED_DECODE
+#endif
+
+namespace cpuvisor {
+
+  bool getJpegSize(const unsigned char* data, const size_t len,
+                   int* width, int* height) {
+
+    // check for SOI marker
+    if ((len < 4) || (data[0] != 0xFF) || (data[1] != 0xD8)) return false;
+
+    // walk segments until a start of frame marker is found
+    size_t pos = 2;
+    while (pos + 4 <= len) {
+      if (data[pos] != 0xFF) return false;
+      const unsigned char marker = data[pos + 1];
+      if (marker == 0xFF) { // fill byte
+        ++pos;
+        continue;
+      }
+      pos += 2;
+      // markers without a payload
+      if ((marker == 0x01) || ((marker >= 0xD0) && (marker <= 0xD8))) continue;
+      if (marker == 0xD9) return false; // EOI
+
+      const size_t seg_len = (data[pos] << 8) | data[pos + 1];
+      if (seg_len < 2) return false;
+
+      // SOF0-SOF15 (excluding DHT, JPG and DAC)
+      if ((marker >= 0xC0) && (marker <= 0xCF) &&
+          (marker != 0xC4) && (marker != 0xC8) && (marker != 0xCC)) {
+        if ((seg_len < 7) || (pos + 7 > len)) return false;
+        (*height) = (data[pos + 3] << 8) | data[pos + 4];
+        (*width) = (data[pos + 5] << 8) | data[pos + 6];
+        return ((*width) > 0) && ((*height) > 0);
+      }
+
+      pos += seg_len;
+    }
+
+    return false;
+  }
+
+  cv::Mat decodeImage(const std::string& data, const size_t min_dim) {
+
+    if (data.empty()) return cv::Mat();
+
+    int flags = CV_LOAD_IMAGE_COLOR;
+
+    #ifdef CPUVISOR_REDUCED_DECODE
+    int width, height;
+    if ((min_dim > 0) &&
+        getJpegSize(reinterpret_cast<const unsigned char*>(data.data()), data.size(),
+                    &width, &height)) {
+      // largest scale at which the (rounded down) smaller dimension
+      // still covers min_dim
+      const size_t im_min_dim = std::min(width, height);
+      if (im_min_dim/8 >= min_dim) {
+        flags = cv::IMREAD_REDUCED_COLOR_8;
+      } else if (im_min_dim/4 >= min_dim) {
+        flags = cv::IMREAD_REDUCED_COLOR_4;
+      } else if (im_min_dim/2 >= min_dim) {
+        flags = cv::IMREAD_REDUCED_COLOR_2;
+      }
+      DLOG(INFO) << "Decoding " << width << "x" << height << " JPEG image with flags: " << flags;
+    }
+    #endif
+
+    cv::Mat buf(1, data.size(), CV_8UC1, const_cast<char*>(data.data()));
+    return cv::imdecode(buf, flags);
+  }
+
+  cv::Mat readImage(const std::string& path, const size_t min_dim) {
+
+    std::ifstream in_file(path.c_str(), std::ios::in | std::ios::binary);
+    if (!in_file.is_open()) return cv::Mat();
+
+    std::string data;
+    in_file.seekg(0, std::ios::end);
+    data.resize(in_file.tellg());
+    in_file.seekg(0, std::ios::beg);
+    if (!data.empty()) {
+      in_file.read(&data[0], data.size());
+    }
+
+    return decodeImage(data, min_dim);
+  }
+
+}
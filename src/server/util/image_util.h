@@ -0,0 +1,32 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        image_util.h
+//    Author:      Ken Chatfield
+//    Description: Helpers for decoding images for feature extraction
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_IMAGE_UTIL_H_
+#define CPUVISOR_UTILS_IMAGE_UTIL_H_
+
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+namespace cpuvisor {
+
+  // reads the width and height of a JPEG image from its header,
+  // returning false if data is not a (valid) JPEG image
+  bool getJpegSize(const unsigned char* data, const size_t len,
+                   int* width, int* height);
+
+  // decode an 8-bit BGR image from encoded image data - JPEG images are
+  // downscaled during decoding (by 1/2, 1/4 or 1/8) where the smaller
+  // dimension of the decoded image would still be at least min_dim
+  // (0 = always decode at full resolution). Returns an empty matrix if
+  // the image could not be decoded
+  cv::Mat decodeImage(const std::string& data, const size_t min_dim = 0);
+  // as above, reading the image data from a file
+  cv::Mat readImage(const std::string& path, const size_t min_dim = 0);
+
+}
+
+#endif
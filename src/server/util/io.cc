@@ -6,11 +6,16 @@
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
 
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
 #include <fstream>
+#include <cstring>
 #include <fcntl.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/text_format.h>
+#include <google/protobuf/wire_format_lite.h>
 
 using google::protobuf::io::FileInputStream;
 using google::protobuf::io::FileOutputStream;
@@ -18,6 +23,7 @@ using google::protobuf::io::ZeroCopyInputStream;
 using google::protobuf::io::CodedInputStream;
 using google::protobuf::io::ZeroCopyOutputStream;
 using google::protobuf::io::CodedOutputStream;
+using google::protobuf::internal::WireFormatLite;
 
 namespace cpuvisor {
 
@@ -86,7 +92,8 @@ namespace cpuvisor {
 
   void writeChunkIndexToProto(const std::vector<std::string>& chunk_fnames,
                               const size_t feat_num, const size_t feat_dim,
-                              const std::string& proto_path) {
+                              const std::string& proto_path,
+                              const std::vector<size_t>& chunk_nums) {
     cpuvisor::FeatsProto feats_proto;
     feats_proto.set_num(feat_num);
     feats_proto.set_dim(feat_dim);
@@ -96,142 +103,456 @@ namespace cpuvisor {
     for (size_t i = 0; i < chunk_fnames.size(); ++i) {
       feats_proto.add_chunks(chunk_fnames[i]);
     }
+    if (!chunk_nums.empty()) {
+      CHECK_EQ(chunk_nums.size(), chunk_fnames.size());
+      for (size_t i = 0; i < chunk_nums.size(); ++i) {
+        feats_proto.add_chunk_nums(chunk_nums[i]);
+      }
+    }
 
     writeProtoToBinaryFile(proto_path, feats_proto);
   }
 
-  bool readFeatsFromProto(const std::string& proto_path,
-                          cv::Mat* feats, std::vector<std::string>* paths) {
+  bool readFeatsHeaderFromProto(const std::string& proto_path,
+                                size_t* num, size_t* dim) {
+    int fd = open(proto_path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      LOG(ERROR) << "File not found: " << proto_path;
+      return false;
+    }
+    BOOST_SCOPE_EXIT( (&fd) ) {
+      close(fd);
+    } BOOST_SCOPE_EXIT_END
 
-    cpuvisor::FeatsProto feats_proto;
-    bool success = readProtoFromBinaryFile(proto_path, &feats_proto);
-    if (!success) return success;
+    FileInputStream raw_input(fd);
+    CodedInputStream coded_input(&raw_input);
+    coded_input.SetTotalBytesLimit(1073741824, 536870912);
+
+    // num and dim are serialized before all other fields, so usually
+    // only the first few bytes of the file need to be read
+    (*num) = 0;
+    (*dim) = 0;
+    bool has_num = false, has_dim = false;
+
+    uint32_t tag;
+    while ((!has_num || !has_dim) && ((tag = coded_input.ReadTag()) != 0)) {
+      const int field_num = WireFormatLite::GetTagFieldNumber(tag);
+      const WireFormatLite::WireType wire_type = WireFormatLite::GetTagWireType(tag);
+      uint32_t value;
+
+      if ((field_num == FeatsProto::kNumFieldNumber || field_num == FeatsProto::kDimFieldNumber) &&
+          (wire_type == WireFormatLite::WIRETYPE_VARINT)) {
+        if (!coded_input.ReadVarint32(&value)) return false;
+        if (field_num == FeatsProto::kNumFieldNumber) {
+          (*num) = value;
+          has_num = true;
+        } else {
+          (*dim) = value;
+          has_dim = true;
+        }
+      } else {
+        if (!WireFormatLite::SkipField(&coded_input, tag)) return false;
+      }
+    }
 
-    fs::path proto_dir_fs = fs::path(proto_path).parent_path();
+    return true;
+  }
 
-    (*feats) = cv::Mat::zeros(feats_proto.num(), feats_proto.dim(), CV_32FC1);
-    std::vector<std::string>& paths_ref = (*paths);
-    paths_ref = std::vector<std::string>(feats_proto.num());
+  namespace {
 
-    float* feats_data = (float*)feats->data;
+    // shared state for threads loading the chunks of a chunk index
+    struct ChunkLoadState_ {
+      std::vector<std::string> chunk_paths;
+      std::vector<size_t> chunk_nums;
+      std::vector<size_t> chunk_offsets;
+      size_t feat_dim;
+      float* feats_data;
+      std::string* paths_data;
 
-    if (feats_proto.chunks_size() > 0) {
-      // 1. read in chunks from index file if applicable
-      // -----------------------------------------------
+      boost::mutex mutex;
+      size_t next_chunk;
+      size_t chunks_done;
+      bool failed;
+    };
 
-      size_t chunks_count = feats_proto.chunks_size();
+    void loadChunks_(ChunkLoadState_* state);
 
-      size_t ptr = 0;
+    bool readFeatsFromProtoInto_(const std::string& proto_path,
+                                 const size_t feat_num, const size_t feat_dim,
+                                 float* feats_data, std::string* paths_data,
+                                 const size_t num_threads) {
 
-      for (size_t ci = 0; ci < chunks_count; ++ci) {
-        cv::Mat chunk_feats;
-        std::vector<std::string> chunk_paths;
+      // 1. decode feature data and paths directly into output
+      // -----------------------------------------------------
 
-        std::string chunk_proto_path = feats_proto.chunks(ci);
-        fs::path chunk_proto_path_fs = fs::path(chunk_proto_path);
-        if (!chunk_proto_path_fs.is_absolute()) {
-          chunk_proto_path_fs = proto_dir_fs / chunk_proto_path_fs;
-          chunk_proto_path = chunk_proto_path_fs.string();
-        }
+      std::vector<std::string> chunks;
+      std::vector<size_t> chunk_nums;
+      size_t data_ptr = 0, paths_ptr = 0;
+      const size_t data_sz = feat_num*feat_dim;
+      bool legacy_feats = false;
 
-        if (!readFeatsFromProto(chunk_proto_path,
-                                &chunk_feats, &chunk_paths)) {
-          LOG(ERROR) << "Error reading chunk: " << chunk_proto_path;
+      {
+        int fd = open(proto_path.c_str(), O_RDONLY);
+        if (fd == -1) {
+          LOG(ERROR) << "File not found: " << proto_path;
           return false;
         }
+        BOOST_SCOPE_EXIT( (&fd) ) {
+          close(fd);
+        } BOOST_SCOPE_EXIT_END
+
+        FileInputStream raw_input(fd);
+        CodedInputStream coded_input(&raw_input);
+        coded_input.SetTotalBytesLimit(1073741824, 536870912);
+
+        uint32_t tag;
+        while ((tag = coded_input.ReadTag()) != 0) {
+          const int field_num = WireFormatLite::GetTagFieldNumber(tag);
+          const WireFormatLite::WireType wire_type = WireFormatLite::GetTagWireType(tag);
+          uint32_t value;
+
+          if ((field_num == FeatsProto::kNumFieldNumber || field_num == FeatsProto::kDimFieldNumber) &&
+              (wire_type == WireFormatLite::WIRETYPE_VARINT)) {
+            if (!coded_input.ReadVarint32(&value)) return false;
+            if (value != ((field_num == FeatsProto::kNumFieldNumber) ? feat_num : feat_dim)) {
+              LOG(ERROR) << "Feature file header inconsistent with index: " << proto_path;
+              return false;
+            }
+
+          } else if ((field_num == FeatsProto::kDataFieldNumber) &&
+                     (wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED)) {
+            // packed float data - read straight into destination rows
+            if (!coded_input.ReadVarint32(&value)) return false;
+            const size_t value_count = value / sizeof(float);
+            if ((value % sizeof(float) != 0) || (data_ptr + value_count > data_sz)) {
+              LOG(ERROR) << "Feature file contains too much data: " << proto_path;
+              return false;
+            }
+            #if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+            for (size_t i = 0; i < value_count; ++i) {
+              uint32_t bits;
+              if (!coded_input.ReadLittleEndian32(&bits)) return false;
+              std::memcpy(&feats_data[data_ptr + i], &bits, sizeof(float));
+            }
+            #else
+            if (!coded_input.ReadRaw(&feats_data[data_ptr], value)) return false;
+            #endif
+            data_ptr += value_count;
+
+          } else if ((field_num == FeatsProto::kDataFieldNumber) &&
+                     (wire_type == WireFormatLite::WIRETYPE_FIXED32)) {
+            // unpacked float data
+            uint32_t bits;
+            if (!coded_input.ReadLittleEndian32(&bits)) return false;
+            if (data_ptr >= data_sz) {
+              LOG(ERROR) << "Feature file contains too much data: " << proto_path;
+              return false;
+            }
+            std::memcpy(&feats_data[data_ptr++], &bits, sizeof(float));
+
+          } else if (field_num == FeatsProto::kPathsFieldNumber) {
+            if (paths_ptr >= feat_num) {
+              LOG(ERROR) << "Feature file contains too many paths: " << proto_path;
+              return false;
+            }
+            if (paths_data) {
+              if (!WireFormatLite::ReadString(&coded_input, &paths_data[paths_ptr])) return false;
+            } else {
+              if (!WireFormatLite::SkipField(&coded_input, tag)) return false;
+            }
+            ++paths_ptr;
+
+          } else if (field_num == FeatsProto::kChunksFieldNumber) {
+            std::string chunk;
+            if (!WireFormatLite::ReadString(&coded_input, &chunk)) return false;
+              chunks.push_back(chunk);
+
+      } else if ((field_num == FeatsProto::kChunkNumsFieldNumber) &&
+                 (wire_type == WireFormatLite::WIRETYPE_VARINT)) {
+        if (!coded_input.ReadVarint32(&value)) return false;
+        chunk_nums.push_back(value);
+
+      } else if ((field_num == FeatsProto::kChunkNumsFieldNumber) &&
+                 (wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED)) {
+        // packed chunk sizes
+        if (!coded_input.ReadVarint32(&value)) return false;
+        const CodedInputStream::Limit limit = coded_input.PushLimit(value);
+        while (coded_input.BytesUntilLimit() > 0) {
+          if (!coded_input.ReadVarint32(&value)) return false;
+          chunk_nums.push_back(value);
+        }
+        coded_input.PopLimit(limit);
 
-        size_t chunk_size = chunk_paths.size();
-        CHECK_EQ(chunk_feats.rows, chunk_size);
-
-        if ((ptr + chunk_size) > paths_ref.size()) {
-          LOG(ERROR) << "Loaded chunks inconsistent - too many features ("
-                     << ptr + chunk_size << " vs. " << paths_ref.size() << ")";
-          return false;
+          } else {
+            if (field_num == FeatsProto::kFeatsFieldNumber) legacy_feats = true;
+            if (!WireFormatLite::SkipField(&coded_input, tag)) return false;
+          }
         }
+      }
 
-        cv::Mat submat = feats->rowRange(ptr, ptr + chunk_size);
-        chunk_feats.copyTo(submat);
-        for (size_t i = 0; i < chunk_size; ++i) {
-          paths_ref[ptr + i] = chunk_paths[i];
+      if (legacy_feats) {
+        // each feature stored in separate message (unused by writer)
+        cpuvisor::FeatsProto feats_proto;
+        if (!readProtoFromBinaryFile(proto_path, &feats_proto)) return false;
+        CHECK_EQ(feats_proto.feats_size(), feat_num);
+        for (size_t i = 0; i < feat_num; ++i) {
+          const cpuvisor::FeatProto& feat_proto = feats_proto.feats(i);
+          CHECK_EQ(feat_proto.data_size(), feat_dim);
+          std::memcpy(&feats_data[i*feat_dim], feat_proto.data().data(), feat_dim*sizeof(float));
         }
+        data_ptr = data_sz;
+      }
 
-        ptr += chunk_size;
+      if (chunks.empty()) {
+        if ((data_ptr != data_sz) || (paths_ptr != feat_num)) {
+          LOG(ERROR) << "Feature file inconsistent - expected " << feat_num << "x" << feat_dim
+                     << " features but read " << data_ptr << " values and " << paths_ptr
+                     << " paths: " << proto_path;
+          return false;
+        }
+        return true;
       }
 
-      if (ptr != paths_ref.size()) {
-        LOG(ERROR) << "Loaded chunks inconsistent - too few features ("
-                   << ptr << " vs. " << paths_ref.size() << ")";
+      // 2. else file is a chunk index - load chunks in parallel
+      // -------------------------------------------------------
+
+      if ((data_ptr != 0) || (paths_ptr != 0)) {
+        LOG(ERROR) << "Chunk index file should not contain features: " << proto_path;
         return false;
       }
 
-    } else {
-      // 2. else load in a regular chunk
-      // -------------------------------
-
-      if (feats_proto.feats_size() > 0) {
-        // each feature stored in separate message
-        size_t feat_count = feats_proto.num();
-        size_t feat_dim = feats_proto.dim();
-        CHECK_EQ(feats_proto.feats_size(), feat_count);
-        for (size_t i = 0; i < feat_count; ++i) {
-          const cpuvisor::FeatProto& feat_proto = feats_proto.feats(i);
-          CHECK_EQ(feat_proto.data_size(), feat_dim);
-          for (size_t j = 0; j < feat_dim; ++j) {
-            feats_data[i*feat_dim + j] = feat_proto.data(j);
-          }
+      fs::path proto_dir_fs = fs::path(proto_path).parent_path();
+      ChunkLoadState_ state;
+      state.chunk_paths.resize(chunks.size());
+      for (size_t ci = 0; ci < chunks.size(); ++ci) {
+        fs::path chunk_proto_path_fs = fs::path(chunks[ci]);
+        if (!chunk_proto_path_fs.is_absolute()) {
+          chunk_proto_path_fs = proto_dir_fs / chunk_proto_path_fs;
         }
+        state.chunk_paths[ci] = chunk_proto_path_fs.string();
+      }
+
+      // use sizes recorded in the index if available, otherwise read
+      // them from the chunk headers
+      if (chunk_nums.size() == chunks.size()) {
+        state.chunk_nums.swap(chunk_nums);
       } else {
-        // features stored in one large packed message
-        size_t max_size = feats_proto.num()*feats_proto.dim();
-        for (size_t i = 0; i < max_size; ++i) {
-          feats_data[i] = feats_proto.data(i);
+        state.chunk_nums.resize(chunks.size());
+        for (size_t ci = 0; ci < chunks.size(); ++ci) {
+          size_t chunk_dim;
+          if (!readFeatsHeaderFromProto(state.chunk_paths[ci],
+                                        &state.chunk_nums[ci], &chunk_dim)) {
+            LOG(ERROR) << "Error reading chunk header: " << state.chunk_paths[ci];
+            return false;
+          }
+          if (chunk_dim != feat_dim) {
+            LOG(ERROR) << "Loaded chunks inconsistent - wrong dimensionality ("
+                       << chunk_dim << " vs. " << feat_dim << ")";
+            return false;
+          }
         }
       }
 
-      size_t max_size = feats_proto.num();
-      for (size_t i = 0; i < max_size; ++i) {
-        paths_ref[i] = feats_proto.paths(i);
+      // compute destination row offset of each chunk
+      state.chunk_offsets.resize(chunks.size());
+      size_t ptr = 0;
+      for (size_t ci = 0; ci < chunks.size(); ++ci) {
+        state.chunk_offsets[ci] = ptr;
+        ptr += state.chunk_nums[ci];
+      }
+      if (ptr != feat_num) {
+        LOG(ERROR) << "Loaded chunks inconsistent - expected " << feat_num
+                   << " features but chunks contain " << ptr;
+        return false;
       }
 
-      // DEBUG
-      #ifndef NDEBUG
+      state.feat_dim = feat_dim;
+      state.feats_data = feats_data;
+      state.paths_data = paths_data;
+      state.next_chunk = 0;
+      state.chunks_done = 0;
+      state.failed = false;
+
+      size_t thread_count = (num_threads > 0) ? num_threads : boost::thread::hardware_concurrency();
+      thread_count = std::max(static_cast<size_t>(1), std::min(thread_count, chunks.size()));
+
+      LOG(INFO) << "Loading " << chunks.size() << " chunks (" << feat_num
+                << " features) using " << thread_count << " threads...";
+
+      boost::thread_group loader_threads;
+      for (size_t t = 0; t < thread_count; ++t) {
+        loader_threads.create_thread(boost::bind(&loadChunks_, &state));
+      }
+      loader_threads.join_all();
+
+      return !state.failed;
+    }
+
+    void loadChunks_(ChunkLoadState_* state) {
+      while (true) {
+        size_t ci;
+        {
+          boost::mutex::scoped_lock lock(state->mutex);
+          if (state->failed || (state->next_chunk >= state->chunk_paths.size())) return;
+          ci = state->next_chunk++;
+        }
+
+        const size_t offset = state->chunk_offsets[ci];
+        // nested chunk indexes are loaded serially by this thread
+        bool success = readFeatsFromProtoInto_(state->chunk_paths[ci],
+                                               state->chunk_nums[ci], state->feat_dim,
+                                               state->feats_data + offset*state->feat_dim,
+                                               state->paths_data ? state->paths_data + offset : 0,
+                                               1);
+
+        boost::mutex::scoped_lock lock(state->mutex);
+        if (!success) {
+          LOG(ERROR) << "Error reading chunk: " << state->chunk_paths[ci];
+          state->failed = true;
+          return;
+        }
+        ++state->chunks_done;
+        LOG(INFO) << "Loaded chunk " << state->chunks_done << "/" << state->chunk_paths.size()
+                  << ": " << state->chunk_paths[ci];
+      }
+    }
+
+    bool readPathsFromProtoInto_(const std::string& proto_path,
+                                 std::vector<char>* path_data,
+                                 std::vector<uint64_t>* path_offsets) {
+
+      std::vector<std::string> chunks;
+
       {
-        for (size_t i = 0; i < 5; ++i) {
-          DLOG(INFO) << (*paths)[i] << ":";
-          DLOG(INFO) << (*feats)(cv::Rect(0,0,std::min(10, feats->cols),1));
+        int fd = open(proto_path.c_str(), O_RDONLY);
+        if (fd == -1) {
+          LOG(ERROR) << "File not found: " << proto_path;
+          return false;
+        }
+        BOOST_SCOPE_EXIT( (&fd) ) {
+          close(fd);
+        } BOOST_SCOPE_EXIT_END
+
+        FileInputStream raw_input(fd);
+        CodedInputStream coded_input(&raw_input);
+        coded_input.SetTotalBytesLimit(1073741824, 536870912);
+
+        uint32_t tag;
+        while ((tag = coded_input.ReadTag()) != 0) {
+          const int field_num = WireFormatLite::GetTagFieldNumber(tag);
+          const WireFormatLite::WireType wire_type = WireFormatLite::GetTagWireType(tag);
+
+          if ((field_num == FeatsProto::kPathsFieldNumber) &&
+              (wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED)) {
+            // read string data straight onto the end of the table
+            uint32_t len;
+            if (!coded_input.ReadVarint32(&len)) return false;
+            const size_t start = path_data->size();
+            path_data->resize(start + len);
+            if ((len > 0) && !coded_input.ReadRaw(&(*path_data)[start], len)) return false;
+            path_offsets->push_back(path_data->size());
+
+          } else if (field_num == FeatsProto::kChunksFieldNumber) {
+            std::string chunk;
+            if (!WireFormatLite::ReadString(&coded_input, &chunk)) return false;
+            chunks.push_back(chunk);
+
+          } else {
+            if (!WireFormatLite::SkipField(&coded_input, tag)) return false;
+          }
         }
       }
-      #endif
-      // END DEBUG
 
+      // paths of chunk indexes are read from each chunk in turn
+      fs::path proto_dir_fs = fs::path(proto_path).parent_path();
+      for (size_t ci = 0; ci < chunks.size(); ++ci) {
+        fs::path chunk_proto_path_fs = fs::path(chunks[ci]);
+        if (!chunk_proto_path_fs.is_absolute()) {
+          chunk_proto_path_fs = proto_dir_fs / chunk_proto_path_fs;
+        }
+        if (!readPathsFromProtoInto_(chunk_proto_path_fs.string(), path_data, path_offsets)) {
+          LOG(ERROR) << "Error reading chunk: " << chunk_proto_path_fs.string();
+          return false;
+        }
+      }
+
+      return true;
     }
 
+  }
+
+  bool readFeatsFromProto(const std::string& proto_path,
+                          cv::Mat* feats, std::vector<std::string>* paths,
+                          const size_t num_threads) {
+
+    size_t feat_num, feat_dim;
+    bool success = readFeatsHeaderFromProto(proto_path, &feat_num, &feat_dim);
+    if (!success) return success;
+
+    // preallocate output - all chunks are decoded directly into it
+    (*feats) = cv::Mat(feat_num, feat_dim, CV_32FC1);
+    std::string* paths_data = 0;
+    if (paths) {
+      (*paths) = std::vector<std::string>(feat_num);
+      if (feat_num > 0) paths_data = &(*paths)[0];
+    }
+
+    success = readFeatsFromProtoInto_(proto_path, feat_num, feat_dim,
+                                      (float*)feats->data, paths_data,
+                                      num_threads);
+
+    // DEBUG
+    #ifndef NDEBUG
+    if (success) {
+      for (size_t i = 0; i < std::min(feat_num, static_cast<size_t>(5)); ++i) {
+        if (paths) DLOG(INFO) << (*paths)[i] << ":";
+        DLOG(INFO) << feats->row(i).colRange(0, std::min(10, feats->cols));
+      }
+    }
+    #endif
+    // END DEBUG
+
     return success;
   }
 
-  void writeModelToProto(const cv::Mat& model, const std::string& proto_path) {
+  bool readPathsFromProto(const std::string& proto_path,
+                          std::vector<char>* path_data,
+                          std::vector<uint64_t>* path_offsets) {
+    path_data->clear();
+    path_offsets->assign(1, 0);
 
-    cpuvisor::ModelProto model_proto;
-    model_proto.set_dim(model.rows);
-    model_proto.clear_data();
+    size_t feat_num, feat_dim;
+    if (!readFeatsHeaderFromProto(proto_path, &feat_num, &feat_dim)) return false;
+    path_offsets->reserve(feat_num + 1);
+
+    if (!readPathsFromProtoInto_(proto_path, path_data, path_offsets)) return false;
+
+    if (path_offsets->size() != feat_num + 1) {
+      LOG(ERROR) << "Feature file inconsistent - expected " << feat_num
+                 << " paths but read " << path_offsets->size() - 1 << ": " << proto_path;
+      return false;
+    }
+    return true;
+  }
+
+  void modelToProto(const cv::Mat& model, ModelProto* model_proto) {
+
+    model_proto->set_dim(model.rows);
+    model_proto->clear_data();
 
     CHECK_EQ(model.cols, 1);
     CHECK(model.isContinuous());
 
     const float* model_data = (float*)model.data;
     for (size_t i = 0; i < static_cast<size_t>(model.rows); ++i) {
-      model_proto.add_data(model_data[i]);
+      model_proto->add_data(model_data[i]);
     }
 
-    writeProtoToBinaryFile(proto_path, model_proto);
-
   }
 
-  bool readModelFromProto(const std::string& proto_path, cv::Mat* model) {
+  void modelFromProto(const ModelProto& model_proto, cv::Mat* model) {
 
-    cpuvisor::ModelProto model_proto;
-    bool success = readProtoFromBinaryFile(proto_path, &model_proto);
-    if (!success) return success;
+    CHECK_EQ(static_cast<uint32_t>(model_proto.data_size()), model_proto.dim());
 
     (*model) = cv::Mat::zeros(model_proto.dim(), 1, CV_32FC1);
     float* model_data = (float*)model->data;
@@ -240,6 +561,25 @@ namespace cpuvisor {
       model_data[i] = model_proto.data(i);
     }
 
+  }
+
+  void writeModelToProto(const cv::Mat& model, const std::string& proto_path) {
+
+    cpuvisor::ModelProto model_proto;
+    modelToProto(model, &model_proto);
+
+    writeProtoToBinaryFile(proto_path, model_proto);
+
+  }
+
+  bool readModelFromProto(const std::string& proto_path, cv::Mat* model) {
+
+    cpuvisor::ModelProto model_proto;
+    bool success = readProtoFromBinaryFile(proto_path, &model_proto);
+    if (!success) return success;
+
+    modelFromProto(model_proto, model);
+
     return success;
 
   }
@@ -10,6 +10,7 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <stdint.h>
 
 #include <glog/logging.h>
 
@@ -26,10 +27,23 @@ namespace cpuvisor {
                          const std::string& proto_path);
   void writeChunkIndexToProto(const std::vector<std::string>& chunk_fnames,
                               const size_t feat_num, const size_t feat_dim,
-                              const std::string& proto_path);
+                              const std::string& proto_path,
+                              const std::vector<size_t>& chunk_nums = std::vector<size_t>());
+  bool readFeatsHeaderFromProto(const std::string& proto_path,
+                                size_t* num, size_t* dim);
+  // chunk indexes are loaded using num_threads threads (0 = one per core)
+  // - paths may be NULL, in which case they are skipped
   bool readFeatsFromProto(const std::string& proto_path,
-                          cv::Mat* feats, std::vector<std::string>* paths);
-
+                          cv::Mat* feats, std::vector<std::string>* paths,
+                          const size_t num_threads = 0);
+  // reads only the paths, as a path table: path i is the string data in
+  // the range [path_offsets[i], path_offsets[i + 1]) of path_data
+  bool readPathsFromProto(const std::string& proto_path,
+                          std::vector<char>* path_data,
+                          std::vector<uint64_t>* path_offsets);
+
+  void modelToProto(const cv::Mat& model, ModelProto* model_proto);
+  void modelFromProto(const ModelProto& model_proto, cv::Mat* model);
   void writeModelToProto(const cv::Mat& model, const std::string& proto_path);
   bool readModelFromProto(const std::string& proto_path, cv::Mat* model);
 
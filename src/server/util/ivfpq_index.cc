@@ -0,0 +1,422 @@
+#include "ivfpq_index.h"
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+
+namespace cpuvisor {
+
+  namespace {
+
+    // number of features quantized at once when encoding
+    const size_t ENCODE_BLOCK_SZ = 16384;
+
+    inline uint64_t alignOffset_(const uint64_t offset, const uint64_t alignment) {
+      return ((offset + alignment - 1) / alignment) * alignment;
+    }
+
+    inline void writePadding_(std::ofstream& out, const uint64_t alignment) {
+      uint64_t pos = static_cast<uint64_t>(out.tellp());
+      uint64_t padded_pos = alignOffset_(pos, alignment);
+      for (uint64_t i = pos; i < padded_pos; ++i) {
+        out.put(0);
+      }
+    }
+
+    inline void writeMat_(std::ofstream& out, const cv::Mat& mat) {
+      CHECK_EQ(mat.type(), CV_32F);
+      cv::Mat mat_c = mat.isContinuous() ? mat : mat.clone();
+      out.write(reinterpret_cast<const char*>(mat_c.data), mat_c.total()*sizeof(float));
+    }
+
+    // assigns each row of x to the nearest (in L2 distance) row of centers
+    // - center_sq_norms holds the squared norm of each row of centers
+    void assignNearest_(const cv::Mat& x, const cv::Mat& centers,
+                        const std::vector<float>& center_sq_norms,
+                        int* labels, const size_t labels_stride = 1) {
+      // |x - c|^2 = |x|^2 - 2x.c + |c|^2, where |x|^2 is constant per row
+      cv::Mat dots;
+      cv::gemm(x, centers, 1.0, cv::Mat(), 0.0, dots, CV_GEMM_B_T);
+
+      for (int i = 0; i < dots.rows; ++i) {
+        const float* dots_ptr = dots.ptr<float>(i);
+        int best_c = 0;
+        float best_dist = std::numeric_limits<float>::max();
+        for (int c = 0; c < dots.cols; ++c) {
+          const float dist = center_sq_norms[c] - 2.0f*dots_ptr[c];
+          if (dist < best_dist) {
+            best_dist = dist;
+            best_c = c;
+          }
+        }
+        labels[i*labels_stride] = best_c;
+      }
+    }
+
+    std::vector<float> computeSqNorms_(const cv::Mat& centers) {
+      std::vector<float> sq_norms(centers.rows);
+      for (int i = 0; i < centers.rows; ++i) {
+        const float* c = centers.ptr<float>(i);
+        sq_norms[i] = scoreFeat(c, c, centers.cols);
+      }
+      return sq_norms;
+    }
+
+    // subtracts the assigned centroid from each row of x (in place)
+    void computeResiduals_(cv::Mat* x, const cv::Mat& centroids, const int* labels) {
+      for (int i = 0; i < x->rows; ++i) {
+        float* x_ptr = x->ptr<float>(i);
+        const float* c_ptr = centroids.ptr<float>(labels[i]);
+        for (int j = 0; j < x->cols; ++j) {
+          x_ptr[j] -= c_ptr[j];
+        }
+      }
+    }
+
+  }
+
+  // Index construction ------------------------------------------------------
+
+  void buildIvfPqIndex(const cv::Mat& feats, const std::string& index_path,
+                       const IvfPqBuildParams& params) {
+    CHECK_EQ(feats.type(), CV_32F);
+    const size_t num = feats.rows;
+    const size_t dim = feats.cols;
+    const size_t nlist = params.nlist;
+    const size_t m = params.m;
+
+    CHECK_GT(nlist, 0);
+    CHECK_GT(m, 0);
+    CHECK_EQ(dim % m, 0) << "Number of sub-quantizers must divide feature dimensionality";
+    const size_t dsub = dim / m;
+
+    // 1. train quantizers over an evenly strided subsample of the features
+    // --------------------------------------------------------------------
+
+    const size_t train_sz = std::min(params.train_sz, num);
+    CHECK_GE(train_sz, nlist) << "Too few training features for number of inverted lists";
+    CHECK_GE(train_sz, IVFPQ_KSUB) << "Too few training features for product quantizer";
+
+    cv::Mat train_feats(train_sz, dim, CV_32F);
+    for (size_t i = 0; i < train_sz; ++i) {
+      feats.row((i*num)/train_sz).copyTo(train_feats.row(i));
+    }
+
+    const cv::TermCriteria criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS,
+                                    params.kmeans_iters, 1e-4);
+
+    LOG(INFO) << "Training " << nlist << " coarse centroids over "
+              << train_sz << " features...";
+    cv::Mat centroids, train_labels;
+    cv::kmeans(train_feats, nlist, train_labels, criteria, 1,
+               cv::KMEANS_PP_CENTERS, centroids);
+    CHECK_EQ(train_labels.type(), CV_32S);
+
+    computeResiduals_(&train_feats, centroids, (const int*)train_labels.data);
+
+    LOG(INFO) << "Training " << m << " product sub-quantizers of "
+              << dsub << " dimensions...";
+    cv::Mat codebooks(m*IVFPQ_KSUB, dsub, CV_32F);
+    for (size_t j = 0; j < m; ++j) {
+      cv::Mat sub_feats = train_feats.colRange(j*dsub, (j+1)*dsub).clone();
+      cv::Mat sub_labels, sub_centers;
+      cv::kmeans(sub_feats, IVFPQ_KSUB, sub_labels, criteria, 1,
+                 cv::KMEANS_PP_CENTERS, sub_centers);
+      sub_centers.copyTo(codebooks.rowRange(j*IVFPQ_KSUB, (j+1)*IVFPQ_KSUB));
+    }
+    train_feats.release();
+
+    // 2. encode all features
+    // ----------------------
+
+    LOG(INFO) << "Encoding " << num << " features...";
+
+    const std::vector<float> centroid_sq_norms = computeSqNorms_(centroids);
+    std::vector<std::vector<float> > codeword_sq_norms(m);
+    for (size_t j = 0; j < m; ++j) {
+      codeword_sq_norms[j] =
+        computeSqNorms_(codebooks.rowRange(j*IVFPQ_KSUB, (j+1)*IVFPQ_KSUB));
+    }
+
+    std::vector<int> labels(num);
+    std::vector<uint8_t> codes(num*m);
+    std::vector<int> block_codes(ENCODE_BLOCK_SZ*m);
+
+    for (size_t start = 0; start < num; start += ENCODE_BLOCK_SZ) {
+      const size_t end = std::min(start + ENCODE_BLOCK_SZ, num);
+      cv::Mat block = feats.rowRange(start, end).clone();
+
+      assignNearest_(block, centroids, centroid_sq_norms, &labels[start]);
+      computeResiduals_(&block, centroids, &labels[start]);
+
+      for (size_t j = 0; j < m; ++j) {
+        assignNearest_(block.colRange(j*dsub, (j+1)*dsub),
+                       codebooks.rowRange(j*IVFPQ_KSUB, (j+1)*IVFPQ_KSUB),
+                       codeword_sq_norms[j], &block_codes[j], m);
+      }
+      for (size_t i = 0; i < (end - start)*m; ++i) {
+        codes[start*m + i] = static_cast<uint8_t>(block_codes[i]);
+      }
+
+      if ((start / ENCODE_BLOCK_SZ) % 64 == 63) {
+        LOG(INFO) << "Encoded " << end << " of " << num << " features";
+      }
+    }
+
+    // 3. group features by inverted list (counting sort)
+    // ---------------------------------------------------
+
+    std::vector<uint64_t> list_offsets(nlist + 1, 0);
+    for (size_t i = 0; i < num; ++i) {
+      ++list_offsets[labels[i] + 1];
+    }
+    for (size_t l = 0; l < nlist; ++l) {
+      list_offsets[l + 1] += list_offsets[l];
+    }
+
+    std::vector<uint32_t> list_ids(num);
+    std::vector<uint8_t> list_codes(num*m);
+    {
+      std::vector<uint64_t> list_ptrs(list_offsets.begin(), list_offsets.end() - 1);
+      for (size_t i = 0; i < num; ++i) {
+        const uint64_t pos = list_ptrs[labels[i]]++;
+        list_ids[pos] = i;
+        std::memcpy(&list_codes[pos*m], &codes[i*m], m);
+      }
+    }
+    std::vector<uint8_t>().swap(codes);
+
+    // 4. write index
+    // --------------
+
+    LOG(INFO) << "Writing IVF-PQ index to: " << index_path;
+
+    fs::path index_dir_fs = fs::path(index_path).parent_path();
+    if (!index_dir_fs.empty() && !fs::exists(index_dir_fs)) {
+      fs::create_directories(index_dir_fs);
+    }
+
+    const std::string tmp_path = index_path + ".tmp";
+    std::ofstream out(tmp_path.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+    CHECK(out.is_open()) << "Could not open file for writing: " << tmp_path;
+
+    IvfPqHeader hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+
+    std::strncpy(hdr.magic, IVFPQ_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = IVFPQ_INDEX_VERSION;
+    hdr.ksub = IVFPQ_KSUB;
+    hdr.num = num;
+    hdr.dim = dim;
+    hdr.nlist = nlist;
+    hdr.m = m;
+    hdr.dsub = dsub;
+
+    writePadding_(out, IVFPQ_INDEX_ALIGNMENT);
+    hdr.centroids_offset = static_cast<uint64_t>(out.tellp());
+    writeMat_(out, centroids);
+
+    writePadding_(out, IVFPQ_INDEX_ALIGNMENT);
+    hdr.codebooks_offset = static_cast<uint64_t>(out.tellp());
+    writeMat_(out, codebooks);
+
+    writePadding_(out, IVFPQ_INDEX_ALIGNMENT);
+    hdr.lists_offset = static_cast<uint64_t>(out.tellp());
+    out.write(reinterpret_cast<const char*>(&list_offsets[0]),
+              list_offsets.size()*sizeof(uint64_t));
+
+    writePadding_(out, IVFPQ_INDEX_ALIGNMENT);
+    hdr.ids_offset = static_cast<uint64_t>(out.tellp());
+    if (num > 0) {
+      out.write(reinterpret_cast<const char*>(&list_ids[0]), num*sizeof(uint32_t));
+    }
+
+    writePadding_(out, IVFPQ_INDEX_ALIGNMENT);
+    hdr.codes_offset = static_cast<uint64_t>(out.tellp());
+    if (num > 0) {
+      out.write(reinterpret_cast<const char*>(&list_codes[0]), num*m);
+    }
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    out.close();
+    CHECK(!out.fail()) << "Error writing to: " << tmp_path;
+
+    fs::rename(fs::path(tmp_path), fs::path(index_path));
+  }
+
+  // IvfPqIndex --------------------------------------------------------------
+
+  IvfPqIndex::IvfPqIndex()
+    : fd_(-1)
+    , data_(0)
+    , size_(0) { }
+
+  IvfPqIndex::~IvfPqIndex() {
+    close();
+  }
+
+  bool IvfPqIndex::open(const std::string& index_path) {
+    close();
+
+    fd_ = ::open(index_path.c_str(), O_RDONLY);
+    if (fd_ == -1) {
+      LOG(ERROR) << "File not found: " << index_path;
+      return false;
+    }
+
+    struct stat st;
+    if ((fstat(fd_, &st) != 0) || (static_cast<size_t>(st.st_size) < sizeof(IvfPqHeader))) {
+      LOG(ERROR) << "IVF-PQ index file is truncated: " << index_path;
+      close();
+      return false;
+    }
+    size_ = st.st_size;
+
+    void* data = mmap(0, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+      LOG(ERROR) << "Could not memory map IVF-PQ index file: " << index_path;
+      close();
+      return false;
+    }
+    data_ = static_cast<char*>(data);
+
+    const IvfPqHeader& hdr = header();
+
+    if (std::strncmp(hdr.magic, IVFPQ_INDEX_MAGIC, sizeof(hdr.magic)) != 0) {
+      LOG(ERROR) << "Not an IVF-PQ index file: " << index_path;
+    } else if (hdr.version != IVFPQ_INDEX_VERSION) {
+      LOG(ERROR) << "Unsupported IVF-PQ index version (" << hdr.version << "): " << index_path;
+    } else if ((hdr.ksub != IVFPQ_KSUB) || (hdr.m == 0) || (hdr.nlist == 0) ||
+               (hdr.m*hdr.dsub != hdr.dim) ||
+               (hdr.centroids_offset + hdr.nlist*hdr.dim*sizeof(float) > hdr.codebooks_offset) ||
+               (hdr.codebooks_offset + hdr.m*IVFPQ_KSUB*hdr.dsub*sizeof(float) > hdr.lists_offset) ||
+               (hdr.lists_offset + (hdr.nlist + 1)*sizeof(uint64_t) > hdr.ids_offset) ||
+               (hdr.ids_offset + hdr.num*sizeof(uint32_t) > hdr.codes_offset) ||
+               (hdr.codes_offset + hdr.num*hdr.m > size_) ||
+               (reinterpret_cast<const uint64_t*>(data_ + hdr.lists_offset)[hdr.nlist] != hdr.num)) {
+      LOG(ERROR) << "IVF-PQ index file is corrupt or truncated: " << index_path;
+    } else {
+      return true;
+    }
+
+    close();
+    return false;
+  }
+
+  void IvfPqIndex::close() {
+    if (data_) {
+      munmap(data_, size_);
+      data_ = 0;
+    }
+    if (fd_ != -1) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+    size_ = 0;
+  }
+
+  void IvfPqIndex::search(const cv::Mat& model, const size_t top_k, const size_t nprobe,
+                          std::vector<ScoredIdx>* results) const {
+    const IvfPqHeader& hdr = header();
+    const size_t dim = hdr.dim;
+    const size_t m = hdr.m;
+    const size_t dsub = hdr.dsub;
+
+    CHECK_EQ(model.type(), CV_32F);
+    CHECK_EQ(model.total(), dim);
+    cv::Mat model_c = model.isContinuous() ? model : model.clone();
+    const float* model_ptr = (const float*)model_c.data;
+
+    const float* centroids = reinterpret_cast<const float*>(data_ + hdr.centroids_offset);
+    const float* codebooks = reinterpret_cast<const float*>(data_ + hdr.codebooks_offset);
+    const uint64_t* list_offsets = reinterpret_cast<const uint64_t*>(data_ + hdr.lists_offset);
+    const uint32_t* ids = reinterpret_cast<const uint32_t*>(data_ + hdr.ids_offset);
+    const uint8_t* codes = reinterpret_cast<const uint8_t*>(data_ + hdr.codes_offset);
+
+    // select the nprobe lists with the highest scoring centroids
+    std::vector<ScoredIdx> list_scores(hdr.nlist);
+    for (size_t l = 0; l < hdr.nlist; ++l) {
+      list_scores[l].score = scoreFeat(centroids + l*dim, model_ptr, dim);
+      list_scores[l].idx = l;
+    }
+    const size_t probe_count = std::min(std::max(nprobe, static_cast<size_t>(1)),
+                                        static_cast<size_t>(hdr.nlist));
+    std::partial_sort(list_scores.begin(), list_scores.begin() + probe_count,
+                      list_scores.end(), isBetterScoredIdx);
+
+    // precompute the score contribution of every codeword
+    std::vector<float> table(m*IVFPQ_KSUB);
+    for (size_t j = 0; j < m; ++j) {
+      for (size_t k = 0; k < IVFPQ_KSUB; ++k) {
+        table[j*IVFPQ_KSUB + k] =
+          scoreFeat(codebooks + (j*IVFPQ_KSUB + k)*dsub, model_ptr + j*dsub, dsub);
+      }
+    }
+    const float* table_ptr = &table[0];
+
+    results->clear();
+    if (top_k == 0) return;
+    results->reserve(top_k);
+
+    for (size_t p = 0; p < probe_count; ++p) {
+      const size_t l = list_scores[p].idx;
+      const float base_score = list_scores[p].score;
+
+      for (uint64_t i = list_offsets[l]; i < list_offsets[l + 1]; ++i) {
+        const uint8_t* code = codes + i*m;
+        float score = base_score;
+        for (size_t j = 0; j < m; ++j) {
+          score += table_ptr[j*IVFPQ_KSUB + code[j]];
+        }
+        pushTopK(results, top_k, score, ids[i]);
+      }
+    }
+
+    std::sort(results->begin(), results->end(), isBetterScoredIdx);
+  }
+
+  void IvfPqIndex::rank(const cv::Mat& model, const cv::Mat& exact_feats,
+                        Ranking* ranking, const size_t top_k, const size_t nprobe,
+                        const size_t rescore_sz) const {
+    const size_t cand_count = (top_k > 0) ? std::max(top_k, rescore_sz) : num();
+
+    std::vector<ScoredIdx> cands;
+    search(model, cand_count, nprobe, &cands);
+
+    if (!exact_feats.empty()) {
+      CHECK_EQ(exact_feats.type(), CV_32F);
+      CHECK_EQ(exact_feats.rows, num());
+      CHECK_EQ(exact_feats.cols, dim());
+      cv::Mat model_c = model.isContinuous() ? model : model.clone();
+
+      for (size_t i = 0; i < cands.size(); ++i) {
+        cands[i].score = scoreFeat(exact_feats.ptr<float>(cands[i].idx),
+                                   (const float*)model_c.data, dim());
+      }
+      std::sort(cands.begin(), cands.end(), isBetterScoredIdx);
+    }
+
+    ranking->scores = cv::Mat(cands.size(), 1, CV_32F);
+    ranking->sort_idxs = cv::Mat(cands.size(), 1, CV_32S);
+    float* scores_ptr = (float*)ranking->scores.data;
+    int* sort_idxs_ptr = (int*)ranking->sort_idxs.data;
+    for (size_t i = 0; i < cands.size(); ++i) {
+      scores_ptr[i] = cands[i].score;
+      sort_idxs_ptr[i] = cands[i].idx;
+    }
+    ranking->sorted_count = cands.size();
+    ranking->truncated = true;
+  }
+
+}
@@ -0,0 +1,126 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        ivfpq_index.h
+//    Author:      Ken Chatfield
+//    Description: Approximate inverted file index with product quantized
+//                 residuals (IVF-PQ) for sub-linear ranking
+//
+//    Each dataset feature x is assigned to its nearest coarse centroid c,
+//    and the residual x - c is product quantized into m sub-vectors of
+//    dsub = dim/m dimensions, each encoded as one byte indexing one of
+//    IVFPQ_KSUB codewords. A linear model w then scores x as:
+//
+//      w.x ~= w.c + sum_j w_j.q_j(code_j)
+//
+//    so only the nprobe inverted lists with the highest w.c are scanned,
+//    using a per-query table of the m x IVFPQ_KSUB sub-model/codeword
+//    products (asymmetric distance computation).
+//
+//    Layout of an IVF-PQ index file (all fields in native byte order):
+//
+//      [0, 128)                IvfPqHeader
+//      [centroids_offset, ..)  nlist x dim float32 coarse centroids
+//      [codebooks_offset, ..)  m x IVFPQ_KSUB x dsub float32 codewords
+//      [lists_offset, ..)      (nlist + 1) uint64 offsets of the start of
+//                              each inverted list in ids/codes
+//      [ids_offset, ..)        num uint32 dataset indexes in list order
+//      [codes_offset, ..)      num x m uint8 PQ codes in list order
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_IVFPQ_INDEX_H_
+#define CPUVISOR_UTILS_IVFPQ_INDEX_H_
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include <boost/utility.hpp>
+
+#include <glog/logging.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "server/query_data.h"
+#include "server/util/scoring_engine.h"
+
+#define IVFPQ_INDEX_MAGIC "CPVIVPQ"
+#define IVFPQ_INDEX_VERSION 1
+#define IVFPQ_INDEX_ALIGNMENT 64
+#define IVFPQ_KSUB 256
+
+namespace cpuvisor {
+
+  struct IvfPqHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t ksub;
+    uint64_t num;
+    uint64_t dim;
+    uint64_t nlist;
+    uint64_t m;
+    uint64_t dsub;
+    uint64_t centroids_offset;
+    uint64_t codebooks_offset;
+    uint64_t lists_offset;
+    uint64_t ids_offset;
+    uint64_t codes_offset;
+    uint64_t reserved[4];
+  };
+
+  struct IvfPqBuildParams {
+    IvfPqBuildParams()
+      : nlist(1024)
+      , m(64)
+      , train_sz(100000)
+      , kmeans_iters(20) { }
+    size_t nlist;        // number of coarse centroids (inverted lists)
+    size_t m;            // number of PQ sub-quantizers (must divide dim)
+    size_t train_sz;     // max number of features used to train quantizers
+    size_t kmeans_iters;
+  };
+
+  // trains quantizers over (a subsample of) feats and writes an IVF-PQ
+  // index over all of its rows to index_path
+  void buildIvfPqIndex(const cv::Mat& feats, const std::string& index_path,
+                       const IvfPqBuildParams& params = IvfPqBuildParams());
+
+  // read-only memory mapping of an IVF-PQ index file ------------
+
+  class IvfPqIndex : boost::noncopyable {
+  public:
+    IvfPqIndex();
+    virtual ~IvfPqIndex();
+
+    bool open(const std::string& index_path);
+    void close();
+
+    inline const IvfPqHeader& header() const {
+      CHECK(data_);
+      return *reinterpret_cast<const IvfPqHeader*>(data_);
+    }
+    inline size_t num() const { return header().num; }
+    inline size_t dim() const { return header().dim; }
+    inline size_t nlist() const { return header().nlist; }
+    inline size_t m() const { return header().m; }
+
+    // approximate top_k items with the highest score under model,
+    // scanning the nprobe most promising inverted lists - results are
+    // returned in descending order of (approximate) score
+    void search(const cv::Mat& model, const size_t top_k, const size_t nprobe,
+                std::vector<ScoredIdx>* results) const;
+
+    // as search, but rescores the top max(top_k, rescore_sz) candidates
+    // exactly using exact_feats (if not empty) and returns them as a
+    // truncated ranking
+    void rank(const cv::Mat& model, const cv::Mat& exact_feats,
+              Ranking* ranking, const size_t top_k, const size_t nprobe,
+              const size_t rescore_sz = 0) const;
+
+  protected:
+    int fd_;
+    char* data_;
+    size_t size_;
+  };
+
+}
+
+#endif
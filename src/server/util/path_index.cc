@@ -0,0 +1,162 @@
+#include "path_index.h"
+
+#include <cstring>
+#include <limits>
+
+#include <glog/logging.h>
+
+namespace cpuvisor {
+
+  PathIndex::PathIndex()
+    : base_num_(0)
+    , base_offsets_(0)
+    , base_data_(0)
+    , offsets_(1, 0)
+    , slot_mask_(0) { }
+
+  PathIndex::PathIndex(const std::vector<std::string>& paths)
+    : base_num_(0)
+    , base_offsets_(0)
+    , base_data_(0)
+    , offsets_(1, 0)
+    , slot_mask_(0) {
+    append(paths);
+  }
+
+  PathIndex::PathIndex(const boost::shared_ptr<FeatsIndexMapping>& mapping)
+    : mapping_(mapping)
+    , base_num_(mapping->num())
+    , base_offsets_(mapping->pathOffsets())
+    , base_data_(mapping->pathData())
+    , offsets_(1, 0)
+    , slot_mask_(0) {
+    CHECK_LE(base_num_, static_cast<size_t>(std::numeric_limits<uint32_t>::max()));
+
+    // hashes the mapped paths in place
+    reserve_(base_num_, 0);
+  }
+
+  PathIndex::PathIndex(std::vector<char>* path_data, std::vector<uint64_t>* path_offsets)
+    : base_num_(0)
+    , base_offsets_(0)
+    , base_data_(0)
+    , slot_mask_(0) {
+    CHECK(!path_offsets->empty());
+    CHECK_EQ(path_offsets->front(), 0);
+    CHECK_EQ(path_offsets->back(), path_data->size());
+    CHECK_LE(path_offsets->size() - 1, static_cast<size_t>(std::numeric_limits<uint32_t>::max()));
+
+    arena_.swap(*path_data);
+    offsets_.swap(*path_offsets);
+
+    reserve_(size_(), arena_.size());
+  }
+
+  void PathIndex::append(const std::vector<std::string>& paths) {
+
+    size_t num_chars = 0;
+    for (size_t i = 0; i < paths.size(); ++i) {
+      num_chars += paths[i].size();
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+    const size_t start_idx = size_();
+    CHECK_LE(start_idx + paths.size(),
+             static_cast<size_t>(std::numeric_limits<uint32_t>::max()));
+
+    reserve_(start_idx + paths.size(), arena_.size() + num_chars);
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+      arena_.insert(arena_.end(), paths[i].begin(), paths[i].end());
+      offsets_.push_back(arena_.size());
+      insert_(start_idx + i);
+    }
+  }
+
+  bool PathIndex::find(const std::string& path, size_t* idx) const {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    return find_(path.data(), path.size(), idx);
+  }
+
+  std::string PathIndex::path(const size_t idx) const {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    CHECK_LT(idx, size_());
+    return std::string(str_(idx), len_(idx));
+  }
+
+  size_t PathIndex::size() const {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    return size_();
+  }
+
+  // -----------------------------------------------------------------------------
+
+  uint64_t PathIndex::hash_(const char* str, const size_t len) {
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+      hash ^= static_cast<unsigned char>(str[i]);
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  void PathIndex::reserve_(const size_t num_paths, const size_t num_chars) {
+
+    arena_.reserve(num_chars);
+    offsets_.reserve(num_paths - base_num_ + 1);
+
+    // keep the table at most half full
+    if (2*num_paths <= slots_.size()) return;
+
+    size_t num_slots = 1024;
+    while (num_slots < 2*num_paths) num_slots *= 2;
+
+    slots_.assign(num_slots, 0);
+    slot_mask_ = num_slots - 1;
+
+    // rehash existing paths
+    for (size_t i = 0; i < size_(); ++i) {
+      insert_(i);
+    }
+  }
+
+  void PathIndex::insert_(const size_t idx) {
+
+    const char* str = str_(idx);
+    const size_t len = len_(idx);
+
+    size_t slot = hash_(str, len) & slot_mask_;
+    while (slots_[slot] != 0) {
+      // keep the first occurrence of duplicate paths
+      const size_t other_idx = slots_[slot] - 1;
+      if ((len_(other_idx) == len) &&
+          (std::memcmp(str_(other_idx), str, len) == 0)) {
+        LOG(WARNING) << "Duplicate path in dataset: " << std::string(str, len);
+        return;
+      }
+      slot = (slot + 1) & slot_mask_;
+    }
+    slots_[slot] = idx + 1;
+  }
+
+  bool PathIndex::find_(const char* str, const size_t len, size_t* idx) const {
+
+    if (slots_.empty()) return false;
+
+    size_t slot = hash_(str, len) & slot_mask_;
+    while (slots_[slot] != 0) {
+      const size_t cand_idx = slots_[slot] - 1;
+      if ((len_(cand_idx) == len) &&
+          (std::memcmp(str_(cand_idx), str, len) == 0)) {
+        (*idx) = cand_idx;
+        return true;
+      }
+      slot = (slot + 1) & slot_mask_;
+    }
+
+    return false;
+  }
+
+}
@@ -0,0 +1,82 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        path_index.h
+//    Author:      Ken Chatfield
+//    Description: Compact hash index from dataset paths to row indices
+//
+//    Paths are interned into a single contiguous string arena, and
+//    looked up using an open-addressing (linear probing) hash table of
+//    row indices, so no per-path allocations are made. The index may be
+//    appended to, and is safe for concurrent lookups while doing so.
+//
+//    An index can also be built on the path table of a mapped feature
+//    index file, in which case the base paths are read directly from
+//    the mapping and only appended paths are copied into the arena.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_PATH_INDEX_H_
+#define CPUVISOR_UTILS_PATH_INDEX_H_
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include "server/util/feats_index.h"
+
+namespace cpuvisor {
+
+  class PathIndex : boost::noncopyable {
+  public:
+    PathIndex();
+    PathIndex(const std::vector<std::string>& paths);
+    // the mapping is kept alive for the lifetime of the index
+    PathIndex(const boost::shared_ptr<FeatsIndexMapping>& mapping);
+    // takes over a path table (as read by readPathsFromProto) - the
+    // contents of path_data and path_offsets are swapped into the index
+    PathIndex(std::vector<char>* path_data, std::vector<uint64_t>* path_offsets);
+
+    // paths are assigned indices following on from those already in
+    // the index
+    void append(const std::vector<std::string>& paths);
+
+    bool find(const std::string& path, size_t* idx) const;
+    std::string path(const size_t idx) const;
+    size_t size() const;
+
+  protected:
+    static uint64_t hash_(const char* str, const size_t len);
+
+    void reserve_(const size_t num_paths, const size_t num_chars);
+    void insert_(const size_t idx);
+    bool find_(const char* str, const size_t len, size_t* idx) const;
+    inline size_t size_() const { return base_num_ + offsets_.size() - 1; }
+    inline const char* str_(const size_t idx) const {
+      if (idx < base_num_) return base_data_ + base_offsets_[idx];
+      return arena_.empty() ? "" : &arena_[0] + offsets_[idx - base_num_];
+    }
+    inline size_t len_(const size_t idx) const {
+      if (idx < base_num_) return base_offsets_[idx + 1] - base_offsets_[idx];
+      return offsets_[idx - base_num_ + 1] - offsets_[idx - base_num_];
+    }
+
+    // base paths in a mapped path table (if any)
+    boost::shared_ptr<FeatsIndexMapping> mapping_;
+    size_t base_num_;
+    const uint64_t* base_offsets_;
+    const char* base_data_;
+
+    // appended paths
+    std::vector<char> arena_;
+    std::vector<uint64_t> offsets_; // (num appended + 1) offsets into arena_
+    std::vector<uint32_t> slots_;   // idx + 1 for each path (0 = empty)
+    size_t slot_mask_;
+
+    mutable boost::shared_mutex mutex_;
+  };
+
+}
+
+#endif
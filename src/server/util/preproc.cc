@@ -1,5 +1,7 @@
 #include "preproc.h"
 
+#include <algorithm>
+
 #ifdef MATEXP_DEBUG
   #include "server/util/debug/matfileutils_cpp.h"
 #endif
@@ -12,10 +14,10 @@ namespace cpuvisor {
                     const std::string& base_path,
                     const int64_t limit,
                     const int64_t start_idx,
-                    const int64_t end_idx) {
+                    const int64_t end_idx,
+                    const bool resume) {
     std::vector<std::string> paths;
-
-    std::ifstream imfiles(text_path.c_str());
+    readPathsFromTextFile(text_path, &paths, limit, start_idx, end_idx);
 
     fs::path base_path_fs(base_path);
     if (!base_path.empty()) {
@@ -23,6 +25,20 @@ namespace cpuvisor {
         << "Base path should exist or be blank: " << base_path;
     }
 
+    procPathList(paths, proto_path, encoder, base_path, resume);
+
+  }
+
+  void readPathsFromTextFile(const std::string& text_path,
+                             std::vector<std::string>* paths,
+                             const int64_t limit,
+                             const int64_t start_idx,
+                             const int64_t end_idx) {
+
+    paths->clear();
+
+    std::ifstream imfiles(text_path.c_str());
+
     std::string imfile;
     int64_t iter_count = 0;
     while (std::getline(imfiles, imfile)) {
@@ -32,8 +48,8 @@ namespace cpuvisor {
         continue;
       }
 
-      if ((limit > 0) && (paths.size() >= static_cast<size_t>(limit))) {
-        DLOG(INFO) << "Breaking, paths.size(): " << paths.size() << " > limit of: " << limit;
+      if ((limit > 0) && (paths->size() >= static_cast<size_t>(limit))) {
+        DLOG(INFO) << "Breaking, paths.size(): " << paths->size() << " > limit of: " << limit;
         break;
       }
       if ((end_idx > -1) && (iter_count == end_idx)) {
@@ -43,64 +59,80 @@ namespace cpuvisor {
 
       if (!imfile.empty()) {
         DLOG(INFO) << "Pushing back: " << imfile;
-        paths.push_back(imfile);
+        paths->push_back(imfile);
         ++iter_count;
       }
       CHECK_GE(iter_count, 0);
     }
 
-    CHECK_GT(paths.size(), 0) << "No paths could be read from file: " << text_path;
-
-    procPathList(paths, proto_path, encoder, base_path);
+    CHECK_GT(paths->size(), 0) << "No paths could be read from file: " << text_path;
 
   }
 
-  void procPathList(const std::vector<std::string>& paths,
-                    const std::string& proto_path,
-                    featpipe::CaffeEncoder& encoder,
-                    const std::string& base_path) {
+  void writePathsToTextFile(const std::vector<std::string>& paths,
+                            const std::string& text_path) {
+
+    std::ofstream out_file(text_path.c_str());
+    CHECK(out_file.is_open()) << "Could not open file for writing: " << text_path;
 
-    cv::Mat feats = procPaths_(paths, encoder, base_path);
-    writeFeatsToProto_(feats, paths, proto_path);
+    for (size_t i = 0; i < paths.size(); ++i) {
+      out_file << paths[i] << std::endl;
+    }
 
   }
 
-  void procPathListAppend(const std::vector<std::string>& new_paths,
-                          const std::string& proto_path,
-                          featpipe::CaffeEncoder& encoder,
-                          cv::Mat* existing_feats,
-                          std::vector<std::string>* existing_paths,
-                          const std::string& base_path) {
+  void procPathList(const std::vector<std::string>& paths,
+                    const std::string& proto_path,
+                    featpipe::CaffeEncoder& encoder,
+                    const std::string& base_path,
+                    const bool resume) {
 
-    cv::Mat& feats = *existing_feats;
-    std::vector<std::string>& paths = *existing_paths;
+    // ensure output dir exists (for the log)
+    fs::path proto_dir_fs = fs::path(proto_path).parent_path();
+    if (!proto_dir_fs.empty() && !fs::exists(proto_dir_fs)) {
+      fs::create_directories(proto_dir_fs);
+    }
 
-    cv::Mat new_feats = procPaths_(new_paths, encoder, base_path);
+    const std::string log_path = proto_path + ".log";
+    if (!resume && fs::exists(log_path)) {
+      LOG(INFO) << "Discarding existing feature log: " << log_path;
+      fs::remove(log_path);
+    }
 
-    CHECK_EQ(feats.rows, paths.size());
-    if (paths.size() > 0) {
-      // appending to an existing feature matrix
-      CHECK_EQ(feats.cols, new_feats.cols);
+    std::vector<size_t> skipped_idxs;
+    cv::Mat feats = procPaths_(paths, encoder, base_path, log_path, &skipped_idxs);
+    if (skipped_idxs.empty()) {
+      writeFeatsToProto_(feats, paths, proto_path);
     } else {
-      // starting with an empty feature matrix
-      CHECK_EQ(feats.cols, 0);
+      // skipped images would otherwise all score zero for every query
+      cv::Mat kept_feats;
+      std::vector<std::string> kept_paths;
+      dropSkippedRows_(feats, paths, skipped_idxs, &kept_feats, &kept_paths);
+      writeFeatsToProto_(kept_feats, kept_paths, proto_path);
     }
-    CHECK_EQ(new_feats.rows, new_paths.size());
-
-    // always add features before paths to the index to prevent false lookups
-
-    for (int i = 0; i < new_feats.rows; ++i) {
-      feats.push_back(new_feats.row(i)); // could be done more efficiently
+    fs::remove(log_path);
+
+    const std::string skipped_path = proto_path + ".skipped";
+    if (!skipped_idxs.empty()) {
+      std::sort(skipped_idxs.begin(), skipped_idxs.end());
+      std::vector<std::string> skipped_paths(skipped_idxs.size());
+      for (size_t i = 0; i < skipped_idxs.size(); ++i) {
+        skipped_paths[i] = paths[skipped_idxs[i]];
+      }
+      LOG(WARNING) << skipped_paths.size() << " images could not be processed "
+                   << "(and were left out of the features) - listed in: " << skipped_path;
+      writePathsToTextFile(skipped_paths, skipped_path);
+    } else if (fs::exists(skipped_path)) {
+      fs::remove(skipped_path);
     }
-    paths.insert(paths.end(), new_paths.begin(), new_paths.end());
-
-    writeFeatsToProto_(feats, paths, proto_path);
 
   }
 
   cv::Mat procPaths_(const std::vector<std::string>& paths,
                      featpipe::CaffeEncoder& encoder,
-                     const std::string& base_path) {
+                     const std::string& base_path,
+                     const std::string& log_path,
+                     std::vector<size_t>* skipped_idxs) {
 
     fs::path base_path_fs(base_path);
     if (!base_path.empty()) {
@@ -108,17 +140,41 @@ namespace cpuvisor {
         << "Base path should exist or be blank: " << base_path;
     }
 
-    cv::Mat feats(paths.size(), encoder.get_code_size(), CV_32F);
+    cv::Mat feats = cv::Mat::zeros(paths.size(), encoder.get_code_size(), CV_32F);
+    std::vector<bool> done(paths.size(), false);
+
+    FeatsLog log;
+    if (!log_path.empty()) {
+      const size_t replayed = log.open(log_path, feats.cols, &feats, &done, skipped_idxs);
+      if (replayed > 0) {
+        LOG(INFO) << "Resuming from feature log: " << log_path
+                  << " (" << replayed << " of " << paths.size() << " images done)";
+      }
+    }
 
     for (size_t i = 0; i < paths.size(); ++i) {
+      if (done[i]) continue;
 
       LOG(INFO) << "Computing feature for image: " << paths[i];
 
       std::string full_path = (base_path_fs / fs::path(paths[i])).string();
 
-      cv::Mat feat = cpuvisor::computeFeat(full_path, encoder);
-      feat.copyTo(feats.row(i));
-      //feats.row(i) = cpuvisor::computeFeat(full_path, encoder); <- this doesn't work
+      if (!skipped_idxs) {
+        cv::Mat feat = cpuvisor::computeFeat(full_path, encoder);
+        feat.copyTo(feats.row(i));
+        //feats.row(i) = cpuvisor::computeFeat(full_path, encoder); <- this doesn't work
+        continue;
+      }
+
+      try {
+        cv::Mat feat = cpuvisor::computeFeat(full_path, encoder);
+        feat.copyTo(feats.row(i));
+        if (log.is_open()) log.append(i, feat);
+      } catch (featpipe::InvalidImageError& e) {
+        LOG(ERROR) << "Could not compute feature for image: " << paths[i];
+        skipped_idxs->push_back(i);
+        if (log.is_open()) log.appendSkipped(i);
+      }
 
     }
 
@@ -126,6 +182,32 @@ namespace cpuvisor {
 
   }
 
+  void dropSkippedRows_(const cv::Mat& feats,
+                        const std::vector<std::string>& paths,
+                        const std::vector<size_t>& skipped_idxs,
+                        cv::Mat* kept_feats,
+                        std::vector<std::string>* kept_paths) {
+
+    CHECK_EQ(feats.rows, paths.size());
+
+    std::vector<bool> skipped(paths.size(), false);
+    for (size_t i = 0; i < skipped_idxs.size(); ++i) {
+      CHECK_LT(skipped_idxs[i], paths.size());
+      skipped[skipped_idxs[i]] = true;
+    }
+    const size_t kept_num = std::count(skipped.begin(), skipped.end(), false);
+
+    (*kept_feats) = cv::Mat(kept_num, feats.cols, CV_32F);
+    kept_paths->clear();
+    kept_paths->reserve(kept_num);
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if (skipped[i]) continue;
+      feats.row(i).copyTo(kept_feats->row(kept_paths->size()));
+      kept_paths->push_back(paths[i]);
+    }
+
+  }
+
   void writeFeatsToProto_(const cv::Mat feats,
                           const std::vector<std::string>& paths,
                           const std::string& proto_path) {
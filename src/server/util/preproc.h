@@ -21,6 +21,7 @@ namespace fs = boost::filesystem;
 #include "directencode/caffe_encoder.h"
 #include "server/util/feat_util.h"
 #include "server/util/io.h"
+#include "server/util/feats_log.h"
 
 namespace cpuvisor {
   void procTextFile(const std::string& text_path,
@@ -29,22 +30,37 @@ namespace cpuvisor {
                     const std::string& base_path = std::string(),
                     const int64_t limit = -1,
                     const int64_t start_idx = -1,
-                    const int64_t end_idx = -1);
+                    const int64_t end_idx = -1,
+                    const bool resume = true);
+  void readPathsFromTextFile(const std::string& text_path,
+                             std::vector<std::string>* paths,
+                             const int64_t limit = -1,
+                             const int64_t start_idx = -1,
+                             const int64_t end_idx = -1);
+  void writePathsToTextFile(const std::vector<std::string>& paths,
+                            const std::string& text_path);
+  // features are checkpointed to a log (proto_path + ".log") as they are
+  // computed - if resume is set, rows in an existing log are not recomputed.
+  // Images which cannot be read are left out of the written features, and
+  // listed in proto_path + ".skipped"
   void procPathList(const std::vector<std::string>& paths,
                     const std::string& proto_path,
                     featpipe::CaffeEncoder& encoder,
-                    const std::string& base_path = std::string());
-  void procPathListAppend(const std::vector<std::string>& new_paths,
-                          const std::string& proto_path,
-                          featpipe::CaffeEncoder& encoder,
-                          cv::Mat* existing_feats,
-                          std::vector<std::string>* existing_paths,
-                          const std::string& base_path = std::string());
+                    const std::string& base_path = std::string(),
+                    const bool resume = true);
 
 
   cv::Mat procPaths_(const std::vector<std::string>& paths,
                      featpipe::CaffeEncoder& encoder,
-                     const std::string& base_path);
+                     const std::string& base_path,
+                     const std::string& log_path = std::string(),
+                     std::vector<size_t>* skipped_idxs = 0);
+  // copies the rows of feats (and paths) not listed in skipped_idxs
+  void dropSkippedRows_(const cv::Mat& feats,
+                        const std::vector<std::string>& paths,
+                        const std::vector<size_t>& skipped_idxs,
+                        cv::Mat* kept_feats,
+                        std::vector<std::string>* kept_paths);
   void writeFeatsToProto_(const cv::Mat feats,
                           const std::vector<std::string>& paths,
                           const std::string& proto_path);
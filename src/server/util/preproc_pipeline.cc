@@ -0,0 +1,395 @@
+#include "preproc_pipeline.h"
+
+#include <fstream>
+#include <algorithm>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+
+#include <glog/logging.h>
+
+#include "server/util/io.h"
+#include "server/util/image_util.h"
+#include "server/util/preproc.h"
+#include "server/util/tictoc.h"
+
+namespace cpuvisor {
+
+  PreprocPipeline::PreprocPipeline(featpipe::CaffeEncoder& encoder,
+                                   const PreprocPipelineParams& params)
+    : encoder_(encoder)
+    , params_(params)
+    , paths_(0)
+    , next_todo_(0)
+    , failed_count_(0) {
+
+    if (params_.decode_threads == 0) {
+      params_.decode_threads = boost::thread::hardware_concurrency();
+    }
+    CHECK_GE(params_.read_threads, 1);
+    CHECK_GE(params_.decode_threads, 1);
+    CHECK_GE(params_.encode_threads, 1);
+    CHECK_GE(params_.batch_sz, 1);
+    CHECK_GE(params_.queue_sz, 1);
+  }
+
+  void PreprocPipeline::run(const std::vector<std::string>& paths,
+                            const std::string& base_path,
+                            const std::string& feats_file) {
+
+    CHECK_GT(paths.size(), 0);
+
+    paths_ = &paths;
+    base_path_ = base_path;
+    failed_count_ = 0;
+
+    // ensure output dir exists
+    fs::path feats_file_fs(feats_file);
+    if (!feats_file_fs.parent_path().empty() && !fs::exists(feats_file_fs.parent_path())) {
+      fs::create_directories(feats_file_fs.parent_path());
+    }
+
+    // split paths into chunks (named as for cpuvisor_preproc_sge)
+    chunks_.clear();
+    const size_t chunk_sz = (params_.chunk_sz > 0) ? params_.chunk_sz : paths.size();
+    const std::string feats_file_base = (feats_file_fs.parent_path() / feats_file_fs.stem()).string();
+    const std::string feats_file_ext = feats_file_fs.extension().string();
+
+    for (size_t start_idx = 0; start_idx < paths.size(); start_idx += chunk_sz) {
+      Chunk chunk;
+      chunk.start_idx = start_idx;
+      chunk.end_idx = std::min(start_idx + chunk_sz, paths.size());
+      if (params_.chunk_sz > 0) {
+        chunk.fname = (feats_file_base
+                       + "_" + boost::lexical_cast<std::string>(chunk.start_idx + 1)
+                       + "-" + boost::lexical_cast<std::string>(chunk.end_idx)
+                       + feats_file_ext);
+      } else {
+        chunk.fname = feats_file;
+      }
+      chunk.remaining = chunk.end_idx - chunk.start_idx;
+      chunks_.push_back(chunk);
+    }
+
+    const size_t code_size = encoder_.get_code_size();
+
+    todo_idxs_.clear();
+    next_todo_ = 0;
+    for (size_t i = 0; i < chunks_.size(); ++i) {
+      Chunk& chunk = chunks_[i];
+      if ((params_.chunk_sz > 0) && fs::exists(chunk.fname)) {
+        LOG(INFO) << "Skipping existing chunk: " << chunk.fname;
+        chunk.remaining = 0;
+        continue;
+      }
+
+      // replay rows checkpointed by an interrupted run
+      const std::string log_fname = chunk.fname + ".log";
+      std::vector<bool> done(chunk.end_idx - chunk.start_idx, false);
+      if (fs::exists(log_fname)) {
+        if (params_.resume) {
+          chunk.feats = cv::Mat::zeros(chunk.end_idx - chunk.start_idx, code_size, CV_32F);
+          FeatsLog log;
+          const size_t replayed = log.open(log_fname, code_size, &chunk.feats, &done,
+                                           &chunk.skipped_idxs);
+          LOG(INFO) << "Resuming from feature log: " << log_fname
+                    << " (" << replayed << " of " << done.size() << " images done)";
+          chunk.remaining -= replayed;
+        } else {
+          LOG(INFO) << "Discarding existing feature log: " << log_fname;
+          fs::remove(log_fname);
+        }
+      }
+
+      if (chunk.remaining == 0) {
+        writeChunk_(chunk);
+        continue;
+      }
+      for (size_t idx = chunk.start_idx; idx < chunk.end_idx; ++idx) {
+        if (!done[idx - chunk.start_idx]) todo_idxs_.push_back(idx);
+      }
+    }
+
+    LOG(INFO) << "Computing features for " << todo_idxs_.size() << " of " << paths.size()
+              << " images (" << params_.read_threads << " read, "
+              << params_.decode_threads << " decode and "
+              << params_.encode_threads << " encode threads)...";
+
+    decode_queue_.reset(new ItemQueue(params_.queue_sz, params_.read_threads));
+    encode_queue_.reset(new ItemQueue(params_.queue_sz, params_.decode_threads));
+    write_queue_.reset(new ItemQueue(params_.queue_sz, params_.encode_threads));
+
+    boost::thread_group stage_threads;
+    for (size_t i = 0; i < params_.read_threads; ++i) {
+      stage_threads.add_thread(new boost::thread(&PreprocPipeline::read_, this));
+    }
+    for (size_t i = 0; i < params_.decode_threads; ++i) {
+      stage_threads.add_thread(new boost::thread(&PreprocPipeline::decode_, this));
+    }
+    for (size_t i = 0; i < params_.encode_threads; ++i) {
+      stage_threads.add_thread(new boost::thread(&PreprocPipeline::encode_, this));
+    }
+    stage_threads.add_thread(new boost::thread(&PreprocPipeline::write_, this));
+    stage_threads.join_all();
+
+    if (failed_count_ > 0) {
+      LOG(WARNING) << failed_count_ << " images could not be processed (and were left out of the features)";
+    }
+    writeSkipList_(feats_file);
+
+    if (params_.chunk_sz > 0) {
+      LOG(INFO) << "Saving chunk index file...";
+      std::vector<std::string> chunk_fnames(chunks_.size());
+      std::vector<size_t> chunk_nums(chunks_.size());
+      size_t feat_num = 0;
+      for (size_t i = 0; i < chunks_.size(); ++i) {
+        CHECK_EQ(chunks_[i].remaining, 0);
+        chunk_fnames[i] = fs::path(chunks_[i].fname).filename().string();
+        // (chunks exclude skipped images, including those written by
+        // previous runs, so sizes are read back from the chunk headers)
+        size_t chunk_dim;
+        CHECK(cpuvisor::readFeatsHeaderFromProto(chunks_[i].fname, &chunk_nums[i], &chunk_dim));
+        CHECK_EQ(chunk_dim, code_size);
+        feat_num += chunk_nums[i];
+      }
+      cpuvisor::writeChunkIndexToProto(chunk_fnames, feat_num, code_size,
+                                       feats_file, chunk_nums);
+    }
+
+    paths_ = 0;
+    chunks_.clear();
+    todo_idxs_.clear();
+  }
+
+  // -----------------------------------------------------------------------------
+
+  void PreprocPipeline::read_() {
+
+    const fs::path base_path_fs(base_path_);
+
+    while (true) {
+      Item item;
+      {
+        boost::mutex::scoped_lock lock(next_todo_mutex_);
+        if (next_todo_ == todo_idxs_.size()) break;
+        item.idx = todo_idxs_[next_todo_++];
+      }
+
+      const std::string full_path = (base_path_fs / fs::path((*paths_)[item.idx])).string();
+
+      item.data.reset(new std::string());
+      std::ifstream in_file(full_path.c_str(), std::ios::in | std::ios::binary);
+      if (in_file.is_open()) {
+        in_file.seekg(0, std::ios::end);
+        const std::streamoff file_sz = in_file.tellg();
+        if (file_sz < 0) {
+          // (leaves the data empty, so the image is skipped)
+          LOG(ERROR) << "Could not determine size of image: " << full_path;
+        } else {
+          item.data->resize(file_sz);
+          in_file.seekg(0, std::ios::beg);
+          if (!item.data->empty() && !in_file.read(&(*item.data)[0], item.data->size())) {
+            LOG(ERROR) << "Could not read image: " << full_path;
+            item.data->clear();
+          }
+        }
+      } else {
+        LOG(ERROR) << "Could not read image: " << full_path;
+      }
+
+      decode_queue_->push(item);
+    }
+
+    decode_queue_->close();
+  }
+
+  void PreprocPipeline::decode_() {
+
+    const size_t min_dim = encoder_.get_min_image_dim();
+
+    Item item;
+    while (decode_queue_->waitAndPop(item)) {
+
+      item.image = decodeImage(*item.data, min_dim);
+      item.data.reset();
+
+      if (item.image.empty()) {
+        LOG(ERROR) << "Could not decode image: " << (*paths_)[item.idx];
+      } else {
+        // downsize to the size the encoder will crop from (interpolating
+        // as the encoder would), so less data is passed on to the encode
+        // stage
+        const int im_min_dim = std::min(item.image.rows, item.image.cols);
+        if (im_min_dim > static_cast<int>(min_dim)) {
+          const double sf = static_cast<double>(min_dim) / static_cast<double>(im_min_dim);
+          cv::Mat resized_im;
+          cv::resize(item.image, resized_im, cv::Size(), sf, sf);
+          item.image = resized_im;
+        }
+      }
+
+      encode_queue_->push(item);
+    }
+
+    encode_queue_->close();
+  }
+
+  void PreprocPipeline::encode_() {
+
+    std::vector<Item> batch;
+    Item item;
+    while (encode_queue_->waitAndPop(item)) {
+
+      // take any further images which are already waiting
+      batch.clear();
+      batch.push_back(item);
+      while ((batch.size() < params_.batch_sz) && encode_queue_->tryPop(item)) {
+        batch.push_back(item);
+      }
+
+      std::vector<cv::Mat> images;
+      std::vector<size_t> batch_idxs;
+      for (size_t i = 0; i < batch.size(); ++i) {
+        if (!batch[i].image.empty()) {
+          images.push_back(batch[i].image);
+          batch_idxs.push_back(i);
+        }
+      }
+
+      if (!images.empty()) {
+        try {
+          cv::Mat feats = encoder_.compute(images);
+          for (size_t i = 0; i < batch_idxs.size(); ++i) {
+            batch[batch_idxs[i]].feat = feats.row(i);
+          }
+        } catch (featpipe::InvalidImageError& e) {
+          // retry individually, so only the invalid image(s) are skipped
+          for (size_t i = 0; i < batch_idxs.size(); ++i) {
+            try {
+              std::vector<cv::Mat> single_image(1, images[i]);
+              batch[batch_idxs[i]].feat = encoder_.compute(single_image);
+            } catch (featpipe::InvalidImageError& e) {
+              LOG(ERROR) << "Could not compute feature for image: " << (*paths_)[batch[batch_idxs[i]].idx];
+            }
+          }
+        }
+      }
+
+      for (size_t i = 0; i < batch.size(); ++i) {
+        batch[i].image.release();
+        write_queue_->push(batch[i]);
+      }
+    }
+
+    write_queue_->close();
+  }
+
+  void PreprocPipeline::write_() {
+
+    const size_t code_size = encoder_.get_code_size();
+    const size_t chunk_sz = (params_.chunk_sz > 0) ? params_.chunk_sz : paths_->size();
+
+    TicTocObj timer = tic();
+    size_t done_count = 0;
+
+    Item item;
+    while (write_queue_->waitAndPop(item)) {
+
+      Chunk& chunk = chunks_[item.idx / chunk_sz];
+      CHECK_GT(chunk.remaining, 0);
+      if (chunk.feats.empty()) {
+        chunk.feats = cv::Mat::zeros(chunk.end_idx - chunk.start_idx, code_size, CV_32F);
+      }
+      if (!chunk.log) {
+        chunk.log.reset(new FeatsLog());
+        chunk.log->open(chunk.fname + ".log", code_size);
+      }
+
+      const size_t row_idx = item.idx - chunk.start_idx;
+      if (item.feat.empty()) {
+        ++failed_count_;
+        chunk.skipped_idxs.push_back(row_idx);
+        chunk.log->appendSkipped(row_idx);
+      } else {
+        CHECK_EQ(item.feat.cols, static_cast<int>(code_size));
+        item.feat.copyTo(chunk.feats.row(row_idx));
+        chunk.log->append(row_idx, chunk.feats.row(row_idx));
+      }
+      ++done_count;
+
+      if (--chunk.remaining == 0) {
+        writeChunk_(chunk);
+
+        const float elapsed = toc(timer);
+        LOG(INFO) << "Processed " << done_count << " of " << todo_idxs_.size() << " images ("
+                  << ((elapsed > 0) ? done_count/elapsed : 0) << " images/s)";
+      }
+    }
+  }
+
+  void PreprocPipeline::writeChunk_(Chunk& chunk) {
+
+    std::vector<std::string> chunk_paths(paths_->begin() + chunk.start_idx,
+                                         paths_->begin() + chunk.end_idx);
+    LOG(INFO) << "Writing features to: " << chunk.fname;
+    if (chunk.skipped_idxs.empty()) {
+      cpuvisor::writeFeatsToProto(chunk.feats, chunk_paths, chunk.fname);
+    } else {
+      // skipped images would otherwise all score zero for every query
+      cv::Mat kept_feats;
+      std::vector<std::string> kept_paths;
+      dropSkippedRows_(chunk.feats, chunk_paths, chunk.skipped_idxs, &kept_feats, &kept_paths);
+      cpuvisor::writeFeatsToProto(kept_feats, kept_paths, chunk.fname);
+    }
+    chunk.feats.release();
+
+    // the log is no longer needed once the chunk itself has been written,
+    // but skipped images are kept alongside it until the end of the run
+    const std::string log_fname = chunk.fname + ".log";
+    if (chunk.log) {
+      chunk.log->remove();
+      chunk.log.reset();
+    } else if (fs::exists(log_fname)) {
+      fs::remove(log_fname);
+    }
+
+    if (!chunk.skipped_idxs.empty()) {
+      std::sort(chunk.skipped_idxs.begin(), chunk.skipped_idxs.end());
+      std::vector<std::string> skipped_paths(chunk.skipped_idxs.size());
+      for (size_t i = 0; i < chunk.skipped_idxs.size(); ++i) {
+        skipped_paths[i] = chunk_paths[chunk.skipped_idxs[i]];
+      }
+      writePathsToTextFile(skipped_paths, chunk.fname + ".skipped");
+    } else if (fs::exists(chunk.fname + ".skipped")) {
+      fs::remove(chunk.fname + ".skipped");
+    }
+  }
+
+  void PreprocPipeline::writeSkipList_(const std::string& feats_file) {
+
+    // gather the paths skipped for every chunk (including those written
+    // by previous runs) into a single list
+    std::vector<std::string> skipped_paths;
+    for (size_t i = 0; i < chunks_.size(); ++i) {
+      const std::string chunk_skipped_fname = chunks_[i].fname + ".skipped";
+      if ((chunks_[i].fname == feats_file) || !fs::exists(chunk_skipped_fname)) continue;
+
+      std::ifstream in_file(chunk_skipped_fname.c_str());
+      std::string path;
+      while (std::getline(in_file, path)) {
+        if (!path.empty()) skipped_paths.push_back(path);
+      }
+    }
+
+    const std::string skipped_fname = feats_file + ".skipped";
+    if (!skipped_paths.empty()) {
+      LOG(WARNING) << skipped_paths.size() << " images in total were left out of the features "
+                   << "- listed in: " << skipped_fname;
+      writePathsToTextFile(skipped_paths, skipped_fname);
+    } else if ((params_.chunk_sz > 0) && fs::exists(skipped_fname)) {
+      fs::remove(skipped_fname);
+    }
+  }
+
+}
@@ -0,0 +1,120 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        preproc_pipeline.h
+//    Author:      Ken Chatfield
+//    Description: Multi-threaded pipeline for computing features for a
+//                 list of images on a single machine
+//
+//    Images pass through the following stages, each run from its own
+//    pool of threads and connected by bounded queues:
+//
+//      read   - read encoded image data from disk
+//      decode - decode (at reduced resolution where possible) and resize
+//               to the size the encoder crops images from
+//      encode - compute features for batches of images (cropping and
+//               mean subtraction are fused into the network input copy)
+//      write  - collect features into chunks (in path order), writing
+//               each one out as soon as it is complete
+//
+//    Chunks are written in the same format as cpuvisor_preproc_sge, and
+//    the chunk index as cpuvisor_combine_chunks. Until a chunk is
+//    complete its features are checkpointed to a log (<chunk>.log), so an
+//    interrupted run can be resumed - existing chunks are skipped, and rows
+//    in existing logs are not recomputed. Images which cannot be processed
+//    are left out of the written chunks (which may then hold fewer rows
+//    than their names suggest), and are listed in <feats_file>.skipped
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_PREPROC_PIPELINE_H_
+#define CPUVISOR_UTILS_PREPROC_PIPELINE_H_
+
+#include <vector>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <opencv2/opencv.hpp>
+
+#include "directencode/caffe_encoder.h"
+#include "server/util/bounded_queue.h"
+#include "server/util/feats_log.h"
+
+namespace cpuvisor {
+
+  struct PreprocPipelineParams {
+    PreprocPipelineParams()
+      : read_threads(4)
+      , decode_threads(0)
+      , encode_threads(1)
+      , batch_sz(1)
+      , chunk_sz(1000)
+      , queue_sz(256)
+      , resume(true) { }
+    size_t read_threads;
+    size_t decode_threads; // 0 = one per core
+    size_t encode_threads; // should match the encoder netpool size
+    size_t batch_sz;       // max images passed to the encoder at once
+    size_t chunk_sz;       // images per chunk (0 = write a single feature file)
+    size_t queue_sz;       // max images waiting between each pair of stages
+    bool resume;           // if false, existing chunk logs are discarded
+  };
+
+  class PreprocPipeline : boost::noncopyable {
+  public:
+    PreprocPipeline(featpipe::CaffeEncoder& encoder,
+                    const PreprocPipelineParams& params = PreprocPipelineParams());
+
+    // computes features for paths (relative to base_path), writing them
+    // to feats_file - either directly, or as a chunk index if chunked
+    void run(const std::vector<std::string>& paths,
+             const std::string& base_path,
+             const std::string& feats_file);
+
+  protected:
+    struct Item {
+      size_t idx;
+      boost::shared_ptr<std::string> data;
+      cv::Mat image;
+      cv::Mat feat; // empty if a feature could not be computed
+    };
+    typedef featpipe::BoundedQueue<Item> ItemQueue;
+
+    struct Chunk {
+      size_t start_idx;
+      size_t end_idx;
+      std::string fname;
+      cv::Mat feats;
+      size_t remaining;
+      boost::shared_ptr<FeatsLog> log;
+      std::vector<size_t> skipped_idxs;
+    };
+
+    void read_();
+    void decode_();
+    void encode_();
+    void write_();
+
+    void writeChunk_(Chunk& chunk);
+    void writeSkipList_(const std::string& feats_file);
+
+    featpipe::CaffeEncoder& encoder_;
+    PreprocPipelineParams params_;
+
+    // state for the current run
+    const std::vector<std::string>* paths_;
+    std::string base_path_;
+    std::vector<size_t> todo_idxs_;
+    size_t next_todo_;
+    boost::mutex next_todo_mutex_;
+    std::vector<Chunk> chunks_;
+    size_t failed_count_;
+
+    boost::shared_ptr<ItemQueue> decode_queue_;
+    boost::shared_ptr<ItemQueue> encode_queue_;
+    boost::shared_ptr<ItemQueue> write_queue_;
+  };
+
+}
+
+#endif
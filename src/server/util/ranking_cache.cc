@@ -0,0 +1,126 @@
+#include "ranking_cache.h"
+
+#include <boost/lexical_cast.hpp>
+
+#include <glog/logging.h>
+
+#include "server/util/feat_cache.h"
+
+namespace cpuvisor {
+
+  namespace {
+
+    std::string rankingKey_(const std::string& model_hash, const size_t dset_version) {
+      return model_hash + ":" + boost::lexical_cast<std::string>(dset_version);
+    }
+
+    inline size_t matBytes_(const cv::Mat& mat) {
+      return mat.total()*mat.elemSize();
+    }
+
+    // deep copy (cv::Mat copies otherwise share data)
+    Ranking cloneRanking_(const Ranking& ranking) {
+      Ranking copy = ranking;
+      copy.scores = ranking.scores.clone();
+      copy.sort_idxs = ranking.sort_idxs.clone();
+      return copy;
+    }
+
+  }
+
+  RankingCache::RankingCache(const size_t max_bytes)
+    : max_bytes_(max_bytes)
+    , bytes_(0) {
+
+    CHECK_GT(max_bytes_, 0);
+  }
+
+  bool RankingCache::getRanking(const std::string& model_hash, const size_t dset_version,
+                                Ranking* ranking) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    EntryIndex::iterator it = key_index_.find(rankingKey_(model_hash, dset_version));
+    if (it == key_index_.end()) return false;
+
+    entries_.splice(entries_.begin(), entries_, it->second);
+    (*ranking) = cloneRanking_(it->second->ranking);
+
+    return true;
+  }
+
+  void RankingCache::insertRanking(const std::string& model_hash, const size_t dset_version,
+                                   const Ranking& ranking) {
+    Entry entry;
+    entry.key = rankingKey_(model_hash, dset_version);
+    entry.ranking = cloneRanking_(ranking);
+    entry.bytes = matBytes_(entry.ranking.scores) + matBytes_(entry.ranking.sort_idxs);
+    for (size_t i = 0; i < entry.ranking.paths.size(); ++i) {
+      entry.bytes += entry.ranking.paths[i].size();
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    insert_(entry);
+  }
+
+  void RankingCache::clear() {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    entries_.clear();
+    key_index_.clear();
+    bytes_ = 0;
+  }
+
+  size_t RankingCache::size() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return entries_.size();
+  }
+
+  size_t RankingCache::bytes() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return bytes_;
+  }
+
+  std::string RankingCache::hashMat(const cv::Mat& mat) {
+    CHECK(mat.empty() || mat.isContinuous());
+
+    std::string data = boost::lexical_cast<std::string>(mat.rows)
+      + "x" + boost::lexical_cast<std::string>(mat.cols)
+      + ":" + boost::lexical_cast<std::string>(mat.type()) + ":";
+    if (!mat.empty()) {
+      data.append((const char*)mat.data, matBytes_(mat));
+    }
+
+    return FeatCache::hashData(data);
+  }
+
+  // -----------------------------------------------------------------------------
+
+  void RankingCache::insert_(const Entry& entry) {
+
+    // entries larger than the whole cache are never stored
+    if (entry.bytes > max_bytes_) {
+      LOG(WARNING) << "Not caching result larger than cache (" << entry.bytes << " bytes)";
+      return;
+    }
+
+    EntryIndex::iterator it = key_index_.find(entry.key);
+    if (it != key_index_.end()) {
+      erase_(it->second);
+    }
+
+    entries_.push_front(entry);
+    key_index_[entry.key] = entries_.begin();
+    bytes_ += entry.bytes;
+
+    while (bytes_ > max_bytes_) {
+      erase_(--entries_.end());
+    }
+  }
+
+  void RankingCache::erase_(EntryList::iterator it) {
+    bytes_ -= it->bytes;
+    key_index_.erase(it->key);
+    entries_.erase(it);
+  }
+
+}
@@ -0,0 +1,70 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        ranking_cache.h
+//    Author:      Ken Chatfield
+//    Description: LRU cache of the rankings of previous queries, bounded
+//                 by memory use
+//
+//    Rankings are keyed by a hash of the model and the version of the
+//    dataset index they were computed over (so rankings are never
+//    returned for a different dataset).
+//
+//    Rankings are copied on insertion and retrieval, so the lazily
+//    extended sort of a retrieved ranking never touches the cached copy.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_RANKING_CACHE_H_
+#define CPUVISOR_UTILS_RANKING_CACHE_H_
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <opencv2/opencv.hpp>
+
+#include "server/query_data.h"
+
+namespace cpuvisor {
+
+  class RankingCache : boost::noncopyable {
+  public:
+    RankingCache(const size_t max_bytes);
+
+    bool getRanking(const std::string& model_hash, const size_t dset_version,
+                    Ranking* ranking);
+    void insertRanking(const std::string& model_hash, const size_t dset_version,
+                       const Ranking& ranking);
+
+    // removes all cached rankings (e.g. once the dataset has changed)
+    void clear();
+
+    size_t size();
+    size_t bytes();
+
+    // hex SHA-1 digest of the data of mat (which must be continuous)
+    static std::string hashMat(const cv::Mat& mat);
+
+  protected:
+    struct Entry {
+      std::string key;
+      Ranking ranking;
+      size_t bytes;
+    };
+    typedef std::list<Entry> EntryList;
+    typedef std::map<std::string, EntryList::iterator> EntryIndex;
+
+    void insert_(const Entry& entry);
+    void erase_(EntryList::iterator it);
+
+    size_t max_bytes_;
+    size_t bytes_;
+    EntryList entries_; // most recently used first
+    EntryIndex key_index_;
+    boost::mutex mutex_;
+  };
+
+}
+
+#endif
@@ -0,0 +1,531 @@
+#include "scoring_engine.h"
+
+#include <algorithm>
+
+#include "server/util/feats_index.h" // for float16 conversion
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+  #include <immintrin.h>
+#endif
+
+namespace cpuvisor {
+
+  namespace {
+
+    // SIMD dot product kernels -----------------------------------------
+
+    #if defined(__AVX512F__)
+
+    inline void scoreRows4_(const float* r0, const float* r1, const float* r2, const float* r3,
+                            const float* model, const size_t dim, float* out) {
+      __m512 acc0 = _mm512_setzero_ps();
+      __m512 acc1 = _mm512_setzero_ps();
+      __m512 acc2 = _mm512_setzero_ps();
+      __m512 acc3 = _mm512_setzero_ps();
+      size_t j = 0;
+      for (; j + 16 <= dim; j += 16) {
+        // model is loaded once and shared by all four rows
+        const __m512 m = _mm512_loadu_ps(model + j);
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(r0 + j), m, acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(r1 + j), m, acc1);
+        acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(r2 + j), m, acc2);
+        acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(r3 + j), m, acc3);
+      }
+      out[0] = _mm512_reduce_add_ps(acc0);
+      out[1] = _mm512_reduce_add_ps(acc1);
+      out[2] = _mm512_reduce_add_ps(acc2);
+      out[3] = _mm512_reduce_add_ps(acc3);
+      for (; j < dim; ++j) {
+        out[0] += r0[j]*model[j];
+        out[1] += r1[j]*model[j];
+        out[2] += r2[j]*model[j];
+        out[3] += r3[j]*model[j];
+      }
+    }
+
+    inline float scoreRow_(const float* r, const float* model, const size_t dim) {
+      __m512 acc = _mm512_setzero_ps();
+      size_t j = 0;
+      for (; j + 16 <= dim; j += 16) {
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(r + j), _mm512_loadu_ps(model + j), acc);
+      }
+      float sum = _mm512_reduce_add_ps(acc);
+      for (; j < dim; ++j) {
+        sum += r[j]*model[j];
+      }
+      return sum;
+    }
+
+    #elif defined(__AVX2__) && defined(__FMA__)
+
+    inline float hsum256_(const __m256 v) {
+      __m128 lo = _mm256_castps256_ps128(v);
+      __m128 hi = _mm256_extractf128_ps(v, 1);
+      lo = _mm_add_ps(lo, hi);
+      __m128 shuf = _mm_movehdup_ps(lo);
+      __m128 sums = _mm_add_ps(lo, shuf);
+      shuf = _mm_movehl_ps(shuf, sums);
+      sums = _mm_add_ss(sums, shuf);
+      return _mm_cvtss_f32(sums);
+    }
+
+    inline void scoreRows4_(const float* r0, const float* r1, const float* r2, const float* r3,
+                            const float* model, const size_t dim, float* out) {
+      __m256 acc0 = _mm256_setzero_ps();
+      __m256 acc1 = _mm256_setzero_ps();
+      __m256 acc2 = _mm256_setzero_ps();
+      __m256 acc3 = _mm256_setzero_ps();
+      size_t j = 0;
+      for (; j + 8 <= dim; j += 8) {
+        // model is loaded once and shared by all four rows
+        const __m256 m = _mm256_loadu_ps(model + j);
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(r0 + j), m, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(r1 + j), m, acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(r2 + j), m, acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(r3 + j), m, acc3);
+      }
+      out[0] = hsum256_(acc0);
+      out[1] = hsum256_(acc1);
+      out[2] = hsum256_(acc2);
+      out[3] = hsum256_(acc3);
+      for (; j < dim; ++j) {
+        out[0] += r0[j]*model[j];
+        out[1] += r1[j]*model[j];
+        out[2] += r2[j]*model[j];
+        out[3] += r3[j]*model[j];
+      }
+    }
+
+    inline float scoreRow_(const float* r, const float* model, const size_t dim) {
+      __m256 acc = _mm256_setzero_ps();
+      size_t j = 0;
+      for (; j + 8 <= dim; j += 8) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(r + j), _mm256_loadu_ps(model + j), acc);
+      }
+      float sum = hsum256_(acc);
+      for (; j < dim; ++j) {
+        sum += r[j]*model[j];
+      }
+      return sum;
+    }
+
+    #else
+
+    inline float scoreRow_(const float* r, const float* model, const size_t dim) {
+      // four independent accumulators to allow auto-vectorization
+      float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+      size_t j = 0;
+      for (; j + 4 <= dim; j += 4) {
+        acc[0] += r[j]*model[j];
+        acc[1] += r[j+1]*model[j+1];
+        acc[2] += r[j+2]*model[j+2];
+        acc[3] += r[j+3]*model[j+3];
+      }
+      float sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+      for (; j < dim; ++j) {
+        sum += r[j]*model[j];
+      }
+      return sum;
+    }
+
+    inline void scoreRows4_(const float* r0, const float* r1, const float* r2, const float* r3,
+                            const float* model, const size_t dim, float* out) {
+      out[0] = scoreRow_(r0, model, dim);
+      out[1] = scoreRow_(r1, model, dim);
+      out[2] = scoreRow_(r2, model, dim);
+      out[3] = scoreRow_(r3, model, dim);
+    }
+
+    #endif
+
+    // compressed feature kernels -------------------------------------
+
+    #if defined(__AVX512F__)
+
+    inline float scoreRowF16_(const uint16_t* r, const float* model, const size_t dim) {
+      __m512 acc = _mm512_setzero_ps();
+      size_t j = 0;
+      for (; j + 16 <= dim; j += 16) {
+        const __m512 v = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(r + j)));
+        acc = _mm512_fmadd_ps(v, _mm512_loadu_ps(model + j), acc);
+      }
+      float sum = _mm512_reduce_add_ps(acc);
+      for (; j < dim; ++j) {
+        sum += halfToFloat(r[j])*model[j];
+      }
+      return sum;
+    }
+
+    inline float scoreRowI8_(const int8_t* r, const float* model, const size_t dim) {
+      __m512 acc = _mm512_setzero_ps();
+      size_t j = 0;
+      for (; j + 16 <= dim; j += 16) {
+        const __m512 v =
+          _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(r + j))));
+        acc = _mm512_fmadd_ps(v, _mm512_loadu_ps(model + j), acc);
+      }
+      float sum = _mm512_reduce_add_ps(acc);
+      for (; j < dim; ++j) {
+        sum += r[j]*model[j];
+      }
+      return sum;
+    }
+
+    #elif defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+
+    inline float scoreRowF16_(const uint16_t* r, const float* model, const size_t dim) {
+      __m256 acc = _mm256_setzero_ps();
+      size_t j = 0;
+      for (; j + 8 <= dim; j += 8) {
+        const __m256 v = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(r + j)));
+        acc = _mm256_fmadd_ps(v, _mm256_loadu_ps(model + j), acc);
+      }
+      float sum = hsum256_(acc);
+      for (; j < dim; ++j) {
+        sum += halfToFloat(r[j])*model[j];
+      }
+      return sum;
+    }
+
+    inline float scoreRowI8_(const int8_t* r, const float* model, const size_t dim) {
+      __m256 acc = _mm256_setzero_ps();
+      size_t j = 0;
+      for (; j + 8 <= dim; j += 8) {
+        const __m256 v =
+          _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(r + j))));
+        acc = _mm256_fmadd_ps(v, _mm256_loadu_ps(model + j), acc);
+      }
+      float sum = hsum256_(acc);
+      for (; j < dim; ++j) {
+        sum += r[j]*model[j];
+      }
+      return sum;
+    }
+
+    #else
+
+    inline float scoreRowF16_(const uint16_t* r, const float* model, const size_t dim) {
+      float sum = 0.0f;
+      for (size_t j = 0; j < dim; ++j) {
+        sum += halfToFloat(r[j])*model[j];
+      }
+      return sum;
+    }
+
+    inline float scoreRowI8_(const int8_t* r, const float* model, const size_t dim) {
+      float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+      size_t j = 0;
+      for (; j + 4 <= dim; j += 4) {
+        acc[0] += r[j]*model[j];
+        acc[1] += r[j+1]*model[j+1];
+        acc[2] += r[j+2]*model[j+2];
+        acc[3] += r[j+3]*model[j+3];
+      }
+      float sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+      for (; j < dim; ++j) {
+        sum += r[j]*model[j];
+      }
+      return sum;
+    }
+
+    #endif
+
+  }
+
+  float scoreFeat(const float* feat, const float* model, const size_t dim) {
+    return scoreRow_(feat, model, dim);
+  }
+
+  // ScoringEngine -------------------------------------------------------------
+
+  ScoringEngine::ScoringEngine(const size_t num_threads)
+    : job_generation_(0)
+    , threads_done_(0)
+    , stopping_(false)
+    , job_feats_(0)
+    , job_scales_(0)
+    , job_model_(0)
+    , job_scores_(0)
+    , job_top_k_(0) {
+
+    thread_count_ = (num_threads > 0) ? num_threads : boost::thread::hardware_concurrency();
+    if (thread_count_ < 1) thread_count_ = 1;
+    thread_top_.resize(thread_count_);
+
+    LOG(INFO) << "Starting scoring engine with " << thread_count_ << " threads...";
+    for (size_t t = 0; t < thread_count_; ++t) {
+      threads_.create_thread(boost::bind(&ScoringEngine::worker_, this, t));
+    }
+  }
+
+  ScoringEngine::~ScoringEngine() {
+    {
+      boost::mutex::scoped_lock lock(state_mutex_);
+      stopping_ = true;
+    }
+    job_cond_var_.notify_all();
+    threads_.join_all();
+  }
+
+  void ScoringEngine::score(const cv::Mat& dset_feats, const cv::Mat& model,
+                            cv::Mat* scores,
+                            std::vector<int>* top_idxs, const size_t top_k,
+                            const cv::Mat& row_scales) {
+    CHECK((dset_feats.type() == CV_32FC1) || (dset_feats.type() == CV_16UC1) ||
+          (dset_feats.type() == CV_8SC1)) << "Unsupported feature type for scoring";
+    if (dset_feats.type() == CV_8SC1) {
+      CHECK_EQ(row_scales.type(), CV_32FC1);
+      CHECK_EQ(row_scales.rows, dset_feats.rows);
+      CHECK(row_scales.isContinuous());
+    }
+    CHECK_EQ(model.type(), CV_32FC1);
+    CHECK_EQ(model.cols, 1);
+    CHECK_EQ(model.rows, dset_feats.cols);
+    CHECK(model.isContinuous());
+
+    (*scores) = cv::Mat(dset_feats.rows, 1, CV_32FC1);
+
+    boost::mutex::scoped_lock job_lock(job_mutex_);
+
+    {
+      boost::mutex::scoped_lock lock(state_mutex_);
+      job_feats_ = &dset_feats;
+      job_scales_ = (dset_feats.type() == CV_8SC1) ? (const float*)row_scales.data : 0;
+      job_model_ = (const float*)model.data;
+      job_scores_ = (float*)scores->data;
+      job_top_k_ = top_idxs ? std::min(top_k, static_cast<size_t>(dset_feats.rows)) : 0;
+      threads_done_ = 0;
+      ++job_generation_;
+    }
+    job_cond_var_.notify_all();
+
+    {
+      boost::mutex::scoped_lock lock(state_mutex_);
+      while (threads_done_ < thread_count_) {
+        done_cond_var_.wait(lock);
+      }
+      job_feats_ = 0;
+    }
+
+    if (top_idxs) {
+      // merge per-thread candidates
+      std::vector<ScoredIdx> candidates;
+      for (size_t t = 0; t < thread_count_; ++t) {
+        candidates.insert(candidates.end(), thread_top_[t].begin(), thread_top_[t].end());
+        thread_top_[t].clear();
+      }
+      const size_t k = std::min(job_top_k_, candidates.size());
+      std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end(),
+                        isBetterScoredIdx);
+
+      top_idxs->resize(k);
+      for (size_t i = 0; i < k; ++i) {
+        (*top_idxs)[i] = candidates[i].idx;
+      }
+    }
+  }
+
+  void ScoringEngine::rank(const cv::Mat& dset_feats, const cv::Mat& model,
+                           Ranking* ranking, const size_t top_k) {
+    const size_t dset_sz = dset_feats.rows;
+
+    if ((top_k == 0) || (top_k >= dset_sz)) {
+      // full ranking requested - no benefit from a fused selection
+      score(dset_feats, model, &ranking->scores);
+
+      std::vector<ScoredIdx> items(dset_sz);
+      const float* scores_ptr = (const float*)ranking->scores.data;
+      for (size_t i = 0; i < dset_sz; ++i) {
+        items[i].score = scores_ptr[i];
+        items[i].idx = i;
+      }
+      std::sort(items.begin(), items.end(), isBetterScoredIdx);
+
+      ranking->sort_idxs = cv::Mat(dset_sz, 1, CV_32S);
+      int* sort_idxs_ptr = (int*)ranking->sort_idxs.data;
+      for (size_t i = 0; i < dset_sz; ++i) {
+        sort_idxs_ptr[i] = items[i].idx;
+      }
+      ranking->sorted_count = dset_sz;
+
+    } else {
+      std::vector<int> top_idxs;
+      score(dset_feats, model, &ranking->scores, &top_idxs, top_k);
+
+      // only the sorted prefix is stored - it is expanded to a full
+      // permutation by ensureRankingSorted if deeper pages are requested
+      ranking->sort_idxs = cv::Mat(top_idxs.size(), 1, CV_32S);
+      std::copy(top_idxs.begin(), top_idxs.end(), (int*)ranking->sort_idxs.data);
+      ranking->sorted_count = top_idxs.size();
+    }
+  }
+
+  void ScoringEngine::rankSegments(const std::vector<cv::Mat>& segments, const cv::Mat& model,
+                                   Ranking* ranking, const size_t top_k) {
+    if (segments.size() == 1) {
+      rank(segments[0], model, ranking, top_k);
+      return;
+    }
+
+    size_t dset_sz = 0;
+    for (size_t s = 0; s < segments.size(); ++s) {
+      CHECK_EQ(segments[s].type(), CV_32FC1);
+      dset_sz += segments[s].rows;
+    }
+    const size_t k = ((top_k == 0) || (top_k >= dset_sz)) ? dset_sz : top_k;
+
+    // score each segment into its slice of the overall scores, keeping
+    // the top k candidates of each segment
+    ranking->scores = cv::Mat(dset_sz, 1, CV_32FC1);
+    float* scores_ptr = (float*)ranking->scores.data;
+    std::vector<ScoredIdx> candidates;
+
+    size_t offset = 0;
+    for (size_t s = 0; s < segments.size(); ++s) {
+      if (segments[s].rows == 0) continue;
+
+      cv::Mat seg_scores;
+      std::vector<int> seg_top_idxs;
+      score(segments[s], model, &seg_scores, &seg_top_idxs, k);
+      std::copy((const float*)seg_scores.data, (const float*)seg_scores.data + segments[s].rows,
+                scores_ptr + offset);
+
+      for (size_t i = 0; i < seg_top_idxs.size(); ++i) {
+        ScoredIdx item;
+        item.idx = offset + seg_top_idxs[i];
+        item.score = scores_ptr[item.idx];
+        candidates.push_back(item);
+      }
+      offset += segments[s].rows;
+    }
+    CHECK_EQ(offset, dset_sz);
+
+    const size_t sorted_count = std::min(k, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + sorted_count, candidates.end(),
+                      isBetterScoredIdx);
+
+    // only the sorted prefix is stored (as for rank)
+    ranking->sort_idxs = cv::Mat(sorted_count, 1, CV_32S);
+    int* sort_idxs_ptr = (int*)ranking->sort_idxs.data;
+    for (size_t i = 0; i < sorted_count; ++i) {
+      sort_idxs_ptr[i] = candidates[i].idx;
+    }
+    ranking->sorted_count = sorted_count;
+  }
+
+  void ScoringEngine::rankCompressed(const cv::Mat& compressed_feats, const cv::Mat& row_scales,
+                                     const cv::Mat& exact_feats, const cv::Mat& model,
+                                     Ranking* ranking, const size_t top_k,
+                                     const size_t rescore_sz) {
+    CHECK_EQ(exact_feats.type(), CV_32FC1);
+    CHECK_EQ(exact_feats.rows, compressed_feats.rows);
+    CHECK_EQ(exact_feats.cols, compressed_feats.cols);
+    const size_t dset_sz = compressed_feats.rows;
+    const size_t dim = compressed_feats.cols;
+
+    size_t candidate_count = std::max(top_k, rescore_sz);
+    if ((top_k == 0) || (candidate_count > dset_sz)) candidate_count = dset_sz;
+
+    std::vector<int> candidates;
+    score(compressed_feats, model, &ranking->scores, &candidates, candidate_count, row_scales);
+
+    // rescore candidates exactly - the approximate scores of all other
+    // items are retained, so items beyond the sorted part may (rarely)
+    // score higher than the last rescored items
+    float* scores_ptr = (float*)ranking->scores.data;
+    const float* model_ptr = (const float*)model.data;
+    std::vector<ScoredIdx> rescored(candidates.size());
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      const int idx = candidates[i];
+      scores_ptr[idx] = scoreFeat(exact_feats.ptr<float>(idx), model_ptr, dim);
+      rescored[i].score = scores_ptr[idx];
+      rescored[i].idx = idx;
+    }
+    std::sort(rescored.begin(), rescored.end(), isBetterScoredIdx);
+
+    ranking->sort_idxs = cv::Mat(rescored.size(), 1, CV_32S);
+    int* sort_idxs_ptr = (int*)ranking->sort_idxs.data;
+    for (size_t i = 0; i < rescored.size(); ++i) {
+      sort_idxs_ptr[i] = rescored[i].idx;
+    }
+    ranking->sorted_count = rescored.size();
+  }
+
+  void ScoringEngine::worker_(const size_t thread_idx) {
+    size_t last_generation = 0;
+
+    while (true) {
+      {
+        boost::mutex::scoped_lock lock(state_mutex_);
+        while (!stopping_ && (job_generation_ == last_generation)) {
+          job_cond_var_.wait(lock);
+        }
+        if (stopping_) return;
+        last_generation = job_generation_;
+      }
+
+      processPartition_(thread_idx);
+
+      {
+        boost::mutex::scoped_lock lock(state_mutex_);
+        ++threads_done_;
+      }
+      done_cond_var_.notify_one();
+    }
+  }
+
+  void ScoringEngine::processPartition_(const size_t thread_idx) {
+    const cv::Mat& feats = *job_feats_;
+    const size_t dset_sz = feats.rows;
+    const size_t dim = feats.cols;
+
+    // static partition of rows - each thread streams through a
+    // contiguous range of the feature matrix
+    const size_t start_row = (dset_sz*thread_idx) / thread_count_;
+    const size_t end_row = (dset_sz*(thread_idx + 1)) / thread_count_;
+
+    size_t block_rows = SCORING_BLOCK_BYTES / std::max(dim*feats.elemSize(), static_cast<size_t>(1));
+    block_rows = std::max(block_rows - (block_rows % 4), static_cast<size_t>(4));
+
+    std::vector<ScoredIdx>& top = thread_top_[thread_idx];
+    top.clear();
+    top.reserve(job_top_k_);
+
+    for (size_t block_start = start_row; block_start < end_row; block_start += block_rows) {
+      const size_t block_end = std::min(block_start + block_rows, end_row);
+
+      switch (feats.type()) {
+      case CV_32FC1: {
+        size_t i = block_start;
+        for (; i + 4 <= block_end; i += 4) {
+          scoreRows4_(feats.ptr<float>(i), feats.ptr<float>(i+1),
+                      feats.ptr<float>(i+2), feats.ptr<float>(i+3),
+                      job_model_, dim, job_scores_ + i);
+        }
+        for (; i < block_end; ++i) {
+          job_scores_[i] = scoreRow_(feats.ptr<float>(i), job_model_, dim);
+        }
+        break;
+      }
+      case CV_16UC1:
+        for (size_t i = block_start; i < block_end; ++i) {
+          job_scores_[i] = scoreRowF16_(feats.ptr<uint16_t>(i), job_model_, dim);
+        }
+        break;
+      case CV_8SC1:
+        for (size_t i = block_start; i < block_end; ++i) {
+          job_scores_[i] = job_scales_[i]*scoreRowI8_(feats.ptr<int8_t>(i), job_model_, dim);
+        }
+        break;
+      }
+
+      // fused top-K selection over the block (scores still in L1)
+      if (job_top_k_ > 0) {
+        for (size_t bi = block_start; bi < block_end; ++bi) {
+          pushTopK(&top, job_top_k_, job_scores_[bi], bi);
+        }
+      }
+    }
+  }
+
+}
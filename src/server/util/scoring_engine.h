@@ -0,0 +1,124 @@
+////////////////////////////////////////////////////////////////////////////
+//    File:        scoring_engine.h
+//    Author:      Ken Chatfield
+//    Description: Multi-threaded, SIMD-blocked linear model scoring with
+//                 fused top-K selection
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUVISOR_UTILS_SCORING_ENGINE_H_
+#define CPUVISOR_UTILS_SCORING_ENGINE_H_
+
+#include <vector>
+#include <algorithm>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <glog/logging.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "server/query_data.h"
+
+// target size of the block of features scored at once by each thread
+// (should fit comfortably in per-core L2 cache)
+#define SCORING_BLOCK_BYTES 262144
+
+namespace cpuvisor {
+
+  struct ScoredIdx {
+    float score;
+    int idx;
+  };
+
+  // descending score, ties broken by ascending index
+  inline bool isBetterScoredIdx(const ScoredIdx& a, const ScoredIdx& b) {
+    return (a.score > b.score) || ((a.score == b.score) && (a.idx < b.idx));
+  }
+
+  // pushes an item onto a min-heap of the top_k best items seen so far
+  // (the heap front is the worst retained item)
+  inline void pushTopK(std::vector<ScoredIdx>* heap, const size_t top_k,
+                       const float score, const int idx) {
+    ScoredIdx item;
+    item.score = score;
+    item.idx = idx;
+    if (heap->size() < top_k) {
+      heap->push_back(item);
+      std::push_heap(heap->begin(), heap->end(), isBetterScoredIdx);
+    } else if (isBetterScoredIdx(item, heap->front())) {
+      std::pop_heap(heap->begin(), heap->end(), isBetterScoredIdx);
+      heap->back() = item;
+      std::push_heap(heap->begin(), heap->end(), isBetterScoredIdx);
+    }
+  }
+
+  // computes the dot product of a single feature with a model
+  float scoreFeat(const float* feat, const float* model, const size_t dim);
+
+  class ScoringEngine : boost::noncopyable {
+  public:
+    // num_threads = 0 uses one thread per core
+    ScoringEngine(const size_t num_threads = 0);
+    virtual ~ScoringEngine();
+
+    // computes scores = dset_feats*model, and if top_idxs is specified
+    // also the indexes of the top_k highest scoring rows (in descending
+    // order of score) - the top-K selection is fused with scoring, so
+    // the scores are never re-read from memory
+    //
+    // dset_feats may be CV_32F, CV_16U (raw float16 values) or CV_8S
+    // (in which case the per-row scales must also be specified)
+    void score(const cv::Mat& dset_feats, const cv::Mat& model,
+               cv::Mat* scores,
+               std::vector<int>* top_idxs = 0, const size_t top_k = 0,
+               const cv::Mat& row_scales = cv::Mat());
+
+    // as rankUsingModel - the returned ranking has only its first top_k
+    // items sorted (or all items if top_k = 0)
+    void rank(const cv::Mat& dset_feats, const cv::Mat& model,
+              Ranking* ranking, const size_t top_k);
+
+    // as rank, for CV_32F features split across a number of segments
+    // (e.g. base features followed by delta segments) with rows numbered
+    // consecutively from the first segment
+    void rankSegments(const std::vector<cv::Mat>& segments, const cv::Mat& model,
+                      Ranking* ranking, const size_t top_k);
+
+    // ranks using compressed features, then rescores the top
+    // max(top_k, rescore_sz) items exactly using the float features (so
+    // only those rows of exact_feats are ever accessed) - the rescored
+    // items form the sorted part of the returned ranking
+    void rankCompressed(const cv::Mat& compressed_feats, const cv::Mat& row_scales,
+                        const cv::Mat& exact_feats, const cv::Mat& model,
+                        Ranking* ranking, const size_t top_k, const size_t rescore_sz);
+
+    inline size_t num_threads() const { return thread_count_; }
+
+  protected:
+    void worker_(const size_t thread_idx);
+    void processPartition_(const size_t thread_idx);
+
+    size_t thread_count_;
+    boost::thread_group threads_;
+
+    boost::mutex job_mutex_; // serializes calls to score()
+
+    boost::mutex state_mutex_;
+    boost::condition_variable job_cond_var_;
+    boost::condition_variable done_cond_var_;
+    size_t job_generation_;
+    size_t threads_done_;
+    bool stopping_;
+
+    // current job
+    const cv::Mat* job_feats_;
+    const float* job_scales_;
+    const float* job_model_;
+    float* job_scores_;
+    size_t job_top_k_;
+    std::vector<std::vector<ScoredIdx> > thread_top_;
+  };
+
+}
+
+#endif
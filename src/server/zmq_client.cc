@@ -3,12 +3,91 @@
 #include <iostream>
 #include <boost/algorithm/string/replace.hpp>
 
+#include "server/util/io.h"
+
 namespace cpuvisor {
 
   ZmqClient::ZmqClient(const cpuvisor::Config& config,
                        boost::shared_ptr<zmq::context_t> context)
     : config_(config) {
 
+    std::string server_endpoint = config_.server_config().server_endpoint();
+    boost::replace_all(server_endpoint, "localhost", "*");
+
+    connect_(server_endpoint, -1, context);
+
+  }
+
+  ZmqClient::ZmqClient(const std::string& server_endpoint, const int timeout_ms,
+                       boost::shared_ptr<zmq::context_t> context) {
+
+    connect_(server_endpoint, timeout_ms, context);
+
+  }
+
+  ZmqClient::~ZmqClient() {
+
+  }
+
+  void ZmqClient::addDsetImagesToIndex(const std::vector<std::string>& dset_paths) {
+
+    // prepare request object
+    RPCReq rpc_req;
+    rpc_req.set_request_string("add_dset_images_to_index");
+    for (size_t i = 0; i < dset_paths.size(); ++i) {
+      rpc_req.add_image_paths(dset_paths[i]);
+    }
+
+    RPCRep rpc_rep;
+    request_(rpc_req, &rpc_rep);
+
+  }
+
+  bool ZmqClient::applyStoredClassifiers() {
+
+    // prepare request object
+    RPCReq rpc_req;
+    rpc_req.set_request_string("apply_stored_classifiers");
+
+    RPCRep rpc_rep;
+    if (!request_(rpc_req, &rpc_rep)) return false;
+
+    if (!rpc_rep.success()) {
+      LOG(ERROR) << "Applying stored classifiers failed: " << rpc_rep.err_msg();
+      return false;
+    }
+
+    return true;
+
+  }
+
+  bool ZmqClient::rankUsingModel(const cv::Mat& model, const size_t top_k,
+                                 RankedList* ranking) {
+
+    // prepare request object
+    RPCReq rpc_req;
+    rpc_req.set_request_string("rank_using_model");
+    modelToProto(model, rpc_req.mutable_model());
+    rpc_req.set_top_k(top_k);
+
+    RPCRep rpc_rep;
+    if (!request_(rpc_req, &rpc_rep)) return false;
+
+    if (!rpc_rep.success()) {
+      LOG(ERROR) << "Ranking request failed: " << rpc_rep.err_msg();
+      return false;
+    }
+
+    ranking->Swap(rpc_rep.mutable_ranking());
+    return true;
+
+  }
+
+  // -----------------------------------------------------------------------------
+
+  void ZmqClient::connect_(const std::string& server_endpoint, const int timeout_ms,
+                           boost::shared_ptr<zmq::context_t> context) {
+
     // Prepare a ZMQ context if not supplied with one
     if (context) {
       DLOG(INFO) << "Setting context...";
@@ -21,8 +100,12 @@ namespace cpuvisor {
     // Prepare *REQ*-REP socket
     DLOG(INFO) << "Initializing REQ socket...";
     socket_ = boost::shared_ptr<zmq::socket_t>(new zmq::socket_t(*context_, ZMQ_REQ));
-    std::string server_endpoint = config_.server_config().server_endpoint();
-    boost::replace_all(server_endpoint, "localhost", "*");
+    if (timeout_ms >= 0) {
+      // don't block on close if a request timed out
+      const int linger = 0;
+      socket_->setsockopt(ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
+      socket_->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    }
 
     std::cout << "Connecting to server: " << server_endpoint << std::endl;
     socket_->connect(server_endpoint.c_str());
@@ -30,18 +113,7 @@ namespace cpuvisor {
 
   }
 
-  ZmqClient::~ZmqClient() {
-
-  }
-
-  void ZmqClient::addDsetImagesToIndex(const std::vector<std::string>& dset_paths) {
-
-    // prepare request object
-    RPCReq rpc_req;
-    rpc_req.set_request_string("add_dset_images_to_index");
-    for (size_t i = 0; i < dset_paths.size(); ++i) {
-      rpc_req.add_image_paths(dset_paths[i]);
-    }
+  bool ZmqClient::request_(const RPCReq& rpc_req, RPCRep* rpc_rep) {
 
     // serialize and send request
     std::string rpc_req_serialized;
@@ -55,10 +127,17 @@ namespace cpuvisor {
 
     // receive response
     zmq::message_t reply;
-    socket_->recv(&reply);
+    if (!socket_->recv(&reply)) {
+      LOG(ERROR) << "Timed out waiting for reply to request: " << rpc_req.request_string();
+      return false;
+    }
 
-    RPCRep rpc_rep;
-    rpc_rep.ParseFromArray(reply.data(), reply.size());
+    if (!rpc_rep->ParseFromArray(reply.data(), reply.size())) {
+      LOG(ERROR) << "Could not parse reply to request: " << rpc_req.request_string();
+      return false;
+    }
+
+    return true;
 
   }
 
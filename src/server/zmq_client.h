@@ -3,7 +3,8 @@
 //    Author:      Ken Chatfield
 //    Description: Lightweight client for CPU Visor using ZMQ
 //                 (not fully featured - used only for incremental
-//                  indexing for now)
+//                  indexing, applying stored classifiers and ranking of
+//                  dataset shards for now)
 ////////////////////////////////////////////////////////////////////////////
 
 #ifndef CPUVISOR_ZMQ_CLIENT_H_
@@ -16,6 +17,8 @@
 
 #include <zmq.hpp>
 
+#include <opencv2/opencv.hpp>
+
 #include "cpuvisor_config.pb.h"
 #include "cpuvisor_srv.pb.h"
 
@@ -25,11 +28,25 @@ namespace cpuvisor {
   public:
     ZmqClient(const cpuvisor::Config& config,
               boost::shared_ptr<zmq::context_t> context = boost::shared_ptr<zmq::context_t>());
+    // connect directly to server_endpoint - requests fail if no reply is
+    // received within timeout_ms (-1 = wait indefinitely)
+    ZmqClient(const std::string& server_endpoint, const int timeout_ms = -1,
+              boost::shared_ptr<zmq::context_t> context = boost::shared_ptr<zmq::context_t>());
     virtual ~ZmqClient();
 
     virtual void addDsetImagesToIndex(const std::vector<std::string>& dset_paths);
+    // applies all classifiers in the server's classifier store to the
+    // dataset (blocking until complete)
+    virtual bool applyStoredClassifiers();
+    // returns the top_k highest scoring dataset items under model
+    virtual bool rankUsingModel(const cv::Mat& model, const size_t top_k,
+                                RankedList* ranking);
 
   protected:
+    virtual void connect_(const std::string& server_endpoint, const int timeout_ms,
+                          boost::shared_ptr<zmq::context_t> context);
+    virtual bool request_(const RPCReq& rpc_req, RPCRep* rpc_rep);
+
     Config config_;
 
     boost::shared_ptr<zmq::context_t> context_;
@@ -1,6 +1,7 @@
 #include "zmq_server.h"
 
 #include <cmath>
+#include <limits>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
@@ -10,6 +11,12 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/algorithm/string/replace.hpp>
 
+#include "server/util/io.h"
+#include "server/util/feat_util.h"
+
+// in-process endpoint over which requests are distributed to workers
+#define WORKERS_ENDPOINT "inproc://workers"
+
 namespace cpuvisor {
 
   ZmqServer::ZmqServer(const cpuvisor::Config& config)
@@ -25,6 +32,7 @@ namespace cpuvisor {
   ZmqServer::~ZmqServer() {
     // interrupt serve thread to ensure termination before auto-detaching
     if (serve_thread_) serve_thread_->interrupt();
+    worker_threads_.interrupt_all();
     if (monitor_state_change_thread_) monitor_state_change_thread_->interrupt();
     if (monitor_add_trs_images_thread_) monitor_add_trs_images_thread_->interrupt();
     if (monitor_add_trs_complete_thread_) monitor_add_trs_complete_thread_->interrupt();
@@ -46,11 +54,15 @@ namespace cpuvisor {
     // Prepare our context
     zmq::context_t context(1);
 
-    // Prepare REQ-*REP* socket
-    zmq::socket_t socket(context, ZMQ_REP);
+    // Prepare REQ-*ROUTER* socket for clients
+    zmq::socket_t clients(context, ZMQ_ROUTER);
     std::string server_endpoint = config_.server_config().server_endpoint();
     boost::replace_all(server_endpoint, "localhost", "*");
-    socket.bind(server_endpoint.c_str());
+    clients.bind(server_endpoint.c_str());
+
+    // Prepare *DEALER*-REP socket to distribute requests between workers
+    zmq::socket_t workers(context, ZMQ_DEALER);
+    workers.bind(WORKERS_ENDPOINT);
 
     // Prepare *PUB*-SUB socket
     boost::shared_ptr<zmq::socket_t> notify_socket(new zmq::socket_t(context, ZMQ_PUB));
@@ -60,7 +72,24 @@ namespace cpuvisor {
 
     notify_socket_ = notify_socket; // store when ready for use in notify threads
 
-    std::cout << "ZMQ server started..." << std::endl;
+    // launch worker threads (requests are then handled concurrently, so
+    // long-running calls do not block other clients)
+    const size_t worker_count = std::max(config_.server_config().worker_threads(),
+                                         static_cast<uint32_t>(1));
+    for (size_t i = 0; i < worker_count; ++i) {
+      worker_threads_.add_thread(new boost::thread(&ZmqServer::worker_, this, &context));
+    }
+
+    std::cout << "ZMQ server started with " << worker_count << " worker threads..." << std::endl;
+
+    // forward requests to workers and replies back to clients
+    zmq::proxy(static_cast<void*>(clients), static_cast<void*>(workers), NULL);
+  }
+
+  void ZmqServer::worker_(zmq::context_t* context) {
+    // Prepare REQ-*REP* socket (connected via the DEALER socket)
+    zmq::socket_t socket(*context, ZMQ_REP);
+    socket.connect(WORKERS_ENDPOINT);
 
     while (true) {
       zmq::message_t request;
@@ -84,7 +113,17 @@ namespace cpuvisor {
                   << ", query_id: " << rpc_req.id() << ", tag: " << rpc_req.tag() << std::endl
                   << "**********************************\n";
 
-        rpc_rep = dispatch_(rpc_req);
+        try {
+          rpc_rep = dispatch_(rpc_req);
+        } catch (const std::exception& e) {
+          // (a failed request must never take down the worker)
+          rpc_rep = RPCRep();
+          rpc_rep.set_id(rpc_req.id());
+          rpc_rep.set_success(false);
+          rpc_rep.set_err_msg(std::string("Request failed: ") + e.what());
+
+          LOG(ERROR) << "Request failed: " << e.what();
+        }
 
       } else {
 
@@ -184,7 +223,7 @@ namespace cpuvisor {
 
         } else if (req_str == "get_ranking") {
 
-          Ranking ranking = base_server_->getRanking(id);
+          Ranking ranking = base_server_->getRanking(id, getRankingPageEnd_(rpc_req));
 
           getRankingPage_(ranking, rpc_req, &rpc_rep);
 
@@ -192,8 +231,8 @@ namespace cpuvisor {
 
           // blocking version of all three above functions which
           // returns ranking directly
-          Ranking ranking;
-          base_server_->trainAndRank(id, true, &ranking);
+          base_server_->trainAndRank(id, true);
+          Ranking ranking = base_server_->getRanking(id, getRankingPageEnd_(rpc_req));
 
           getRankingPage_(ranking, rpc_req, &rpc_rep);
 
@@ -257,6 +296,20 @@ namespace cpuvisor {
           const std::string filepath = rpc_req.filepath();
           base_server_->loadClassifier(id, filepath);
 
+        } else if (req_str == "add_classifier_to_store") {
+
+          base_server_->addClassifierToStore(id, rpc_req.classifier_name());
+
+        } else if (req_str == "apply_stored_classifiers") {
+
+          base_server_->applyStoredClassifiers();
+
+        } else if (req_str == "get_stored_classifier_ranking") {
+
+          Ranking ranking = base_server_->getStoredClassifierRanking(rpc_req.classifier_name());
+
+          getRankingPage_(ranking, rpc_req, &rpc_rep);
+
         } else if (req_str == "add_dset_images_to_index") {
 
           const int path_count = rpc_req.image_paths_size();
@@ -267,6 +320,28 @@ namespace cpuvisor {
 
           base_server_->addDsetImagesToIndex(paths);
 
+        } else if (req_str == "rank_using_model") {
+
+          // used by coordinator servers to rank a dataset shard - returns
+          // the top_k items as a single page
+          const ModelProto& model_proto = rpc_req.model();
+          if (static_cast<uint32_t>(model_proto.data_size()) != model_proto.dim()) {
+            throw InvalidRequestError("Model data is inconsistent with model dimensionality");
+          }
+          cv::Mat model;
+          modelFromProto(model_proto, &model);
+
+          const size_t top_k = rpc_req.top_k();
+          Ranking ranking;
+          base_server_->rankUsingModel(model, top_k, &ranking);
+          ensureRankingSorted(&ranking, top_k);
+
+          if (ranking.size() > 0) {
+            getRankingProto_(ranking, rpc_rep.mutable_ranking(), top_k, 1);
+          } else {
+            rpc_rep.mutable_ranking(); // empty shard
+          }
+
         } else if (req_str == "return_classifiers_scores_for_images") {
 
           const int path_count = rpc_req.image_paths_size();
@@ -312,6 +387,18 @@ namespace cpuvisor {
 
       LOG(ERROR) << "Request error occurred: " << sstrm.str();
 
+    } catch (const std::exception& e) {
+
+      // discard any partially filled reply
+      rpc_rep.Clear();
+      rpc_rep.set_id(id);
+      rpc_rep.set_success(false);
+      std::stringstream sstrm;
+      sstrm << "Request failed: " << e.what();
+      rpc_rep.set_err_msg(sstrm.str());
+
+      LOG(ERROR) << "Request error occurred: " << sstrm.str();
+
     }
 
     // std::string rpc_rep_str;
@@ -336,13 +423,21 @@ namespace cpuvisor {
 
   }
 
+  size_t ZmqServer::getRankingPageEnd_(const RPCReq& rpc_req) {
+    // number of sorted items required to return the requested page
+    size_t page_sz = config_.server_config().page_size();
+    size_t page_num = rpc_req.retrieve_page();
+
+    return (page_sz < 1) ? std::numeric_limits<size_t>::max() : page_sz*page_num;
+  }
+
   void ZmqServer::getRankingProto_(const Ranking& ranking,
                                    RankedList* ranking_proto,
                                    const size_t page_sz,
                                    const size_t page_num) {
 
-    uint32_t dset_sz = ranking.scores.rows;
-    CHECK_GE(dset_sz, ranking.scores.cols);
+    uint32_t dset_sz = ranking.size();
+    CHECK_GE(static_cast<uint32_t>(ranking.scores.rows), dset_sz);
     CHECK_EQ(ranking.scores.cols, 1);
 
     uint32_t page_count;
@@ -370,12 +465,11 @@ namespace cpuvisor {
 
     CHECK_EQ(ranking.sort_idxs.type(), CV_32S);
     CHECK_EQ(ranking.scores.type(), CV_32F);
-    uint32_t* sort_idxs_ptr = (uint32_t*)ranking.sort_idxs.data;
-    float* scores_ptr = (float*)ranking.scores.data;
+    CHECK_LE(end_idx, ranking.sorted_count);
 
-    for (size_t i = 0; i < 10; ++i) {
-      DLOG(INFO) << i+1 << ": " << base_server_->dset_path(sort_idxs_ptr[i])
-                 << " (" << scores_ptr[sort_idxs_ptr[i]] << ")";
+    for (size_t i = 0; i < std::min(static_cast<size_t>(10), ranking.sorted_count); ++i) {
+      DLOG(INFO) << i+1 << ": " << getRankedPath_(ranking, i)
+                 << " (" << ranking.rankedScore(i) << ")";
     }
 
     DLOG(INFO) << "Page start idx is: " << start_idx;
@@ -383,13 +477,20 @@ namespace cpuvisor {
 
     for (size_t i = start_idx; i < end_idx; ++i) {
       RankedItem* ritem_proto = ranking_proto->add_rlist();
-      uint32_t sort_idx = sort_idxs_ptr[i];
-      ritem_proto->set_path(base_server_->dset_path(sort_idx));
-      ritem_proto->set_score(scores_ptr[sort_idx]);
+      ritem_proto->set_path(getRankedPath_(ranking, i));
+      ritem_proto->set_score(ranking.rankedScore(i));
     }
 
   }
 
+  std::string ZmqServer::getRankedPath_(const Ranking& ranking, const size_t rank) {
+    // rankings merged from dataset shards carry their own paths
+    if (!ranking.paths.empty()) return ranking.paths[rank];
+
+    const uint32_t* sort_idxs_ptr = (const uint32_t*)ranking.sort_idxs.data;
+    return base_server_->dset_path(sort_idxs_ptr[rank]);
+  }
+
   void ZmqServer::getAnnotations_(const std::vector<std::string>& paths,
                                   const std::vector<int32_t>& annos,
                                   const RPCReq& rpc_req, RPCRep* rpc_rep) {
@@ -451,6 +552,7 @@ namespace cpuvisor {
         memcpy((void*)notify_msg.data(), notify_proto_serialized.c_str(),
                notify_proto_serialized.size());
 
+        boost::mutex::scoped_lock lock(notify_mutex_);
         notify_socket_->send(notify_msg);
       }
     }
@@ -480,6 +582,7 @@ namespace cpuvisor {
         memcpy((void*)notify_msg.data(), notify_proto_serialized.c_str(),
                notify_proto_serialized.size());
 
+        boost::mutex::scoped_lock lock(notify_mutex_);
         notify_socket_->send(notify_msg);
       }
     }
@@ -507,6 +610,7 @@ namespace cpuvisor {
         memcpy((void*)notify_msg.data(), notify_proto_serialized.c_str(),
                notify_proto_serialized.size());
 
+        boost::mutex::scoped_lock lock(notify_mutex_);
         notify_socket_->send(notify_msg);
       }
     }
@@ -536,6 +640,7 @@ namespace cpuvisor {
         memcpy((void*)notify_msg.data(), notify_proto_serialized.c_str(),
                notify_proto_serialized.size());
 
+        boost::mutex::scoped_lock lock(notify_mutex_);
         notify_socket_->send(notify_msg);
       }
     }
@@ -30,14 +30,17 @@ namespace cpuvisor {
 
   protected:
     virtual void serve_();
+    virtual void worker_(zmq::context_t* context);
     virtual RPCRep dispatch_(RPCReq rpc_req);
 
+    virtual size_t getRankingPageEnd_(const RPCReq& rpc_req);
     virtual void getRankingPage_(const Ranking& ranking,
                                  const RPCReq& rpc_req, RPCRep* rpc_rep);
     virtual void getRankingProto_(const Ranking& ranking,
                                   RankedList* ranking_proto,
                                   const size_t page_sz = -1,
                                   const size_t page_num = 0);
+    virtual std::string getRankedPath_(const Ranking& ranking, const size_t rank);
 
     virtual void getAnnotations_(const std::vector<std::string>& paths,
                                  const std::vector<int32_t>& annos,
@@ -51,6 +54,7 @@ namespace cpuvisor {
     Config config_;
 
     boost::shared_ptr<boost::thread> serve_thread_;
+    boost::thread_group worker_threads_;
     boost::shared_ptr<BaseServer> base_server_;
 
     boost::shared_ptr<boost::thread> monitor_state_change_thread_;
@@ -59,6 +63,7 @@ namespace cpuvisor {
     boost::shared_ptr<boost::thread> monitor_errors_thread_;
 
     boost::shared_ptr<zmq::socket_t> notify_socket_;
+    boost::mutex notify_mutex_; // notify_socket_ is shared by all monitor threads
   };
 
 }
@@ -42,3 +42,6 @@ void removeTempDir(const std::string& tempdir) {
 
 
 #include "test_sets/feats.inl"
+#include "test_sets/ranking.inl"
+#include "test_sets/paths.inl"
+#include "test_sets/images.inl"
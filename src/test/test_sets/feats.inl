@@ -8,6 +8,12 @@
 #include "directencode/caffe_encoder.h"
 #include "server/util/feat_util.h"
 #include "server/util/io.h"
+#include "server/util/feats_index.h"
+#include "server/util/feats_log.h"
+#include "server/util/path_index.h"
+#include "server/util/feat_cache.h"
+#include "server/util/preproc.h"
+#include "server/util/preproc_pipeline.h"
 
 #include "cpuvisor_config.pb.h"
 
@@ -185,3 +191,387 @@ TEST_CASE("feats/saveLoad",
   }
   REQUIRE(cv::countNonZero(feats != loaded_feats) == 0);
 }
+
+TEST_CASE("feats/saveLoadIndex",
+          "Test that feats written to and loaded from a feature index (both copied and mapped) are the same") {
+
+  cv::Mat feats(25, 128, CV_32F);
+  cv::randu(feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+  std::vector<std::string> paths(25);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::ostringstream path_strm;
+    path_strm << "dir " << i % 3 << "/path " << i << ".jpg";
+    paths[i] = path_strm.str();
+  }
+
+  std::string temp_dir = getCleanTempDir();
+  std::string temp_file = getTempFile(temp_dir);
+
+  {
+    // write in two parts to exercise streaming writes
+    cpuvisor::FeatsIndexWriter writer(temp_file, feats.cols);
+    writer.append(feats.rowRange(0, 10),
+                  std::vector<std::string>(paths.begin(), paths.begin() + 10));
+    writer.append(feats.rowRange(10, feats.rows),
+                  std::vector<std::string>(paths.begin() + 10, paths.end()));
+    writer.close();
+  }
+
+  REQUIRE(cpuvisor::isFeatsIndexFile(temp_file) == true);
+
+  cv::Mat loaded_feats;
+  std::vector<std::string> loaded_paths;
+  REQUIRE(cpuvisor::readFeatsFromFile(temp_file, &loaded_feats, &loaded_paths) == true);
+
+  cv::Mat mapped_feats;
+  std::vector<std::string> mapped_paths;
+  boost::shared_ptr<cpuvisor::FeatsIndexMapping> mapping;
+  REQUIRE(cpuvisor::readFeatsFromFile(temp_file, &mapped_feats, &mapped_paths, &mapping) == true);
+  REQUIRE(mapping);
+  REQUIRE(((size_t)mapped_feats.data % FEATS_INDEX_ALIGNMENT) == 0);
+
+  REQUIRE(paths.size() == loaded_paths.size());
+  REQUIRE(paths.size() == mapped_paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    REQUIRE(paths[i] == loaded_paths[i]);
+    REQUIRE(paths[i] == mapped_paths[i]);
+    REQUIRE(paths[i] == mapping->path(i));
+  }
+  REQUIRE(cv::countNonZero(feats != loaded_feats) == 0);
+  REQUIRE(cv::countNonZero(feats != mapped_feats) == 0);
+
+  mapping.reset();
+  removeTempDir(temp_dir);
+}
+
+TEST_CASE("feats/saveLoadChunks",
+          "Test that feats written to chunks and loaded in parallel from a chunk index are the same") {
+
+  cv::Mat feats(25, 128, CV_32F);
+  cv::randu(feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+  std::vector<std::string> paths(25);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::ostringstream path_strm;
+    path_strm << "path " << i;
+    paths[i] = path_strm.str();
+  }
+
+  std::string temp_dir = getCleanTempDir();
+
+  // write uneven chunks
+  const size_t chunk_bounds[] = {0, 10, 20, 25};
+  std::vector<std::string> chunk_files;
+  std::vector<size_t> chunk_nums;
+  for (size_t ci = 0; ci < 3; ++ci) {
+    std::string chunk_file = getTempFile(temp_dir);
+    cpuvisor::writeFeatsToProto(feats.rowRange(chunk_bounds[ci], chunk_bounds[ci+1]).clone(),
+                                std::vector<std::string>(paths.begin() + chunk_bounds[ci],
+                                                         paths.begin() + chunk_bounds[ci+1]),
+                                chunk_file);
+    chunk_files.push_back(boost::filesystem::path(chunk_file).filename().string());
+    chunk_nums.push_back(chunk_bounds[ci+1] - chunk_bounds[ci]);
+  }
+
+  // write index both with and without chunk sizes
+  std::string index_file = getTempFile(temp_dir);
+  std::string index_file_nosz = getTempFile(temp_dir);
+  cpuvisor::writeChunkIndexToProto(chunk_files, feats.rows, feats.cols, index_file, chunk_nums);
+  cpuvisor::writeChunkIndexToProto(chunk_files, feats.rows, feats.cols, index_file_nosz);
+
+  cv::Mat loaded_feats, loaded_feats_nosz;
+  std::vector<std::string> loaded_paths, loaded_paths_nosz;
+  REQUIRE(cpuvisor::readFeatsFromProto(index_file, &loaded_feats, &loaded_paths, 2) == true);
+  REQUIRE(cpuvisor::readFeatsFromProto(index_file_nosz, &loaded_feats_nosz, &loaded_paths_nosz) == true);
+
+  // features can be read without paths, and paths on their own
+  cv::Mat loaded_feats_nopaths;
+  REQUIRE(cpuvisor::readFeatsFromProto(index_file, &loaded_feats_nopaths, 0) == true);
+  std::vector<char> path_data;
+  std::vector<uint64_t> path_offsets;
+  REQUIRE(cpuvisor::readPathsFromProto(index_file, &path_data, &path_offsets) == true);
+
+  removeTempDir(temp_dir);
+
+  REQUIRE(paths == loaded_paths);
+  REQUIRE(paths == loaded_paths_nosz);
+  REQUIRE(cv::countNonZero(feats != loaded_feats) == 0);
+  REQUIRE(cv::countNonZero(feats != loaded_feats_nosz) == 0);
+  REQUIRE(cv::countNonZero(feats != loaded_feats_nopaths) == 0);
+
+  REQUIRE(path_offsets.size() == paths.size() + 1);
+  cpuvisor::PathIndex path_index(&path_data, &path_offsets);
+  REQUIRE(path_index.size() == paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    size_t idx;
+    REQUIRE(path_index.path(i) == paths[i]);
+    REQUIRE(path_index.find(paths[i], &idx));
+    REQUIRE(idx == i);
+  }
+}
+
+TEST_CASE("feats/saveLoadCompressedIndex",
+          "Test that feats written to float16 and int8 feature indexes are recovered approximately") {
+
+  cv::Mat feats(25, 128, CV_32F);
+  cv::randu(feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+  for (int i = 0; i < feats.rows; ++i) {
+    cv::normalize(feats.row(i), feats.row(i));
+  }
+  std::vector<std::string> paths(25);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::ostringstream path_strm;
+    path_strm << "path " << i;
+    paths[i] = path_strm.str();
+  }
+
+  std::string temp_dir = getCleanTempDir();
+  std::string fp16_file = getTempFile(temp_dir);
+  std::string int8_file = getTempFile(temp_dir);
+
+  cpuvisor::writeFeatsToIndex(feats, paths, fp16_file, cpuvisor::FIDX_FLOAT16);
+  cpuvisor::writeFeatsToIndex(feats, paths, int8_file, cpuvisor::FIDX_INT8);
+
+  // compressed indexes cannot be read as float features
+  cv::Mat loaded_feats;
+  std::vector<std::string> loaded_paths;
+  REQUIRE(cpuvisor::readFeatsFromFile(fp16_file, &loaded_feats, &loaded_paths) == false);
+
+  cpuvisor::FeatsIndexMapping fp16_mapping, int8_mapping;
+  REQUIRE(fp16_mapping.open(fp16_file) == true);
+  REQUIRE(int8_mapping.open(int8_file) == true);
+  REQUIRE(fp16_mapping.dtype() == cpuvisor::FIDX_FLOAT16);
+  REQUIRE(int8_mapping.dtype() == cpuvisor::FIDX_INT8);
+
+  cv::Mat fp16_feats = fp16_mapping.feats();
+  cv::Mat int8_feats = int8_mapping.feats();
+  cv::Mat int8_scales = int8_mapping.scales();
+  REQUIRE(fp16_feats.type() == CV_16UC1);
+  REQUIRE(int8_feats.type() == CV_8SC1);
+  REQUIRE(int8_scales.rows == feats.rows);
+
+  for (int i = 0; i < feats.rows; ++i) {
+    REQUIRE(fp16_mapping.path(i) == paths[i]);
+    REQUIRE(int8_mapping.path(i) == paths[i]);
+    const float scale = int8_scales.at<float>(i);
+    for (int j = 0; j < feats.cols; ++j) {
+      const float val = feats.at<float>(i, j);
+      REQUIRE(std::abs(cpuvisor::halfToFloat(fp16_feats.at<uint16_t>(i, j)) - val) < 1e-3);
+      REQUIRE(std::abs(int8_feats.at<int8_t>(i, j)*scale - val) <= 0.51*scale);
+    }
+  }
+
+  fp16_mapping.close();
+  int8_mapping.close();
+  removeTempDir(temp_dir);
+}
+
+TEST_CASE("feats/featsLogReplay",
+          "Test that rows appended to a feature log are replayed, discarding a truncated final record") {
+
+  cv::Mat feats(20, 64, CV_32F);
+  cv::randu(feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+
+  std::string temp_dir = getCleanTempDir();
+  std::string log_file = getTempFile(temp_dir);
+
+  // rows appended out of order, with row 3 skipped
+  {
+    cpuvisor::FeatsLog log;
+    REQUIRE(log.open(log_file, feats.cols) == 0);
+    for (int i = feats.rows - 1; i >= 10; --i) {
+      if (i == 13) {
+        log.appendSkipped(i);
+      } else {
+        log.append(i, feats.row(i));
+      }
+    }
+  }
+
+  // simulate a crash part-way through writing the final record (row 10)
+  const size_t log_sz = boost::filesystem::file_size(log_file);
+  boost::filesystem::resize_file(log_file, log_sz - 7);
+
+  cv::Mat loaded_feats = cv::Mat::zeros(feats.rows, feats.cols, CV_32F);
+  std::vector<bool> done(feats.rows, false);
+  std::vector<size_t> skipped_idxs;
+  {
+    cpuvisor::FeatsLog log;
+    REQUIRE(log.open(log_file, feats.cols, &loaded_feats, &done, &skipped_idxs) == 9);
+    // appending after replay should continue from the last complete record
+    log.append(10, feats.row(10));
+  }
+  REQUIRE(skipped_idxs.size() == 1);
+  REQUIRE(skipped_idxs[0] == 13);
+  for (int i = 0; i < feats.rows; ++i) {
+    REQUIRE(done[i] == ((i > 10) ? true : false));
+    if ((i > 10) && (i != 13)) {
+      REQUIRE(cv::countNonZero(feats.row(i) != loaded_feats.row(i)) == 0);
+    } else {
+      REQUIRE(cv::countNonZero(loaded_feats.row(i)) == 0);
+    }
+  }
+
+  std::fill(done.begin(), done.end(), false);
+  {
+    cpuvisor::FeatsLog log;
+    REQUIRE(log.open(log_file, feats.cols, &loaded_feats, &done) == 10);
+  }
+  REQUIRE(cv::countNonZero(feats.row(10) != loaded_feats.row(10)) == 0);
+
+  // a log of a different dimension should be discarded
+  {
+    cpuvisor::FeatsLog log;
+    REQUIRE(log.open(log_file, 32) == 0);
+  }
+  REQUIRE(boost::filesystem::file_size(log_file) == sizeof(cpuvisor::FeatsLogHeader));
+
+  removeTempDir(temp_dir);
+}
+
+TEST_CASE("feats/featCache",
+          "Test LRU eviction, lookup by url and image hash, and persisting of the feature cache") {
+
+  cv::Mat feats(10, 16, CV_32F);
+  cv::randu(feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+  std::vector<std::string> urls, hashes, imfiles;
+  for (int i = 0; i < feats.rows; ++i) {
+    const std::string i_str = boost::lexical_cast<std::string>(i);
+    urls.push_back("http://host/" + i_str + ".jpg");
+    hashes.push_back("hash" + i_str);
+    imfiles.push_back("images/" + i_str + ".jpg");
+  }
+  // (header + one record for the strings above)
+  const size_t header_sz = 4*sizeof(uint32_t) + 6;
+  const size_t record_sz = 4*sizeof(uint32_t) + 17 + 5 + 12 + 16*sizeof(float);
+
+  std::string temp_dir = getCleanTempDir();
+  std::string cache_file = getTempFile(temp_dir);
+
+  cv::Mat feat;
+  std::string imfile;
+  {
+    cpuvisor::FeatCache cache(3, feats.cols, cache_file, "modelA");
+    for (size_t i = 0; i < 4; ++i) {
+      cache.insert(urls[i], hashes[i], imfiles[i], feats.row(i));
+    }
+    REQUIRE(cache.size() == 3);
+    REQUIRE(!cache.getByUrl(urls[0], &feat));
+
+    // using an entry should protect it from eviction
+    REQUIRE(cache.getByUrl(urls[1], &feat, &imfile));
+    REQUIRE(cv::countNonZero(feat != feats.row(1)) == 0);
+    REQUIRE(imfile == imfiles[1]);
+    cache.insert(urls[4], hashes[4], imfiles[4], feats.row(4));
+    REQUIRE(!cache.getByHash(hashes[2], &feat));
+    REQUIRE(cache.getByHash(hashes[3], &feat));
+    REQUIRE(cv::countNonZero(feat != feats.row(3)) == 0);
+
+    // the same image data downloaded from a different url
+    cache.insert(urls[5], hashes[1], imfiles[5], feats.row(5));
+    REQUIRE(cache.getByHash(hashes[1], &feat));
+    REQUIRE(cv::countNonZero(feat != feats.row(5)) == 0);
+
+    // the file should be compacted on the 7th record (> 2*max_entries)
+    cache.insert(urls[6], hashes[6], imfiles[6], feats.row(6));
+    cache.insert(urls[7], hashes[7], imfiles[7], feats.row(7));
+    REQUIRE(boost::filesystem::file_size(cache_file) == header_sz + 4*record_sz);
+  }
+
+  // entries should be replayed in order of use
+  {
+    cpuvisor::FeatCache cache(3, feats.cols, cache_file, "modelA");
+    REQUIRE(cache.size() == 3);
+    REQUIRE(boost::filesystem::file_size(cache_file) == header_sz + 3*record_sz);
+    for (size_t i = 5; i < 8; ++i) {
+      REQUIRE(cache.getByUrl(urls[i], &feat, &imfile));
+      REQUIRE(cv::countNonZero(feat != feats.row(i)) == 0);
+      REQUIRE(imfile == imfiles[i]);
+    }
+    cache.insert(urls[8], hashes[8], imfiles[8], feats.row(8));
+    REQUIRE(!cache.getByUrl(urls[5], &feat));
+  }
+
+  // a file written using a different model should be discarded
+  {
+    cpuvisor::FeatCache cache(3, feats.cols, cache_file, "modelB");
+    REQUIRE(cache.size() == 0);
+  }
+  {
+    cpuvisor::FeatCache cache(3, feats.cols, cache_file, "modelA");
+    REQUIRE(cache.size() == 0);
+    cache.insert(urls[9], hashes[9], imfiles[9], feats.row(9));
+  }
+  {
+    cpuvisor::FeatCache cache(3, 32, cache_file, "modelA");
+    REQUIRE(cache.size() == 0);
+  }
+
+  // as should a file without a header
+  {
+    std::ofstream stream(cache_file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    stream << "not a feature cache";
+  }
+  {
+    cpuvisor::FeatCache cache(3, feats.cols, cache_file, "modelA");
+    REQUIRE(cache.size() == 0);
+  }
+  REQUIRE(boost::filesystem::file_size(cache_file) == header_sz);
+
+  removeTempDir(temp_dir);
+}
+
+TEST_CASE("feats/preprocPipelineSkipped",
+          "Test that images which cannot be processed are left out of the chunks written by the pipeline") {
+  featpipe::CaffeEncoder encoder = setupCaffe();
+
+  std::string temp_dir = getCleanTempDir();
+  std::string feats_file = temp_dir + "/feats.binaryproto";
+
+  // valid images, interleaved with an unreadable one and a missing one
+  std::vector<std::string> paths;
+  std::vector<std::string> valid_paths;
+  for (size_t i = 0; i < 5; ++i) {
+    const std::string path = "im" + boost::lexical_cast<std::string>(i) + ".jpg";
+    boost::filesystem::copy_file(TEST_FILE, temp_dir + "/" + path);
+    paths.push_back(path);
+    valid_paths.push_back(path);
+    if (i == 0) paths.push_back("bad.jpg");
+    if (i == 2) paths.push_back("missing.jpg");
+  }
+  {
+    std::ofstream bad_file((temp_dir + "/bad.jpg").c_str());
+    bad_file << "not an image";
+  }
+
+  cpuvisor::PreprocPipelineParams params;
+  params.read_threads = 2;
+  params.decode_threads = 2;
+  params.batch_sz = 2;
+  params.chunk_sz = 3;
+
+  // the second run should reuse the chunks written by the first
+  for (size_t run = 0; run < 2; ++run) {
+    cpuvisor::PreprocPipeline pipeline(encoder, params);
+    pipeline.run(paths, temp_dir, feats_file);
+
+    cv::Mat feats;
+    std::vector<std::string> loaded_paths;
+    REQUIRE(cpuvisor::readFeatsFromProto(feats_file, &feats, &loaded_paths) == true);
+    REQUIRE(loaded_paths == valid_paths);
+    REQUIRE(feats.rows == 5);
+    REQUIRE(feats.cols == encoder.get_code_size());
+    for (int i = 0; i < feats.rows; ++i) {
+      REQUIRE(cv::norm(feats.row(i)) == Approx(1.0));
+      // (the same image, though possibly encoded in a different batch)
+      REQUIRE(cv::norm(feats.row(i), feats.row(0)) < 1e-4);
+    }
+
+    std::vector<std::string> skipped_paths;
+    cpuvisor::readPathsFromTextFile(feats_file + ".skipped", &skipped_paths);
+    REQUIRE(skipped_paths.size() == 2);
+    REQUIRE(skipped_paths[0] == "bad.jpg");
+    REQUIRE(skipped_paths[1] == "missing.jpg");
+  }
+
+  removeTempDir(temp_dir);
+}
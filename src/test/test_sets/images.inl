@@ -0,0 +1,67 @@
+#include <string>
+
+#include "server/util/image_util.h"
+#include "server/util/host_limiter.h"
+
+TEST_CASE("images/jpegSize",
+          "Test reading image dimensions from JPEG headers") {
+
+  // SOI, APP0 segment, then SOF0 for a 640x480 image
+  const unsigned char jpeg[] = {
+    0xFF, 0xD8,
+    0xFF, 0xE0, 0x00, 0x06, 'J', 'F', 'I', 'F',
+    0xFF, 0xFF, // fill byte
+    0xFF, 0xC0, 0x00, 0x11, 0x08, 0x01, 0xE0, 0x02, 0x80, 0x03,
+    0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01
+  };
+
+  int width = 0, height = 0;
+  REQUIRE(cpuvisor::getJpegSize(jpeg, sizeof(jpeg), &width, &height));
+  REQUIRE(width == 640);
+  REQUIRE(height == 480);
+
+  // truncated before the frame header
+  REQUIRE(!cpuvisor::getJpegSize(jpeg, 12, &width, &height));
+
+  // not a JPEG image
+  const unsigned char png[] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+  REQUIRE(!cpuvisor::getJpegSize(png, sizeof(png), &width, &height));
+
+  REQUIRE(cpuvisor::decodeImage(std::string()).empty());
+}
+
+TEST_CASE("images/hostLimiter",
+          "Test limiting the number of downloads in flight to each host") {
+
+  cpuvisor::HostLimiter<int> limiter(2);
+
+  // slots are acquired up to the limit, after which downloads are deferred
+  REQUIRE(limiter.acquireOrDefer("a.com", 1));
+  REQUIRE(limiter.acquireOrDefer("a.com", 2));
+  REQUIRE(!limiter.acquireOrDefer("a.com", 3));
+  REQUIRE(!limiter.acquireOrDefer("a.com", 4));
+  // other hosts are limited separately
+  REQUIRE(limiter.acquireOrDefer("b.com", 5));
+  REQUIRE(limiter.hostCount() == 2);
+
+  // released slots are handed over to pending downloads in order
+  int next = 0;
+  REQUIRE(limiter.release("a.com", &next));
+  REQUIRE(next == 3);
+  REQUIRE(limiter.release("a.com", &next));
+  REQUIRE(next == 4);
+
+  // a host is forgotten once its last slot is released
+  REQUIRE(!limiter.release("b.com", &next));
+  REQUIRE(limiter.hostCount() == 1);
+  REQUIRE(!limiter.release("a.com", &next));
+  REQUIRE(limiter.hostCount() == 1);
+  REQUIRE(!limiter.release("a.com", &next));
+  REQUIRE(limiter.hostCount() == 0);
+
+  // with no limit, downloads are never deferred
+  cpuvisor::HostLimiter<int> unlimited;
+  for (int i = 0; i < 100; ++i) {
+    REQUIRE(unlimited.acquireOrDefer("a.com", i));
+  }
+}
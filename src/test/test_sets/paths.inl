@@ -0,0 +1,93 @@
+#include <vector>
+#include <string>
+
+#include "server/util/path_index.h"
+#include "server/util/feats_index.h"
+
+TEST_CASE("paths/pathIndex",
+          "Test lookup of dataset paths, including after appending") {
+
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < 5000; ++i) {
+    paths.push_back("images/" + boost::lexical_cast<std::string>(i) + ".jpg");
+  }
+
+  cpuvisor::PathIndex path_index(paths);
+  REQUIRE(path_index.size() == 5000);
+
+  size_t idx;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    REQUIRE(path_index.find(paths[i], &idx));
+    REQUIRE(idx == i);
+    REQUIRE(path_index.path(i) == paths[i]);
+  }
+  REQUIRE(!path_index.find("images/5000.jpg", &idx));
+  REQUIRE(!path_index.find("images/1.jp", &idx));
+  REQUIRE(!path_index.find("", &idx));
+
+  // appending should grow the table without disturbing existing entries
+  std::vector<std::string> new_paths;
+  for (size_t i = 5000; i < 7000; ++i) {
+    new_paths.push_back("images/" + boost::lexical_cast<std::string>(i) + ".jpg");
+  }
+  path_index.append(new_paths);
+  REQUIRE(path_index.size() == 7000);
+
+  for (size_t i = 0; i < 7000; ++i) {
+    REQUIRE(path_index.find("images/" + boost::lexical_cast<std::string>(i) + ".jpg", &idx));
+    REQUIRE(idx == i);
+  }
+
+  // an empty index should find nothing
+  cpuvisor::PathIndex empty_index;
+  REQUIRE(empty_index.size() == 0);
+  REQUIRE(!empty_index.find("images/0.jpg", &idx));
+}
+
+TEST_CASE("paths/pathIndexMapped",
+          "Test lookup of dataset paths read from a mapped feature index") {
+
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < 3000; ++i) {
+    paths.push_back("images/" + boost::lexical_cast<std::string>(i) + ".jpg");
+  }
+  cv::Mat feats = cv::Mat::zeros(paths.size(), 4, CV_32FC1);
+
+  std::string temp_dir = getCleanTempDir();
+  std::string temp_file = getTempFile(temp_dir);
+  cpuvisor::writeFeatsToIndex(feats, paths, temp_file);
+
+  {
+    boost::shared_ptr<cpuvisor::FeatsIndexMapping> mapping(new cpuvisor::FeatsIndexMapping());
+    REQUIRE(mapping->open(temp_file));
+
+    cpuvisor::PathIndex path_index(mapping);
+    mapping.reset(); // index keeps the mapping alive
+    REQUIRE(path_index.size() == 3000);
+
+    size_t idx;
+    for (size_t i = 0; i < paths.size(); ++i) {
+      REQUIRE(path_index.find(paths[i], &idx));
+      REQUIRE(idx == i);
+      REQUIRE(path_index.path(i) == paths[i]);
+    }
+    REQUIRE(!path_index.find("images/3000.jpg", &idx));
+
+    // appended paths follow on from the mapped paths
+    std::vector<std::string> new_paths;
+    new_paths.push_back("images/3000.jpg");
+    new_paths.push_back("images/0.jpg"); // duplicate of a mapped path
+    path_index.append(new_paths);
+    REQUIRE(path_index.size() == 3002);
+
+    REQUIRE(path_index.find("images/3000.jpg", &idx));
+    REQUIRE(idx == 3000);
+    REQUIRE(path_index.path(3000) == "images/3000.jpg");
+    REQUIRE(path_index.find("images/0.jpg", &idx));
+    REQUIRE(idx == 0);
+    REQUIRE(path_index.find("images/2999.jpg", &idx));
+    REQUIRE(idx == 2999);
+  }
+
+  removeTempDir(temp_dir);
+}
@@ -0,0 +1,513 @@
+#include <vector>
+#include <algorithm>
+
+#include "server/util/feat_util.h"
+#include "server/util/scoring_engine.h"
+#include "server/util/ivfpq_index.h"
+#include "server/util/delta_segments.h"
+#include "server/util/classifier_cache.h"
+#include "server/util/classifier_store.h"
+#include "server/util/ranking_cache.h"
+#include "server/util/io.h"
+#include "classification/svm/liblinear.h"
+#include "classification/svm/dense_linear_svm.h"
+
+TEST_CASE("ranking/partialSortConsistency",
+          "Test that lazily extended partial rankings match a full ranking") {
+
+  cv::Mat dset_feats(1000, 64, CV_32F);
+  cv::randu(dset_feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+  // duplicate some rows to ensure ties are ordered consistently
+  dset_feats.row(10).copyTo(dset_feats.row(500));
+  dset_feats.row(20).copyTo(dset_feats.row(30));
+
+  cv::Mat model(64, 1, CV_32F);
+  cv::randu(model, cv::Scalar(-1.0), cv::Scalar(1.0));
+
+  cpuvisor::Ranking full_ranking;
+  cpuvisor::rankUsingModel(model, dset_feats, &full_ranking, 0);
+  REQUIRE(full_ranking.sorted_count == 1000);
+
+  cpuvisor::Ranking ranking;
+  cpuvisor::rankUsingModel(model, dset_feats, &ranking, 100);
+  REQUIRE(ranking.sorted_count == 100);
+  REQUIRE(ranking.sort_idxs.rows == 1000);
+
+  const int* full_idxs = (const int*)full_ranking.sort_idxs.data;
+  const int* idxs = (const int*)ranking.sort_idxs.data;
+  const float* scores = (const float*)ranking.scores.data;
+
+  for (size_t i = 0; i < 100; ++i) {
+    REQUIRE(idxs[i] == full_idxs[i]);
+  }
+
+  // extend in uneven increments and past the end of the dataset
+  const size_t increments[] = {250, 251, 999, 5000};
+  for (size_t inc = 0; inc < 4; ++inc) {
+    cpuvisor::ensureRankingSorted(&ranking, increments[inc]);
+    REQUIRE(ranking.sorted_count == std::min(increments[inc], static_cast<size_t>(1000)));
+    for (size_t i = 0; i < ranking.sorted_count; ++i) {
+      REQUIRE(idxs[i] == full_idxs[i]);
+    }
+  }
+
+  for (size_t i = 1; i < 1000; ++i) {
+    REQUIRE(scores[idxs[i-1]] >= scores[idxs[i]]);
+  }
+
+  // sort indexes should remain a permutation of the dataset
+  std::vector<int> sorted_idxs(idxs, idxs + 1000);
+  std::sort(sorted_idxs.begin(), sorted_idxs.end());
+  for (size_t i = 0; i < 1000; ++i) {
+    REQUIRE(sorted_idxs[i] == static_cast<int>(i));
+  }
+}
+
+TEST_CASE("ranking/scoringEngine",
+          "Test that the multi-threaded scoring engine matches rankUsingModel") {
+
+  // odd dimensionality to exercise SIMD tails
+  cv::Mat dset_feats(1003, 131, CV_32F);
+  cv::randu(dset_feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+  dset_feats.row(10).copyTo(dset_feats.row(500));
+
+  cv::Mat model(131, 1, CV_32F);
+  cv::randu(model, cv::Scalar(-1.0), cv::Scalar(1.0));
+
+  cpuvisor::Ranking ref_ranking;
+  cpuvisor::rankUsingModel(model, dset_feats, &ref_ranking, 0);
+  const int* ref_idxs = (const int*)ref_ranking.sort_idxs.data;
+
+  cpuvisor::ScoringEngine engine(3);
+
+  cpuvisor::Ranking ranking;
+  engine.rank(dset_feats, model, &ranking, 50);
+  REQUIRE(ranking.sorted_count == 50);
+  REQUIRE(ranking.scores.rows == 1003);
+
+  const float* ref_scores = (const float*)ref_ranking.scores.data;
+  const float* scores = (const float*)ranking.scores.data;
+  for (size_t i = 0; i < 1003; ++i) {
+    REQUIRE(scores[i] == Approx(ref_scores[i]).epsilon(1e-4));
+  }
+  const int* idxs = (const int*)ranking.sort_idxs.data;
+  for (size_t i = 0; i < 50; ++i) {
+    REQUIRE(scores[idxs[i]] == Approx(ref_scores[ref_idxs[i]]).epsilon(1e-4));
+  }
+
+  // prefix-only rankings should extend to a full ranking
+  cpuvisor::ensureRankingSorted(&ranking, 1003);
+  REQUIRE(ranking.sort_idxs.rows == 1003);
+  idxs = (const int*)ranking.sort_idxs.data;
+  for (size_t i = 1; i < 1003; ++i) {
+    REQUIRE(scores[idxs[i-1]] >= scores[idxs[i]]);
+  }
+}
+
+TEST_CASE("ranking/ivfpqIndex",
+          "Test that approximate IVF-PQ rankings recover the exact top ranked items") {
+
+  // clustered features, so the coarse quantizer is meaningful
+  cv::Mat centers(16, 32, CV_32F);
+  cv::randu(centers, cv::Scalar(-1.0), cv::Scalar(1.0));
+  cv::Mat dset_feats(2000, 32, CV_32F);
+  cv::randn(dset_feats, cv::Scalar(0.0), cv::Scalar(0.2));
+  for (int i = 0; i < dset_feats.rows; ++i) {
+    dset_feats.row(i) += centers.row(i % centers.rows);
+  }
+
+  cv::Mat model(32, 1, CV_32F);
+  cv::randu(model, cv::Scalar(-1.0), cv::Scalar(1.0));
+
+  std::string temp_dir = getCleanTempDir();
+  std::string temp_file = getTempFile(temp_dir);
+
+  cpuvisor::IvfPqBuildParams params;
+  params.nlist = 16;
+  params.m = 8;
+  params.train_sz = 2000;
+  params.kmeans_iters = 10;
+  cpuvisor::buildIvfPqIndex(dset_feats, temp_file, params);
+
+  cpuvisor::IvfPqIndex index;
+  REQUIRE(index.open(temp_file) == true);
+  REQUIRE(index.num() == 2000);
+  REQUIRE(index.dim() == 32);
+
+  cpuvisor::Ranking ref_ranking;
+  cpuvisor::rankUsingModel(model, dset_feats, &ref_ranking, 10);
+  const int* ref_idxs = (const int*)ref_ranking.sort_idxs.data;
+  const float* ref_scores = (const float*)ref_ranking.scores.data;
+
+  // scanning all lists with exact rescoring of many candidates should
+  // recover the exact top ranked items
+  cpuvisor::Ranking ranking;
+  index.rank(model, dset_feats, &ranking, 10, 16, 200);
+  REQUIRE(ranking.truncated == true);
+  REQUIRE(ranking.size() == 200);
+  for (size_t i = 0; i < 10; ++i) {
+    REQUIRE(ranking.rankedScore(i) == Approx(ref_scores[ref_idxs[i]]).epsilon(1e-4));
+  }
+  for (size_t i = 1; i < ranking.size(); ++i) {
+    REQUIRE(ranking.rankedScore(i-1) >= ranking.rankedScore(i));
+  }
+
+  // truncated rankings cannot be extended
+  cpuvisor::ensureRankingSorted(&ranking, 1000);
+  REQUIRE(ranking.size() == 200);
+
+  // probing fewer lists should return no more than the scanned items
+  std::vector<cpuvisor::ScoredIdx> results;
+  index.search(model, 2000, 1, &results);
+  REQUIRE(results.size() > 0);
+  REQUIRE(results.size() < 2000);
+
+  index.close();
+  removeTempDir(temp_dir);
+}
+
+TEST_CASE("ranking/deltaSegments",
+          "Test that features appended as delta segments rank as if appended to the base features") {
+
+  cv::Mat all_feats(1000, 64, CV_32F);
+  cv::randu(all_feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+  std::vector<std::string> all_paths(all_feats.rows);
+  for (size_t i = 0; i < all_paths.size(); ++i) {
+    all_paths[i] = "images/" + boost::lexical_cast<std::string>(i) + ".jpg";
+  }
+  cv::Mat model(64, 1, CV_32F);
+  cv::randu(model, cv::Scalar(-1.0), cv::Scalar(1.0));
+
+  std::string temp_dir = getCleanTempDir();
+  std::string base_file = temp_dir + "/dsetfeats.binaryproto";
+
+  const cv::Mat base_feats = all_feats.rowRange(0, 700);
+  boost::shared_mutex update_mutex;
+  const std::vector<std::string> base_paths(all_paths.begin(), all_paths.begin() + 700);
+
+  cpuvisor::ScoringEngine engine(2);
+  cpuvisor::Ranking ref_ranking;
+  engine.rank(all_feats, model, &ref_ranking, 50);
+  const int* ref_idxs = (const int*)ref_ranking.sort_idxs.data;
+
+  {
+    cpuvisor::PathIndex path_index(base_paths);
+    cpuvisor::DeltaSegments deltas(base_file, 700, 64, update_mutex, &path_index, 100);
+    REQUIRE(deltas.load() == true);
+    REQUIRE(deltas.num() == 0);
+
+    // append the remaining features in three segments, then merge two
+    const size_t seg_ends[] = {750, 900, 1000};
+    size_t seg_start = 700;
+    for (size_t s = 0; s < 3; ++s) {
+      std::vector<std::string> seg_paths(all_paths.begin() + seg_start,
+                                         all_paths.begin() + seg_ends[s]);
+      deltas.append(all_feats.rowRange(seg_start, seg_ends[s]).clone(), seg_paths);
+      seg_start = seg_ends[s];
+      if (s == 1) deltas.compact();
+    }
+    REQUIRE(deltas.num() == 300);
+    REQUIRE(deltas.segments().size() == 2);
+    REQUIRE(path_index.size() == 1000);
+    for (size_t i = 0; i < all_paths.size(); ++i) {
+      REQUIRE(path_index.path(i) == all_paths[i]);
+    }
+
+    std::vector<cv::Mat> segments(1, base_feats);
+    segments.insert(segments.end(), deltas.segments().begin(), deltas.segments().end());
+    cpuvisor::Ranking ranking;
+    engine.rankSegments(segments, model, &ranking, 50);
+    REQUIRE(ranking.sorted_count == 50);
+    REQUIRE(ranking.scores.rows == 1000);
+    const int* idxs = (const int*)ranking.sort_idxs.data;
+    for (size_t i = 0; i < 50; ++i) {
+      REQUIRE(idxs[i] == ref_idxs[i]);
+    }
+  }
+
+  // segments should be reloaded from the manifest in the same order
+  cpuvisor::PathIndex path_index(base_paths);
+  cpuvisor::DeltaSegments deltas(base_file, 700, 64, update_mutex, &path_index);
+  REQUIRE(deltas.load() == true);
+  REQUIRE(deltas.num() == 300);
+  REQUIRE(path_index.size() == 1000);
+  size_t idx;
+  REQUIRE(path_index.find(all_paths[950], &idx));
+  REQUIRE(idx == 950);
+  for (size_t i = 0; i < 300; ++i) {
+    REQUIRE(cv::countNonZero(deltas.row(i) != all_feats.row(700 + i)) == 0);
+  }
+
+  removeTempDir(temp_dir);
+}
+
+TEST_CASE("ranking/denseLinearSvm",
+          "Test that the dense SVM solver gives the same model as Liblinear") {
+
+  // overlapping classes, so that not all training samples are separable
+  cv::Mat pos_feats(50, 64, CV_32F);
+  cv::Mat neg_feats(2000, 64, CV_32F);
+  cv::randn(pos_feats, cv::Scalar(0.1), cv::Scalar(0.2));
+  cv::randn(neg_feats, cv::Scalar(0.0), cv::Scalar(0.2));
+  cv::Mat feats;
+  cv::vconcat(pos_feats, neg_feats, feats);
+
+  std::vector<std::vector<size_t> > labels(1);
+  for (size_t i = 0; i < static_cast<size_t>(pos_feats.rows); ++i) {
+    labels[0].push_back(i);
+  }
+
+  featpipe::Liblinear ref_svm;
+  ref_svm.set_c(1.0);
+  ref_svm.set_eps(0.0001);
+  ref_svm.train((float*)feats.data, feats.cols, feats.rows, labels);
+  cv::Mat ref_w(feats.cols + 1, 1, CV_32F, ref_svm.get_w());
+
+  featpipe::DenseLinearSvm svm;
+  svm.set_c(1.0);
+  svm.set_eps(0.0001);
+  svm.train((const float*)pos_feats.data, pos_feats.rows,
+            (const float*)neg_feats.data, neg_feats.rows, feats.cols);
+  cv::Mat w(feats.cols + 1, 1, CV_32F, svm.get_w());
+
+  // both solve the same dual problem to the same tolerance
+  REQUIRE(cv::norm(w - ref_w) <= 1e-2*cv::norm(ref_w));
+
+  // training through the generic interface should give the same model
+  featpipe::DenseLinearSvm svm_generic;
+  svm_generic.set_c(1.0);
+  svm_generic.set_eps(0.0001);
+  svm_generic.train((float*)feats.data, feats.cols, feats.rows, labels);
+  cv::Mat w_generic(feats.cols + 1, 1, CV_32F, svm_generic.get_w());
+  REQUIRE(cv::norm(w - w_generic) <= 1e-5*cv::norm(w));
+}
+
+TEST_CASE("ranking/denseLinearSvmWarmStart",
+          "Test that warm-starting from a solution for the negatives gives the same model, whatever was trained before") {
+
+  cv::Mat neg_feats(2000, 64, CV_32F);
+  cv::randn(neg_feats, cv::Scalar(0.0), cv::Scalar(0.2));
+  featpipe::DenseSvmSampleSet neg_set((const float*)neg_feats.data,
+                                      neg_feats.rows, neg_feats.cols);
+
+  // two unrelated queries
+  cv::Mat pos_feats_a(50, 64, CV_32F);
+  cv::Mat pos_feats_b(20, 64, CV_32F);
+  cv::randn(pos_feats_a, cv::Scalar(0.1), cv::Scalar(0.2));
+  cv::randn(pos_feats_b, cv::Scalar(-0.1), cv::Scalar(0.2));
+
+  featpipe::DenseSvmWarmStart warm_start;
+  {
+    featpipe::DenseLinearSvm svm;
+    svm.set_eps(0.0001);
+    svm.set_c(10.0);
+    svm.solveWarmStart(neg_set, &warm_start);
+  }
+  REQUIRE(warm_start.c == 10.0);
+  REQUIRE(warm_start.alpha.size() == static_cast<size_t>(neg_feats.rows));
+
+  for (size_t ci = 0; ci < 2; ++ci) {
+    // (the second pass has a smaller C, so the stored solution is clipped)
+    const double svm_c = (ci == 0) ? 10.0 : 1.0;
+
+    featpipe::DenseLinearSvm cold_svm;
+    cold_svm.set_eps(0.0001);
+    cold_svm.set_c(svm_c);
+    cold_svm.train((const float*)pos_feats_b.data, pos_feats_b.rows,
+                   (const float*)neg_feats.data, neg_feats.rows, neg_feats.cols);
+    cv::Mat cold_w(neg_feats.cols + 1, 1, CV_32F, cold_svm.get_w());
+
+    featpipe::DenseLinearSvm warm_svm;
+    warm_svm.set_eps(0.0001);
+    warm_svm.set_c(svm_c);
+    warm_svm.train((const float*)pos_feats_b.data, pos_feats_b.rows, neg_set, &warm_start);
+    cv::Mat warm_w(neg_feats.cols + 1, 1, CV_32F, warm_svm.get_w());
+
+    REQUIRE(cv::norm(warm_w - cold_w) <= 1e-2*cv::norm(cold_w));
+  }
+
+  // at the tolerance used by the server, the model found for a query
+  // should not depend on which queries were trained before it
+  featpipe::DenseSvmWarmStart server_warm_start;
+  featpipe::DenseLinearSvm svm; // (default eps)
+  svm.set_c(10.0);
+  svm.solveWarmStart(neg_set, &server_warm_start);
+  const std::vector<double> warm_start_alpha = server_warm_start.alpha;
+
+  svm.train((const float*)pos_feats_b.data, pos_feats_b.rows, neg_set, &server_warm_start);
+  cv::Mat first_w = cv::Mat(neg_feats.cols + 1, 1, CV_32F, svm.get_w()).clone();
+  svm.train((const float*)pos_feats_a.data, pos_feats_a.rows, neg_set, &server_warm_start);
+  svm.train((const float*)pos_feats_b.data, pos_feats_b.rows, neg_set, &server_warm_start);
+  cv::Mat second_w(neg_feats.cols + 1, 1, CV_32F, svm.get_w());
+
+  REQUIRE(server_warm_start.alpha == warm_start_alpha);
+  REQUIRE(cv::countNonZero(first_w != second_w) == 0);
+}
+
+TEST_CASE("ranking/multipleClassifiers",
+          "Test that cached classifiers applied together rank as if applied one by one") {
+
+  cv::Mat feats(500, 64, CV_32F);
+  cv::randu(feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+
+  std::string temp_dir = getCleanTempDir();
+  std::vector<std::string> classifier_paths;
+  std::vector<cv::Mat> models;
+  for (size_t i = 0; i < 5; ++i) {
+    cv::Mat model(64, 1, CV_32F);
+    cv::randu(model, cv::Scalar(-1.0), cv::Scalar(1.0));
+    classifier_paths.push_back(temp_dir + "/model" + boost::lexical_cast<std::string>(i) + ".binaryproto");
+    cpuvisor::writeModelToProto(model, classifier_paths.back());
+    models.push_back(model);
+  }
+
+  cpuvisor::ClassifierCache cache(3);
+  cv::Mat stacked_models;
+  REQUIRE(cache.getStacked(classifier_paths, &stacked_models) == true);
+  REQUIRE(stacked_models.rows == 64);
+  REQUIRE(stacked_models.cols == 5);
+  REQUIRE(cache.size() == 3); // least recently used are evicted
+
+  std::vector<cpuvisor::Ranking> rankings;
+  cpuvisor::rankUsingModels(stacked_models, feats, &rankings);
+  REQUIRE(rankings.size() == 5);
+
+  for (size_t i = 0; i < 5; ++i) {
+    cpuvisor::Ranking ref_ranking;
+    cpuvisor::rankUsingModel(models[i], feats, &ref_ranking, 0);
+    REQUIRE(rankings[i].sorted_count == 500);
+    REQUIRE(cv::norm(rankings[i].scores - ref_ranking.scores) <= 1e-4*cv::norm(ref_ranking.scores));
+    // (scores may differ in the last bits, so compare only the top item)
+    REQUIRE(rankings[i].sort_idxs.at<int>(0) == ref_ranking.sort_idxs.at<int>(0));
+  }
+
+  // a modified classifier file is read again
+  cv::Mat new_model = -models[4];
+  cpuvisor::writeModelToProto(new_model, classifier_paths[4]);
+  boost::filesystem::last_write_time(classifier_paths[4],
+                                     boost::filesystem::last_write_time(classifier_paths[4]) + 10);
+  cv::Mat model;
+  REQUIRE(cache.get(classifier_paths[4], &model) == true);
+  REQUIRE(cv::norm(model - new_model) == 0.0);
+
+  std::string err_path;
+  std::vector<std::string> bad_paths(1, temp_dir + "/missing.binaryproto");
+  REQUIRE(cache.getStacked(bad_paths, &stacked_models, &err_path) == false);
+  REQUIRE(err_path == bad_paths[0]);
+
+  removeTempDir(temp_dir);
+}
+
+TEST_CASE("ranking/classifierStore",
+          "Test that applying all stored classifiers at once gives the top results of each") {
+
+  cv::Mat feats(500, 64, CV_32F);
+  cv::randu(feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+  // dataset split as base features and a delta segment
+  std::vector<cv::Mat> segments;
+  segments.push_back(feats.rowRange(0, 300));
+  segments.push_back(feats.rowRange(300, 500));
+
+  std::string temp_dir = getCleanTempDir();
+  std::string store_path = temp_dir + "/classifiers";
+
+  std::vector<cv::Mat> models;
+  {
+    cpuvisor::ClassifierStore store(store_path, 64, 20, 2);
+    REQUIRE(store.load() == true);
+    REQUIRE(store.size() == 0);
+
+    for (size_t i = 0; i < 5; ++i) {
+      cv::Mat model(64, 1, CV_32F);
+      cv::randu(model, cv::Scalar(-1.0), cv::Scalar(1.0));
+      store.add("model" + boost::lexical_cast<std::string>(i), model);
+      models.push_back(model);
+    }
+    REQUIRE(store.size() == 5);
+  }
+
+  // classifiers are read back from the store directory
+  cpuvisor::ClassifierStore store(store_path, 64, 20, 2);
+  REQUIRE(store.load() == true);
+  REQUIRE(store.size() == 5);
+
+  cpuvisor::Ranking ranking;
+  REQUIRE(store.getResults("model0", &ranking) == false);
+
+  store.applyAll(segments);
+
+  for (size_t i = 0; i < 5; ++i) {
+    const std::string name = "model" + boost::lexical_cast<std::string>(i);
+    REQUIRE(store.getResults(name, &ranking) == true);
+    REQUIRE(ranking.truncated == true);
+    REQUIRE(ranking.size() == 20);
+
+    cpuvisor::Ranking ref_ranking;
+    cpuvisor::rankUsingModel(models[i], feats, &ref_ranking, 20);
+    for (size_t j = 0; j < 20; ++j) {
+      REQUIRE(std::fabs(ranking.rankedScore(j) - ref_ranking.rankedScore(j)) < 1e-4);
+    }
+    REQUIRE(ranking.sort_idxs.at<int>(0) == ref_ranking.sort_idxs.at<int>(0));
+  }
+
+  // replacing a classifier discards its results
+  store.add("model3", -models[3]);
+  REQUIRE(store.getResults("model3", &ranking) == false);
+  REQUIRE(store.getResults("model2", &ranking) == true);
+  cv::Mat model;
+  REQUIRE(store.getModel("model3", &model) == true);
+  REQUIRE(cv::norm(model + models[3]) == 0.0);
+
+  REQUIRE(cpuvisor::ClassifierStore::isValidName("cars_2015-v2") == true);
+  REQUIRE(cpuvisor::ClassifierStore::isValidName("../model") == false);
+  REQUIRE(cpuvisor::ClassifierStore::isValidName("") == false);
+
+  removeTempDir(temp_dir);
+}
+
+TEST_CASE("ranking/rankingCache",
+          "Test that cached rankings are returned only for the same model and dataset version") {
+
+  cv::Mat dset_feats(1000, 64, CV_32F);
+  cv::randu(dset_feats, cv::Scalar(-1.0), cv::Scalar(1.0));
+  cv::Mat model(64, 1, CV_32F);
+  cv::randu(model, cv::Scalar(-1.0), cv::Scalar(1.0));
+
+  cpuvisor::Ranking ranking;
+  cpuvisor::rankUsingModel(model, dset_feats, &ranking, 100);
+
+  // each ranking takes 1000 scores and 1000 sort indexes
+  cpuvisor::RankingCache cache(3*8000);
+  const std::string model_hash = cpuvisor::RankingCache::hashMat(model);
+  REQUIRE(model_hash == cpuvisor::RankingCache::hashMat(model.clone()));
+  REQUIRE(model_hash != cpuvisor::RankingCache::hashMat(-model));
+
+  cpuvisor::Ranking cached_ranking;
+  REQUIRE(cache.getRanking(model_hash, 0, &cached_ranking) == false);
+  cache.insertRanking(model_hash, 0, ranking);
+  REQUIRE(cache.getRanking(model_hash, 1, &cached_ranking) == false);
+  REQUIRE(cache.getRanking(model_hash, 0, &cached_ranking) == true);
+  REQUIRE(cached_ranking.sorted_count == 100);
+
+  // extending the sort of a retrieved ranking does not modify the cache
+  cpuvisor::ensureRankingSorted(&cached_ranking, 1000);
+  REQUIRE(cache.getRanking(model_hash, 0, &cached_ranking) == true);
+  REQUIRE(cached_ranking.sorted_count == 100);
+  const int* idxs = (const int*)ranking.sort_idxs.data;
+  const int* cached_idxs = (const int*)cached_ranking.sort_idxs.data;
+  for (size_t i = 0; i < 100; ++i) {
+    REQUIRE(idxs[i] == cached_idxs[i]);
+  }
+
+  cache.clear();
+  REQUIRE(cache.getRanking(model_hash, 0, &cached_ranking) == false);
+  REQUIRE(cache.bytes() == 0);
+
+  // least recently used entries are evicted once the cache is full
+  for (size_t v = 0; v < 4; ++v) {
+    cache.insertRanking(model_hash, v, ranking);
+  }
+  REQUIRE(cache.bytes() <= 3*8000);
+  REQUIRE(cache.getRanking(model_hash, 0, &cached_ranking) == false);
+  REQUIRE(cache.getRanking(model_hash, 3, &cached_ranking) == true);
+}